@@ -27,11 +27,88 @@ enum timssdr_error
     TIMSSDR_ERROR_OTHER,
     TIMSSDR_ERROR_STREAMING_THREAD_ERR,
     TIMSSDR_ERROR_STREAMING_STOPPED,
-    TIMSSDR_ERROR_STREAMING_EXIT_CALLED
+    TIMSSDR_ERROR_STREAMING_EXIT_CALLED,
+    TIMSSDR_ERROR_NOT_SUPPORTED,
+    TIMSSDR_ERROR_TIMEOUT,
+    TIMSSDR_ERROR_FILE,
+    TIMSSDR_ERROR_NETWORK
 };
 
 typedef struct timssdr_device timssdr_device;
 
+/**
+ * Fan-out RX consumer of a device, see @ref timssdr_rx_subscribe
+ * @ingroup streaming
+ */
+typedef struct timssdr_subscription timssdr_subscription;
+
+/**
+ * Maximum number of subscribers of a device, see @ref timssdr_rx_subscribe
+ * @ingroup streaming
+ */
+#define TIMSSDR_MAX_SUBSCRIBERS 16
+
+/**
+ * How libusb events (transfer completions) are handled, see @ref timssdr_set_event_mode
+ * @ingroup library
+ */
+enum timssdr_event_mode {
+	/**
+	 * Every open device gets its own event handling thread (default)
+	 */
+	TIMSSDR_EVENTS_PER_DEVICE = 0,
+	/**
+	 * A single library thread handles events for all open devices
+	 */
+	TIMSSDR_EVENTS_SHARED = 1,
+	/**
+	 * No library thread, the application handles events, see @ref timssdr_handle_events
+	 */
+	TIMSSDR_EVENTS_EXTERNAL = 2,
+};
+
+/**
+ * How much of a device is set up when it is opened, see @ref timssdr_set_open_mode
+ * @ingroup library
+ */
+enum timssdr_open_mode {
+	/**
+	 * Detach kernel drivers from every interface, allocate the transfers and start event handling right away (default)
+	 */
+	TIMSSDR_OPEN_EAGER = 0,
+	/**
+	 * Only claim the device, the rest is done when it first streams
+	 */
+	TIMSSDR_OPEN_LAZY = 1,
+};
+
+/**
+ * File descriptor the library needs watched, see @ref timssdr_get_pollfds
+ * @ingroup library
+ */
+typedef struct {
+	/**
+	 * File descriptor
+	 */
+	int fd;
+	/**
+	 * poll() events to wait for (POLLIN, POLLOUT)
+	 */
+	short events;
+} timssdr_pollfd;
+
+/**
+ * Called when the library starts using a file descriptor, see @ref timssdr_set_pollfd_notifiers
+ * @ingroup library
+ */
+typedef void (*timssdr_pollfd_added_cb_fn)(int fd, short events, void* ctx);
+
+/**
+ * Called when the library stops using a file descriptor, see @ref timssdr_set_pollfd_notifiers
+ * @ingroup library
+ */
+typedef void (*timssdr_pollfd_removed_cb_fn)(int fd, void* ctx);
+
 typedef struct {
 	/**
 	 * MCU part ID register value
@@ -43,6 +120,44 @@ typedef struct {
 	uint32_t serial_no[4];
 } read_partid_serialno_t;
 
+/**
+ * Sample formats understood by @ref timssdr_convert. All formats are interleaved I/Q pairs.
+ * @ingroup conversion
+ */
+enum timssdr_sample_format {
+	/**
+	 * signed 8 bit I/Q
+	 */
+	TIMSSDR_FORMAT_S8 = 0,
+	/**
+	 * unsigned (offset binary, 128 is zero) 8 bit I/Q
+	 */
+	TIMSSDR_FORMAT_U8 = 1,
+	/**
+	 * signed 16 bit I/Q, 8 bit samples are scaled to full range
+	 */
+	TIMSSDR_FORMAT_CS16 = 2,
+	/**
+	 * 32 bit float I/Q (C `float complex`), 8 bit samples are scaled to [-1, 1)
+	 */
+	TIMSSDR_FORMAT_CF32 = 3,
+};
+
+/**
+ * Flags in @ref timssdr_transfer.flags
+ * @ingroup streaming
+ */
+enum timssdr_transfer_flags {
+	/**
+	 * Samples were lost between the previous block and this one, either dropped by the library (see @ref timssdr_get_rx_overruns) or, if the stream rate is known (see @ref timssdr_set_stream_rate), by the device while it was waiting for a transfer to be resubmitted. @ref timssdr_transfer.sample_index accounts for the lost samples.
+	 */
+	TIMSSDR_TRANSFER_DISCONTINUITY = 1,
+	/**
+	 * First block delivered after @ref timssdr_resume_rx. All of its samples were received after the call. Because the blocks of the retune window were dropped, @ref TIMSSDR_TRANSFER_DISCONTINUITY is set as well.
+	 */
+	TIMSSDR_TRANSFER_RESUMED = 2,
+};
+
 typedef struct {
 	/** TimsSDR USB device for this transfer */
 	timssdr_device* device;
@@ -56,8 +171,408 @@ typedef struct {
 	void* rx_ctx;
 	/** User provided TX context. Not used by the library, but available to transfer callbacks for use. Set along with the transfer callback using @ref timssdr_start_tx*/
 	void* tx_ctx;
+	/** RX samples converted by the library, see @ref timssdr_set_rx_conversion. NULL if conversion is disabled. */
+	void* converted;
+	/** number of complex samples in @ref converted */
+	int converted_count;
+	/** index of the first sample (I/Q pair) of this block, counted from the start of the stream. In TX mode, refers to the block that has just been sent, and is 0 while the buffers are first filled. */
+	uint64_t sample_index;
+	/** time the USB transfer of this block completed, `CLOCK_MONOTONIC_RAW` in nanoseconds */
+	uint64_t timestamp_ns;
+	/** bitmask of @ref timssdr_transfer_flags */
+	uint32_t flags;
 } timssdr_transfer;
 
+/**
+ * Number of bins in @ref timssdr_stats.callback_histogram
+ * @ingroup streaming
+ */
+#define TIMSSDR_STATS_HISTOGRAM_BINS 16
+
+/**
+ * Streaming statistics, see @ref timssdr_get_stats
+ * 
+ * Counters accumulate over start/stop cycles until @ref timssdr_reset_stats is called. Cancelled transfers (from stopping the stream) are not counted.
+ * @ingroup streaming
+ */
+typedef struct {
+	/** transfers completed successfully */
+	uint64_t transfers_completed;
+	/** bytes moved by successfully completed transfers */
+	uint64_t bytes_transferred;
+	/** completed transfers that carried fewer bytes than requested, but not zero */
+	uint64_t short_transfers;
+	/** completed transfers that carried no data */
+	uint64_t zero_length_transfers;
+	/** transfers that ended with an error status (stall, timeout, device gone, ...) */
+	uint64_t failed_transfers;
+	/** transfers that could not be resubmitted after completing */
+	uint64_t resubmit_failures;
+	/** blocks dropped in buffered RX mode, see @ref timssdr_get_rx_overruns */
+	uint64_t rx_overruns;
+	/** times a TX transfer had to wait for data in push mode, see @ref timssdr_start_tx_buffered */
+	uint64_t tx_underruns;
+	/** blocks delivered with @ref TIMSSDR_TRANSFER_DISCONTINUITY set */
+	uint64_t discontinuities;
+	/** received blocks the PSD stage skipped because all its workers were busy, see @ref timssdr_set_psd */
+	uint64_t psd_dropped;
+	/** received blocks the DDC stage skipped because a worker was busy, see @ref timssdr_set_ddc */
+	uint64_t ddc_dropped;
+	/** received blocks dropped while RX was paused or retuning, see @ref timssdr_pause_rx */
+	uint64_t paused_blocks;
+	/** failed RX transfers that were resubmitted by error recovery, see @ref timssdr_set_error_recovery */
+	uint64_t recovered_transfers;
+	/** transfers in flight right now */
+	uint32_t active_transfers;
+	/** highest number of transfers in flight at once */
+	uint32_t peak_active_transfers;
+	/** number of sample block callback invocations */
+	uint64_t callbacks;
+	/** total time spent in sample block callbacks in nanoseconds */
+	uint64_t callback_time_total_ns;
+	/** longest sample block callback in nanoseconds */
+	uint64_t callback_time_max_ns;
+	/** callback durations. Bin 0 counts calls shorter than 1 us, bin n calls of [2^(n-1), 2^n) us, the last bin everything longer. */
+	uint64_t callback_histogram[TIMSSDR_STATS_HISTOGRAM_BINS];
+	/** mean time between two transfer completions in nanoseconds */
+	uint64_t interval_mean_ns;
+	/** shortest time between two transfer completions in nanoseconds */
+	uint64_t interval_min_ns;
+	/** longest time between two transfer completions in nanoseconds */
+	uint64_t interval_max_ns;
+	/** standard deviation of the time between two transfer completions in nanoseconds */
+	uint64_t interval_jitter_ns;
+} timssdr_stats;
+
+/**
+ * A hole in the RX stream left by a failed transfer, see @ref timssdr_set_error_recovery
+ * @ingroup streaming
+ */
+typedef struct {
+	/** device the transfer failed on */
+	timssdr_device* device;
+	/** how the transfer failed, or how its last resubmission failed */
+	enum libusb_transfer_status status;
+	/** @ref timssdr_transfer.sample_index of the first sample lost */
+	uint64_t sample_index;
+	/** samples lost, estimated as the block the transfer would have carried */
+	uint64_t lost_samples;
+	/** resubmissions it took */
+	uint32_t attempts;
+	/** nonzero if streaming goes on, 0 if recovery gave up and the stream ended */
+	int recovered;
+	/** context passed in @ref timssdr_recovery_opts */
+	void* gap_ctx;
+} timssdr_gap_event;
+
+/**
+ * Gap event callback, called from the library's recovery thread once a failed transfer was resubmitted or given up on
+ * @ingroup streaming
+ */
+typedef void (*timssdr_gap_cb_fn)(const timssdr_gap_event* event);
+
+/**
+ * Error recovery options, see @ref timssdr_set_error_recovery
+ * @ingroup streaming
+ */
+typedef struct {
+	/** submissions of a failed transfer before giving up and ending the stream, 0 for the default (8) */
+	uint32_t max_attempts;
+	/** called for every gap, can be NULL */
+	timssdr_gap_cb_fn gap_callback;
+	/** passed to @p gap_callback in @ref timssdr_gap_event.gap_ctx */
+	void* gap_ctx;
+} timssdr_recovery_opts;
+
+/**
+ * Configuration of a mock device, see @ref timssdr_open_mock
+ * @ingroup device
+ */
+typedef struct {
+	/** rate at which the mock "bus" moves samples (2 bytes each) in samples per second. 0 completes transfers as fast as possible. */
+	double sample_rate;
+	/** if nonzero, the first 8 bytes of each completed transfer are overwritten with the completion time (`CLOCK_MONOTONIC`, nanoseconds, native byte order) */
+	int stamp_completions;
+	/** if nonzero, every error_interval-th transfer fails with `LIBUSB_TRANSFER_STALL` instead of completing, to exercise error handling (see @ref timssdr_set_error_recovery) */
+	uint32_t error_interval;
+} timssdr_mock_config;
+
+/**
+ * Magic at the start of a recording, see @ref timssdr_file_header
+ * @ingroup recording
+ */
+#define TIMSSDR_FILE_MAGIC "TIMSSDR\0"
+/**
+ * Current version of @ref timssdr_file_header
+ * @ingroup recording
+ */
+#define TIMSSDR_FILE_VERSION 1
+/**
+ * Size of the header in front of the samples of a recording. One page, so the samples that follow can be written with O_DIRECT.
+ * @ingroup recording
+ */
+#define TIMSSDR_FILE_HEADER_SIZE 4096
+
+/**
+ * Header of a file written by @ref timssdr_start_rx_to_file, in host byte order. The samples follow at offset @ref header_size, the rest of the header is zero.
+ * @ingroup recording
+ */
+typedef struct {
+	/** @ref TIMSSDR_FILE_MAGIC */
+	char magic[8];
+	/** @ref TIMSSDR_FILE_VERSION */
+	uint32_t version;
+	/** offset of the first sample in bytes */
+	uint32_t header_size;
+	/** sample format, a @ref timssdr_sample_format */
+	uint32_t format;
+	uint32_t reserved;
+	/** sample rate in samples per second as given in @ref timssdr_recorder_opts, 0 if unknown */
+	double sample_rate;
+	/** wall clock time the recording was started, `CLOCK_REALTIME` in nanoseconds */
+	uint64_t start_time_ns;
+	/** the same moment on the clock of @ref timssdr_transfer.timestamp_ns */
+	uint64_t start_timestamp_ns;
+	/** number of sample bytes after the header. Set when the recording is stopped, 0 if it was cut short. */
+	uint64_t data_bytes;
+} timssdr_file_header;
+
+/**
+ * Recorder options, see @ref timssdr_start_rx_to_file
+ * @ingroup recording
+ */
+typedef struct {
+	/** number of blocks buffered between the USB transfers and the writer thread, 0 for the default of 32. Together with the transfer size (see @ref timssdr_set_transfer_config), this bounds the memory used and how long the disk may stall before blocks are dropped. */
+	uint32_t queue_depth;
+	/** nonzero to bypass the page cache with O_DIRECT. Falls back to regular writes where the file system doesn't support it. */
+	int direct_io;
+	/** sample rate, stored in the header. If nonzero also passed to @ref timssdr_set_stream_rate for gap detection. */
+	double sample_rate;
+} timssdr_recorder_opts;
+
+/**
+ * Replay options, see @ref timssdr_start_tx_from_file
+ * @ingroup recording
+ */
+typedef struct {
+	/** nonzero to start over with the first file after the last one, until stopped */
+	int loop;
+} timssdr_replay_opts;
+
+/**
+ * Size of a sweep block: a @ref TIMSSDR_SWEEP_HEADER_SIZE byte header followed by samples taken at one frequency. Sweep transfers carry several blocks back to back, see @ref timssdr_start_rx_sweep.
+ * @ingroup sweep
+ */
+#define TIMSSDR_SWEEP_BLOCK_SIZE 16384
+/**
+ * Size of the header of a sweep block: two @ref TIMSSDR_SWEEP_MARKER bytes, then the frequency the block was taken at in Hz as 64 bit little endian.
+ * @ingroup sweep
+ */
+#define TIMSSDR_SWEEP_HEADER_SIZE 10
+/**
+ * Value of the first two bytes of every sweep block
+ * @ingroup sweep
+ */
+#define TIMSSDR_SWEEP_MARKER 0x7F
+/**
+ * Maximum number of frequency ranges passed to @ref timssdr_init_sweep
+ * @ingroup sweep
+ */
+#define TIMSSDR_SWEEP_MAX_RANGES 10
+
+/**
+ * Order in which the steps of a sweep are tuned, see @ref timssdr_init_sweep
+ * @ingroup sweep
+ */
+enum timssdr_sweep_style {
+	/**
+	 * tune once per step, at `start + n * step_width + offset`
+	 */
+	TIMSSDR_SWEEP_STYLE_LINEAR = 0,
+	/**
+	 * tune twice per step, at `start + n * step_width + offset` and half a step higher, so the band edges of one tuning fall into the middle of another
+	 */
+	TIMSSDR_SWEEP_STYLE_INTERLEAVED = 1,
+};
+
+/**
+ * One sweep block, as found by @ref timssdr_sweep_parse. Points into the transfer buffer, so it is only valid until the sample block callback returns (or, in buffered mode, until the next @ref timssdr_rx_read).
+ * @ingroup sweep
+ */
+typedef struct {
+	/** frequency the samples were taken at in Hz */
+	uint64_t frequency;
+	/** interleaved 8 bit I/Q samples following the header */
+	const uint8_t* samples;
+	/** length of @ref samples in bytes */
+	int length;
+} timssdr_sweep_block;
+
+/**
+ * Window applied to each FFT segment of the PSD stage, see @ref timssdr_psd_config
+ * @ingroup spectrum
+ */
+enum timssdr_window {
+	/**
+	 * no window
+	 */
+	TIMSSDR_WINDOW_RECTANGULAR = 0,
+	/**
+	 * Hann window
+	 */
+	TIMSSDR_WINDOW_HANN = 1,
+	/**
+	 * Hamming window
+	 */
+	TIMSSDR_WINDOW_HAMMING = 2,
+	/**
+	 * 4 term Blackman-Harris window, for a low sidelobe level
+	 */
+	TIMSSDR_WINDOW_BLACKMAN_HARRIS = 3,
+};
+
+/**
+ * PSD stage configuration, see @ref timssdr_set_psd
+ * @ingroup spectrum
+ */
+typedef struct {
+	/** FFT length and number of bins per frame, a power of two from 16 to 65536 */
+	uint32_t fft_size;
+	/** window applied to each segment */
+	enum timssdr_window window;
+	/** number of samples shared by consecutive segments, less than @ref fft_size. Half of @ref fft_size is usual with a Hann window. */
+	uint32_t overlap;
+	/** number of segments averaged into one frame. 0 averages the segments starting in each block (or sweep block) into one frame. */
+	uint32_t averages;
+	/** number of worker threads, 0 for one */
+	uint32_t threads;
+} timssdr_psd_config;
+
+/**
+ * Averaged power spectrum, passed to @ref timssdr_psd_cb_fn
+ * @ingroup spectrum
+ */
+typedef struct {
+	/** TimsSDR USB device the samples came from */
+	timssdr_device* device;
+	/** power of each bin relative to full scale (a full scale tone centered in a bin reads 1.0), from -fs/2 to fs/2 with DC at index bin_count / 2. Only valid during the callback. */
+	const float* power;
+	/** number of bins, the FFT size */
+	uint32_t bin_count;
+	/** number of segments averaged */
+	uint32_t averaged;
+	/** index of the first sample of the first segment, see @ref timssdr_transfer.sample_index */
+	uint64_t sample_index;
+	/** time the block holding the last samples of the frame was received, see @ref timssdr_transfer.timestamp_ns */
+	uint64_t timestamp_ns;
+	/** frequency of the sweep block in Hz (see @ref timssdr_start_rx_sweep), 0 outside sweep mode */
+	uint64_t frequency;
+	/** @ref timssdr_transfer_flags of the blocks fed since the previous frame. @ref TIMSSDR_TRANSFER_DISCONTINUITY is also set when the stage had to skip blocks. */
+	uint32_t flags;
+	/** User provided PSD context, see @ref timssdr_set_psd */
+	void* psd_ctx;
+} timssdr_psd_frame;
+
+/**
+ * PSD frame callback, see @ref timssdr_set_psd
+ * 
+ * Called on one of the PSD worker threads, but never concurrently, and in stream order. Should return 0 to keep receiving frames, any other value stops the PSD stage until it is set up again. Stopping RX is still done with @ref timssdr_stop_rx from the main thread.
+ * @ingroup spectrum
+ */
+typedef int (*timssdr_psd_cb_fn)(timssdr_psd_frame* frame);
+
+/**
+ * How the DDC stage forms its channels, see @ref timssdr_ddc_config
+ * @ingroup ddc
+ */
+enum timssdr_ddc_mode {
+	/**
+	 * Every channel has its own NCO, filter and decimation, for channels of different widths at arbitrary frequencies
+	 */
+	TIMSSDR_DDC_INDEPENDENT = 0,
+	/**
+	 * Polyphase filter bank: the band is split into @ref timssdr_ddc_config.pfb_channels channels of equal width, centered on multiples of sample rate / pfb_channels, all decimated by pfb_channels and sharing one filter
+	 */
+	TIMSSDR_DDC_PFB = 1,
+};
+
+/**
+ * Block of channel samples, passed to @ref timssdr_ddc_cb_fn
+ * @ingroup ddc
+ */
+typedef struct {
+	/** TimsSDR USB device the samples came from */
+	timssdr_device* device;
+	/** index of the channel in @ref timssdr_ddc_config.channels */
+	uint32_t channel;
+	/** interleaved complex float samples at the channel's rate, scaled like @ref TIMSSDR_FORMAT_CF32. Only valid during the callback. */
+	const float* samples;
+	/** number of complex samples */
+	uint32_t sample_count;
+	/** index of the input sample (see @ref timssdr_transfer.sample_index) the first output sample was computed at. Consecutive output samples are decimation input samples apart. */
+	uint64_t sample_index;
+	/** time the block holding the input samples was received, see @ref timssdr_transfer.timestamp_ns */
+	uint64_t timestamp_ns;
+	/** @ref timssdr_transfer_flags of the input block. @ref TIMSSDR_TRANSFER_DISCONTINUITY is also set when the stage had to skip input blocks before this one. */
+	uint32_t flags;
+	/** User provided channel context, see @ref timssdr_ddc_channel.ctx */
+	void* ctx;
+} timssdr_ddc_block;
+
+/**
+ * DDC channel callback, see @ref timssdr_set_ddc
+ * 
+ * Called once per received block on the thread processing the channel, in stream order and never concurrently for the same channel. Different channels may be called concurrently. Should return 0 to keep receiving samples, any other value stops this channel until the stage is set up again.
+ * @ingroup ddc
+ */
+typedef int (*timssdr_ddc_cb_fn)(timssdr_ddc_block* block);
+
+/**
+ * DDC channel, see @ref timssdr_ddc_config
+ * @ingroup ddc
+ */
+typedef struct {
+	/** @ref TIMSSDR_DDC_INDEPENDENT: channel center relative to the RX center frequency in Hz, within +-sample rate / 2 */
+	double offset_hz;
+	/** @ref TIMSSDR_DDC_INDEPENDENT: decimation factor from 1 to 4096, the channel rate is the sample rate divided by it */
+	uint32_t decimation;
+	/** @ref TIMSSDR_DDC_INDEPENDENT: passband width in Hz, 0 for 80 % of the channel rate */
+	double bandwidth_hz;
+	/** @ref TIMSSDR_DDC_PFB: filter bank channel, centered on index * sample rate / pfb_channels. Channels from pfb_channels / 2 up are the negative frequencies. */
+	uint32_t pfb_channel;
+	/** channel callback */
+	timssdr_ddc_cb_fn callback;
+	/** User provided context, available to @ref callback as @ref timssdr_ddc_block.ctx */
+	void* ctx;
+} timssdr_ddc_channel;
+
+/**
+ * DDC stage configuration, see @ref timssdr_set_ddc
+ * @ingroup ddc
+ */
+typedef struct {
+	/** how channels are formed */
+	enum timssdr_ddc_mode mode;
+	/** RX sample rate in Hz, which the channel frequencies are relative to */
+	double sample_rate;
+	/** filter length per decimated output sample (taps per polyphase branch), 0 for 16. Longer filters have steeper edges and cost proportionally more. */
+	uint32_t taps_per_phase;
+	/** @ref TIMSSDR_DDC_PFB: number of filter bank channels, from 2 to 1024 */
+	uint32_t pfb_channels;
+	/** channels to produce, copied by @ref timssdr_set_ddc */
+	const timssdr_ddc_channel* channels;
+	/** number of channels, from 1 to @ref TIMSSDR_DDC_MAX_CHANNELS */
+	uint32_t channel_count;
+	/** number of worker threads the channels are spread over, 0 to process them on the thread receiving the blocks */
+	uint32_t threads;
+} timssdr_ddc_config;
+
+/**
+ * Maximum number of channels of a DDC stage
+ * @ingroup ddc
+ */
+#define TIMSSDR_DDC_MAX_CHANNELS 256
+
 enum timssdr_usb_board_id {
 	/**
 	 * F232R product ID
@@ -85,11 +600,11 @@ struct timssdr_device_list {
 	int devicecount;
 
 	/**
-	 * All USB devices (as `libusb_device**` array)
+	 * Queried USB devices (as `libusb_device**` array). Only TimsSDR devices are queried.
 	 */
 	void** usb_devices;
 	/**
-	 * Number of all queried USB devices. Length of array @ref usb_devices.
+	 * Number of queried USB devices. Length of array @ref usb_devices.
 	 */
 	int usb_devicecount;
 };
@@ -97,145 +612,783 @@ struct timssdr_device_list {
 typedef struct timssdr_device_list timssdr_device_list_t;
 
 /**
- * Sample block callback, used in RX and TX (set via @ref timssdr_start_rx, @ref timssdr_start_rx_sweep and @ref timssdr_start_tx). In each mode, it is called when data needs to be handled, meaning filling samples in TX mode or reading them in RX modes.
+ * Device events reported to a @ref timssdr_hotplug_cb_fn
+ * @ingroup device
+ */
+enum timssdr_hotplug_event {
+	/**
+	 * a TimsSDR device was connected (or was already connected when the callback was set)
+	 */
+	TIMSSDR_HOTPLUG_ARRIVED = 1,
+	/**
+	 * a previously reported TimsSDR device was disconnected
+	 */
+	TIMSSDR_HOTPLUG_LEFT = 2,
+};
+
+/**
+ * Hotplug callback, set via @ref timssdr_set_hotplug_callback
+ * 
+ * Called on the library's hotplug thread, one event at a time. It may list and open devices, but must not call @ref timssdr_set_hotplug_callback or @ref timssdr_exit.
+ * @param event what happened
+ * @param serial_number serial number of the device, NULL if it has none or it couldn't be read
+ * @param hotplug_ctx User provided context, see @ref timssdr_set_hotplug_callback
+ * @ingroup device
+ */
+typedef void (*timssdr_hotplug_cb_fn)(enum timssdr_hotplug_event event, const char* serial_number, void* hotplug_ctx);
+
+/**
+ * Sample block callback, used in RX and TX (set via @ref timssdr_start_rx, @ref timssdr_start_rx_sweep and @ref timssdr_start_tx). In each mode, it is called when data needs to be handled, meaning filling samples in TX mode or reading them in RX modes.
+ * 
+ * In TX mode, it should refill the transfer buffer with new raw IQ data, and set @ref timssdr_transfer.valid_length.
+ * 
+ * In RX mode, it should copy/process the contents of the transfer buffer's valid part.
+ * 
+ * In RX SWEEP mode, it receives multiple "blocks" of data, each with a 10-byte header containing the tuned frequency followed by the samples. See @ref timssdr_init_sweep for more info.
+ * 
+ * The callback should return 0 if it wants to be called again, and any other value otherwise. Stopping the RX/TX/SWEEP is still done with @ref timssdr_stop_rx and @ref timssdr_stop_tx, and those should be called from the main thread, so this callback should signal the main thread that it should stop. Signaling the main thread to stop TX should be done from the flush callback in order to guarantee that no samples are discarded, see @ref timssdr_flush_cb_fn
+ * @ingroup streaming
+ */
+typedef int (*timssdr_sample_block_cb_fn)(timssdr_transfer* transfer);
+
+/**
+ * Block complete callback. 
+ * 
+ * Set via @ref timssdr_set_tx_block_complete_callback, called when a transfer is finished to the device's buffer, regardless if the transfer was successful or not. It can signal the main thread to stop on failure, can catch USB transfer errors and can also gather statistics about the transfered data.
+ * @ingroup streaming
+ */
+typedef void (*timssdr_tx_block_complete_cb_fn)(timssdr_transfer* transfer, int);
+
+/**
+ * Flush (end of transmission) callback
+ * 
+ * Will be called when the last samples are transmitted and stopping transmission will result in no samples getting lost. Should signal the main thread that it should stop transmission via @ref timssdr_stop_tx
+ * @ingroup streaming
+ */
+typedef void (*timssdr_flush_cb_fn)(void* flush_ctx, int);
+
+/**
+ * Magic at the start of every packet of a network stream ("TSDR"), see @ref timssdr_net_header
+ * @ingroup network
+ */
+#define TIMSSDR_NET_MAGIC 0x52445354u
+/**
+ * Current version of @ref timssdr_net_header
+ * @ingroup network
+ */
+#define TIMSSDR_NET_VERSION 1
+/**
+ * Port timssdr-server listens on by default, for TCP and UDP
+ * @ingroup network
+ */
+#define TIMSSDR_NET_DEFAULT_PORT 5550
+/**
+ * Largest UDP payload (header and samples) of a network stream packet
+ * @ingroup network
+ */
+#define TIMSSDR_NET_MAX_DATAGRAM 65507
+
+/**
+ * Transport of a network stream, see @ref timssdr_net_connect
+ * @ingroup network
+ */
+enum timssdr_net_protocol {
+	/**
+	 * one connection per client, every block is sent in one packet and nothing is lost on the way. A client that can't keep up is dropped by the server.
+	 */
+	TIMSSDR_NET_TCP = 0,
+	/**
+	 * blocks are split into datagrams, lost ones show up as gaps in @ref timssdr_net_header.sequence. The client subscribes to the server's port and renews its subscription every second.
+	 */
+	TIMSSDR_NET_UDP = 1,
+};
+
+/**
+ * Kind of packet, see @ref timssdr_net_header.type
+ * @ingroup network
+ */
+enum timssdr_net_packet_type {
+	/**
+	 * server to client: part of a received block
+	 */
+	TIMSSDR_NET_PACKET_DATA = 0,
+	/**
+	 * UDP client to server: start or keep streaming to the sender's address
+	 */
+	TIMSSDR_NET_PACKET_SUBSCRIBE = 1,
+	/**
+	 * UDP client to server: stop streaming to the sender's address
+	 */
+	TIMSSDR_NET_PACKET_UNSUBSCRIBE = 2,
+};
+
+/**
+ * Header in front of every packet of a network stream, little-endian on the wire. The @ref length bytes of samples follow it directly.
+ * @ingroup network
+ */
+typedef struct {
+	/** @ref TIMSSDR_NET_MAGIC */
+	uint32_t magic;
+	/** @ref TIMSSDR_NET_VERSION */
+	uint16_t version;
+	/** @ref timssdr_net_packet_type */
+	uint16_t type;
+	/** number of the packet in the stream to this client, starting from 0 and without gaps unless packets were lost */
+	uint64_t sequence;
+	/** @ref timssdr_transfer.sample_index of the block */
+	uint64_t sample_index;
+	/** @ref timssdr_transfer.timestamp_ns of the block, server clock */
+	uint64_t timestamp_ns;
+	/** @ref timssdr_transfer.flags of the block */
+	uint32_t block_flags;
+	/** number of sample bytes in the whole block */
+	uint32_t block_length;
+	/** position of this packet's samples in the block */
+	uint32_t offset;
+	/** number of sample bytes in this packet */
+	uint32_t length;
+} timssdr_net_header;
+
+/**
+ * Reader of a shared-memory RX ring published by another process, see @ref timssdr_shm_attach
+ * @ingroup ipc
+ */
+typedef struct timssdr_shm_consumer timssdr_shm_consumer;
+
+/**
+ * Receiving end of a network stream, see @ref timssdr_net_connect
+ * @ingroup network
+ */
+typedef struct timssdr_net_client timssdr_net_client;
+
+/**
+ * Counters of a network stream, see @ref timssdr_net_get_stats
+ * @ingroup network
+ */
+typedef struct {
+	/** packets received */
+	uint64_t packets;
+	/** sample bytes received */
+	uint64_t bytes;
+	/** packets missing from the sequence */
+	uint64_t lost_packets;
+	/** blocks delivered to the callback */
+	uint64_t blocks;
+	/** partly received blocks thrown away because packets were lost */
+	uint64_t dropped_blocks;
+} timssdr_net_stats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Initialize libtimssdr
+ * 
+ * Should be called before any other libtimssdr function. Initializes libusb. Can be safely called multiple times.
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_LIBUSB
+ * @ingroup library
+ */
+extern int timssdr_init();
+
+/**
+ * Exit libtimssdr
+ * 
+ * Should be called before exit. No other libtimssdr functions should be called after it. Can be safely called multiple times.
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_NOT_LAST_DEVICE if not all devices were closed properly.
+ * @ingroup library
+ */
+extern int timssdr_exit();
+
+/**
+ * Get library version.
+ * 
+ * Can be called before @ref timssdr_init
+ * @return library version as a human-readable string
+ * @ingroup library
+ */
+extern const char* timssdr_library_version();
+
+/**
+ * Select how transfer completions are handled
+ * 
+ * All devices share one libusb context and libusb lets only one thread handle its events at a time, so with many devices the per-device threads mostly wake each other up. In @ref TIMSSDR_EVENTS_SHARED mode a single thread serves every open device, started with the first device and stopped with the last one. Sample block callbacks of all devices then run on that thread, one at a time, so they should be quick (or use @ref timssdr_start_rx_buffered). In @ref TIMSSDR_EVENTS_EXTERNAL mode the library starts no event thread at all and the application drives it from its own loop, see @ref timssdr_handle_events.
+ * 
+ * Must be called after @ref timssdr_init and while no device is open.
+ * @param mode event handling mode
+ * @param cpu CPU to pin the event thread(s) to, or -1 to leave them unpinned. Only supported on Linux, ignored elsewhere.
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on an unknown mode or a CPU number beyond `CPU_SETSIZE`, or @ref TIMSSDR_ERROR_BUSY if a device is open
+ * @ingroup library
+ */
+extern int timssdr_set_event_mode(enum timssdr_event_mode mode, int cpu);
+
+/**
+ * Select how devices are set up when they are opened
+ * 
+ * By default, opening a device detaches kernel drivers from all its interfaces, which reads the configuration descriptor and probes each interface, then allocates and zero-fills the transfer buffers (1 MiB by default) and starts the event thread. For short-lived jobs that open a device, read a few values and close it again, that dominates their runtime.
+ * 
+ * In @ref TIMSSDR_OPEN_LAZY mode, if the device is in the right configuration already, libusb is asked to detach the driver of the claimed interface only, and to reattach it when the device is closed. Where libusb doesn't support that, drivers are detached as in the default mode. The transfers and event handling are set up by the first call that streams or uses the transfer buffers (@ref timssdr_start_rx and the other start functions, @ref timssdr_read_sync, @ref timssdr_write_sync). That call then also reports any errors doing so.
+ * 
+ * Applies to devices opened afterwards. Mock devices (@ref timssdr_open_mock) are always opened eagerly.
+ * @param mode open mode
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_INVALID_PARAM on an unknown mode
+ * @ingroup library
+ */
+extern int timssdr_set_open_mode(enum timssdr_open_mode mode);
+
+/**
+ * Get the file descriptors to watch for events
+ * 
+ * For @ref TIMSSDR_EVENTS_EXTERNAL mode: add these to the application's poll()/epoll loop and call @ref timssdr_handle_events with a zero timeout whenever one is ready. Also wait no longer than @ref timssdr_get_next_timeout says. The set changes as devices are opened and closed, so call this again afterwards or use @ref timssdr_set_pollfd_notifiers.
+ * 
+ * @param[out] fds descriptors, up to @p max_fds of them. May be NULL if @p max_fds is 0.
+ * @param[in] max_fds size of @p fds
+ * @param[out] fd_count total number of descriptors, which may be more than @p max_fds
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid arguments or @ref TIMSSDR_ERROR_NOT_SUPPORTED if the platform has no pollable descriptors (Windows)
+ * @ingroup library
+ */
+extern int timssdr_get_pollfds(timssdr_pollfd* fds, int max_fds, int* fd_count);
+
+/**
+ * Get notified when the set of file descriptors from @ref timssdr_get_pollfds changes
+ * 
+ * The callbacks may run on any thread that opens or closes a device or handles events.
+ * @param added_cb called for each new descriptor, or NULL
+ * @param removed_cb called for each descriptor no longer used, or NULL
+ * @param ctx passed to both callbacks
+ * @return @ref TIMSSDR_SUCCESS
+ * @ingroup library
+ */
+extern int timssdr_set_pollfd_notifiers(
+	timssdr_pollfd_added_cb_fn added_cb,
+	timssdr_pollfd_removed_cb_fn removed_cb,
+	void* ctx);
+
+/**
+ * Get the longest time the application may wait before calling @ref timssdr_handle_events
+ * 
+ * Only needed on platforms where libusb doesn't expose its timeouts as a descriptor (anything but Linux, mostly).
+ * @param[out] timeout_ms time in milliseconds, or -1 if only the descriptors matter
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on NULL @p timeout_ms or @ref TIMSSDR_ERROR_LIBUSB
+ * @ingroup library
+ */
+extern int timssdr_get_next_timeout(int* timeout_ms);
+
+/**
+ * Handle pending events: transfer completions, hotplug events and timeouts
+ * 
+ * In @ref TIMSSDR_EVENTS_EXTERNAL mode this is what runs the sample block callbacks, so it must be called for as long as a device is streaming, from one thread. Stopping a stream (@ref timssdr_stop_rx, @ref timssdr_close, ...) handles its own events while waiting for the transfers to finish, so it may be called from that thread as well, though not from within a callback. Buffered streams (@ref timssdr_rx_read, @ref timssdr_tx_submit) only make progress while another thread handles events.
+ * 
+ * @param timeout_ms time to wait for an event in milliseconds, 0 to only handle what is pending, or negative to wait until something is handled
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_LIBUSB
+ * @ingroup library
+ */
+extern int timssdr_handle_events(int timeout_ms);
+
+/**
+ * Pin and prioritize a device's event thread
+ * 
+ * Applies CPU affinity and a scheduling policy to the thread handling the device's transfer completions (see @ref TIMSSDR_EVENTS_PER_DEVICE), right away and whenever that thread is started. With @p cpus given, the transfer buffers are reallocated from those CPUs, and buffer pools allocated later (see @ref timssdr_start_rx_buffered, @ref timssdr_start_tx_buffered) are as well, so Linux' first-touch policy puts them on the NUMA node of the thread that handles them. Overrides the CPU given to @ref timssdr_set_event_mode for this device.
+ * 
+ * Must be called while the device is not streaming. Only supported on Linux.
+ * @param device device to configure
+ * @param cpus numbers of the CPUs the thread may run on, each below `CPU_SETSIZE`, or NULL to let it float on all CPUs the process may use
+ * @param cpu_count number of entries in @p cpus, 0 to let the thread float
+ * @param sched_policy `SCHED_OTHER`, `SCHED_BATCH`, `SCHED_IDLE`, `SCHED_FIFO` or `SCHED_RR` from `<sched.h>`
+ * @param priority static priority for @p sched_policy, 1 to 99 for the real-time policies, 0 otherwise
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid parameters (or CPUs not available), @ref TIMSSDR_ERROR_BUSY while streaming, @ref TIMSSDR_ERROR_NOT_SUPPORTED if the device has no event thread of its own (shared event mode, mock devices), on other platforms, or if the process may not use the policy
+ * @ingroup library
+ */
+extern int timssdr_set_thread_attrs(
+	timssdr_device* device,
+	const int* cpus,
+	int cpu_count,
+	int sched_policy,
+	int priority);
+
+/**
+ * List connected TimsSDR devices
+ * 
+ * Devices are taken from an enumeration cache that libusb hotplug notifications keep up to date (or, where libusb has no hotplug support, that is refreshed by scanning for TimsSDR devices). Each device is opened once, when it first shows up, to read its serial number, so listing and opening by serial number don't touch other USB devices or reopen TimsSDR devices.
+ * @return list of connected devices. The list should be freed with @ref timssdr_device_list_free
+ * @ingroup device
+ */
+extern timssdr_device_list_t* timssdr_device_list();
+
+/**
+ * Open a @ref timssdr_device from a device list
+ * @param[in] list device list to open device from
+ * @param[in] idx index of the device to open
+ * @param[out] device device handle to open
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid parameters or other @ref timssdr_error variant
+ * @ingroup device
+ */
+extern int timssdr_device_list_open(
+	timssdr_device_list_t* list,
+	int idx,
+	timssdr_device** device);
+
+/**
+ * Open the first @p n devices of a device list in parallel
+ * 
+ * Equivalent to calling @ref timssdr_device_list_open for indices 0 to @p n - 1, but each device is opened and configured on a thread of its own, so bringing up many boards takes about as long as opening one. Either all devices are opened, or none: if one fails, the others are closed again.
+ * @param[in] list device list to open devices from
+ * @param[out] devices array of @p n device handles to open, set to NULL on failure
+ * @param[in] n number of devices to open, at most @ref timssdr_device_list.devicecount
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid parameters, or the error of the first device that failed to open
+ * @ingroup device
+ */
+extern int timssdr_open_all(timssdr_device_list_t* list, timssdr_device** devices, int n);
+
+/**
+ * Free a previously allocated @ref timssdr_device_list list.
+ * @param[in] list list to free
+ * @ingroup device
+ */
+extern void timssdr_device_list_free(timssdr_device_list_t* list);
+
+/**
+ * Get notified of TimsSDR devices being connected and disconnected
+ * 
+ * Starts a thread that watches for device arrival and removal and calls @p callback for each. Devices connected at the time of the call are reported as arrivals first. Setting a new callback replaces the previous one, NULL stops notifications. The thread is also stopped by @ref timssdr_exit.
+ * 
+ * Must be called after @ref timssdr_init, and not from the callback itself.
+ * @param callback hotplug callback, or NULL
+ * @param hotplug_ctx User provided context, passed to @p callback
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_THREAD
+ * @ingroup device
+ */
+extern int timssdr_set_hotplug_callback(timssdr_hotplug_cb_fn callback, void* hotplug_ctx);
+
+/**
+ * Open first available TimsSDR device
+ * @param[out] device device handle
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM if @p device is NULL, @ref TIMSSDR_ERROR_NOT_FOUND if no TimsSDR devices are found or other @ref timssdr_error variant
+ * @ingroup device
+ */
+extern int timssdr_open(timssdr_device** device);
+
+/**
+ * Open TimsSDR device by serial number
+ * @param[in] desired_serial_number serial number of device to open. If NULL then default to first device found.
+ * @param[out] device device handle
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM if @p device is NULL, @ref TIMSSDR_ERROR_NOT_FOUND if no TimsSDR devices are found or other @ref timssdr_error variant
+ * @ingroup device
+ */
+extern int timssdr_open_by_serial(
+	const char* const desired_serial_number,
+	timssdr_device** device);
+
+/**
+ * Open a mock device that streams without any hardware
+ * 
+ * Transfers are completed by a library thread at the configured rate instead of going over USB, so the whole streaming path (callbacks, buffered RX, conversion, statistics) can be exercised and benchmarked. RX transfers are delivered with whatever the buffers contained, TX data is discarded. Synchronous reads and writes outside of buffered RX are not supported. Doesn't need @ref timssdr_init.
+ * @param[in] config mock configuration, NULL for defaults (unthrottled, no stamps)
+ * @param[out] device device handle, close with @ref timssdr_close
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM if @p device is NULL or other @ref timssdr_error variant
+ * @ingroup device
+ */
+extern int timssdr_open_mock(const timssdr_mock_config* config, timssdr_device** device);
+
+/**
+ * Close a previously opened device
+ * @param[in] device device to close
+ * @return @ref TIMSSDR_SUCCESS on success or variant of @ref timssdr_error
+ * @ingroup device
+ */
+extern int timssdr_close(timssdr_device* device);
+
+/**
+ * Start receiving
+ * 
+ * Should be called after setting gains, frequency and sampling rate, as these values won't get reset but instead keep their last value, thus their state is unknown.
+ * 
+ * The callback is called with a @ref timssdr_transfer object whenever the buffer is full. The callback is called in an async context so no libtimssdr functions should be called from it. The callback should treat its argument as read-only.
+ * @param device device to configure
+ * @param callback rx_callback
+ * @param rx_ctx User provided RX context. Not used by the library, but available to @p callback as @ref timssdr_transfer.rx_ctx.
+ * @return @ref TIMSSDR_SUCCESS on success or @ref timssdr_error variant
+ * @ingroup streaming
+ */
+extern int timssdr_start_rx(
+	timssdr_device* device,
+	timssdr_sample_block_cb_fn callback,
+	void* rx_ctx);
+
+/**
+ * Set up a frequency sweep for @ref timssdr_start_rx_sweep
+ * 
+ * The device steps through every range from its start to its stop frequency in steps of @p step_width, staying for @p num_bytes at each tuning, and starts over at the first range after the last. Retuning happens on the device, so a whole sweep costs no control traffic, and the samples of each tuning arrive as blocks tagged with their frequency (see @ref TIMSSDR_SWEEP_BLOCK_SIZE).
+ * 
+ * The plan is kept by the library and sent to the device when the sweep is started. Must be called while not streaming.
+ * 
+ * @param device device to configure
+ * @param frequency_list @p num_ranges pairs of start and stop frequencies in MHz. The stop frequency is not tuned to.
+ * @param num_ranges number of ranges in @p frequency_list, at most @ref TIMSSDR_SWEEP_MAX_RANGES
+ * @param num_bytes number of sample bytes (headers included) captured at each tuning, a nonzero multiple of @ref TIMSSDR_SWEEP_BLOCK_SIZE
+ * @param step_width distance between tunings in Hz
+ * @param offset distance in Hz of each tuned frequency from the start of its step, e.g. half the bandwidth used to keep the DC spike out of the step
+ * @param style tuning order, see @ref timssdr_sweep_style
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid parameters, @ref TIMSSDR_ERROR_BUSY while streaming, @ref TIMSSDR_ERROR_NOT_SUPPORTED if the device can't sweep, or @ref TIMSSDR_ERROR_NO_MEM
+ * @ingroup sweep
+ */
+extern int timssdr_init_sweep(
+	timssdr_device* device,
+	const uint16_t* frequency_list,
+	int num_ranges,
+	uint32_t num_bytes,
+	uint32_t step_width,
+	uint32_t offset,
+	enum timssdr_sweep_style style);
+
+/**
+ * Start receiving in sweep mode
+ * 
+ * Like @ref timssdr_start_rx, but the device follows the plan set with @ref timssdr_init_sweep, and each transfer holds @ref timssdr_transfer.buffer_length / @ref TIMSSDR_SWEEP_BLOCK_SIZE tagged blocks (16 with the default 256 KiB transfers). Use @ref timssdr_sweep_parse in the callback to find them. Stop with @ref timssdr_stop_rx.
+ * 
+ * @ref timssdr_transfer.converted (see @ref timssdr_set_rx_conversion) treats the headers like samples, so it should be disabled while sweeping.
+ * 
+ * @param device device to sweep with
+ * @param callback rx_callback
+ * @param rx_ctx User provided RX context. Not used by the library, but available to @p callback as @ref timssdr_transfer.rx_ctx.
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM if no sweep was set up or the transfer size is not a multiple of @ref TIMSSDR_SWEEP_BLOCK_SIZE, or other @ref timssdr_error variant
+ * @ingroup sweep
+ */
+extern int timssdr_start_rx_sweep(
+	timssdr_device* device,
+	timssdr_sample_block_cb_fn callback,
+	void* rx_ctx);
+
+/**
+ * Find the sweep blocks in a received buffer
+ * 
+ * Walks @p buffer in steps of @ref TIMSSDR_SWEEP_BLOCK_SIZE and fills @p blocks with views of the samples of each block, without copying. Blocks without the @ref TIMSSDR_SWEEP_MARKER bytes are skipped. A short last block yields the samples it has.
+ * 
+ * @param buffer received data, usually @ref timssdr_transfer.buffer
+ * @param length number of valid bytes in @p buffer, usually @ref timssdr_transfer.valid_length
+ * @param blocks array receiving the blocks found
+ * @param max_blocks size of @p blocks. Parsing stops once it is full.
+ * @param block_count number of blocks stored in @p blocks
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_INVALID_PARAM
+ * @ingroup sweep
+ */
+extern int timssdr_sweep_parse(
+	const uint8_t* buffer,
+	int length,
+	timssdr_sweep_block* blocks,
+	int max_blocks,
+	int* block_count);
+
+/**
+ * Start receiving on several devices at once
+ * 
+ * Like calling @ref timssdr_start_rx for each device, but all preparation is done first, and the first transfers of all devices are then submitted round robin while completions are held back, so the devices start within a few submissions of each other. @ref timssdr_transfer.timestamp_ns tells the remaining skew. If any device fails to start, the others are stopped again. Stop each device with @ref timssdr_stop_rx.
+ * 
+ * @param devices @p n different devices to start, none of them streaming
+ * @param n number of devices
+ * @param callback rx_callback, shared by all devices. @ref timssdr_transfer.device tells them apart.
+ * @param rx_ctx array of @p n RX contexts, one per device (see @ref timssdr_transfer.rx_ctx), or NULL
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid parameters, @ref TIMSSDR_ERROR_BUSY if a device is already streaming, or other @ref timssdr_error variant
+ * @ingroup streaming
+ */
+extern int timssdr_start_rx_group(
+	timssdr_device* const* devices,
+	int n,
+	timssdr_sample_block_cb_fn callback,
+	void* const* rx_ctx);
+
+/**
+ * Stop receiving
+ * 
+ * @param device device to stop RX on
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_FILE if a recording (see @ref timssdr_start_rx_to_file) failed, or other @ref timssdr_error variant
+ * @ingroup streaming
+ */
+extern int timssdr_stop_rx(timssdr_device* device);
+
+/**
+ * Pause receiving, e.g. to retune
+ * 
+ * Stopping and restarting RX cancels every transfer, waits for them to drain and submits them again, which takes far longer than a retune. While paused, the transfers stay submitted and the device keeps streaming, but received blocks are dropped (and counted in @ref timssdr_stats.paused_blocks) instead of being passed to the callback, the buffers or the shared-memory ring. Their samples still count towards @ref timssdr_transfer.sample_index. Pausing takes effect right away and is safe from any thread, including the sample block callback.
+ * 
+ * Works with every RX mode started by @ref timssdr_start_rx, @ref timssdr_start_rx_buffered, @ref timssdr_start_rx_subscribers, @ref timssdr_start_rx_to_file and @ref timssdr_start_rx_shm. Stop with @ref timssdr_stop_rx as usual, paused or not.
+ * 
+ * @param device device to pause RX on
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_STREAMING_STOPPED if the device isn't receiving, or other @ref timssdr_error variant
+ * @ingroup streaming
+ */
+extern int timssdr_pause_rx(timssdr_device* device);
+
+/**
+ * Resume receiving after @ref timssdr_pause_rx
+ * 
+ * Call once the retune is done. Transfers that are in flight at this point may still hold samples from before it, so their blocks are dropped as well. Delivery resumes with the first transfer submitted after this call, which is flagged @ref TIMSSDR_TRANSFER_RESUMED. The dead time after resuming is therefore about the time the device needs to fill all transfers in flight, so smaller transfers (see @ref timssdr_set_transfer_config) make hops shorter.
+ * 
+ * @param device device to resume RX on
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_STREAMING_STOPPED if the device isn't receiving, or other @ref timssdr_error variant
+ * @ingroup streaming
+ */
+extern int timssdr_resume_rx(timssdr_device* device);
+
+/**
+ * Start receiving in buffered mode
+ * 
+ * Like @ref timssdr_start_rx, but samples are not processed on the libusb event thread. Each completed transfer is queued to a consumer through a lock-free single-producer/single-consumer queue and a spare buffer from a pool of @p queue_depth extra buffers is resubmitted right away, so slow processing doesn't delay the USB transfers. When the consumer falls behind and no spare buffer is left, the block is dropped and counted, see @ref timssdr_get_rx_overruns.
+ * 
+ * If @p callback is not NULL, the library starts a delivery thread that calls it for every queued block. The callback may take its time, but should return within a few blocks on average to avoid overruns. If @p callback is NULL, the application pulls blocks itself with @ref timssdr_rx_read from a single thread.
+ * 
+ * Stop with @ref timssdr_stop_rx. Blocks still queued at that point remain available to @ref timssdr_rx_read until the end of stream is reported.
+ * @param device device to configure
+ * @param queue_depth number of spare buffers of the current transfer size (see @ref timssdr_set_transfer_config) on top of the in-flight ones. Must be at least 2.
+ * @param callback callback run on the delivery thread, or NULL for pull mode
+ * @param rx_ctx User provided RX context. Not used by the library, but available as @ref timssdr_transfer.rx_ctx.
+ * @return @ref TIMSSDR_SUCCESS on success or @ref timssdr_error variant
+ * @ingroup streaming
+ */
+extern int timssdr_start_rx_buffered(
+	timssdr_device* device,
+	uint32_t queue_depth,
+	timssdr_sample_block_cb_fn callback,
+	void* rx_ctx);
+
+/**
+ * Add a consumer of received blocks
  * 
- * In TX mode, it should refill the transfer buffer with new raw IQ data, and set @ref timssdr_transfer.valid_length.
+ * Subscribers share the stream started with @ref timssdr_start_rx_subscribers. Every block is queued to each subscriber without copying. The buffer is reference counted and only goes back to the pool of spare transfer buffers once the last subscriber is done with it. Each subscriber has its own thread, which calls @p callback for every block in its queue. When that queue is full, the subscriber misses the block (it is counted, see @ref timssdr_get_subscription_overruns, and the next block it gets is flagged with @ref TIMSSDR_TRANSFER_DISCONTINUITY) without holding up the other subscribers or the transfers.
  * 
- * In RX mode, it should copy/process the contents of the transfer buffer's valid part.
+ * The callback gets the raw device samples, @ref timssdr_set_rx_conversion doesn't apply, and must not modify them. @ref timssdr_transfer.rx_ctx is @p ctx. Returning nonzero stops callbacks for this subscriber only.
  * 
- * In RX SWEEP mode, it receives multiple "blocks" of data, each with a 10-byte header containing the tuned frequency followed by the samples. See @ref timssdr_init_sweep for more info.
+ * Must be called while the device is not streaming. Subscriptions last until @ref timssdr_rx_unsubscribe or @ref timssdr_close.
+ * @param device device to subscribe to
+ * @param callback callback run on the subscriber's thread
+ * @param ctx User provided context, available as @ref timssdr_transfer.rx_ctx
+ * @param queue_depth number of blocks that may wait for the subscriber, at least 1
+ * @param[out] subscription the new subscription
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid arguments, @ref TIMSSDR_ERROR_BUSY while streaming or @ref TIMSSDR_ERROR_NO_MEM (also beyond @ref TIMSSDR_MAX_SUBSCRIBERS subscribers)
+ * @ingroup streaming
+ */
+extern int timssdr_rx_subscribe(
+	timssdr_device* device,
+	timssdr_sample_block_cb_fn callback,
+	void* ctx,
+	uint32_t queue_depth,
+	timssdr_subscription** subscription);
+
+/**
+ * Remove a subscriber added with @ref timssdr_rx_subscribe
  * 
- * The callback should return 0 if it wants to be called again, and any other value otherwise. Stopping the RX/TX/SWEEP is still done with @ref timssdr_stop_rx and @ref timssdr_stop_tx, and those should be called from the main thread, so this callback should signal the main thread that it should stop. Signaling the main thread to stop TX should be done from the flush callback in order to guarantee that no samples are discarded, see @ref timssdr_flush_cb_fn
+ * Must be called while the device is not streaming.
+ * @param subscription subscription to remove, invalid afterwards
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on an unknown subscription or @ref TIMSSDR_ERROR_BUSY while streaming
  * @ingroup streaming
  */
-typedef int (*timssdr_sample_block_cb_fn)(timssdr_transfer* transfer);
+extern int timssdr_rx_unsubscribe(timssdr_subscription* subscription);
 
 /**
- * Block complete callback. 
+ * Get the number of blocks a subscriber missed because its queue was full
  * 
- * Set via @ref timssdr_set_tx_block_complete_callback, called when a transfer is finished to the device's buffer, regardless if the transfer was successful or not. It can signal the main thread to stop on failure, can catch USB transfer errors and can also gather statistics about the transfered data.
+ * Counted from the start of the stream. Blocks dropped for everyone because all spare buffers were held are counted in @ref timssdr_get_rx_overruns instead.
+ * @param subscription subscription to query
+ * @param[out] overruns missed blocks
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_INVALID_PARAM
  * @ingroup streaming
  */
-typedef void (*timssdr_tx_block_complete_cb_fn)(timssdr_transfer* transfer, int);
+extern int timssdr_get_subscription_overruns(const timssdr_subscription* subscription, uint64_t* overruns);
 
 /**
- * Flush (end of transmission) callback
+ * Start receiving to every subscriber
  * 
- * Will be called when the last samples are transmitted and stopping transmission will result in no samples getting lost. Should signal the main thread that it should stop transmission via @ref timssdr_stop_tx
+ * Works like @ref timssdr_start_rx_buffered, with the blocks shared between the subscribers added with @ref timssdr_rx_subscribe instead of handed to a single consumer. The pool holds enough spare buffers for every subscriber's queue. The processing stages (@ref timssdr_set_psd, @ref timssdr_set_ddc) are not fed in this mode. Stop with @ref timssdr_stop_rx, which returns once every subscriber has handled its queue.
+ * @param device device to start
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM without subscribers, @ref TIMSSDR_ERROR_BUSY while streaming or other @ref timssdr_error variant
  * @ingroup streaming
  */
-typedef void (*timssdr_flush_cb_fn)(void* flush_ctx, int);
+extern int timssdr_start_rx_subscribers(timssdr_device* device);
 
-#ifdef __cplusplus
-extern "C" {
-#endif
+/**
+ * Read the next block received in buffered pull mode
+ * 
+ * Only valid after @ref timssdr_start_rx_buffered with a NULL callback, and only from one thread at a time. On success @p transfer points at a library owned buffer holding the block, which stays valid until the next call to this function. It must not be called concurrently with @ref timssdr_start_rx_buffered or @ref timssdr_close.
+ * @param[in] device device to read from
+ * @param[out] transfer filled with the received block
+ * @param[in] timeout_ms maximum time to wait for a block in milliseconds, negative to wait forever
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_TIMEOUT if no block arrived in time, @ref TIMSSDR_ERROR_STREAMING_STOPPED once the stream has ended and all queued blocks were read, @ref TIMSSDR_ERROR_BUSY if blocks are delivered to a callback, or other @ref timssdr_error variant
+ * @ingroup streaming
+ */
+extern int timssdr_rx_read(
+	timssdr_device* device,
+	timssdr_transfer* transfer,
+	int timeout_ms);
 
 /**
- * Initialize libtimssdr
+ * Start receiving into a shared-memory ring for other processes
  * 
- * Should be called before any other libtimssdr function. Initializes libusb. Can be safely called multiple times.
- * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_LIBUSB
- * @ingroup library
+ * Broker mode: the device's blocks are published to any number of consumer processes on the same host, which attach by @p name with @ref timssdr_shm_attach. The ring is a file on hugetlbfs (`/dev/hugepages`) if hugepages are available, a POSIX shared memory object otherwise. Its slots serve as the transfer buffers, so blocks are received straight into shared memory and published in place without being copied. A ring of the same name left behind by a process that died is replaced.
+ * 
+ * The broker never waits for consumers. Each slot is reused @p slot_count blocks later, so a consumer has @p slot_count minus the number of transfers (see @ref timssdr_set_transfer_config) blocks of slack before it misses blocks. Stop with @ref timssdr_stop_rx, after which consumers see the end of stream. The ring stays around until the next start or @ref timssdr_close.
+ * @param device device to start
+ * @param name name of the ring, without '/', at most 200 characters
+ * @param slot_count number of blocks in the ring, more than the number of transfers
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid arguments, @ref TIMSSDR_ERROR_BUSY while streaming, @ref TIMSSDR_ERROR_FILE if the ring can't be created or other @ref timssdr_error variant
+ * @ingroup ipc
  */
-extern int timssdr_init();
+extern int timssdr_start_rx_shm(timssdr_device* device, const char* name, uint32_t slot_count);
 
 /**
- * Exit libtimssdr
+ * Attach to a shared-memory ring published with @ref timssdr_start_rx_shm
  * 
- * Should be called before exit. No other libtimssdr functions should be called after it. Can be safely called multiple times.
- * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_NOT_LAST_DEVICE if not all devices were closed properly.
- * @ingroup library
+ * The ring is mapped read-only. Reading starts with the next block the broker publishes.
+ * @param name name the broker gave the ring
+ * @param[out] consumer the new consumer
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid arguments, @ref TIMSSDR_ERROR_NOT_FOUND if there's no such ring, @ref TIMSSDR_ERROR_FILE if it can't be mapped or isn't a ring or @ref TIMSSDR_ERROR_NO_MEM
+ * @ingroup ipc
  */
-extern int timssdr_exit();
+extern int timssdr_shm_attach(const char* name, timssdr_shm_consumer** consumer);
 
 /**
- * Get library version.
+ * Read the next block from a shared-memory ring
  * 
- * Can be called before @ref timssdr_init
- * @return library version as a human-readable string
- * @ingroup library
+ * On success @p transfer points straight into the ring, no samples are copied. @ref timssdr_transfer.device is NULL. Blocks the consumer was too slow for are skipped, counted (see @ref timssdr_shm_get_overruns) and the next block is flagged with @ref TIMSSDR_TRANSFER_DISCONTINUITY. The broker may start overwriting the block once the consumer falls behind again, so check @ref timssdr_shm_block_intact after using the samples if that matters.
+ * @param[in] consumer consumer to read with, from one thread at a time
+ * @param[out] transfer filled with the block
+ * @param[in] timeout_ms maximum time to wait for a block in milliseconds, 0 to poll, negative to wait forever
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_TIMEOUT if no block arrived in time, @ref TIMSSDR_ERROR_STREAMING_STOPPED once the broker stopped and all blocks were read, or @ref TIMSSDR_ERROR_INVALID_PARAM
+ * @ingroup ipc
  */
-extern const char* timssdr_library_version();
+extern int timssdr_shm_read(timssdr_shm_consumer* consumer, timssdr_transfer* transfer, int timeout_ms);
 
 /**
- * List connected TimsSDR devices
- * @return list of connected devices. The list should be freed with @ref timssdr_device_list_free
- * @ingroup device
+ * Check that the block last returned by @ref timssdr_shm_read hasn't been overwritten
+ * 
+ * The broker marks a slot before it receives into it, so if this reports the block intact after its samples were used, they were read untouched.
+ * @param consumer consumer to check
+ * @return @ref TIMSSDR_TRUE if the block is intact, @ref TIMSSDR_ERROR_BUSY if the broker has begun overwriting it (counted as an overrun) or @ref TIMSSDR_ERROR_INVALID_PARAM if there's no block to check
+ * @ingroup ipc
  */
-extern timssdr_device_list_t* timssdr_device_list();
+extern int timssdr_shm_block_intact(timssdr_shm_consumer* consumer);
 
 /**
- * Open a @ref timssdr_device from a device list
- * @param[in] list device list to open device from
- * @param[in] idx index of the device to open
- * @param[out] device device handle to open
- * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid parameters or other @ref timssdr_error variant
- * @ingroup device
+ * Get the number of blocks a consumer missed
+ * @param[in] consumer consumer to query
+ * @param[out] overruns blocks skipped or overwritten since @ref timssdr_shm_attach
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_INVALID_PARAM
+ * @ingroup ipc
  */
-extern int timssdr_device_list_open(
-	timssdr_device_list_t* list,
-	int idx,
-	timssdr_device** device);
+extern int timssdr_shm_get_overruns(const timssdr_shm_consumer* consumer, uint64_t* overruns);
 
 /**
- * Free a previously allocated @ref timssdr_device_list list.
- * @param[in] list list to free
- * @ingroup device
+ * Detach from a shared-memory ring
+ * @param consumer consumer to detach, invalid afterwards
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_INVALID_PARAM
+ * @ingroup ipc
  */
-extern void timssdr_device_list_free(timssdr_device_list_t* list);
+extern int timssdr_shm_detach(timssdr_shm_consumer* consumer);
 
 /**
- * Open first available TimsSDR device
- * @param[out] device device handle
- * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM if @p device is NULL, @ref TIMSSDR_ERROR_NOT_FOUND if no TimsSDR devices are found or other @ref timssdr_error variant
- * @ingroup device
+ * Get the number of blocks dropped in buffered RX mode
+ * 
+ * A block is dropped when it completes while the consumer holds every spare buffer. The counter is reset by @ref timssdr_start_rx_buffered.
+ * @param[in] device device to query
+ * @param[out] overruns number of dropped blocks
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_INVALID_PARAM
+ * @ingroup streaming
  */
-extern int timssdr_open(timssdr_device** device);
+extern int timssdr_get_rx_overruns(timssdr_device* device, uint64_t* overruns);
 
 /**
- * Open TimsSDR device by serial number
- * @param[in] desired_serial_number serial number of device to open. If NULL then default to first device found.
- * @param[out] device device handle
- * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM if @p device is NULL, @ref TIMSSDR_ERROR_NOT_FOUND if no TimsSDR devices are found or other @ref timssdr_error variant
- * @ingroup device
+ * Start recording received samples to a file
+ * 
+ * Starts buffered RX (see @ref timssdr_start_rx_buffered) with a writer thread that writes each block to @p path straight from the transfer buffer, after a @ref timssdr_file_header. A slow disk only delays the writer: blocks queue up until the queue depth is exhausted and are then dropped and counted as overruns, so the USB transfers keep going and memory use stays bounded.
+ * 
+ * Stop with @ref timssdr_stop_rx, which writes out the queued blocks, completes the header and closes the file. A write error ends the stream.
+ * @param device device to record from
+ * @param path file to create or truncate
+ * @param opts recorder options, NULL for defaults
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_FILE if the file could not be created, @ref TIMSSDR_ERROR_BUSY if the device is streaming, or other @ref timssdr_error variant
+ * @ingroup recording
  */
-extern int timssdr_open_by_serial(
-	const char* const desired_serial_number,
-	timssdr_device** device);
+extern int timssdr_start_rx_to_file(
+	timssdr_device* device,
+	const char* path,
+	const timssdr_recorder_opts* opts);
 
 /**
- * Close a previously opened device
- * @param[in] device device to close
- * @return @ref TIMSSDR_SUCCESS on success or variant of @ref timssdr_error
- * @ingroup device
+ * Query the progress of a recording
+ * 
+ * Can be called from any thread, also after the recording was stopped, until the next one is started.
+ * @param[in] device device to query
+ * @param[out] bytes_written sample bytes written so far. Can be NULL.
+ * @param[out] os_error `errno` of the first failed file operation, 0 if none. Can be NULL.
+ * @return @ref TIMSSDR_SUCCESS if no error occurred, @ref TIMSSDR_ERROR_FILE if one did or @ref TIMSSDR_ERROR_INVALID_PARAM
+ * @ingroup recording
  */
-extern int timssdr_close(timssdr_device* device);
+extern int timssdr_get_recording_status(
+	timssdr_device* device,
+	uint64_t* bytes_written,
+	int* os_error);
 
 /**
- * Start receiving
+ * Read samples synchronously
  * 
- * Should be called after setting gains, frequency and sampling rate, as these values won't get reset but instead keep their last value, thus their state is unknown.
+ * Blocks until @p len bytes were received, the stream ended or @p timeout_ms expired.
  * 
- * The callback is called with a @ref timssdr_transfer object whenever the buffer is full. The callback is called in an async context so no libtimssdr functions should be called from it. The callback should treat its argument as read-only.
- * @param device device to configure
- * @param callback rx_callback
- * @param rx_ctx User provided RX context. Not used by the library, but available to @p callback as @ref timssdr_transfer.rx_ctx.
- * @return @ref TIMSSDR_SUCCESS on success or @ref timssdr_error variant
+ * If buffered RX was started in pull mode (@ref timssdr_start_rx_buffered with a NULL callback), the bytes are copied out of the queued blocks, which keeps transfers in flight between calls. Otherwise, if the device is not streaming, @p buf is submitted to the device directly as bulk transfers, so whole 512-byte packets land in it without any copy. Only a tail shorter than a packet goes through an internal buffer; received bytes that didn't fit are returned by the next call. In this mode nothing is received between calls.
+ * 
+ * In either mode, don't mix this function with @ref timssdr_rx_read on the same stream.
+ * @param[in] device device to read from
+ * @param[out] buf buffer to fill with interleaved 8 bit I/Q samples
+ * @param[in] len number of bytes to read
+ * @param[out] n_read number of bytes read, also on error. Can be NULL.
+ * @param[in] timeout_ms maximum time to wait in milliseconds, negative to wait forever
+ * @return @ref TIMSSDR_SUCCESS on success (@p n_read may be less than @p len if the device sent a short transfer or the stream ended), @ref TIMSSDR_ERROR_TIMEOUT if the timeout expired, @ref TIMSSDR_ERROR_STREAMING_STOPPED once a buffered stream has ended, @ref TIMSSDR_ERROR_BUSY if the device is streaming in another mode, or other @ref timssdr_error variant
  * @ingroup streaming
  */
-extern int timssdr_start_rx(
+extern int timssdr_read_sync(
 	timssdr_device* device,
-	timssdr_sample_block_cb_fn callback,
-	void* rx_ctx);
+	void* buf,
+	int len,
+	int* n_read,
+	int timeout_ms);
 
 /**
- * Stop receiving
+ * Write samples synchronously
  * 
- * @param device device to stop RX on
- * @return @ref TIMSSDR_SUCCESS on success or @ref timssdr_error variant
+ * Blocks until all @p len bytes were sent to the device or @p timeout_ms expired. Only valid while the device is not streaming. Whole 512-byte packets are sent straight from @p buf without a copy, a shorter tail is copied and zero-padded to a full packet, like the TX streaming path does.
+ * @param[in] device device to write to
+ * @param[in] buf interleaved 8 bit I/Q samples to send
+ * @param[in] len number of bytes to send
+ * @param[out] n_written number of bytes sent, also on error. Can be NULL.
+ * @param[in] timeout_ms maximum time to wait in milliseconds, negative to wait forever
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_TIMEOUT if the timeout expired, @ref TIMSSDR_ERROR_BUSY if the device is streaming, or other @ref timssdr_error variant
  * @ingroup streaming
  */
-extern int timssdr_stop_rx(timssdr_device* device);
+extern int timssdr_write_sync(
+	timssdr_device* device,
+	const void* buf,
+	int len,
+	int* n_written,
+	int timeout_ms);
+
+/**
+ * Get streaming statistics
+ * 
+ * Can be called from any thread at any time, including while streaming. Each counter is read atomically, but the counters are not a single snapshot.
+ * @param[in] device device to query
+ * @param[out] stats statistics
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_INVALID_PARAM
+ * @ingroup streaming
+ */
+extern int timssdr_get_stats(timssdr_device* device, timssdr_stats* stats);
+
+/**
+ * Reset streaming statistics to zero
+ * 
+ * Best called while not streaming, counters updated concurrently may keep part of their old value.
+ * @param device device to reset
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_INVALID_PARAM
+ * @ingroup streaming
+ */
+extern int timssdr_reset_stats(timssdr_device* device);
 
 /**
  * Start transmitting
@@ -256,6 +1409,61 @@ extern int timssdr_start_tx(
 	timssdr_sample_block_cb_fn callback,
 	void* tx_ctx);
 
+/**
+ * Start transmitting in push mode
+ * 
+ * Instead of a callback filling each transfer when it completes, the application queues samples with @ref timssdr_tx_submit from its own thread. Samples are copied into a pool of transfer-sized blocks shared through lock-free single-producer/single-consumer queues, and a completing transfer only swaps in the next full block. With @p queue_depth blocks of slack a bursty producer doesn't cause underruns as long as it keeps up on average.
+ * 
+ * Nothing is sent until the first block is full (or pushed out early with an empty @ref timssdr_tx_submit). When the producer falls behind, transfers wait for data and the device underruns, see @ref timssdr_stats.tx_underruns. TX flush (@ref timssdr_enable_tx_flush) is not used in this mode. Stop with @ref timssdr_stop_tx.
+ * @param device device to configure
+ * @param queue_depth number of blocks of the current transfer size (see @ref timssdr_set_transfer_config) on top of the in-flight ones. Must be at least 2.
+ * @param tx_ctx User provided TX context. Not used by the library, but available to the block complete callback as @ref timssdr_transfer.tx_ctx.
+ * @return @ref TIMSSDR_SUCCESS on success or @ref timssdr_error variant
+ * @ingroup streaming
+ */
+extern int timssdr_start_tx_buffered(
+	timssdr_device* device,
+	uint32_t queue_depth,
+	void* tx_ctx);
+
+/**
+ * Queue samples for transmission in push mode
+ * 
+ * Only valid after @ref timssdr_start_tx_buffered, and only from one thread at a time. Blocks while all blocks are queued or in flight. Full blocks are queued as soon as they are filled, a partly filled block is kept for the next call. Call with @p length 0 to queue a partly filled block right away, zero-padded to whole 512-byte packets.
+ * @param[in] device device to transmit on
+ * @param[in] samples interleaved 8 bit I/Q samples, may be NULL if @p length is 0
+ * @param[in] length number of bytes to queue
+ * @param[out] n_submitted number of bytes accepted, also on error. Can be NULL.
+ * @param[in] timeout_ms maximum time to wait for a free block in milliseconds, negative to wait forever
+ * @return @ref TIMSSDR_SUCCESS once all of @p samples were accepted, @ref TIMSSDR_ERROR_TIMEOUT if no block became free in time, @ref TIMSSDR_ERROR_STREAMING_STOPPED if the stream was stopped or has failed, or other @ref timssdr_error variant
+ * @ingroup streaming
+ */
+extern int timssdr_tx_submit(
+	timssdr_device* device,
+	const void* samples,
+	int length,
+	int* n_submitted,
+	int timeout_ms);
+
+/**
+ * Start transmitting samples from files
+ * 
+ * The files are memory mapped and sent back to back without gaps, as one stream. Transfers are filled straight from the mappings on the event thread, with the kernel reading ahead sequentially, so there are no system calls per block. Files written by @ref timssdr_start_rx_to_file are recognised by their header, which is skipped. Other files are sent as raw 8 bit I/Q.
+ * 
+ * Without looping the stream ends after the last file: the final block is zero-padded to whole packets and, if enabled with @ref timssdr_enable_tx_flush, the flush follows as after any TX callback that ends the stream. Stop with @ref timssdr_stop_tx in either case, which also unmaps the files.
+ * @param device device to transmit on
+ * @param paths files to send, in order
+ * @param path_count number of entries in @p paths
+ * @param opts replay options, NULL for defaults (no looping)
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_FILE if a file could not be opened or mapped, @ref TIMSSDR_ERROR_NOT_SUPPORTED for a recording in another sample format, @ref TIMSSDR_ERROR_INVALID_PARAM if there are no samples at all, or other @ref timssdr_error variant
+ * @ingroup recording
+ */
+extern int timssdr_start_tx_from_file(
+	timssdr_device* device,
+	const char* const* paths,
+	int path_count,
+	const timssdr_replay_opts* opts);
+
 /**
  * Setup callback to be called when an USB transfer is completed.
  * 
@@ -295,6 +1503,104 @@ extern int timssdr_enable_tx_flush(
  */
 extern int timssdr_stop_tx(timssdr_device* device);
 
+/**
+ * Enable or disable full-duplex streaming
+ * 
+ * By default RX and TX share one set of transfers, so starting one direction while the other is streaming fails with @ref TIMSSDR_ERROR_BUSY. With full duplex enabled, TX streaming runs on its own transfers (same count and size as set with @ref timssdr_set_transfer_config) with its own event handling, so @ref timssdr_start_rx and @ref timssdr_start_tx (or any of their variants) can run at the same time and be stopped independently with @ref timssdr_stop_rx and @ref timssdr_stop_tx. The TX callbacks still see @p device in @ref timssdr_transfer.device.
+ * 
+ * A TX block complete callback and TX flush set up before enabling are carried over. Ones set while enabled apply to TX streaming until full duplex is disabled again. @ref timssdr_get_stats then adds up the counters of both directions, the completion interval figures are for RX only. @ref timssdr_set_thread_attrs applies to RX event handling only. Disabled by default.
+ * @param device device to configure
+ * @param enable nonzero to enable full duplex, 0 to disable it
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_BUSY if the device is streaming in either direction or other @ref timssdr_error variant
+ * @ingroup streaming
+ */
+extern int timssdr_set_full_duplex(timssdr_device* device, int enable);
+
+/**
+ * Configure the number and size of USB bulk transfers used for streaming
+ * 
+ * More in-flight transfers tolerate longer callback or scheduling hiccups at high sample rates, smaller transfers reduce latency at low sample rates. The transfer buffers are reallocated, so this must be called while the device is not streaming, i.e. before @ref timssdr_start_rx / @ref timssdr_start_tx or after stopping. The new @p transfer_buffer_size is reported to callbacks as @ref timssdr_transfer.buffer_length.
+ * 
+ * Defaults to 4 transfers of 262144 bytes each.
+ * 
+ * @param device device to configure
+ * @param transfer_count number of transfers kept in flight, must be at least 1
+ * @param transfer_buffer_size size of each transfer buffer in bytes, must be a non-zero multiple of 512 that fits in an int
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid parameters, @ref TIMSSDR_ERROR_BUSY if the device is streaming or @ref TIMSSDR_ERROR_NO_MEM if the buffers couldn't be allocated (the previous configuration is kept in that case)
+ * @ingroup streaming
+ */
+extern int timssdr_set_transfer_config(
+	timssdr_device* device,
+	uint32_t transfer_count,
+	uint32_t transfer_buffer_size);
+
+/**
+ * Query the current transfer configuration
+ * 
+ * @param[in] device device to query
+ * @param[out] transfer_count number of transfers kept in flight. Can be NULL.
+ * @param[out] transfer_buffer_size size of each transfer buffer in bytes. Can be NULL.
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_INVALID_PARAM
+ * @ingroup streaming
+ */
+extern int timssdr_get_transfer_config(
+	timssdr_device* device,
+	uint32_t* transfer_count,
+	uint32_t* transfer_buffer_size);
+
+/**
+ * Enable or disable zero-copy transfer buffers
+ * 
+ * When enabled, the transfer buffers are allocated with `libusb_dev_mem_alloc()`, which on Linux maps memory shared with the kernel's usbfs driver. Completed RX transfers then land directly in the buffer handed to the @ref timssdr_sample_block_cb_fn callback, without the kernel copying every block into user memory. Disabled by default.
+ * 
+ * Where device memory is not available (non-Linux platforms, old kernels or libusb versions) the regular heap buffers are kept and the device continues to work normally. The buffers are reallocated, so this must be called while the device is not streaming.
+ * 
+ * @param device device to configure
+ * @param enable nonzero to request zero-copy buffers, 0 to use regular heap buffers
+ * @return @ref TIMSSDR_SUCCESS if the requested mode is in effect, @ref TIMSSDR_ERROR_NOT_SUPPORTED if zero-copy was requested but device memory is unavailable (regular buffers are used instead), @ref TIMSSDR_ERROR_BUSY if the device is streaming or other @ref timssdr_error variant
+ * @ingroup streaming
+ */
+extern int timssdr_set_zero_copy(timssdr_device* device, int enable);
+
+/**
+ * Enable or disable hugepage-backed transfer buffers
+ * 
+ * When enabled, the transfer buffers, the block pools of buffered RX/TX and the TX flush buffer are mapped from 2 MiB hugepages: from the kernel's hugetlb pool if it has enough pages reserved (see `/proc/sys/vm/nr_hugepages`), otherwise from regular memory advised for transparent hugepages. This cuts TLB misses when blocks are processed at high sample rates. Each buffer is rounded up to a multiple of 2 MiB and faulted in when it is allocated, so no page faults are taken while streaming. The buffers are kept across start/stop cycles. Disabled by default.
+ * 
+ * Zero-copy buffers (see @ref timssdr_set_zero_copy) take precedence where they are available. The buffers are reallocated, so this must be called while the device is not streaming, and blocks of a stopped buffered stream that weren't read yet are dropped.
+ * 
+ * @param device device to configure
+ * @param enable nonzero to request hugepage buffers, 0 to use regular heap buffers
+ * @return @ref TIMSSDR_SUCCESS if the requested mode is in effect, @ref TIMSSDR_ERROR_NOT_SUPPORTED if hugepages were requested but aren't available on this platform (regular buffers are used instead), @ref TIMSSDR_ERROR_BUSY if the device is streaming or other @ref timssdr_error variant
+ * @ingroup streaming
+ */
+extern int timssdr_set_hugepages(timssdr_device* device, int enable);
+
+/**
+ * Tell the library the rate the device streams at
+ * 
+ * The library can't query the sample rate from the device. Knowing it, it can tell when the device ran out of submitted transfers and had to drop (RX) or pad (TX) samples, flag the next block with @ref TIMSSDR_TRANSFER_DISCONTINUITY and advance @ref timssdr_transfer.sample_index by the estimated number of lost samples. The estimate is based on host time, so the rate should be accurate and gaps shorter than clock drift over the stream can go unnoticed. Disabled (0) by default.
+ * @param device device to configure
+ * @param sample_rate rate in samples (I/Q pairs) per second, 0 to disable gap estimation
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_INVALID_PARAM for a negative, infinite or NaN rate
+ * @ingroup streaming
+ */
+extern int timssdr_set_stream_rate(timssdr_device* device, double sample_rate);
+
+/**
+ * Keep receiving through transient USB errors
+ * 
+ * Without recovery, any RX transfer that fails (or can't be resubmitted) ends the stream, and getting it back takes a close and reopen. With recovery on, transfers that failed with an error, time-out, stall or overflow are handed to a library thread instead, while the other transfers keep streaming. It clears the endpoint halt after a stall and resubmits the transfer, backing off from 1 ms up to 100 ms between further attempts. The block the transfer would have carried is counted as lost: the next block delivered is flagged with @ref TIMSSDR_TRANSFER_DISCONTINUITY and its @ref timssdr_transfer.sample_index is past the hole. With the stream rate set (@ref timssdr_set_stream_rate), time the device spent without any transfer to fill is added as well. Each hole is reported to @ref timssdr_recovery_opts.gap_callback, and counted in @ref timssdr_stats.recovered_transfers.
+ * 
+ * The stream still ends if the device is gone, or if a transfer couldn't be resubmitted after @ref timssdr_recovery_opts.max_attempts tries. Covers the RX modes of @ref timssdr_start_rx, @ref timssdr_start_rx_buffered (and the modes built on it) and @ref timssdr_start_rx_shm. TX streams are not recovered. Disabled by default. Must be called while the device is not streaming.
+ * 
+ * @param device device to configure
+ * @param opts recovery options, NULL to disable recovery
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_BUSY if the device is streaming, @ref TIMSSDR_ERROR_THREAD if the recovery thread couldn't be started or other @ref timssdr_error variant
+ * @ingroup streaming
+ */
+extern int timssdr_set_error_recovery(timssdr_device* device, const timssdr_recovery_opts* opts);
+
 /**
  * Get Error details
  * 
@@ -313,6 +1619,175 @@ extern const char* timssdr_error_name(enum timssdr_error error);
  */
 extern int timssdr_is_streaming(timssdr_device* device);
 
+/**
+ * Convert a block of samples between formats
+ * 
+ * Converts between the 8 bit formats and @ref TIMSSDR_FORMAT_CS16 / @ref TIMSSDR_FORMAT_CF32 in either direction, and between the two 8 bit formats. Conversions to 8 bit round to nearest and saturate. Uses SSE2/AVX2 or NEON kernels where the CPU supports them, selected at runtime. Setting the environment variable `TIMSSDR_CONVERT_SCALAR=1` forces the portable version.
+ * 
+ * @param[in] src_format format of @p src
+ * @param[in] src samples to convert
+ * @param[in] dst_format format of @p dst
+ * @param[out] dst output buffer of at least @p count * @ref timssdr_sample_size (@p dst_format) bytes. Must not overlap @p src.
+ * @param[in] count number of complex samples (I/Q pairs)
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_INVALID_PARAM for unsupported format pairs
+ * @ingroup conversion
+ */
+extern int timssdr_convert(
+	enum timssdr_sample_format src_format,
+	const void* src,
+	enum timssdr_sample_format dst_format,
+	void* dst,
+	size_t count);
+
+/**
+ * Size of one complex sample in bytes
+ * @param format sample format
+ * @return size in bytes, or 0 for an unknown format
+ * @ingroup conversion
+ */
+extern size_t timssdr_sample_size(enum timssdr_sample_format format);
+
+/**
+ * Name of the conversion kernels selected for this CPU
+ * @return "avx2", "sse2", "neon" or "scalar"
+ * @ingroup conversion
+ */
+extern const char* timssdr_convert_backend(void);
+
+/**
+ * Compute averaged power spectra of the received samples
+ * 
+ * Each received block (in every RX mode, including buffered and sweep mode) is copied to a pool of worker threads, right before it is handed to the sample block callback. The workers split it into windowed segments of @ref timssdr_psd_config.fft_size samples, transform them and average their power, and @p callback receives one @ref timssdr_psd_frame per @ref timssdr_psd_config.averages segments. Segments and frames span blocks: the samples a block ends with and the segments of an unfinished frame are carried over to the next block, so the frames don't depend on how the stream is cut into blocks. A block flagged with @ref TIMSSDR_TRANSFER_DISCONTINUITY, or one after a skipped block, starts over. In sweep mode, each sweep block is transformed on its own and its frequency is passed along, a frame then averages at most the segments of one sweep block.
+ * 
+ * The FFT is planned once here, with FFTW when the library was built with it (see @ref timssdr_psd_backend) and a built-in radix-2 FFT otherwise. When every worker is busy, blocks are skipped and counted in @ref timssdr_stats.psd_dropped, so the stage never holds up the USB transfers. The sample block callback passed to the start function may be NULL while the PSD stage is enabled.
+ * 
+ * Must be called while the device is not streaming, and after @ref timssdr_set_rx_conversion if that is used to set a device format other than @ref TIMSSDR_FORMAT_S8. The stage stays set up across start/stop cycles.
+ * @param device device to configure
+ * @param config FFT, window and averaging setup, or NULL to disable the stage
+ * @param callback frame callback
+ * @param psd_ctx User provided context, available to @p callback as @ref timssdr_psd_frame.psd_ctx
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid parameters, @ref TIMSSDR_ERROR_BUSY while streaming, @ref TIMSSDR_ERROR_NO_MEM or @ref TIMSSDR_ERROR_THREAD
+ * @ingroup spectrum
+ */
+extern int timssdr_set_psd(
+	timssdr_device* device,
+	const timssdr_psd_config* config,
+	timssdr_psd_cb_fn callback,
+	void* psd_ctx);
+
+/**
+ * Get the name of the FFT backend used by the PSD stage ("fftw3f" or "builtin")
+ * @return backend name
+ * @ingroup spectrum
+ */
+extern const char* timssdr_psd_backend(void);
+
+/**
+ * Split the received samples into decimated channels
+ * 
+ * Each received block (in every RX mode except sweep mode) is converted to complex float and passed through a digital down-converter per channel, and each channel's @ref timssdr_ddc_channel.callback receives the block's worth of decimated samples. In @ref TIMSSDR_DDC_INDEPENDENT mode, a channel is mixed to baseband with a numerically controlled oscillator, then low-pass filtered and decimated by a polyphase FIR, which only computes the output samples that are kept. In @ref TIMSSDR_DDC_PFB mode, a polyphase filter bank splits the band into equal channels at once: its filter runs once per output sample for all channels, and each selected channel adds a single DFT bin, so many channels cost little more than one. Channel state carries over between blocks, so the output is continuous.
+ * 
+ * With @ref timssdr_ddc_config.threads set to 0, channels are processed right where the block is received, before it is handed to the sample block callback, without copying it. Otherwise received blocks are copied to the workers and the channels are spread over them. Every worker processes every block for its channels, and in PFB mode each worker runs the filter bank itself. When a worker falls behind, blocks are skipped for all channels, counted in @ref timssdr_stats.ddc_dropped and flagged on the next output, so the stage never holds up the USB transfers. The sample block callback passed to the start function may be NULL while the DDC stage is enabled.
+ * 
+ * The filter and mixing kernels use SSE2/AVX2 or NEON where the CPU supports them, see @ref timssdr_ddc_backend. Setting the environment variable `TIMSSDR_DDC_SCALAR=1` forces the portable version.
+ * 
+ * Must be called while the device is not streaming, and after @ref timssdr_set_rx_conversion if that is used to set a device format other than @ref TIMSSDR_FORMAT_S8. The stage stays set up across start/stop cycles.
+ * @param device device to configure
+ * @param config channel setup, or NULL to disable the stage
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid parameters, @ref TIMSSDR_ERROR_BUSY while streaming, @ref TIMSSDR_ERROR_NO_MEM or @ref TIMSSDR_ERROR_THREAD
+ * @ingroup ddc
+ */
+extern int timssdr_set_ddc(timssdr_device* device, const timssdr_ddc_config* config);
+
+/**
+ * Get the name of the kernels used by the DDC stage
+ * @return "avx2", "sse2", "neon" or "scalar"
+ * @ingroup ddc
+ */
+extern const char* timssdr_ddc_backend(void);
+
+/**
+ * Convert received samples before they are handed to the RX callback
+ * 
+ * When enabled, every received block is converted from @p device_format to @p output_format right before the sample block callback runs (on the libusb thread for @ref timssdr_start_rx, on the consuming thread in buffered mode), and made available as @ref timssdr_transfer.converted and @ref timssdr_transfer.converted_count. The raw bytes stay available in @ref timssdr_transfer.buffer.
+ * 
+ * The output goes into @p buffer, so a consumer can have it written straight into its own memory. A block that doesn't fit is truncated to the capacity of @p buffer. If @p buffer is NULL, the library allocates one large enough for the current transfer size.
+ * 
+ * Must be called while the device is not streaming.
+ * @param device device to configure
+ * @param device_format format the device delivers, @ref TIMSSDR_FORMAT_S8 or @ref TIMSSDR_FORMAT_U8
+ * @param output_format @ref TIMSSDR_FORMAT_CS16 or @ref TIMSSDR_FORMAT_CF32, or the same value as @p device_format to disable conversion
+ * @param buffer output buffer, or NULL to let the library allocate it
+ * @param buffer_size size of @p buffer in bytes
+ * @return @ref TIMSSDR_SUCCESS on success or @ref timssdr_error variant
+ * @ingroup conversion
+ */
+extern int timssdr_set_rx_conversion(
+	timssdr_device* device,
+	enum timssdr_sample_format device_format,
+	enum timssdr_sample_format output_format,
+	void* buffer,
+	size_t buffer_size);
+
+/**
+ * Connect to a timssdr-server
+ * 
+ * Streaming starts with @ref timssdr_net_start_rx. Blocks arrive as the server read them from its device, with their sample index, time stamp and flags.
+ * @param host name or address of the server
+ * @param port port of the server, usually @ref TIMSSDR_NET_DEFAULT_PORT
+ * @param protocol transport to use
+ * @param[out] client the new client
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid arguments, @ref TIMSSDR_ERROR_NOT_FOUND if @p host can't be resolved, @ref TIMSSDR_ERROR_NETWORK if the server can't be reached or @ref TIMSSDR_ERROR_NO_MEM
+ * @ingroup network
+ */
+extern int timssdr_net_connect(
+	const char* host,
+	uint16_t port,
+	enum timssdr_net_protocol protocol,
+	timssdr_net_client** client);
+
+/**
+ * Start receiving from the server
+ * 
+ * A client thread reassembles the packets and calls @p callback once per block, the same way @ref timssdr_start_rx does for a local device. @ref timssdr_transfer.device is NULL and @ref timssdr_transfer.buffer is only valid until the callback returns. Blocks that were only partly received are skipped, and the next complete one is flagged with @ref TIMSSDR_TRANSFER_DISCONTINUITY. Returning nonzero from the callback stops delivery, the client still has to be stopped with @ref timssdr_net_stop_rx.
+ * @param client client to start
+ * @param callback callback run on the client thread
+ * @param rx_ctx User provided RX context, available as @ref timssdr_transfer.rx_ctx
+ * @return @ref TIMSSDR_SUCCESS on success, @ref TIMSSDR_ERROR_INVALID_PARAM on invalid arguments, @ref TIMSSDR_ERROR_BUSY if already started, @ref TIMSSDR_ERROR_NETWORK or @ref TIMSSDR_ERROR_THREAD
+ * @ingroup network
+ */
+extern int timssdr_net_start_rx(
+	timssdr_net_client* client,
+	timssdr_sample_block_cb_fn callback,
+	void* rx_ctx);
+
+/**
+ * Stop receiving from the server
+ * 
+ * Returns once the client thread has finished. A TCP stream can't be resumed afterwards, UDP clients unsubscribe and may start again.
+ * @param client client to stop
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_INVALID_PARAM
+ * @ingroup network
+ */
+extern int timssdr_net_stop_rx(timssdr_net_client* client);
+
+/**
+ * Get the counters of a network stream
+ * @param[in] client client to query
+ * @param[out] stats filled with the counters since @ref timssdr_net_connect
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_INVALID_PARAM
+ * @ingroup network
+ */
+extern int timssdr_net_get_stats(timssdr_net_client* client, timssdr_net_stats* stats);
+
+/**
+ * Stop receiving if needed and close the connection
+ * @param client client to close, invalid afterwards
+ * @return @ref TIMSSDR_SUCCESS on success or @ref TIMSSDR_ERROR_INVALID_PARAM
+ * @ingroup network
+ */
+extern int timssdr_net_close(timssdr_net_client* client);
+
 /**
  * Read board part ID and serial number
  * 
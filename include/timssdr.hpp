@@ -0,0 +1,369 @@
+#ifndef TIMSSDR_HPP
+#define TIMSSDR_HPP
+
+/*
+ * Header-only C++ wrapper around timssdr.h. Callables passed to the
+ * streaming functions are called through a static trampoline instantiated
+ * for their type, so the block path is the C path plus an inlinable call:
+ * no virtual dispatch, no std::function, no allocation. Errors are thrown
+ * as timssdr::Error, with the timssdr_error code.
+ *
+ * Exceptions can't unwind through the library and the libusb event thread.
+ * One thrown by a callable is caught in the trampoline, which stops the
+ * stream as if the callable had returned nonzero; the exception is then
+ * rethrown by the next stop_rx() or stop_tx().
+ */
+
+#include "timssdr.h"
+
+#include <complex>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+#if defined(__has_include)
+	#if __has_include(<version>)
+		#include <version>
+	#endif
+#endif
+#if defined(__cpp_lib_span) && __cpp_lib_span >= 202002L
+	#include <span>
+#endif
+
+namespace timssdr {
+
+/* One interleaved 8 bit I/Q sample, as laid out in timssdr_transfer.buffer. */
+typedef std::complex<int8_t> sample;
+
+#if defined(__cpp_lib_span) && __cpp_lib_span >= 202002L
+template <typename T>
+using span = std::span<T>;
+#else
+/* The part of std::span used here, for builds before C++20. */
+template <typename T>
+class span {
+public:
+	span() noexcept : data_(nullptr), size_(0) {}
+	span(T* data, std::size_t size) noexcept : data_(data), size_(size) {}
+
+	T* data() const noexcept { return data_; }
+	std::size_t size() const noexcept { return size_; }
+	std::size_t size_bytes() const noexcept { return size_ * sizeof(T); }
+	bool empty() const noexcept { return size_ == 0; }
+	T* begin() const noexcept { return data_; }
+	T* end() const noexcept { return data_ + size_; }
+	T& operator[](std::size_t index) const noexcept { return data_[index]; }
+
+private:
+	T* data_;
+	std::size_t size_;
+};
+#endif
+
+class Error : public std::runtime_error {
+public:
+	explicit Error(int code)
+		: std::runtime_error(timssdr_error_name(static_cast<enum timssdr_error>(code))),
+		  code_(code)
+	{
+	}
+
+	/* The @ref timssdr_error variant */
+	int code() const noexcept { return code_; }
+
+private:
+	int code_;
+};
+
+inline void check(int result)
+{
+	if (result != TIMSSDR_SUCCESS) {
+		throw Error(result);
+	}
+}
+
+/* Calls timssdr_init() and timssdr_exit(), keep one around while devices are open. */
+class Library {
+public:
+	Library() { check(timssdr_init()); }
+	~Library() { timssdr_exit(); }
+
+	Library(const Library&) = delete;
+	Library& operator=(const Library&) = delete;
+};
+
+/*
+ * View of the block handed to a callback. It refers to library owned
+ * memory that is only valid during the callback, so it can't be copied,
+ * only moved within the callback.
+ */
+class Transfer {
+public:
+	explicit Transfer(timssdr_transfer* transfer) noexcept : transfer_(transfer) {}
+
+	Transfer(Transfer&& other) noexcept : transfer_(other.transfer_) {}
+	Transfer& operator=(Transfer&& other) noexcept
+	{
+		transfer_ = other.transfer_;
+		return *this;
+	}
+	Transfer(const Transfer&) = delete;
+	Transfer& operator=(const Transfer&) = delete;
+
+	/* Received samples, the valid part of the buffer */
+	span<const sample> samples() const noexcept
+	{
+		return span<const sample>(
+			reinterpret_cast<const sample*>(transfer_->buffer),
+			static_cast<std::size_t>(transfer_->valid_length) / sizeof(sample));
+	}
+
+	/* The whole buffer, to be filled for TX */
+	span<sample> buffer() const noexcept
+	{
+		return span<sample>(
+			reinterpret_cast<sample*>(transfer_->buffer),
+			static_cast<std::size_t>(transfer_->buffer_length) / sizeof(sample));
+	}
+
+	/* Number of samples of buffer() to send, 0 to stop TX */
+	void set_sample_count(std::size_t count) noexcept
+	{
+		transfer_->valid_length = static_cast<int>(count * sizeof(sample));
+	}
+
+	uint64_t sample_index() const noexcept { return transfer_->sample_index; }
+	uint64_t timestamp_ns() const noexcept { return transfer_->timestamp_ns; }
+	/* bitmask of @ref timssdr_transfer_flags */
+	uint32_t flags() const noexcept { return transfer_->flags; }
+	bool discontinuity() const noexcept
+	{
+		return (transfer_->flags & TIMSSDR_TRANSFER_DISCONTINUITY) != 0;
+	}
+
+	timssdr_transfer& raw() const noexcept { return *transfer_; }
+
+private:
+	timssdr_transfer* transfer_;
+};
+
+/*
+ * An open device, closed when destroyed. Move-only. A default constructed
+ * or moved-from Device holds nothing.
+ *
+ * The callables given to start_rx() and start_tx() are called as
+ * `int callback(timssdr::Transfer&)`, returning 0 to keep streaming.
+ * They are held by reference and must outlive the stream. A Device may be
+ * moved while streaming, but not released.
+ */
+class Device {
+public:
+	Device() noexcept : device_(nullptr) {}
+	/* Takes ownership of a device opened through the C API */
+	explicit Device(timssdr_device* device) noexcept : device_(device) {}
+	~Device() { reset(); }
+
+	Device(Device&& other) noexcept
+		: device_(other.release()),
+		  streams_(std::move(other.streams_))
+	{
+	}
+	Device& operator=(Device&& other) noexcept
+	{
+		if (this != &other) {
+			reset(other.release());
+			streams_ = std::move(other.streams_);
+		}
+		return *this;
+	}
+	Device(const Device&) = delete;
+	Device& operator=(const Device&) = delete;
+
+	static Device open()
+	{
+		timssdr_device* device;
+		check(timssdr_open(&device));
+		return Device(device);
+	}
+
+	static Device open_by_serial(const char* desired_serial_number)
+	{
+		timssdr_device* device;
+		check(timssdr_open_by_serial(desired_serial_number, &device));
+		return Device(device);
+	}
+
+	static Device open_mock(const timssdr_mock_config& config)
+	{
+		timssdr_device* device;
+		check(timssdr_open_mock(&config, &device));
+		return Device(device);
+	}
+
+	timssdr_device* get() const noexcept { return device_; }
+	explicit operator bool() const noexcept { return device_ != nullptr; }
+
+	/* Give up ownership without closing */
+	timssdr_device* release() noexcept
+	{
+		timssdr_device* device = device_;
+		device_ = nullptr;
+		return device;
+	}
+
+	void reset(timssdr_device* device = nullptr) noexcept
+	{
+		if (device_ != nullptr) {
+			timssdr_close(device_);
+		}
+		device_ = device;
+		streams_.reset();
+	}
+
+	template <typename F>
+	void start_rx(F& callback)
+	{
+		Streams& streams = get_streams();
+		streams.rx_callback = &callback;
+		streams.rx_error = nullptr;
+		check(timssdr_start_rx(device_, &rx_trampoline<F>, &streams));
+	}
+
+	/* Also rethrows an exception that ended the stream from the callable */
+	void stop_rx()
+	{
+		check(timssdr_stop_rx(device_));
+		rethrow(streams_ ? &streams_->rx_error : nullptr);
+	}
+
+	void pause_rx() { check(timssdr_pause_rx(device_)); }
+	void resume_rx() { check(timssdr_resume_rx(device_)); }
+
+	template <typename F>
+	void start_tx(F& callback)
+	{
+		Streams& streams = get_streams();
+		streams.tx_callback = &callback;
+		streams.tx_error = nullptr;
+		check(timssdr_start_tx(device_, &tx_trampoline<F>, &streams));
+	}
+
+	/* Also rethrows an exception that ended the stream from the callable */
+	void stop_tx()
+	{
+		check(timssdr_stop_tx(device_));
+		rethrow(streams_ ? &streams_->tx_error : nullptr);
+	}
+
+	bool is_streaming() const noexcept
+	{
+		return timssdr_is_streaming(device_) == TIMSSDR_TRUE;
+	}
+
+	/* Returns the number of samples read, see timssdr_read_sync() */
+	std::size_t read(span<sample> samples, int timeout_ms = -1)
+	{
+		int n_read = 0;
+		check(timssdr_read_sync(
+			device_,
+			samples.data(),
+			static_cast<int>(samples.size_bytes()),
+			&n_read,
+			timeout_ms));
+		return static_cast<std::size_t>(n_read) / sizeof(sample);
+	}
+
+	/* Returns the number of samples written, see timssdr_write_sync() */
+	std::size_t write(span<const sample> samples, int timeout_ms = -1)
+	{
+		int n_written = 0;
+		check(timssdr_write_sync(
+			device_,
+			samples.data(),
+			static_cast<int>(samples.size_bytes()),
+			&n_written,
+			timeout_ms));
+		return static_cast<std::size_t>(n_written) / sizeof(sample);
+	}
+
+	void set_transfer_config(uint32_t transfer_count, uint32_t transfer_buffer_size)
+	{
+		check(timssdr_set_transfer_config(device_, transfer_count, transfer_buffer_size));
+	}
+
+	void set_stream_rate(double sample_rate)
+	{
+		check(timssdr_set_stream_rate(device_, sample_rate));
+	}
+
+	timssdr_stats stats() const
+	{
+		timssdr_stats stats;
+		check(timssdr_get_stats(device_, &stats));
+		return stats;
+	}
+
+private:
+	/*
+	 * The context handed to the library, on the heap so that it stays put
+	 * when the Device is moved. Allocated on the first start.
+	 */
+	struct Streams {
+		void* rx_callback = nullptr;
+		void* tx_callback = nullptr;
+		std::exception_ptr rx_error;
+		std::exception_ptr tx_error;
+	};
+
+	Streams& get_streams()
+	{
+		if (!streams_) {
+			streams_.reset(new Streams());
+		}
+		return *streams_;
+	}
+
+	static void rethrow(std::exception_ptr* error)
+	{
+		if (error != nullptr && *error) {
+			std::exception_ptr thrown = *error;
+			*error = nullptr;
+			std::rethrow_exception(thrown);
+		}
+	}
+
+	template <typename F>
+	static int rx_trampoline(timssdr_transfer* transfer) noexcept
+	{
+		Streams* streams = static_cast<Streams*>(transfer->rx_ctx);
+		Transfer view(transfer);
+		try {
+			return (*static_cast<F*>(streams->rx_callback))(view);
+		} catch (...) {
+			streams->rx_error = std::current_exception();
+			return -1;
+		}
+	}
+
+	template <typename F>
+	static int tx_trampoline(timssdr_transfer* transfer) noexcept
+	{
+		Streams* streams = static_cast<Streams*>(transfer->tx_ctx);
+		Transfer view(transfer);
+		try {
+			return (*static_cast<F*>(streams->tx_callback))(view);
+		} catch (...) {
+			streams->tx_error = std::current_exception();
+			return -1;
+		}
+	}
+
+	timssdr_device* device_;
+	std::unique_ptr<Streams> streams_;
+};
+
+} // namespace timssdr
+
+#endif /* TIMSSDR_HPP */
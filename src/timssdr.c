@@ -1,11 +1,45 @@
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE /* pthread_setaffinity_np() */
+#endif
 #include "timssdr.h"
+#include "timssdr_ddc.h"
+#include "timssdr_psd.h"
+#include "timssdr_shm.h"
+#include "timssdr_queue.h"
+#include "timssdr_trace.h"
+#include "timssdr_transport.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <string.h>
-
-#define TRANSFER_COUNT        4
-#define TRANSFER_BUFFER_SIZE  262144
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_TRANSFER_COUNT       4
+#define DEFAULT_TRANSFER_BUFFER_SIZE 262144
+#define TRANSFER_BUFFER_ALIGNMENT    512
+/* libusb transfer lengths and timssdr_transfer.buffer_length are int */
+#define MAX_TRANSFER_BUFFER_SIZE     (INT_MAX / TRANSFER_BUFFER_ALIGNMENT * TRANSFER_BUFFER_ALIGNMENT)
+#define USB_PACKET_SIZE              512
+#define BUFFER_MEMORY_ALIGNMENT      4096 /* a page, also enough for O_DIRECT */
+#define HUGEPAGE_SIZE                (2 * 1024 * 1024)
+#define DEFAULT_RECORDER_QUEUE_DEPTH 32
+#define REPLAY_WINDOW_SIZE           (16 * 1024 * 1024) /* readahead step of file replay */
+#define MAX_SWEEP_TUNINGS            65536
 #define DEVICE_BUFFER_SIZE    32768
 #define USB_MAX_SERIAL_LENGTH 32
+#define HOTPLUG_POLL_INTERVAL_US 100000
+#define EVENT_THREAD_TIMEOUT_S   60     /* event threads are woken by libusb_interrupt_event_handler() */
+#define EXTERNAL_WAIT_POLL_US    100000
+#define DEFAULT_RECOVERY_ATTEMPTS 8
+#define RECOVERY_BACKOFF_US       1000   /* doubled for every further attempt on the same transfer */
+#define RECOVERY_BACKOFF_MAX_US   100000
 
 #define USB_CONFIG_STANDARD 0x1
 
@@ -18,24 +52,221 @@ typedef int bool;
 	#define false 0
 #endif
 
+/*
+ * Streaming statistics, see timssdr_get_stats(). Updated with relaxed
+ * atomics: completions are counted on the event thread, callback times on
+ * whichever thread runs the callback, and readers only need a consistent
+ * value per counter, not a snapshot across counters.
+ */
+struct timssdr_device_stats {
+	atomic_uint_fast64_t transfers_completed;
+	atomic_uint_fast64_t bytes_transferred;
+	atomic_uint_fast64_t short_transfers;
+	atomic_uint_fast64_t zero_length_transfers;
+	atomic_uint_fast64_t failed_transfers;
+	atomic_uint_fast64_t resubmit_failures;
+	atomic_uint_fast64_t discontinuities;
+	atomic_uint_fast64_t psd_dropped;
+	atomic_uint_fast64_t ddc_dropped;
+	atomic_uint_fast64_t paused_blocks;
+	atomic_uint_fast64_t recovered_transfers;
+	atomic_uint_fast32_t peak_active_transfers;
+	atomic_uint_fast64_t callbacks;
+	atomic_uint_fast64_t callback_time_total_ns;
+	atomic_uint_fast64_t callback_time_max_ns;
+	atomic_uint_fast64_t callback_histogram[TIMSSDR_STATS_HISTOGRAM_BINS];
+	atomic_uint_fast64_t last_completion_ns;
+	atomic_uint_fast64_t intervals;
+	atomic_uint_fast64_t interval_total_ns;
+	_Atomic double interval_total_sq_ns;    /* squares in ns^2, a double so sub-us intervals count */
+	atomic_uint_fast64_t interval_min_ns;
+	atomic_uint_fast64_t interval_max_ns;
+};
+
+/* A file mapped for replay, see timssdr_start_tx_from_file() */
+struct timssdr_replay_file {
+	int fd;            /* kept open to drop sent pages from the page cache, -1 if empty */
+	uint8_t* map;      /* whole file */
+	size_t map_length;
+	size_t start;      /* first sample byte, after a recording header */
+	size_t end;        /* one past the last sample byte */
+};
+
+/* A failed RX transfer held by the recovery thread, see timssdr_set_error_recovery() */
+struct transfer_recovery {
+	bool pending;
+	enum libusb_transfer_status status;
+	uint32_t attempts;
+	uint64_t order;         /* held transfers are resubmitted in the order they failed */
+	uint64_t sample_index;  /* first sample of the hole */
+	uint64_t lost_samples;
+};
+
+struct timssdr_replay {
+	struct timssdr_replay_file* files;
+	int file_count;
+	int file;          /* file being read */
+	size_t offset;     /* next byte to send from it */
+	size_t window_end; /* offset up to which readahead was requested */
+	bool loop;
+};
+
+/* One buffer of a block pool, see timssdr_start_rx_buffered() and timssdr_start_tx_buffered() */
+struct timssdr_block {
+	unsigned char* data;
+	int valid_length;
+	uint64_t sample_index;
+	uint64_t timestamp_ns;
+	uint32_t flags;
+	atomic_uint refs; /* fan-out: subscribers still holding the block */
+};
+
+/* Fan-out RX consumer, see timssdr_rx_subscribe() */
+struct timssdr_subscription {
+	timssdr_device* device;
+	timssdr_sample_block_cb_fn callback;
+	void* ctx;
+	uint32_t queue_depth;
+	timssdr_queue* queue;         /* libusb thread -> subscriber, NULL marks end of stream */
+	pthread_t thread;
+	bool thread_started;
+	atomic_bool active;           /* the callback hasn't asked to stop */
+	bool dropped;                 /* libusb thread only: a block was dropped since the last one queued */
+	atomic_uint_fast64_t overruns;
+};
+
+/* Where a buffer's memory came from, see allocate_buffer_memory() */
+enum buffer_source {
+	BUFFER_HEAP,    /* posix_memalign() */
+	BUFFER_DEV_MEM, /* libusb_dev_mem_alloc() */
+	BUFFER_MAPPED,  /* mmap(), explicit or transparent hugepages */
+};
+
 struct timssdr_device {
-	libusb_device_handle* usb_device;
+	libusb_device_handle* usb_device;  /* NULL for a mock device */
+	struct timssdr_transport* transport; /* NULL to submit transfers to libusb */
 	struct libusb_transfer** transfers;
 	timssdr_sample_block_cb_fn callback;
-	volatile bool
-		transfer_thread_started; /* volatile shared between threads (read only) */
+	atomic_bool transfer_thread_started; /* shared between threads (read only) */
 	pthread_t transfer_thread;
-	volatile bool streaming; /* volatile shared between threads (read only) */
+	bool shared_events;    /* events handled by the shared thread instead of transfer_thread */
+	bool external_events;  /* events handled by the application, see timssdr_handle_events() */
+	/* transfer_thread attributes, see timssdr_set_thread_attrs() */
+	bool thread_attrs_set;
+	bool thread_pinned;             /* false to leave the thread floating */
+#ifdef __linux__
+	cpu_set_t thread_cpus;          /* CPUs the thread is pinned to */
+#endif
+	int thread_sched_policy;
+	int thread_priority;
+	atomic_bool streaming; /* read without transfer_lock by callbacks and timssdr_is_streaming() */
 	void* rx_ctx;
 	void* tx_ctx;
-	volatile bool do_exit;
-	unsigned char buffer[TRANSFER_COUNT * TRANSFER_BUFFER_SIZE];
-	bool transfers_setup;           /* true if the USB transfers have been setup */
+	atomic_bool do_exit;
+	unsigned char* buffer;          /* transfer_count * transfer_buffer_size bytes */
+	uint32_t transfer_count;        /* number of transfers in flight while streaming */
+	uint32_t transfer_buffer_size;  /* size of each transfer buffer in bytes */
+	bool zero_copy;                 /* allocate buffer from libusb device memory if possible */
+	bool hugepages;                 /* map buffers from hugepages, see timssdr_set_hugepages() */
+	enum buffer_source buffer_source;
+	/* Buffered RX: filled blocks are queued to a consumer, spares resubmitted */
+	bool rx_buffered;                   /* transfers currently use the RX block pool */
+	unsigned char* rx_pool;             /* rx_block_count * rx_block_size bytes */
+	enum buffer_source rx_pool_source;
+	uint32_t rx_block_count;
+	uint32_t rx_block_size;
+	struct timssdr_block* rx_blocks;
+	timssdr_queue* rx_filled;           /* libusb thread -> consumer, NULL marks end of stream */
+	timssdr_queue* rx_free;             /* consumer -> libusb thread */
+	struct timssdr_block* rx_held;      /* block handed out by timssdr_rx_read() */
+	int rx_held_offset;                 /* bytes of rx_held already consumed by timssdr_read_sync() */
+	bool rx_end_queued;                 /* end marker was posted, guarded by transfer_lock */
+	bool rx_end_of_stream;              /* consumer has seen the end marker */
+	uint64_t rx_overruns;               /* blocks dropped for lack of a spare, guarded by transfer_lock */
+	pthread_t rx_delivery_thread;
+	bool rx_delivery_thread_started;
+	/* Fan-out RX: filled blocks are shared by the subscribers instead of queued to rx_filled */
+	bool rx_fanout;
+	struct timssdr_subscription* subscribers[TIMSSDR_MAX_SUBSCRIBERS];
+	uint32_t subscriber_count;
+	pthread_mutex_t rx_release_lock;    /* serializes subscribers returning blocks to rx_free */
+	/* Push TX: the producer fills blocks, completions swap them in */
+	bool tx_buffered;                   /* transfers currently use the TX block pool */
+	unsigned char* tx_pool;             /* tx_block_count * tx_block_size bytes */
+	enum buffer_source tx_pool_source;
+	uint32_t tx_block_count;
+	uint32_t tx_block_size;
+	struct timssdr_block* tx_blocks;
+	timssdr_queue* tx_filled;           /* producer -> libusb thread */
+	timssdr_queue* tx_free;             /* libusb thread -> producer */
+	struct timssdr_block* tx_current;   /* block being filled by timssdr_tx_submit() */
+	struct libusb_transfer** tx_idle;   /* transfers waiting for data, guarded by transfer_lock */
+	uint32_t tx_idle_count;             /* guarded by transfer_lock */
+	atomic_uint tx_waiting;             /* tx_idle_count, for the producer to read without the lock */
+	uint64_t tx_underruns;              /* guarded by transfer_lock */
+	/* Recording, see timssdr_start_rx_to_file() */
+	int record_fd;                      /* -1 when not recording */
+	bool record_direct;                 /* record_fd is still open with O_DIRECT */
+	timssdr_file_header* record_header; /* BUFFER_MEMORY_ALIGNMENT aligned for O_DIRECT */
+	atomic_uint_fast64_t record_bytes;  /* sample bytes written so far */
+	atomic_int record_errno;            /* first write error, 0 if none */
+	struct timssdr_replay* replay;      /* file replay, see timssdr_start_tx_from_file() */
+	/* Sweep plan, see timssdr_init_sweep() */
+	uint64_t* sweep_frequencies;        /* tuned frequency of each step in Hz */
+	uint32_t sweep_frequency_count;     /* 0 if no sweep was set up */
+	uint32_t sweep_bytes_per_tuning;
+	bool sweeping;                      /* plan was handed to the transport */
+	/* RX conversion, see timssdr_set_rx_conversion() */
+	enum timssdr_sample_format rx_device_format;
+	enum timssdr_sample_format rx_output_format; /* same as rx_device_format when disabled */
+	void* rx_converted;
+	size_t rx_converted_size;
+	bool rx_converted_owned;                      /* rx_converted was allocated by us */
+	struct timssdr_psd* psd;                      /* PSD stage, see timssdr_set_psd(), NULL if disabled */
+	struct timssdr_ddc* ddc;                      /* DDC stage, see timssdr_set_ddc(), NULL if disabled */
+	/* Broker mode: transfers receive straight into a shared-memory ring, see timssdr_start_rx_shm() */
+	bool rx_shm;
+	struct timssdr_shm_ring* shm;                 /* kept after a stop until the next start or close */
+	uint32_t shm_slot_count;
+	uint32_t shm_next_slot;                       /* slot the next resubmitted transfer goes to */
+	struct timssdr_device_stats stats;
+	/* Full duplex, see timssdr_set_full_duplex() */
+	struct timssdr_device* tx_peer;     /* runs TX streaming while enabled, NULL otherwise */
+	struct timssdr_device* owner;       /* device the application holds, the owner for a tx_peer */
+	timssdr_mock_config mock_config;    /* mock devices: config for a tx_peer's own transport */
+	/* Block numbering, only touched by completion callbacks once streaming */
+	uint64_t next_sample_index;
+	bool discontinuity;             /* samples went missing since the last block handed out */
+	/* Gap estimation, see timssdr_set_stream_rate(). Guarded by transfer_lock. */
+	double stream_rate;             /* samples per second, 0 if unknown */
+	uint64_t device_busy_until_ns;  /* when the device is done with every submitted transfer */
+	uint64_t* transfer_gaps;        /* samples lost before each transfer, indexed like transfers */
+	/* RX pause, see timssdr_pause_rx() */
+	atomic_bool rx_paused;
+	atomic_uint rx_epoch;           /* bumped by timssdr_resume_rx() */
+	atomic_bool rx_resume_pending;  /* the next block delivered is flagged TIMSSDR_TRANSFER_RESUMED */
+	uint32_t* transfer_epochs;      /* rx_epoch at each transfer's last submission, indexed like transfers */
+	/* Error recovery, see timssdr_set_error_recovery(). Guarded by transfer_lock. */
+	bool recovery;                  /* the recovery thread is running */
+	bool recovery_exit;
+	uint32_t recovery_max_attempts;
+	timssdr_gap_cb_fn gap_callback;
+	void* gap_ctx;
+	struct transfer_recovery* transfer_recovery; /* indexed like transfers */
+	uint32_t recovery_pending;      /* transfers held, only nonzero while streaming */
+	uint64_t recovery_order;
+	pthread_t recovery_thread;
+	pthread_cond_t recovery_cv;
+	/* Received bytes left over in buffer by a short synchronous read */
+	int sync_pending_offset;
+	int sync_pending_length;
+	atomic_bool transfers_setup;    /* true if the USB transfers have been setup, written under transfer_lock */
 	pthread_mutex_t transfer_lock;  /* must be held to cancel or restart transfers */
 	volatile int active_transfers;  /* number of active transfers */
 	pthread_cond_t all_finished_cv; /* signalled when all transfers have finished */
 	bool flush;
 	struct libusb_transfer* flush_transfer;
+	enum buffer_source flush_buffer_source;
 	timssdr_flush_cb_fn flush_callback;
 	timssdr_tx_block_complete_cb_fn tx_completion_callback;
 	void* flush_ctx;
@@ -44,13 +275,77 @@ struct timssdr_device {
 static const uint16_t timssdr_usb_vid = TIMSSDR_VENDOR_ID;
 static const uint16_t timssdr_usb_pid = TIMSSDR_PRODUCT_ID;
 
-static uint16_t open_devices = 0;
+static atomic_uint open_devices = 0; /* devices may be opened in parallel, see timssdr_open_all() */
 
 static int create_transfer_thread(timssdr_device* device);
+static timssdr_device* tx_side(timssdr_device* device);
+static void free_tx_peer(timssdr_device* device);
+static void free_subscription(struct timssdr_subscription* subscription);
+static void stop_recovery_thread(timssdr_device* device);
+static void device_cache_start(void);
+static void device_cache_stop(void);
+static void stop_hotplug_thread(void);
 
 static libusb_context* g_libusb_context = NULL;
 int last_libusb_error = LIBUSB_SUCCESS;
 
+/* Event handling mode, see timssdr_set_event_mode(). Only changed while no device is open. */
+static enum timssdr_event_mode event_mode = TIMSSDR_EVENTS_PER_DEVICE;
+static enum timssdr_open_mode open_mode = TIMSSDR_OPEN_EAGER;
+static int event_thread_cpu = -1;
+
+/* Application callbacks, see timssdr_set_pollfd_notifiers() */
+static timssdr_pollfd_added_cb_fn pollfd_added_callback = NULL;
+static timssdr_pollfd_removed_cb_fn pollfd_removed_callback = NULL;
+static void* pollfd_notifier_ctx = NULL;
+
+/* TIMSSDR_EVENTS_SHARED: one thread handles events for every open device */
+static pthread_mutex_t shared_event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t shared_event_thread;
+static int shared_event_users = 0; /* devices using the thread, guarded by shared_event_lock */
+static atomic_bool shared_event_exit;
+
+/*
+ * Enumeration cache of connected TimsSDR devices. Kept current by libusb
+ * hotplug events where available, by scanning the bus otherwise; serial
+ * numbers are read once per device, outside the hotplug callback. A read
+ * that failed (e.g. udev not done with the permissions right after
+ * arrival) is retried on the next lookup, see device_cache_retry_serials().
+ */
+struct device_cache_entry {
+	libusb_device* device;      /* referenced while in the cache */
+	char serial_number[USB_MAX_SERIAL_LENGTH + 1]; /* empty if none */
+	bool serial_known;          /* serial_number was read, or couldn't be */
+	bool serial_failed;         /* the device couldn't be read, retried on a lookup */
+	bool present;               /* false once the device left */
+	bool announced;             /* arrival was reported to hotplug_callback */
+};
+
+static pthread_mutex_t device_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct device_cache_entry* device_cache = NULL; /* guarded by device_cache_lock */
+static size_t device_cache_count = 0;
+static size_t device_cache_capacity = 0;
+static bool device_cache_hotplug = false; /* registered for libusb hotplug events */
+static libusb_hotplug_callback_handle device_cache_handle;
+
+/* Application hotplug notifications, see timssdr_set_hotplug_callback() */
+static timssdr_hotplug_cb_fn hotplug_callback = NULL; /* guarded by device_cache_lock */
+static void* hotplug_ctx = NULL;
+static pthread_t hotplug_thread;
+static bool hotplug_thread_started = false;
+static atomic_bool hotplug_exit;
+
+/*
+ * libusb event threads of the library (per-device and shared) that are
+ * running. While there are any, they deliver the hotplug events, and the
+ * hotplug thread and lookups leave event handling to them so that
+ * completions only run on the threads configured for them.
+ */
+static atomic_uint event_threads = 0;
+static pthread_mutex_t hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hotplug_cv = PTHREAD_COND_INITIALIZER;
+static bool hotplug_pending = false; /* guarded by hotplug_lock */
+
 static int detach_kernel_drivers(libusb_device_handle* usb_device_handle)
 {
 	int i, num_interfaces, result;
@@ -114,23 +409,260 @@ static int set_timssdr_configuration(libusb_device_handle* usb_device, int confi
 	return LIBUSB_SUCCESS;
 }
 
+/*
+ * set_timssdr_configuration() for TIMSSDR_OPEN_LAZY. The device normally
+ * comes up in the standard configuration already, and then libusb is left
+ * to detach the driver of interface 0 when it is claimed (and to reattach
+ * it on release), instead of reading the config descriptor and probing
+ * every interface here.
+ */
+static int set_timssdr_configuration_lazy(libusb_device_handle* usb_device, int config)
+{
+	int result, curr_config;
+
+	result = libusb_get_configuration(usb_device, &curr_config);
+	if (result != 0) {
+		last_libusb_error = result;
+		return TIMSSDR_ERROR_LIBUSB;
+	}
+
+	if (curr_config != config) {
+		return set_timssdr_configuration(usb_device, config);
+	}
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+	result = libusb_set_auto_detach_kernel_driver(usb_device, 1);
+	if (result == LIBUSB_SUCCESS) {
+		return LIBUSB_SUCCESS;
+	} else if (result != LIBUSB_ERROR_NOT_SUPPORTED) {
+		last_libusb_error = result;
+		return TIMSSDR_ERROR_LIBUSB;
+	}
+#endif
+
+	return detach_kernel_drivers(usb_device);
+}
+
+static int free_transfers(timssdr_device* device);
+static uint32_t transfer_index(timssdr_device* device, const struct libusb_transfer* usb_transfer);
+
+static int submit_transfer(timssdr_device* device, struct libusb_transfer* transfer)
+{
+	if (transfer == device->flush_transfer) {
+		TIMSSDR_TRACE(flush_submit, device, 0, transfer->length);
+	} else {
+		TIMSSDR_TRACE(transfer_submit, device, transfer_index(device, transfer), transfer->length);
+	}
+
+	if (device->transport != NULL) {
+		return device->transport->submit(device->transport, transfer);
+	}
+	return libusb_submit_transfer(transfer);
+}
+
+static int cancel_transfer(timssdr_device* device, struct libusb_transfer* transfer)
+{
+	if (device->transport != NULL) {
+		return device->transport->cancel(device->transport, transfer);
+	}
+	return libusb_cancel_transfer(transfer);
+}
+
+/*
+ * Zero freshly allocated memory. Linux places a page on the NUMA node of
+ * the CPU that first touches it, so with the event thread pinned, this
+ * is done from the same CPUs to keep transfer memory local to it.
+ */
+static void first_touch(timssdr_device* const device, void* buffer, size_t length)
+{
+#ifdef __linux__
+	cpu_set_t old_cpus;
+	bool moved = false;
+
+	if (device->thread_pinned &&
+	    pthread_getaffinity_np(pthread_self(), sizeof(old_cpus), &old_cpus) == 0) {
+		moved = pthread_setaffinity_np(
+				pthread_self(),
+				sizeof(device->thread_cpus),
+				&device->thread_cpus) == 0;
+	}
+	memset(buffer, 0, length);
+	if (moved) {
+		pthread_setaffinity_np(pthread_self(), sizeof(old_cpus), &old_cpus);
+	}
+#else
+	(void) device;
+	memset(buffer, 0, length);
+#endif
+}
+
+static size_t mapped_length(size_t length)
+{
+	return (length + HUGEPAGE_SIZE - 1) & ~((size_t) HUGEPAGE_SIZE - 1);
+}
+
+#ifdef __linux__
+/*
+ * Map length bytes from the hugetlb pool if it has enough reserved pages,
+ * otherwise from regular pages the kernel may back with transparent
+ * hugepages. Either way one TLB entry covers 2 MiB of a transfer buffer.
+ */
+static unsigned char* map_hugepages(size_t length)
+{
+	void* map = mmap(
+		NULL,
+		length,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+		-1,
+		0);
+	if (map != MAP_FAILED) {
+		return (unsigned char*) map;
+	}
+
+	map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+	madvise(map, length, MADV_HUGEPAGE);
+	return (unsigned char*) map;
+}
+#endif
+
+static unsigned char* allocate_buffer_memory(
+	timssdr_device* const device,
+	size_t length,
+	enum buffer_source* source)
+{
+	*source = BUFFER_HEAP;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if (device->zero_copy && device->usb_device != NULL) {
+		// Memory mapped from the kernel's usbfs, so completed bulk
+		// transfers land in it without an intermediate copy. Not
+		// available on every platform/kernel, fall back if it fails.
+		unsigned char* buffer =
+			libusb_dev_mem_alloc(device->usb_device, length);
+		if (buffer != NULL) {
+			*source = BUFFER_DEV_MEM;
+			return buffer;
+		}
+	}
+#endif
+
+#ifdef __linux__
+	if (device->hugepages) {
+		unsigned char* buffer = map_hugepages(mapped_length(length));
+		if (buffer != NULL) {
+			*source = BUFFER_MAPPED;
+			// Fault the whole mapping in now rather than on the first transfers.
+			first_touch(device, buffer, mapped_length(length));
+			return buffer;
+		}
+	}
+#endif
+
+	// Aligned for SIMD loads and O_DIRECT writes straight from the buffer.
+	void* buffer;
+	if (posix_memalign(&buffer, BUFFER_MEMORY_ALIGNMENT, length) != 0) {
+		return NULL;
+	}
+	first_touch(device, buffer, length);
+	return (unsigned char*) buffer;
+}
+
+static void free_buffer_memory(
+	timssdr_device* const device,
+	unsigned char* buffer,
+	size_t length,
+	enum buffer_source source)
+{
+	if (buffer == NULL) {
+		return;
+	}
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if (source == BUFFER_DEV_MEM) {
+		libusb_dev_mem_free(device->usb_device, buffer, length);
+		return;
+	}
+#endif
+
+	(void) device;
+	if (source == BUFFER_MAPPED) {
+		munmap(buffer, mapped_length(length));
+		return;
+	}
+	free(buffer);
+}
+
+static unsigned char* allocate_transfer_buffer(timssdr_device* const device)
+{
+	return allocate_buffer_memory(
+		device,
+		(size_t) device->transfer_count * device->transfer_buffer_size,
+		&device->buffer_source);
+}
+
+static void free_transfer_buffer(timssdr_device* const device)
+{
+	free_buffer_memory(
+		device,
+		device->buffer,
+		(size_t) device->transfer_count * device->transfer_buffer_size,
+		device->buffer_source);
+	device->buffer = NULL;
+	device->buffer_source = BUFFER_HEAP;
+}
+
+/* Counterpart of timssdr_enable_tx_flush() */
+static void free_flush_transfer(timssdr_device* const device)
+{
+	if (device->flush_transfer == NULL) {
+		return;
+	}
+
+	free_buffer_memory(
+		device,
+		device->flush_transfer->buffer,
+		DEVICE_BUFFER_SIZE,
+		device->flush_buffer_source);
+	libusb_free_transfer(device->flush_transfer);
+	device->flush_transfer = NULL;
+}
+
 static int allocate_transfers(timssdr_device* const device)
 {
 	if (device->transfers == NULL) {
 		uint32_t transfer_index;
 		device->transfers = (struct libusb_transfer**) calloc(
-			TRANSFER_COUNT,
+			device->transfer_count,
 			sizeof(struct libusb_transfer*));
 		if (device->transfers == NULL) {
 			return TIMSSDR_ERROR_NO_MEM;
 		}
 
-		memset(device->buffer, 0, TRANSFER_COUNT * TRANSFER_BUFFER_SIZE);
+		device->transfer_gaps = (uint64_t*) calloc(
+			device->transfer_count,
+			sizeof(uint64_t));
+		device->transfer_epochs = (uint32_t*) calloc(
+			device->transfer_count,
+			sizeof(uint32_t));
+		device->transfer_recovery = (struct transfer_recovery*) calloc(
+			device->transfer_count,
+			sizeof(struct transfer_recovery));
+		device->buffer = allocate_transfer_buffer(device);
+		if (device->transfer_gaps == NULL || device->transfer_epochs == NULL ||
+		    device->transfer_recovery == NULL || device->buffer == NULL) {
+			free_transfers(device);
+			return TIMSSDR_ERROR_NO_MEM;
+		}
 
-		for (transfer_index = 0; transfer_index < TRANSFER_COUNT;
+		for (transfer_index = 0; transfer_index < device->transfer_count;
 		     transfer_index++) {
 			device->transfers[transfer_index] = libusb_alloc_transfer(0);
 			if (device->transfers[transfer_index] == NULL) {
+				free_transfers(device);
 				return TIMSSDR_ERROR_LIBUSB;
 			}
 
@@ -138,15 +670,12 @@ static int allocate_transfers(timssdr_device* const device)
 				device->transfers[transfer_index],
 				device->usb_device,
 				0,
-				&device->buffer[transfer_index * TRANSFER_BUFFER_SIZE],
-				TRANSFER_BUFFER_SIZE,
+				&device->buffer
+					 [(size_t) transfer_index * device->transfer_buffer_size],
+				device->transfer_buffer_size,
 				NULL,
 				device,
 				0);
-
-			if (device->transfers[transfer_index]->buffer == NULL) {
-				return TIMSSDR_ERROR_NO_MEM;
-			}
 		}
 		return TIMSSDR_SUCCESS;
 	} else {
@@ -154,11 +683,54 @@ static int allocate_transfers(timssdr_device* const device)
 	}
 }
 
+/* Applies all of the device's thread attributes, or none of them. */
+static int apply_thread_attrs(timssdr_device* device, pthread_t thread)
+{
+#ifdef __linux__
+	struct sched_param param = {.sched_priority = device->thread_priority};
+	cpu_set_t cpus, old_cpus;
+	bool restore;
+	int cpu, result;
+
+	if (device->thread_pinned) {
+		cpus = device->thread_cpus;
+	} else {
+		// Floating: every CPU, the kernel narrows it down to the allowed ones.
+		CPU_ZERO(&cpus);
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, &cpus);
+		}
+	}
+	restore = pthread_getaffinity_np(thread, sizeof(old_cpus), &old_cpus) == 0;
+	if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	// Real-time policies need CAP_SYS_NICE or an RLIMIT_RTPRIO allowance.
+	result = pthread_setschedparam(thread, device->thread_sched_policy, &param);
+	if (result != 0) {
+		if (restore) {
+			pthread_setaffinity_np(thread, sizeof(old_cpus), &old_cpus);
+		}
+		return result == EPERM ? TIMSSDR_ERROR_NOT_SUPPORTED : TIMSSDR_ERROR_INVALID_PARAM;
+	}
+	return TIMSSDR_SUCCESS;
+#else
+	(void) device;
+	(void) thread;
+	return TIMSSDR_ERROR_NOT_SUPPORTED;
+#endif
+}
+
 static void* transfer_threadproc(void* arg)
 {
 	timssdr_device* device = (timssdr_device*) arg;
 	int error;
-	struct timeval timeout = {0, 500000};
+	struct timeval timeout = {EVENT_THREAD_TIMEOUT_S, 0};
+
+	if (device->thread_attrs_set) {
+		apply_thread_attrs(device, pthread_self());
+	}
 
 	/*
 	 * timssdr_transfer uses pause() and SIGALRM to print statistics and
@@ -177,6 +749,104 @@ static void* transfer_threadproc(void* arg)
 	return NULL;
 }
 
+static void pin_event_thread(pthread_t thread)
+{
+#ifdef __linux__
+	cpu_set_t cpus;
+
+	if (event_thread_cpu < 0) {
+		return;
+	}
+
+	// Best effort: an invalid or offline CPU leaves the thread floating.
+	CPU_ZERO(&cpus);
+	CPU_SET(event_thread_cpu, &cpus);
+	pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+#else
+	(void) thread;
+#endif
+}
+
+static void* shared_event_threadproc(void* arg)
+{
+	struct timeval timeout = {EVENT_THREAD_TIMEOUT_S, 0};
+	(void) arg;
+
+	// Errors here aren't tied to a particular device. Transfer failures
+	// still end their own device's stream through its completion callback.
+	while (shared_event_exit == false) {
+		libusb_handle_events_timeout(g_libusb_context, &timeout);
+	}
+
+	return NULL;
+}
+
+/* Wake the hotplug thread, to dispatch an event or to exit. */
+static void hotplug_wake(void)
+{
+	pthread_mutex_lock(&hotplug_lock);
+	hotplug_pending = true;
+	pthread_cond_broadcast(&hotplug_cv);
+	pthread_mutex_unlock(&hotplug_lock);
+}
+
+static void event_thread_started(void)
+{
+	atomic_fetch_add(&event_threads, 1);
+	// Get the hotplug thread out of libusb, the new thread takes over.
+	libusb_interrupt_event_handler(g_libusb_context);
+}
+
+static void event_thread_stopped(void)
+{
+	// The hotplug thread handles events again once the last one is gone.
+	if (atomic_fetch_sub(&event_threads, 1) == 1) {
+		hotplug_wake();
+	}
+}
+
+static int attach_shared_event_thread(void)
+{
+	int result = TIMSSDR_SUCCESS;
+
+	pthread_mutex_lock(&shared_event_lock);
+	if (shared_event_users == 0) {
+		shared_event_exit = false;
+		if (pthread_create(&shared_event_thread, 0, shared_event_threadproc, NULL) !=
+		    0) {
+			result = TIMSSDR_ERROR_THREAD;
+		} else {
+			pin_event_thread(shared_event_thread);
+			event_thread_started();
+		}
+	}
+	if (result == TIMSSDR_SUCCESS) {
+		shared_event_users++;
+	}
+	pthread_mutex_unlock(&shared_event_lock);
+
+	return result;
+}
+
+static int detach_shared_event_thread(void)
+{
+	int result = TIMSSDR_SUCCESS;
+
+	pthread_mutex_lock(&shared_event_lock);
+	if (shared_event_users > 0 && --shared_event_users == 0) {
+		shared_event_exit = true;
+		libusb_interrupt_event_handler(g_libusb_context);
+		if (pthread_join(shared_event_thread, NULL) != 0) {
+			result = TIMSSDR_ERROR_THREAD;
+		} else {
+			event_thread_stopped();
+		}
+	}
+	pthread_mutex_unlock(&shared_event_lock);
+
+	return result;
+}
+
 static int create_transfer_thread(timssdr_device* device)
 {
 	int result;
@@ -184,12 +854,33 @@ static int create_transfer_thread(timssdr_device* device)
 	if (device->transfer_thread_started == false) {
 		device->streaming = false;
 		device->do_exit = false;
+		device->shared_events = (event_mode == TIMSSDR_EVENTS_SHARED);
+		device->external_events = (event_mode == TIMSSDR_EVENTS_EXTERNAL);
+		if (device->external_events) {
+			// The application's calls to timssdr_handle_events() stand in for the thread.
+			device->transfer_thread_started = true;
+			return TIMSSDR_SUCCESS;
+		}
+		if (device->shared_events) {
+			result = attach_shared_event_thread();
+			if (result != TIMSSDR_SUCCESS) {
+				return result;
+			}
+			device->transfer_thread_started = true;
+			return TIMSSDR_SUCCESS;
+		}
+
 		result = pthread_create(
 			&device->transfer_thread,
 			0,
 			transfer_threadproc,
 			device);
 		if (result == 0) {
+			// The thread applies its own attributes, which take precedence.
+			if (!device->thread_attrs_set) {
+				pin_event_thread(device->transfer_thread);
+			}
+			event_thread_started();
 			device->transfer_thread_started = true;
 		} else {
 			return TIMSSDR_ERROR_THREAD;
@@ -208,6 +899,26 @@ static int transfers_check_setup(timssdr_device* device)
 	return false;
 }
 
+/*
+ * Wait until every transfer has finished. Must be called with transfer_lock held.
+ * With external event handling nobody else may be handling events while the
+ * application waits on the library, so completions are handled here.
+ */
+static void wait_all_finished_locked(timssdr_device* device)
+{
+	struct timeval timeout = {0, EXTERNAL_WAIT_POLL_US};
+
+	while (device->active_transfers > 0) {
+		if (device->external_events) {
+			pthread_mutex_unlock(&device->transfer_lock);
+			libusb_handle_events_timeout_completed(g_libusb_context, &timeout, NULL);
+			pthread_mutex_lock(&device->transfer_lock);
+		} else {
+			pthread_cond_wait(&device->all_finished_cv, &device->transfer_lock);
+		}
+	}
+}
+
 static int cancel_transfers(timssdr_device* device)
 {
 	uint32_t transfer_index;
@@ -219,28 +930,27 @@ static int cancel_transfers(timssdr_device* device)
 		// Take lock while cancelling transfers. This blocks the
 		// transfer completion callback from restarting a transfer
 		// while we're in the middle of trying to cancel them all.
+		TIMSSDR_TRACE(cancel_lock_wait, device, device->active_transfers, 0);
 		pthread_mutex_lock(&device->transfer_lock);
+		TIMSSDR_TRACE(cancel_lock_acquire, device, device->active_transfers, 0);
 
-		for (transfer_index = 0; transfer_index < TRANSFER_COUNT;
+		for (transfer_index = 0; transfer_index < device->transfer_count;
 		     transfer_index++) {
 			if (device->transfers[transfer_index] != NULL) {
-				libusb_cancel_transfer(device->transfers[transfer_index]);
+				cancel_transfer(device, device->transfers[transfer_index]);
 			}
 		}
 
 		if (device->flush_transfer != NULL)
-			libusb_cancel_transfer(device->flush_transfer);
+			cancel_transfer(device, device->flush_transfer);
 
 		device->transfers_setup = false;
 		device->flush = false;
 
 		// Now wait for the transfer thread to signal that all transfers
 		// have finished, either by completing or being fully cancelled.
-		while (device->active_transfers > 0) {
-			pthread_cond_wait(
-				&device->all_finished_cv,
-				&device->transfer_lock);
-		}
+		wait_all_finished_locked(device);
+		TIMSSDR_TRACE(cancel_lock_release, device, device->active_transfers, 0);
 		pthread_mutex_unlock(&device->transfer_lock);
 
 		return TIMSSDR_SUCCESS;
@@ -255,7 +965,7 @@ static int free_transfers(timssdr_device* device)
 
 	if (device->transfers != NULL) {
 		// libusb_close() should free all transfers referenced from this array.
-		for (transfer_index = 0; transfer_index < TRANSFER_COUNT;
+		for (transfer_index = 0; transfer_index < device->transfer_count;
 		     transfer_index++) {
 			if (device->transfers[transfer_index] != NULL) {
 				libusb_free_transfer(device->transfers[transfer_index]);
@@ -266,15 +976,61 @@ static int free_transfers(timssdr_device* device)
 		device->transfers = NULL;
 	}
 
-	libusb_free_transfer(device->flush_transfer);
+	free(device->transfer_gaps);
+	device->transfer_gaps = NULL;
+	free(device->transfer_epochs);
+	device->transfer_epochs = NULL;
+	free(device->transfer_recovery);
+	device->transfer_recovery = NULL;
+
+	free_transfer_buffer(device);
 
 	return TIMSSDR_SUCCESS;
 }
 
+static int reallocate_transfers(
+	timssdr_device* device,
+	uint32_t transfer_count,
+	uint32_t transfer_buffer_size,
+	bool zero_copy)
+{
+	uint32_t old_count, old_size;
+	bool old_zero_copy;
+	int result;
+
+	if (device->transfers_setup == true) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	old_count = device->transfer_count;
+	old_size = device->transfer_buffer_size;
+	old_zero_copy = device->zero_copy;
+
+	free_transfers(device);
+	device->transfer_count = transfer_count;
+	device->transfer_buffer_size = transfer_buffer_size;
+	device->zero_copy = zero_copy;
+
+	result = allocate_transfers(device);
+	if (result != TIMSSDR_SUCCESS) {
+		// Fall back to the previous configuration so the device stays usable.
+		device->transfer_count = old_count;
+		device->transfer_buffer_size = old_size;
+		device->zero_copy = old_zero_copy;
+		if (allocate_transfers(device) != TIMSSDR_SUCCESS) {
+			return TIMSSDR_ERROR_NO_MEM;
+		}
+	}
+
+	return result;
+}
+
 static void LIBUSB_CALL timssdr_libusb_flush_callback(struct libusb_transfer* usb_transfer)
 {
 	bool success = usb_transfer->status == LIBUSB_TRANSFER_COMPLETED;
 
+	TIMSSDR_TRACE(flush_complete, usb_transfer->user_data, 0, usb_transfer->actual_length);
+
 	// All transfers have now ended, so proceed with signalling completion.
 	timssdr_device* device = (timssdr_device*) usb_transfer->user_data;
 	pthread_mutex_lock(&device->transfer_lock);
@@ -287,706 +1043,5070 @@ static void LIBUSB_CALL timssdr_libusb_flush_callback(struct libusb_transfer* us
 		device->flush_callback(device->flush_ctx, success);
 }
 
-static void LIBUSB_CALL
-timssdr_libusb_transfer_callback(struct libusb_transfer* usb_transfer)
+static uint64_t monotonic_ns(void)
 {
-	timssdr_device* device = (timssdr_device*) usb_transfer->user_data;
-	bool success, resubmit = false;
-	int result;
+	struct timespec now;
 
-	timssdr_transfer transfer = {
-		.device = device,
-		.buffer = usb_transfer->buffer,
-		.buffer_length = TRANSFER_BUFFER_SIZE,
-		.valid_length = usb_transfer->actual_length,
-		.rx_ctx = device->rx_ctx,
-		.tx_ctx = device->tx_ctx};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
 
-	success = usb_transfer->status == LIBUSB_TRANSFER_COMPLETED;
+#define STATS_ADD(device, counter, value) \
+	atomic_fetch_add_explicit(&(device)->stats.counter, (value), memory_order_relaxed)
 
-	if (device->tx_completion_callback != NULL) {
-		device->tx_completion_callback(&transfer, success);
+/*
+ * Callback times are recorded from several threads at once (subscribers,
+ * delivery and event threads), so the extremes are kept with a CAS loop.
+ */
+static void stats_store_max(atomic_uint_fast64_t* counter, uint64_t value)
+{
+	uint_fast64_t current = atomic_load_explicit(counter, memory_order_relaxed);
+
+	while (value > current &&
+	       !atomic_compare_exchange_weak_explicit(
+		       counter,
+		       &current,
+		       value,
+		       memory_order_relaxed,
+		       memory_order_relaxed)) {
 	}
+}
 
-	// Take lock to make sure that we don't restart a
-	// transfer whilst cancel_transfers() is in the middle
-	// of stopping them.
-	pthread_mutex_lock(&device->transfer_lock);
-	if (success) {
-		if (device->streaming && (device->callback(&transfer) == 0) &&
-		    (transfer.valid_length > 0)) {
-			if ((resubmit = device->transfers_setup)) {
-				if (usb_transfer->endpoint == TX_ENDPOINT_ADDRESS) {
-					usb_transfer->length = transfer.valid_length;
-					// Pad to the next 512-byte boundary.
-					uint8_t* buffer = usb_transfer->buffer;
-					while (usb_transfer->length % 512 != 0)
-						buffer[usb_transfer->length++] = 0;
-				}
-				result = libusb_submit_transfer(usb_transfer);
-			}
-		} else if (device->flush) {
-			result = libusb_submit_transfer(device->flush_transfer);
-			if (result != LIBUSB_SUCCESS) {
-				device->streaming = false;
-				device->flush = false;
-			}
-		}
-	} else {
-		device->streaming = false;
-		device->flush = false;
+static void stats_store_max32(atomic_uint_fast32_t* counter, uint32_t value)
+{
+	uint_fast32_t current = atomic_load_explicit(counter, memory_order_relaxed);
+
+	while (value > current &&
+	       !atomic_compare_exchange_weak_explicit(
+		       counter,
+		       &current,
+		       value,
+		       memory_order_relaxed,
+		       memory_order_relaxed)) {
 	}
+}
 
-	// If a data transfer was resubmitted successfully, we're done.
-	if (!resubmit || result != LIBUSB_SUCCESS) {
-		// No further calls should be made to the TX callback.
-		device->streaming = false;
-
-		// If this is the last transfer, signal that all are now finished.
-		if (device->active_transfers == 1) {
-			if (!device->flush) {
-				device->active_transfers = 0;
-				pthread_cond_broadcast(&device->all_finished_cv);
-			}
-		} else {
-			device->active_transfers--;
-		}
+static void stats_store_min(atomic_uint_fast64_t* counter, uint64_t value)
+{
+	uint_fast64_t current = atomic_load_explicit(counter, memory_order_relaxed);
+
+	while (value < current &&
+	       !atomic_compare_exchange_weak_explicit(
+		       counter,
+		       &current,
+		       value,
+		       memory_order_relaxed,
+		       memory_order_relaxed)) {
 	}
-
-	// Now we can release the lock. Our transfer was either
-	// cancelled or restarted, not both.
-	pthread_mutex_unlock(&device->transfer_lock);
 }
 
-static int kill_transfer_thread(timssdr_device* device)
+static void stats_add_double(_Atomic double* counter, double value)
 {
-	void* value;
-	int result;
+	double current = atomic_load_explicit(counter, memory_order_relaxed);
+
+	while (!atomic_compare_exchange_weak_explicit(
+		counter,
+		&current,
+		current + value,
+		memory_order_relaxed,
+		memory_order_relaxed)) {
+	}
+}
 
-	if (device->transfer_thread_started != false) {
-		/*
-		 * Cancel transfers. This call will block until the transfer
-		 * thread has handled all completion callbacks.
-		 */
-		cancel_transfers(device);
+static void stats_reset(timssdr_device* device)
+{
+	struct timssdr_device_stats* stats = &device->stats;
+	int i;
 
-		// Set flag to tell the thread to exit.
-		device->do_exit = true;
+	atomic_store(&stats->transfers_completed, 0);
+	atomic_store(&stats->bytes_transferred, 0);
+	atomic_store(&stats->short_transfers, 0);
+	atomic_store(&stats->zero_length_transfers, 0);
+	atomic_store(&stats->failed_transfers, 0);
+	atomic_store(&stats->resubmit_failures, 0);
+	atomic_store(&stats->discontinuities, 0);
+	atomic_store(&stats->psd_dropped, 0);
+	atomic_store(&stats->ddc_dropped, 0);
+	atomic_store(&stats->paused_blocks, 0);
+	atomic_store(&stats->recovered_transfers, 0);
+	atomic_store(&stats->peak_active_transfers, 0);
+	atomic_store(&stats->callbacks, 0);
+	atomic_store(&stats->callback_time_total_ns, 0);
+	atomic_store(&stats->callback_time_max_ns, 0);
+	for (i = 0; i < TIMSSDR_STATS_HISTOGRAM_BINS; i++) {
+		atomic_store(&stats->callback_histogram[i], 0);
+	}
+	atomic_store(&stats->last_completion_ns, 0);
+	atomic_store(&stats->intervals, 0);
+	atomic_store(&stats->interval_total_ns, 0);
+	atomic_store(&stats->interval_total_sq_ns, 0.0);
+	atomic_store(&stats->interval_min_ns, UINT64_MAX);
+	atomic_store(&stats->interval_max_ns, 0);
+}
 
-		/*
-		 * Interrupt the event handling thread instead of
-		 * waiting for timeout.
-		 */
-		libusb_interrupt_event_handler(g_libusb_context);
+static void stats_record_completion(
+	timssdr_device* device,
+	const struct libusb_transfer* usb_transfer)
+{
+	const uint64_t now = monotonic_ns();
+	uint64_t last, interval;
 
-		value = NULL;
-		result = pthread_join(device->transfer_thread, &value);
-		if (result != 0) {
-			return TIMSSDR_ERROR_THREAD;
-		}
-		device->transfer_thread_started = false;
+	if (usb_transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+		return;
+	}
+	TIMSSDR_TRACE(
+		transfer_complete,
+		device,
+		transfer_index(device, usb_transfer),
+		usb_transfer->actual_length);
+	if (usb_transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		STATS_ADD(device, failed_transfers, 1);
+		return;
 	}
 
-	/*
-	 * Reset do_exit; we're now done here and the thread was
-	 * already dead or is now dead.
-	 */
-	device->do_exit = false;
+	STATS_ADD(device, transfers_completed, 1);
+	STATS_ADD(device, bytes_transferred, (uint64_t) usb_transfer->actual_length);
+	if (usb_transfer->actual_length == 0) {
+		STATS_ADD(device, zero_length_transfers, 1);
+	} else if (usb_transfer->actual_length < usb_transfer->length) {
+		STATS_ADD(device, short_transfers, 1);
+	}
 
-	return TIMSSDR_SUCCESS;
+	last = atomic_exchange_explicit(
+		&device->stats.last_completion_ns,
+		now,
+		memory_order_relaxed);
+	if (last != 0 && now > last) {
+		interval = now - last;
+		STATS_ADD(device, intervals, 1);
+		STATS_ADD(device, interval_total_ns, interval);
+		stats_add_double(&device->stats.interval_total_sq_ns, (double) interval * (double) interval);
+		stats_store_min(&device->stats.interval_min_ns, interval);
+		stats_store_max(&device->stats.interval_max_ns, interval);
+	}
 }
 
-static int prepare_transfers(timssdr_device* device, const uint_fast8_t endpoint_address, libusb_transfer_cb_fn callback)
+static uint64_t completion_timestamp_ns(void)
 {
-	int error;
-	uint32_t transfer_index;
-	uint32_t ready_transfers = 0;
+	struct timespec now;
+
+#ifdef CLOCK_MONOTONIC_RAW
+	// Not slewed by NTP, so intervals between blocks stay true to the
+	// hardware clock.
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+	return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
 
-	if (device->transfers == NULL) {
-		// This shouldn't happen.
-		return TIMSSDR_ERROR_OTHER;
+static uint32_t transfer_index(timssdr_device* device, const struct libusb_transfer* usb_transfer)
+{
+	uint32_t i;
+
+	for (i = 0; i < device->transfer_count; i++) {
+		if (device->transfers[i] == usb_transfer) {
+			break;
+		}
 	}
+	return i;
+}
 
-	// If setting up for TX, call the TX callback to fill each
-	// transfer buffer.
+/*
+ * Called with transfer_lock held right before a data transfer is submitted.
+ *
+ * Bulk transfers are filled (or drained) in the order they were submitted.
+ * Knowing the stream rate, we can tell when the device will be done with
+ * all of them. A transfer submitted after that time makes the device wait
+ * for a buffer, and the samples it produces meanwhile are lost before the
+ * block this transfer will carry.
+ */
+static void note_submit_locked(timssdr_device* device, struct libusb_transfer* usb_transfer)
+{
+	const uint32_t index = transfer_index(device, usb_transfer);
+	uint64_t now, start;
 
-	// All transfers must be filled before any are submitted.
-	// Otherwise a transfer might complete whilst the others are
-	// still being filled, causing the transfer thread to make a
-	// concurrent call to the TX callback.
+	if (index < device->transfer_count) {
+		device->transfer_epochs[index] = atomic_load(&device->rx_epoch);
+	}
 
-	// We also need to handle the case where the callback returns
-	// nonzero to indicate completion, so keep count of how many
-	// transfers were made ready to submit at this stage.
+	if (device->stream_rate <= 0 || index >= device->transfer_count) {
+		return;
+	}
 
-	if (endpoint_address == TX_ENDPOINT_ADDRESS) {
-		for (transfer_index = 0; transfer_index < TRANSFER_COUNT;
-		     transfer_index++) {
-			timssdr_transfer transfer = {
-				.device = device,
-				.buffer = device->transfers[transfer_index]->buffer,
-				.buffer_length = TRANSFER_BUFFER_SIZE,
-				.valid_length = TRANSFER_BUFFER_SIZE,
-				.rx_ctx = device->rx_ctx,
-				.tx_ctx = device->tx_ctx,
-			};
-			if ((device->callback(&transfer) == 0) &&
-			    (transfer.valid_length > 0)) {
-				device->transfers[transfer_index]->length =
-					transfer.valid_length;
-				ready_transfers++;
-			} else {
-				break;
-			}
+	now = completion_timestamp_ns();
+	start = device->device_busy_until_ns;
+	device->transfer_gaps[index] = 0;
+	if (start == 0 || start < now) {
+		if (start != 0) {
+			device->transfer_gaps[index] =
+				(uint64_t) ((double) (now - start) * device->stream_rate / 1e9);
 		}
-
-	} else {
-		// For RX, all transfers are already ready for use.
-		ready_transfers = TRANSFER_COUNT;
+		start = now;
 	}
+	device->device_busy_until_ns = start +
+		(uint64_t) ((double) usb_transfer->length / 2 / device->stream_rate * 1e9);
+}
 
-	// Now everything is ready, go ahead and submit the ready transfers. We must hold
-	// the transfer lock whilst doing this, so that completion callbacks cannot resubmit
-	// any transfers until all transfers have been initially submitted.
-	pthread_mutex_lock(&device->transfer_lock);
+/* Number and timestamp a completed block. */
+static void stamp_block(
+	timssdr_device* device,
+	const struct libusb_transfer* usb_transfer,
+	uint64_t* sample_index,
+	uint64_t* timestamp_ns,
+	uint32_t* flags)
+{
+	const uint32_t index = transfer_index(device, usb_transfer);
 
-	for (transfer_index = 0; transfer_index < ready_transfers; transfer_index++) {
-		struct libusb_transfer* transfer = device->transfers[transfer_index];
-		transfer->endpoint = endpoint_address;
-		transfer->callback = callback;
+	*timestamp_ns = completion_timestamp_ns();
+	*flags = 0;
 
-		// Pad the size of a short transfer to the next 512-byte boundary.
-		if (endpoint_address == TX_ENDPOINT_ADDRESS) {
-			while (transfer->length % 512 != 0)
-				transfer->buffer[transfer->length++] = 0;
-		}
+	if (index < device->transfer_count && device->transfer_gaps[index] > 0) {
+		device->next_sample_index += device->transfer_gaps[index];
+		device->transfer_gaps[index] = 0;
+		device->discontinuity = true;
+	}
 
-		error = libusb_submit_transfer(transfer);
-		if (error != 0) {
-			last_libusb_error = error;
-			break;
-		}
-		device->active_transfers++;
+	*sample_index = device->next_sample_index;
+	if (usb_transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		device->next_sample_index += (uint64_t) usb_transfer->actual_length / 2;
 	}
+}
 
-	if (error == 0) {
-		// We should only continue streaming if all transfers were made ready
-		// and submitted above. Otherwise, set streaming to false so that the
-		// libusb completion callback won't submit further transfers.
-		device->streaming = (ready_transfers == TRANSFER_COUNT);
-		device->transfers_setup = true;
+/*
+ * Decide on a completed RX block before it is handed out. While RX is
+ * paused, and for the transfers that were already in flight when it was
+ * resumed, the samples belong to the retune window: the block is dropped
+ * and the caller resubmits the transfer right away.
+ */
+static bool discard_paused_block(
+	timssdr_device* device,
+	const struct libusb_transfer* usb_transfer,
+	uint32_t* flags)
+{
+	const uint32_t index = transfer_index(device, usb_transfer);
 
-		// If we're not continuing streaming, follow up with a flush if needed.
-		if (!device->streaming && device->flush) {
-			error = libusb_submit_transfer(device->flush_transfer);
-			if (error != 0) {
-				last_libusb_error = error;
-			}
-		}
+	if (atomic_load(&device->rx_paused) ||
+	    (index < device->transfer_count &&
+	     device->transfer_epochs[index] != atomic_load(&device->rx_epoch))) {
+		device->discontinuity = true;
+		STATS_ADD(device, paused_blocks, 1);
+		return true;
 	}
 
-	// Now we can release the transfer lock.
-	pthread_mutex_unlock(&device->transfer_lock);
-
-	if (error == 0) {
-		return TIMSSDR_SUCCESS;
-	} else {
-		return TIMSSDR_ERROR_LIBUSB;
+	if (atomic_exchange(&device->rx_resume_pending, false)) {
+		*flags |= TIMSSDR_TRANSFER_RESUMED;
 	}
+	return false;
 }
 
-static int prepare_setup_transfers(timssdr_device* device, const uint8_t endpoint_address,timssdr_sample_block_cb_fn callback)
+/* Flag a block handed to the application if samples went missing before it. */
+static void flag_discontinuity(timssdr_device* device, uint32_t* flags)
 {
-	if (device->transfers_setup == true) {
-		return TIMSSDR_ERROR_BUSY;
+	if (device->discontinuity) {
+		*flags |= TIMSSDR_TRANSFER_DISCONTINUITY;
+		device->discontinuity = false;
+		STATS_ADD(device, discontinuities, 1);
 	}
-
-	device->callback = callback;
-	return prepare_transfers(
-		device,
-		endpoint_address,
-		timssdr_libusb_transfer_callback);
 }
 
-int timssdr_init()
+#ifdef TIMSSDR_HAVE_SDT
+/* Index of a block's buffer in the block pools or the transfer buffers, for tracing. */
+static uint32_t trace_buffer_index(const timssdr_device* device, const uint8_t* buffer)
 {
-	int libusb_error;
-	if (g_libusb_context != NULL) {
-		return TIMSSDR_SUCCESS;
+	if (device->rx_pool != NULL && buffer >= device->rx_pool &&
+	    buffer < device->rx_pool + (size_t) device->rx_block_count * device->rx_block_size) {
+		return (uint32_t) ((size_t) (buffer - device->rx_pool) / device->rx_block_size);
 	}
-
-	libusb_error = libusb_init(&g_libusb_context);
-	if (libusb_error != 0) {
-		last_libusb_error = libusb_error;
-		return TIMSSDR_ERROR_LIBUSB;
-	} else {
-		return TIMSSDR_SUCCESS;
+	if (device->tx_pool != NULL && buffer >= device->tx_pool &&
+	    buffer < device->tx_pool + (size_t) device->tx_block_count * device->tx_block_size) {
+		return (uint32_t) ((size_t) (buffer - device->tx_pool) / device->tx_block_size);
+	}
+	if (device->buffer != NULL && buffer >= device->buffer &&
+	    buffer < device->buffer + (size_t) device->transfer_count * device->transfer_buffer_size) {
+		return (uint32_t) ((size_t) (buffer - device->buffer) / device->transfer_buffer_size);
 	}
+	return UINT32_MAX;
 }
+#endif
 
-int timssdr_exit(void)
+/* Run a sample block callback and account for the time it took. */
+static int run_timed_callback(
+	timssdr_device* device,
+	timssdr_sample_block_cb_fn callback,
+	timssdr_transfer* transfer)
 {
-	if (open_devices == 0) {
-		if (g_libusb_context != NULL) {
-			libusb_exit(g_libusb_context);
-			g_libusb_context = NULL;
-		}
+	const uint64_t start = monotonic_ns();
+	uint64_t elapsed, us;
+	int result, bin;
 
-		return TIMSSDR_SUCCESS;
-	} else {
-		return TIMSSDR_ERROR_NOT_LAST_DEVICE;
+	// With the PSD stage on, the application may only want its frames.
+	TIMSSDR_TRACE(
+		callback_entry,
+		device,
+		trace_buffer_index(device, transfer->buffer),
+		transfer->valid_length);
+	result = callback != NULL ? callback(transfer) : 0;
+	TIMSSDR_TRACE(
+		callback_exit,
+		device,
+		trace_buffer_index(device, transfer->buffer),
+		transfer->valid_length);
+
+	elapsed = monotonic_ns() - start;
+	STATS_ADD(device, callbacks, 1);
+	STATS_ADD(device, callback_time_total_ns, elapsed);
+	stats_store_max(&device->stats.callback_time_max_ns, elapsed);
+
+	// Bin 0 is below 1 us, bin n covers [2^(n-1), 2^n) us, the last is open.
+	us = elapsed / 1000;
+	bin = 0;
+	while (us != 0 && bin < TIMSSDR_STATS_HISTOGRAM_BINS - 1) {
+		us >>= 1;
+		bin++;
 	}
+	STATS_ADD(device, callback_histogram[bin], 1);
+
+	return result;
 }
 
-#ifndef LIBRARY_VERSION
-	#define LIBRARY_VERSION "unknown"
-#endif
-const char* timssdr_library_version()
+static int run_block_callback(timssdr_device* device, timssdr_transfer* transfer)
 {
-	return LIBRARY_VERSION;
+	return run_timed_callback(device, device->callback, transfer);
 }
 
-timssdr_device_list_t* timssdr_device_list()
+/* Fill in the converted view of a received block, if conversion is enabled. */
+static void convert_rx_block(timssdr_device* device, timssdr_transfer* transfer)
 {
-	int i;
-	libusb_device_handle* usb_device = NULL;
-	uint8_t serial_descriptor_index;
-	char serial_number[64];
-	uint8_t idx, serial_number_length;
+	size_t count;
 
-	timssdr_device_list_t* list = calloc(1, sizeof(*list));
-	if (list == NULL)
-		return NULL;
+	if (device->rx_output_format == device->rx_device_format) {
+		return;
+	}
 
-	list->usb_devicecount = (int) libusb_get_device_list(
-		g_libusb_context,
-		(libusb_device***) &list->usb_devices);
+	count = (size_t) transfer->valid_length / 2;
+	if (count * timssdr_sample_size(device->rx_output_format) > device->rx_converted_size) {
+		count = device->rx_converted_size / timssdr_sample_size(device->rx_output_format);
+	}
 
-	list->serial_numbers = calloc(list->usb_devicecount, sizeof(void*));
-	list->usb_board_ids =
-		calloc(list->usb_devicecount, sizeof(timssdr_usb_vid));
-	list->usb_device_index = calloc(list->usb_devicecount, sizeof(int));
+	timssdr_convert(
+		device->rx_device_format,
+		transfer->buffer,
+		device->rx_output_format,
+		device->rx_converted,
+		count);
+	transfer->converted = device->rx_converted;
+	transfer->converted_count = (int) count;
+}
 
-	if (list->serial_numbers == NULL || list->usb_board_ids == NULL ||
-	    list->usb_device_index == NULL) {
-		timssdr_device_list_free(list);
-		return NULL;
+/* Hand a copy of a received block to the PSD stage, if enabled. */
+static void feed_psd(timssdr_device* device, const timssdr_transfer* transfer)
+{
+	if (device->psd == NULL) {
+		return;
 	}
-	printf("Devices found : \n");
-	for (i = 0; i < list->usb_devicecount; i++) {
-		struct libusb_device_descriptor device_descriptor;
-		libusb_get_device_descriptor(list->usb_devices[i], &device_descriptor);
-		printf("Vendor ID : %x, product ID : %x\n",device_descriptor.idVendor, device_descriptor.idProduct);
-
-		if (device_descriptor.idVendor == timssdr_usb_vid) {
-			if (device_descriptor.idProduct == timssdr_usb_pid) {
-				idx = list->devicecount++;
-				list->usb_board_ids[idx] = device_descriptor.idProduct;
-				list->usb_device_index[idx] = i;
-
-				serial_descriptor_index = device_descriptor.iSerialNumber;
-				if (serial_descriptor_index > 0) {
-					if (libusb_open(
-						    list->usb_devices[i],
-						    &usb_device) != 0) {
-						usb_device = NULL;
-						continue;
-					}
-					serial_number_length =
-						libusb_get_string_descriptor_ascii(
-							usb_device,
-							serial_descriptor_index,
-							(unsigned char*) serial_number,
-							sizeof(serial_number));
-					if (serial_number_length >= USB_MAX_SERIAL_LENGTH)
-						serial_number_length =
-							USB_MAX_SERIAL_LENGTH;
-
-					serial_number[serial_number_length] = 0;
-					list->serial_numbers[idx] = strdup(serial_number);
-
-					libusb_close(usb_device);
-					usb_device = NULL;
-				}
-			}
-		}
+
+	if (!timssdr_psd_feed(
+		    device->psd,
+		    transfer->buffer,
+		    transfer->valid_length,
+		    transfer->sample_index,
+		    transfer->timestamp_ns,
+		    transfer->flags,
+		    device->sweeping)) {
+		STATS_ADD(device, psd_dropped, 1);
 	}
+}
 
-	return list;
+/* Hand a received block to the DDC stage, if enabled. Sweep blocks are not channelized. */
+static void feed_ddc(timssdr_device* device, const timssdr_transfer* transfer)
+{
+	if (device->ddc == NULL || device->sweeping) {
+		return;
+	}
+
+	if (!timssdr_ddc_feed(
+		    device->ddc,
+		    transfer->buffer,
+		    transfer->valid_length,
+		    transfer->sample_index,
+		    transfer->timestamp_ns,
+		    transfer->flags)) {
+		STATS_ADD(device, ddc_dropped, 1);
+	}
 }
 
-void timssdr_device_list_free(timssdr_device_list_t* list)
+/* Run the processing stages on a received block before it reaches the application. */
+static void feed_stages(timssdr_device* device, const timssdr_transfer* transfer)
 {
-	int i;
+	feed_psd(device, transfer);
+	feed_ddc(device, transfer);
+}
 
-	libusb_free_device_list((libusb_device**) list->usb_devices, 1);
+/* Pad a TX transfer with zeroes to whole USB packets. */
+static void pad_tx_transfer(struct libusb_transfer* usb_transfer)
+{
+	const int padded = (usb_transfer->length + USB_PACKET_SIZE - 1) /
+		USB_PACKET_SIZE * USB_PACKET_SIZE;
 
-	for (i = 0; i < list->devicecount; i++) {
-		if (list->serial_numbers[i])
-			free(list->serial_numbers[i]);
-	}
+	memset(usb_transfer->buffer + usb_transfer->length, 0, padded - usb_transfer->length);
+	usb_transfer->length = padded;
+}
 
-	free(list->serial_numbers);
-	free(list->usb_board_ids);
-	free(list->usb_device_index);
-	free(list);
+/* Account for a transfer just submitted, the counterpart of release_transfer_locked(). */
+static void add_active_transfer_locked(timssdr_device* device)
+{
+	device->active_transfers++;
+	stats_store_max32(&device->stats.peak_active_transfers, (uint32_t) device->active_transfers);
 }
 
-libusb_device_handle* timssdr_open_usb(const char* const desired_serial_number)
+/*
+ * Account for a transfer that won't be resubmitted. Must be called with
+ * transfer_lock held. Returns true if this was the last active transfer.
+ */
+static bool release_transfer_locked(timssdr_device* device)
 {
-	libusb_device_handle* usb_device = NULL;
-	libusb_device** devices = NULL;
-	const ssize_t list_length = libusb_get_device_list(g_libusb_context, &devices);
-	ssize_t match_len = 0;
-	ssize_t i;
-	char serial_number[64];
-	int serial_number_length;
+	// If this is the last transfer, signal that all are now finished.
+	if (device->active_transfers == 1) {
+		if (!device->flush) {
+			device->active_transfers = 0;
+			pthread_cond_broadcast(&device->all_finished_cv);
+			return true;
+		}
+	} else {
+		device->active_transfers--;
+	}
+	return false;
+}
 
-	if (desired_serial_number) {
-		/* If a shorter serial number is specified, only match against the suffix.
-		 * Should probably complain if the match is not unique, currently doesn't.
-		 */
-		match_len = strlen(desired_serial_number);
-		if (match_len > 32)
-			return NULL;
+/* Transfer status a failed submission amounts to, for recover_transfer_locked(). */
+static enum libusb_transfer_status submit_error_status(int error)
+{
+	switch (error) {
+	case LIBUSB_ERROR_NO_DEVICE:
+		return LIBUSB_TRANSFER_NO_DEVICE;
+	case LIBUSB_ERROR_PIPE:
+		return LIBUSB_TRANSFER_STALL;
+	default:
+		return LIBUSB_TRANSFER_ERROR;
 	}
+}
 
-	for (i = 0; i < list_length; i++) {
-		struct libusb_device_descriptor device_descriptor;
-		libusb_get_device_descriptor(devices[i], &device_descriptor);
+/*
+ * Called with transfer_lock held for an RX transfer that failed with
+ * status, or couldn't be resubmitted. With error recovery on, errors the
+ * device can come back from are left to the recovery thread instead of
+ * ending the stream. The block the transfer would have carried is counted
+ * as lost, so the next one delivered is flagged as a discontinuity with
+ * its sample index past the hole. Returns true if the transfer was taken
+ * over, it then stays active.
+ */
+static bool recover_transfer_locked(
+	timssdr_device* device,
+	struct libusb_transfer* usb_transfer,
+	enum libusb_transfer_status status)
+{
+	const uint32_t index = transfer_index(device, usb_transfer);
+	struct transfer_recovery* recovery;
 
-		if (device_descriptor.idVendor == timssdr_usb_vid) {
-			if (device_descriptor.idProduct == timssdr_usb_pid) {
-				if (desired_serial_number != NULL) {
-					const uint_fast8_t serial_descriptor_index =
-						device_descriptor.iSerialNumber;
-					if (serial_descriptor_index > 0) {
-						if (libusb_open(
-							    devices[i],
-							    &usb_device) != 0) {
-							usb_device = NULL;
-							continue;
-						}
-						serial_number_length =
-							libusb_get_string_descriptor_ascii(
-								usb_device,
-								serial_descriptor_index,
-								(unsigned char*)
-									serial_number,
-								sizeof(serial_number));
-						if (serial_number_length >=
-						    USB_MAX_SERIAL_LENGTH)
-							serial_number_length =
-								USB_MAX_SERIAL_LENGTH;
-						serial_number[serial_number_length] = 0;
-						if (strncmp(serial_number +
-								    serial_number_length -
-								    match_len,
-							    desired_serial_number,
-							    match_len) == 0) {
-							break;
-						} else {
-							libusb_close(usb_device);
-							usb_device = NULL;
-						}
-					}
-				} else {
-					libusb_open(devices[i], &usb_device);
-					break;
-				}
-			}
-		}
+	if (!device->recovery || !device->streaming || !device->transfers_setup ||
+	    index >= device->transfer_count) {
+		return false;
 	}
 
-	libusb_free_device_list(devices, 1);
+	switch (status) {
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_STALL:
+	case LIBUSB_TRANSFER_OVERFLOW:
+		break;
+	default:
+		// Cancelled, or the device is gone.
+		return false;
+	}
 
-	return usb_device;
+	recovery = &device->transfer_recovery[index];
+	recovery->pending = true;
+	recovery->status = status;
+	recovery->attempts = 0;
+	recovery->order = device->recovery_order++;
+	recovery->sample_index = device->next_sample_index;
+	recovery->lost_samples = (uint64_t) usb_transfer->length / 2;
+	device->next_sample_index += recovery->lost_samples;
+	device->discontinuity = true;
+	device->recovery_pending++;
+	pthread_cond_signal(&device->recovery_cv);
+	return true;
 }
 
-static int timssdr_open_setup(libusb_device_handle* usb_device, timssdr_device** device)
+static void LIBUSB_CALL
+timssdr_libusb_transfer_callback(struct libusb_transfer* usb_transfer)
 {
-	int result;
-	timssdr_device* lib_device;
+	timssdr_device* device = (timssdr_device*) usb_transfer->user_data;
+	bool success, discard = false, more = false, resubmit = false;
+	int result = LIBUSB_SUCCESS;
 
-	//int speed = libusb_get_device_speed(usb_device);
-	// TODO: Error or warning if not high speed USB?
+	timssdr_transfer transfer = {
+		.device = device->owner,
+		.buffer = usb_transfer->buffer,
+		.buffer_length = device->transfer_buffer_size,
+		.valid_length = usb_transfer->actual_length,
+		.rx_ctx = device->rx_ctx,
+		.tx_ctx = device->tx_ctx};
 
-	result = set_timssdr_configuration(usb_device, USB_CONFIG_STANDARD);
-	if (result != LIBUSB_SUCCESS) {
-		libusb_close(usb_device);
-		return result;
+	success = usb_transfer->status == LIBUSB_TRANSFER_COMPLETED;
+	stats_record_completion(device, usb_transfer);
+	stamp_block(device, usb_transfer, &transfer.sample_index, &transfer.timestamp_ns, &transfer.flags);
+	if (success && usb_transfer->endpoint == RX_ENDPOINT_ADDRESS) {
+		discard = discard_paused_block(device, usb_transfer, &transfer.flags);
+	}
+	if (success && !discard) {
+		flag_discontinuity(device, &transfer.flags);
 	}
 
-	result = libusb_claim_interface(usb_device, 0);
-	if (result != LIBUSB_SUCCESS) {
-		last_libusb_error = result;
-		libusb_close(usb_device);
-		return TIMSSDR_ERROR_LIBUSB;
+	if (device->tx_completion_callback != NULL) {
+		device->tx_completion_callback(&transfer, success);
 	}
 
-	lib_device = NULL;
-	lib_device = (timssdr_device*) calloc(1, sizeof(*lib_device));
-	if (lib_device == NULL) {
+	// The user callback runs without transfer_lock, so a slow callback
+	// doesn't hold up cancel_transfers(). This transfer isn't in flight
+	// while we're here, so cancelling it is a no-op, and the transfers_setup
+	// flag is re-checked under the lock before resubmitting it.
+	if (discard) {
+		more = true;
+	} else if (success && device->streaming) {
+		if (usb_transfer->endpoint == RX_ENDPOINT_ADDRESS) {
+			convert_rx_block(device, &transfer);
+			feed_stages(device, &transfer);
+		}
+		more = (run_block_callback(device, &transfer) == 0) &&
+			(transfer.valid_length > 0);
+		if (more && usb_transfer->endpoint == TX_ENDPOINT_ADDRESS) {
+			usb_transfer->length = transfer.valid_length;
+			pad_tx_transfer(usb_transfer);
+		}
+	}
+
+	// Take lock to make sure that we don't restart a
+	// transfer whilst cancel_transfers() is in the middle
+	// of stopping them.
+	pthread_mutex_lock(&device->transfer_lock);
+	if (success) {
+		if (more && device->streaming) {
+			if ((resubmit = device->transfers_setup)) {
+				note_submit_locked(device, usb_transfer);
+				result = submit_transfer(device, usb_transfer);
+				if (result != LIBUSB_SUCCESS) {
+					STATS_ADD(device, resubmit_failures, 1);
+					if (usb_transfer->endpoint == RX_ENDPOINT_ADDRESS &&
+					    recover_transfer_locked(device, usb_transfer, submit_error_status(result))) {
+						result = LIBUSB_SUCCESS;
+					}
+				}
+			}
+		} else if (device->flush) {
+			result = submit_transfer(device, device->flush_transfer);
+			if (result != LIBUSB_SUCCESS) {
+				device->streaming = false;
+				device->flush = false;
+			}
+		}
+	} else if (
+		usb_transfer->endpoint == RX_ENDPOINT_ADDRESS &&
+		recover_transfer_locked(device, usb_transfer, usb_transfer->status)) {
+		resubmit = true;
+	} else {
+		device->streaming = false;
+		device->flush = false;
+	}
+
+	// If a data transfer was resubmitted successfully, we're done.
+	if (!resubmit || result != LIBUSB_SUCCESS) {
+		// No further calls should be made to the TX callback.
+		device->streaming = false;
+		release_transfer_locked(device);
+	}
+
+	// Now we can release the lock. Our transfer was either
+	// cancelled or restarted, not both.
+	pthread_mutex_unlock(&device->transfer_lock);
+}
+
+/* Subscriber queue entries have the low bit set when blocks were dropped before them. */
+#define SUBSCRIPTION_GAP_BIT ((uintptr_t) 1)
+
+/*
+ * Fan-out: queue a filled block to every subscriber with room for it.
+ * Must be called with transfer_lock held, from the libusb thread. Returns
+ * false if nobody took it.
+ */
+static bool share_block_locked(timssdr_device* device, struct timssdr_block* block)
+{
+	struct timssdr_subscription* takers[TIMSSDR_MAX_SUBSCRIBERS];
+	struct timssdr_subscription* subscription;
+	uintptr_t item;
+	uint32_t i, count = 0;
+
+	for (i = 0; i < device->subscriber_count; i++) {
+		subscription = device->subscribers[i];
+		if (!subscription->active) {
+			continue;
+		}
+		// The size can only be overestimated here, so the end marker always fits.
+		if (timssdr_queue_size(subscription->queue) >= subscription->queue_depth) {
+			atomic_fetch_add_explicit(&subscription->overruns, 1, memory_order_relaxed);
+			subscription->dropped = true;
+			continue;
+		}
+		takers[count++] = subscription;
+	}
+	if (count == 0) {
+		return false;
+	}
+
+	// Every reference is counted before the first subscriber can release it.
+	atomic_store(&block->refs, count);
+	for (i = 0; i < count; i++) {
+		item = (uintptr_t) block | (takers[i]->dropped ? SUBSCRIPTION_GAP_BIT : 0);
+		takers[i]->dropped = false;
+		timssdr_queue_push(takers[i]->queue, (void*) item);
+	}
+
+	return true;
+}
+
+/* Fan-out: return a block to the spares. Safe from any thread. */
+static void release_block(timssdr_device* device, struct timssdr_block* block)
+{
+	pthread_mutex_lock(&device->rx_release_lock);
+	timssdr_queue_push(device->rx_free, block);
+	pthread_mutex_unlock(&device->rx_release_lock);
+}
+
+/* Post the end of stream marker. Must be called with transfer_lock held. */
+static void post_rx_end_locked(timssdr_device* device)
+{
+	uint32_t i;
+
+	if (device->rx_fanout) {
+		for (i = 0; i < device->subscriber_count; i++) {
+			timssdr_queue_push(device->subscribers[i]->queue, NULL);
+		}
+	} else {
+		timssdr_queue_push(device->rx_filled, NULL);
+	}
+	device->rx_end_queued = true;
+}
+
+static struct timssdr_block* block_from_buffer(
+	struct timssdr_block* blocks,
+	const unsigned char* pool,
+	uint32_t block_size,
+	const unsigned char* buffer)
+{
+	return &blocks[(size_t) (buffer - pool) / block_size];
+}
+
+static void LIBUSB_CALL
+timssdr_libusb_buffered_rx_callback(struct libusb_transfer* usb_transfer)
+{
+	timssdr_device* device = (timssdr_device*) usb_transfer->user_data;
+	struct timssdr_block* spare;
+	struct timssdr_block* filled;
+	bool resubmit = false;
+	int result = LIBUSB_SUCCESS;
+	uint64_t sample_index, timestamp_ns;
+	uint32_t flags;
+
+	stats_record_completion(device, usb_transfer);
+	stamp_block(device, usb_transfer, &sample_index, &timestamp_ns, &flags);
+
+	// No user code runs here, the lock only covers the hand-off and the
+	// resubmit so that cancel_transfers() can't race with it.
+	pthread_mutex_lock(&device->transfer_lock);
+	if (usb_transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		if (device->streaming && device->transfers_setup) {
+			if (usb_transfer->actual_length > 0 &&
+			    !discard_paused_block(device, usb_transfer, &flags)) {
+				if (timssdr_queue_try_pop(device->rx_free, (void**) &spare)) {
+					filled = block_from_buffer(
+						device->rx_blocks,
+						device->rx_pool,
+						device->rx_block_size,
+						usb_transfer->buffer);
+					filled->valid_length = usb_transfer->actual_length;
+					filled->sample_index = sample_index;
+					filled->timestamp_ns = timestamp_ns;
+					filled->flags = flags;
+					flag_discontinuity(device, &filled->flags);
+					if (!device->rx_fanout) {
+						timssdr_queue_push(device->rx_filled, filled);
+						usb_transfer->buffer = spare->data;
+					} else if (share_block_locked(device, filled)) {
+						usb_transfer->buffer = spare->data;
+					} else {
+						// No subscriber took it, keep the buffer.
+						release_block(device, spare);
+					}
+				} else {
+					// The consumer has fallen behind and holds every
+					// spare block. Drop this one and reuse its buffer.
+					device->rx_overruns++;
+					device->discontinuity = true;
+				}
+			}
+			usb_transfer->length = device->rx_block_size;
+			note_submit_locked(device, usb_transfer);
+			result = submit_transfer(device, usb_transfer);
+			if (result != LIBUSB_SUCCESS) {
+				STATS_ADD(device, resubmit_failures, 1);
+				if (recover_transfer_locked(device, usb_transfer, submit_error_status(result))) {
+					result = LIBUSB_SUCCESS;
+				}
+			}
+			resubmit = true;
+		}
+	} else if (recover_transfer_locked(device, usb_transfer, usb_transfer->status)) {
+		resubmit = true;
+	} else {
+		device->streaming = false;
+	}
+
+	if (!resubmit || result != LIBUSB_SUCCESS) {
+		device->streaming = false;
+		if (release_transfer_locked(device)) {
+			// Last transfer is done, tell the consumer the stream has
+			// ended. The filled queue has room for every block plus this.
+			post_rx_end_locked(device);
+		}
+	}
+	pthread_mutex_unlock(&device->transfer_lock);
+}
+
+static void* rx_delivery_threadproc(void* arg)
+{
+	timssdr_device* device = (timssdr_device*) arg;
+	struct timssdr_block* block;
+
+	for (;;) {
+		timssdr_queue_pop_wait(device->rx_filled, (void**) &block, -1);
+		if (block == NULL) {
+			break;
+		}
+
+		// Keep draining after the callback asked to stop, so that
+		// every block is returned until the end marker arrives.
+		if (device->streaming) {
+			timssdr_transfer transfer = {
+				.device = device,
+				.buffer = block->data,
+				.buffer_length = device->rx_block_size,
+				.valid_length = block->valid_length,
+				.rx_ctx = device->rx_ctx,
+				.tx_ctx = device->tx_ctx,
+				.sample_index = block->sample_index,
+				.timestamp_ns = block->timestamp_ns,
+				.flags = block->flags};
+
+			convert_rx_block(device, &transfer);
+			feed_stages(device, &transfer);
+			if (run_block_callback(device, &transfer) != 0) {
+				device->streaming = false;
+			}
+		}
+
+		timssdr_queue_push(device->rx_free, block);
+	}
+
+	return NULL;
+}
+
+static void* subscription_threadproc(void* arg)
+{
+	struct timssdr_subscription* subscription = (struct timssdr_subscription*) arg;
+	timssdr_device* device = subscription->device;
+	struct timssdr_block* block;
+	uintptr_t item;
+
+	for (;;) {
+		timssdr_queue_pop_wait(subscription->queue, (void**) &item, -1);
+		if (item == 0) {
+			break;
+		}
+		block = (struct timssdr_block*) (item & ~SUBSCRIPTION_GAP_BIT);
+
+		// Keep draining after the callback asked to stop, other
+		// subscribers may still be using the stream.
+		if (subscription->active) {
+			timssdr_transfer transfer = {
+				.device = device,
+				.buffer = block->data,
+				.buffer_length = device->rx_block_size,
+				.valid_length = block->valid_length,
+				.rx_ctx = subscription->ctx,
+				.tx_ctx = device->tx_ctx,
+				.sample_index = block->sample_index,
+				.timestamp_ns = block->timestamp_ns,
+				.flags = block->flags};
+
+			if (item & SUBSCRIPTION_GAP_BIT) {
+				transfer.flags |= TIMSSDR_TRANSFER_DISCONTINUITY;
+			}
+			if (run_timed_callback(device, subscription->callback, &transfer) != 0) {
+				subscription->active = false;
+			}
+		}
+
+		if (atomic_fetch_sub(&block->refs, 1) == 1) {
+			release_block(device, block);
+		}
+	}
+
+	return NULL;
+}
+
+static void wait_transfers_finished(timssdr_device* device)
+{
+	pthread_mutex_lock(&device->transfer_lock);
+	wait_all_finished_locked(device);
+	pthread_mutex_unlock(&device->transfer_lock);
+}
+
+static void free_rx_pool(timssdr_device* device)
+{
+	free_buffer_memory(
+		device,
+		device->rx_pool,
+		(size_t) device->rx_block_count * device->rx_block_size,
+		device->rx_pool_source);
+	device->rx_pool = NULL;
+	device->rx_pool_source = BUFFER_HEAP;
+
+	free(device->rx_blocks);
+	device->rx_blocks = NULL;
+	device->rx_block_count = 0;
+	device->rx_block_size = 0;
+
+	if (device->rx_filled != NULL) {
+		timssdr_queue_destroy(device->rx_filled);
+		device->rx_filled = NULL;
+	}
+	if (device->rx_free != NULL) {
+		timssdr_queue_destroy(device->rx_free);
+		device->rx_free = NULL;
+	}
+	device->rx_held = NULL;
+}
+
+static int setup_rx_pool(timssdr_device* device, uint32_t queue_depth)
+{
+	const uint32_t block_count = device->transfer_count + queue_depth;
+	uint32_t i;
+
+	if (device->rx_pool == NULL || device->rx_block_count != block_count ||
+	    device->rx_block_size != device->transfer_buffer_size) {
+		free_rx_pool(device);
+
+		device->rx_block_count = block_count;
+		device->rx_block_size = device->transfer_buffer_size;
+		device->rx_pool = allocate_buffer_memory(
+			device,
+			(size_t) block_count * device->rx_block_size,
+			&device->rx_pool_source);
+		device->rx_blocks = (struct timssdr_block*) calloc(
+			block_count,
+			sizeof(struct timssdr_block));
+		if (device->rx_pool == NULL || device->rx_blocks == NULL) {
+			free_rx_pool(device);
+			return TIMSSDR_ERROR_NO_MEM;
+		}
+
+		for (i = 0; i < block_count; i++) {
+			device->rx_blocks[i].data =
+				&device->rx_pool[(size_t) i * device->rx_block_size];
+		}
+	}
+
+	// Start with fresh queues. Nobody else touches them while we're idle.
+	if (device->rx_filled != NULL) {
+		timssdr_queue_destroy(device->rx_filled);
+	}
+	if (device->rx_free != NULL) {
+		timssdr_queue_destroy(device->rx_free);
+	}
+	device->rx_filled = timssdr_queue_create(block_count + 1);
+	device->rx_free = timssdr_queue_create(block_count);
+	if (device->rx_filled == NULL || device->rx_free == NULL) {
+		free_rx_pool(device);
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	// The first blocks go in flight, the rest are spares.
+	for (i = 0; i < device->transfer_count; i++) {
+		device->transfers[i]->buffer = device->rx_blocks[i].data;
+	}
+	for (; i < block_count; i++) {
+		timssdr_queue_push(device->rx_free, &device->rx_blocks[i]);
+	}
+
+	device->rx_held = NULL;
+	device->rx_held_offset = 0;
+	device->rx_end_queued = false;
+	device->rx_end_of_stream = false;
+	device->rx_overruns = 0;
+	device->rx_buffered = true;
+
+	return TIMSSDR_SUCCESS;
+}
+
+/* Called once all transfers have finished to leave buffered RX mode. */
+static int finish_buffered_rx(timssdr_device* device)
+{
+	uint32_t transfer_index, i;
+	int result = TIMSSDR_SUCCESS;
+
+	if (!device->rx_buffered) {
+		return TIMSSDR_SUCCESS;
+	}
+
+	if (device->rx_delivery_thread_started) {
+		if (pthread_join(device->rx_delivery_thread, NULL) != 0) {
+			result = TIMSSDR_ERROR_THREAD;
+		}
+		device->rx_delivery_thread_started = false;
+	}
+	for (i = 0; i < device->subscriber_count; i++) {
+		if (device->subscribers[i]->thread_started) {
+			if (pthread_join(device->subscribers[i]->thread, NULL) != 0) {
+				result = TIMSSDR_ERROR_THREAD;
+			}
+			device->subscribers[i]->thread_started = false;
+		}
+	}
+	device->rx_fanout = false;
+
+	// Point the transfers back at their own buffers. The pool and the
+	// queues stay around so a pull consumer can drain what's left.
+	for (transfer_index = 0; transfer_index < device->transfer_count;
+	     transfer_index++) {
+		device->transfers[transfer_index]->buffer =
+			&device->buffer
+				 [(size_t) transfer_index * device->transfer_buffer_size];
+	}
+	device->rx_buffered = false;
+
+	return result;
+}
+
+/*
+ * Move a transfer on to the oldest slot of the ring, the next one in
+ * publishing order. Must be called with transfer_lock held, right before
+ * the transfer is submitted.
+ */
+static void claim_shm_slot_locked(timssdr_device* device, struct libusb_transfer* usb_transfer)
+{
+	const uint32_t slot = device->shm_next_slot;
+
+	device->shm_next_slot = (slot + 1) % device->shm_slot_count;
+	timssdr_shm_ring_claim(device->shm, slot);
+	usb_transfer->buffer = timssdr_shm_ring_slot(device->shm, slot);
+	usb_transfer->length = device->transfer_buffer_size;
+}
+
+/* Give back the slot claimed last, its transfer couldn't be submitted. */
+static void unclaim_shm_slot_locked(timssdr_device* device)
+{
+	device->shm_next_slot =
+		(device->shm_next_slot + device->shm_slot_count - 1) % device->shm_slot_count;
+}
+
+static void LIBUSB_CALL
+timssdr_libusb_shm_rx_callback(struct libusb_transfer* usb_transfer)
+{
+	timssdr_device* device = (timssdr_device*) usb_transfer->user_data;
+	bool resubmit = false;
+	int result = LIBUSB_SUCCESS;
+	int length;
+	uint64_t sample_index, timestamp_ns;
+	uint32_t flags;
+
+	stats_record_completion(device, usb_transfer);
+	stamp_block(device, usb_transfer, &sample_index, &timestamp_ns, &flags);
+
+	pthread_mutex_lock(&device->transfer_lock);
+	if (usb_transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		if (device->streaming && device->transfers_setup) {
+			// Published where it landed, then the transfer moves on to
+			// the oldest slot, which consumers can't read from now on.
+			// A discarded block is published empty, consumers skip it,
+			// so that block n stays in slot n % shm_slot_count.
+			if (discard_paused_block(device, usb_transfer, &flags)) {
+				length = 0;
+			} else {
+				flag_discontinuity(device, &flags);
+				length = usb_transfer->actual_length;
+			}
+			timssdr_shm_ring_publish(
+				device->shm,
+				timssdr_shm_ring_slot_of(device->shm, usb_transfer->buffer),
+				length,
+				sample_index,
+				timestamp_ns,
+				length > 0 ? flags : 0);
+			claim_shm_slot_locked(device, usb_transfer);
+			note_submit_locked(device, usb_transfer);
+			result = submit_transfer(device, usb_transfer);
+			if (result != LIBUSB_SUCCESS) {
+				STATS_ADD(device, resubmit_failures, 1);
+				if (recover_transfer_locked(device, usb_transfer, submit_error_status(result))) {
+					// The recovery thread claims a slot when it resubmits.
+					unclaim_shm_slot_locked(device);
+					result = LIBUSB_SUCCESS;
+				}
+			}
+			resubmit = true;
+		}
+	} else if (recover_transfer_locked(device, usb_transfer, usb_transfer->status)) {
+		// Takes the lost block's place, the resubmitted transfer gets
+		// a fresh slot as it is queued behind the others.
+		timssdr_shm_ring_publish(
+			device->shm,
+			timssdr_shm_ring_slot_of(device->shm, usb_transfer->buffer),
+			0,
+			sample_index,
+			timestamp_ns,
+			0);
+		resubmit = true;
+	} else {
+		device->streaming = false;
+	}
+
+	if (!resubmit || result != LIBUSB_SUCCESS) {
+		device->streaming = false;
+		release_transfer_locked(device);
+	}
+	pthread_mutex_unlock(&device->transfer_lock);
+}
+
+/* Called once all transfers have finished to leave broker mode. */
+static void finish_shm_rx(timssdr_device* device)
+{
+	uint32_t transfer_index;
+
+	if (!device->rx_shm) {
+		return;
+	}
+
+	timssdr_shm_ring_end(device->shm);
+	for (transfer_index = 0; transfer_index < device->transfer_count;
+	     transfer_index++) {
+		device->transfers[transfer_index]->buffer =
+			&device->buffer
+				 [(size_t) transfer_index * device->transfer_buffer_size];
+	}
+	device->rx_shm = false;
+}
+
+static void free_tx_pool(timssdr_device* device)
+{
+	free_buffer_memory(
+		device,
+		device->tx_pool,
+		(size_t) device->tx_block_count * device->tx_block_size,
+		device->tx_pool_source);
+	device->tx_pool = NULL;
+	device->tx_pool_source = BUFFER_HEAP;
+
+	free(device->tx_blocks);
+	device->tx_blocks = NULL;
+	device->tx_block_count = 0;
+	device->tx_block_size = 0;
+
+	free(device->tx_idle);
+	device->tx_idle = NULL;
+	device->tx_idle_count = 0;
+
+	if (device->tx_filled != NULL) {
+		timssdr_queue_destroy(device->tx_filled);
+		device->tx_filled = NULL;
+	}
+	if (device->tx_free != NULL) {
+		timssdr_queue_destroy(device->tx_free);
+		device->tx_free = NULL;
+	}
+	device->tx_current = NULL;
+}
+
+static int setup_tx_pool(timssdr_device* device, uint32_t queue_depth)
+{
+	const uint32_t block_count = device->transfer_count + queue_depth;
+	uint32_t i;
+
+	if (device->tx_pool == NULL || device->tx_block_count != block_count ||
+	    device->tx_block_size != device->transfer_buffer_size) {
+		free_tx_pool(device);
+
+		device->tx_block_count = block_count;
+		device->tx_block_size = device->transfer_buffer_size;
+		device->tx_pool = allocate_buffer_memory(
+			device,
+			(size_t) block_count * device->tx_block_size,
+			&device->tx_pool_source);
+		device->tx_blocks = (struct timssdr_block*) calloc(
+			block_count,
+			sizeof(struct timssdr_block));
+		device->tx_idle = (struct libusb_transfer**) calloc(
+			device->transfer_count,
+			sizeof(struct libusb_transfer*));
+		if (device->tx_pool == NULL || device->tx_blocks == NULL ||
+		    device->tx_idle == NULL) {
+			free_tx_pool(device);
+			return TIMSSDR_ERROR_NO_MEM;
+		}
+
+		for (i = 0; i < block_count; i++) {
+			device->tx_blocks[i].data =
+				&device->tx_pool[(size_t) i * device->tx_block_size];
+		}
+	}
+
+	// Start with fresh queues. Nobody else touches them while we're idle.
+	if (device->tx_filled != NULL) {
+		timssdr_queue_destroy(device->tx_filled);
+	}
+	if (device->tx_free != NULL) {
+		timssdr_queue_destroy(device->tx_free);
+	}
+	device->tx_filled = timssdr_queue_create(block_count);
+	device->tx_free = timssdr_queue_create(block_count);
+	if (device->tx_filled == NULL || device->tx_free == NULL) {
+		free_tx_pool(device);
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	// Every block starts out free, no transfer has data yet.
+	for (i = 0; i < block_count; i++) {
+		timssdr_queue_push(device->tx_free, &device->tx_blocks[i]);
+	}
+	for (i = 0; i < device->transfer_count; i++) {
+		device->tx_idle[i] = device->transfers[i];
+	}
+	device->tx_idle_count = device->transfer_count;
+	atomic_store(&device->tx_waiting, device->tx_idle_count);
+
+	device->tx_current = NULL;
+	device->tx_underruns = 0;
+	device->tx_buffered = true;
+
+	return TIMSSDR_SUCCESS;
+}
+
+/* Called once all transfers have finished to leave push TX mode. */
+static void finish_buffered_tx(timssdr_device* device)
+{
+	uint32_t transfer_index;
+
+	if (!device->tx_buffered) {
+		return;
+	}
+
+	for (transfer_index = 0; transfer_index < device->transfer_count;
+	     transfer_index++) {
+		device->transfers[transfer_index]->buffer =
+			&device->buffer
+				 [(size_t) transfer_index * device->transfer_buffer_size];
+	}
+	device->tx_idle_count = 0;
+	atomic_store(&device->tx_waiting, 0);
+	device->tx_buffered = false;
+}
+
+/*
+ * Called with transfer_lock held. Hand a filled block to a transfer and
+ * submit it. Returns false if no block is ready.
+ */
+static bool submit_tx_block_locked(
+	timssdr_device* device,
+	struct libusb_transfer* usb_transfer,
+	int* result)
+{
+	struct timssdr_block* block;
+
+	if (!timssdr_queue_try_pop(device->tx_filled, (void**) &block)) {
+		return false;
+	}
+
+	// Blocks are padded by the producer, which is all the hot path
+	// needs to know about packet sizes.
+	usb_transfer->buffer = block->data;
+	usb_transfer->length = block->valid_length;
+	note_submit_locked(device, usb_transfer);
+	*result = submit_transfer(device, usb_transfer);
+	return true;
+}
+
+/* Called with transfer_lock held: submit idle transfers for filled blocks. */
+static void kick_idle_tx_locked(timssdr_device* device)
+{
+	struct libusb_transfer* usb_transfer;
+	int result = LIBUSB_SUCCESS;
+
+	while (device->streaming && device->transfers_setup && device->tx_idle_count > 0) {
+		usb_transfer = device->tx_idle[device->tx_idle_count - 1];
+		if (!submit_tx_block_locked(device, usb_transfer, &result)) {
+			break;
+		}
+
+		device->tx_idle_count--;
+		if (result != LIBUSB_SUCCESS) {
+			// The block stays with the transfer until the next start.
+			last_libusb_error = result;
+			device->streaming = false;
+			break;
+		}
+		add_active_transfer_locked(device);
+	}
+	atomic_store(&device->tx_waiting, device->tx_idle_count);
+}
+
+static void LIBUSB_CALL
+timssdr_libusb_buffered_tx_callback(struct libusb_transfer* usb_transfer)
+{
+	timssdr_device* device = (timssdr_device*) usb_transfer->user_data;
+	bool success, resubmit = false, parked = false;
+	int result = LIBUSB_SUCCESS;
+
+	timssdr_transfer transfer = {
+		.device = device->owner,
+		.buffer = usb_transfer->buffer,
+		.buffer_length = device->tx_block_size,
+		.valid_length = usb_transfer->actual_length,
+		.rx_ctx = device->rx_ctx,
+		.tx_ctx = device->tx_ctx};
+
+	success = usb_transfer->status == LIBUSB_TRANSFER_COMPLETED;
+	stats_record_completion(device, usb_transfer);
+	stamp_block(device, usb_transfer, &transfer.sample_index, &transfer.timestamp_ns, &transfer.flags);
+	if (success) {
+		flag_discontinuity(device, &transfer.flags);
+	}
+
+	if (device->tx_completion_callback != NULL) {
+		device->tx_completion_callback(&transfer, success);
+	}
+
+	// The sent block goes back to the producer. This thread is the only
+	// one returning blocks, so the queue stays single-producer.
+	timssdr_queue_push(
+		device->tx_free,
+		block_from_buffer(
+			device->tx_blocks,
+			device->tx_pool,
+			device->tx_block_size,
+			usb_transfer->buffer));
+
+	pthread_mutex_lock(&device->transfer_lock);
+	if (success && device->streaming && device->transfers_setup) {
+		resubmit = submit_tx_block_locked(device, usb_transfer, &result);
+		if (!resubmit) {
+			// The producer hasn't kept up. Park the transfer for
+			// timssdr_tx_submit() to pick up, then look once more in
+			// case a block was queued before it could see us waiting.
+			device->tx_idle[device->tx_idle_count++] = usb_transfer;
+			device->tx_underruns++;
+			atomic_store(&device->tx_waiting, device->tx_idle_count);
+			atomic_thread_fence(memory_order_seq_cst);
+			kick_idle_tx_locked(device);
+			parked = true;
+		} else if (result != LIBUSB_SUCCESS) {
+			STATS_ADD(device, resubmit_failures, 1);
+		}
+	}
+
+	if (parked) {
+		// Not in flight any more, but the stream goes on.
+		device->active_transfers--;
+		if (device->active_transfers == 0) {
+			pthread_cond_broadcast(&device->all_finished_cv);
+		}
+	} else if (!resubmit || result != LIBUSB_SUCCESS) {
+		device->streaming = false;
+		device->active_transfers--;
+		if (device->active_transfers == 0) {
+			pthread_cond_broadcast(&device->all_finished_cv);
+		}
+	}
+	pthread_mutex_unlock(&device->transfer_lock);
+}
+
+/* Write all of a buffer, retrying short writes and interruptions. */
+static int write_fully(int fd, const uint8_t* data, size_t length)
+{
+	ssize_t written;
+
+	while (length > 0) {
+		written = write(fd, data, length);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		data += written;
+		length -= (size_t) written;
+	}
+	return 0;
+}
+
+/* Drop O_DIRECT for the rest of the recording. */
+static void recording_leave_direct(timssdr_device* device)
+{
+	int flags = fcntl(device->record_fd, F_GETFL);
+
+	if (flags != -1) {
+		fcntl(device->record_fd, F_SETFL, flags & ~O_DIRECT);
+	}
+	device->record_direct = false;
+}
+
+/* Sample block callback of the recorder, runs on the delivery thread. */
+static int recorder_block_callback(timssdr_transfer* transfer)
+{
+	timssdr_device* device = transfer->device;
+	int error;
+
+	if (transfer->valid_length <= 0) {
+		return 0;
+	}
+
+	// Blocks are page aligned, but O_DIRECT also needs every write to be
+	// a multiple of the file system block size. After a short block the
+	// file offset isn't aligned any more, so go through the page cache
+	// from then on.
+	if (device->record_direct &&
+	    (transfer->valid_length % BUFFER_MEMORY_ALIGNMENT) != 0) {
+		recording_leave_direct(device);
+	}
+
+	error = write_fully(device->record_fd, transfer->buffer, (size_t) transfer->valid_length);
+	if (error == EINVAL && device->record_direct) {
+		// The file system wants a coarser alignment than we offer.
+		recording_leave_direct(device);
+		error = write_fully(device->record_fd, transfer->buffer, (size_t) transfer->valid_length);
+	}
+	if (error != 0) {
+		atomic_store(&device->record_errno, error);
+		// Ends the stream, the remaining blocks are dropped.
+		return -1;
+	}
+
+	atomic_fetch_add_explicit(&device->record_bytes, (uint64_t) transfer->valid_length, memory_order_relaxed);
+	return 0;
+}
+
+/* Called once the delivery thread has finished to complete the file. */
+static int finish_recording(timssdr_device* device)
+{
+	int error;
+
+	if (device->record_fd < 0) {
+		return TIMSSDR_SUCCESS;
+	}
+
+	// Fill in the final length, the rest of the header is unchanged.
+	device->record_header->data_bytes = atomic_load(&device->record_bytes);
+	if (device->record_direct) {
+		recording_leave_direct(device);
+	}
+	if (pwrite(device->record_fd, device->record_header, TIMSSDR_FILE_HEADER_SIZE, 0) !=
+	    TIMSSDR_FILE_HEADER_SIZE) {
+		atomic_store(&device->record_errno, errno);
+	}
+	if (close(device->record_fd) != 0) {
+		atomic_store(&device->record_errno, errno);
+	}
+	device->record_fd = -1;
+
+	free(device->record_header);
+	device->record_header = NULL;
+
+	error = atomic_load(&device->record_errno);
+	return error == 0 ? TIMSSDR_SUCCESS : TIMSSDR_ERROR_FILE;
+}
+
+static void finish_replay(timssdr_device* device)
+{
+	struct timssdr_replay* replay = device->replay;
+	int i;
+
+	if (replay == NULL) {
+		return;
+	}
+
+	for (i = 0; i < replay->file_count; i++) {
+		munmap(replay->files[i].map, replay->files[i].map_length);
+		if (replay->files[i].fd >= 0) {
+			close(replay->files[i].fd);
+		}
+	}
+	free(replay->files);
+	free(replay);
+	device->replay = NULL;
+}
+
+/* Map a sample file, skipping the header of our own recordings. */
+static int map_replay_file(const char* path, struct timssdr_replay_file* file)
+{
+	const timssdr_file_header* header;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return TIMSSDR_ERROR_FILE;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return TIMSSDR_ERROR_FILE;
+	}
+	if (st.st_size == 0) {
+		// Nothing to send, but fine as part of a concatenation.
+		close(fd);
+		file->fd = -1;
+		file->map = NULL;
+		file->map_length = 0;
+		file->start = file->end = 0;
+		return TIMSSDR_SUCCESS;
+	}
+
+	file->map_length = (size_t) st.st_size;
+	file->map = (uint8_t*) mmap(NULL, file->map_length, PROT_READ, MAP_SHARED, fd, 0);
+	if (file->map == MAP_FAILED) {
+		close(fd);
+		file->map = NULL;
+		return TIMSSDR_ERROR_FILE;
+	}
+	file->fd = fd;
+	madvise(file->map, file->map_length, MADV_SEQUENTIAL);
+
+	file->start = 0;
+	file->end = file->map_length;
+	header = (const timssdr_file_header*) file->map;
+	if (file->map_length >= TIMSSDR_FILE_HEADER_SIZE &&
+	    memcmp(header->magic, TIMSSDR_FILE_MAGIC, sizeof(header->magic)) == 0) {
+		// A shorter header would have its own bytes replayed as samples.
+		if (header->format != TIMSSDR_FORMAT_S8 ||
+		    header->header_size < TIMSSDR_FILE_HEADER_SIZE ||
+		    header->header_size > file->map_length) {
+			munmap(file->map, file->map_length);
+			close(fd);
+			file->map = NULL;
+			return TIMSSDR_ERROR_NOT_SUPPORTED;
+		}
+		file->start = header->header_size;
+		if (header->data_bytes != 0 &&
+		    header->data_bytes <= file->map_length - file->start) {
+			file->end = file->start + header->data_bytes;
+		}
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+/*
+ * Ask for the next window of the file to be read ahead, and drop what has
+ * been sent unless it will be needed again. Only called once per window,
+ * so the hot path stays free of system calls.
+ */
+static void replay_advance_window(struct timssdr_replay* replay)
+{
+	struct timssdr_replay_file* file = &replay->files[replay->file];
+	const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t from, length;
+
+	if (!replay->loop && replay->window_end >= 2 * REPLAY_WINDOW_SIZE) {
+		// MADV_DONTNEED only drops this process's mappings of the pages,
+		// POSIX_FADV_DONTNEED then evicts them, it skips mapped pages.
+		from = (replay->window_end - 2 * REPLAY_WINDOW_SIZE) & ~(page - 1);
+		madvise(file->map + from, REPLAY_WINDOW_SIZE, MADV_DONTNEED);
+		posix_fadvise(file->fd, (off_t) from, REPLAY_WINDOW_SIZE, POSIX_FADV_DONTNEED);
+	}
+
+	from = replay->window_end & ~(page - 1);
+	if (from < file->map_length) {
+		length = file->map_length - from;
+		if (length > REPLAY_WINDOW_SIZE) {
+			length = REPLAY_WINDOW_SIZE;
+		}
+		madvise(file->map + from, length, MADV_WILLNEED);
+	}
+	replay->window_end += REPLAY_WINDOW_SIZE;
+}
+
+/* Move on to the next file with samples, wrapping around when looping. */
+static bool replay_next_file(struct timssdr_replay* replay)
+{
+	int tried;
+
+	for (tried = 0; tried < replay->file_count; tried++) {
+		if (replay->file + 1 == replay->file_count) {
+			if (!replay->loop) {
+				// Stay on the exhausted last file.
+				return false;
+			}
+			replay->file = -1;
+		}
+		replay->file++;
+		if (replay->files[replay->file].end > replay->files[replay->file].start) {
+			replay->offset = replay->files[replay->file].start;
+			replay->window_end = replay->offset;
+			replay_advance_window(replay);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* TX callback of the replay engine, fills a transfer from the mapped files. */
+static int replay_tx_callback(timssdr_transfer* transfer)
+{
+	// The callback sees the owner, the replay lives with the TX side.
+	struct timssdr_replay* replay = tx_side(transfer->device)->replay;
+	struct timssdr_replay_file* file;
+	int filled = 0;
+	size_t chunk;
+
+	while (filled < transfer->buffer_length) {
+		file = &replay->files[replay->file];
+		if (replay->offset >= file->end) {
+			if (!replay_next_file(replay)) {
+				break;
+			}
+			continue;
+		}
+
+		chunk = file->end - replay->offset;
+		if (chunk > (size_t) (transfer->buffer_length - filled)) {
+			chunk = (size_t) (transfer->buffer_length - filled);
+		}
+		memcpy(transfer->buffer + filled, file->map + replay->offset, chunk);
+		replay->offset += chunk;
+		filled += (int) chunk;
+
+		if (replay->offset >= replay->window_end) {
+			replay_advance_window(replay);
+		}
+	}
+
+	// At the end a short block goes out padded, then the stream ends,
+	// followed by the TX flush if one is enabled.
+	transfer->valid_length = filled;
+	return filled > 0 ? 0 : -1;
+}
+
+static int kill_transfer_thread(timssdr_device* device)
+{
+	void* value;
+	int result;
+
+	if (device->transfer_thread_started != false) {
+		/*
+		 * Cancel transfers. This call will block until the transfer
+		 * thread has handled all completion callbacks.
+		 */
+		cancel_transfers(device);
+
+		if (device->transport != NULL) {
+			// The transport's own thread stands in for the event thread.
+			device->transport->destroy(device->transport);
+			device->transport = NULL;
+			device->transfer_thread_started = false;
+			return TIMSSDR_SUCCESS;
+		}
+
+		if (device->external_events) {
+			device->transfer_thread_started = false;
+			return TIMSSDR_SUCCESS;
+		}
+
+		if (device->shared_events) {
+			// Other devices may still need the shared thread.
+			device->transfer_thread_started = false;
+			return detach_shared_event_thread();
+		}
+
+		// Set flag to tell the thread to exit.
+		device->do_exit = true;
+
+		/*
+		 * Interrupt the event handling thread instead of
+		 * waiting for timeout.
+		 */
+		libusb_interrupt_event_handler(g_libusb_context);
+
+		value = NULL;
+		result = pthread_join(device->transfer_thread, &value);
+		if (result != 0) {
+			return TIMSSDR_ERROR_THREAD;
+		}
+		event_thread_stopped();
+		device->transfer_thread_started = false;
+	}
+
+	/*
+	 * Reset do_exit; we're now done here and the thread was
+	 * already dead or is now dead.
+	 */
+	device->do_exit = false;
+
+	return TIMSSDR_SUCCESS;
+}
+
+/* Start the per-stream bookkeeping afresh, before any transfer is submitted. */
+static void reset_stream_state(timssdr_device* device)
+{
+	// Streaming reuses the buffer a synchronous read may have left data in.
+	device->sync_pending_length = 0;
+	device->next_sample_index = 0;
+	device->discontinuity = false;
+	device->device_busy_until_ns = 0;
+	memset(device->transfer_gaps, 0, device->transfer_count * sizeof(uint64_t));
+	atomic_store(&device->rx_paused, false);
+	atomic_store(&device->rx_resume_pending, false);
+	// Intervals are measured between completions of the same stream.
+	atomic_store_explicit(&device->stats.last_completion_ns, 0, memory_order_relaxed);
+}
+
+/*
+ * Get the transfers ready for their first submission: filled by the TX
+ * callback, or restored to full length for RX. Returns how many are ready.
+ */
+static uint32_t ready_initial_transfers(timssdr_device* device, const uint_fast8_t endpoint_address)
+{
+	uint32_t transfer_index;
+	uint32_t ready_transfers = 0;
+
+	// If setting up for TX, call the TX callback to fill each
+	// transfer buffer.
+
+	// All transfers must be filled before any are submitted.
+	// Otherwise a transfer might complete whilst the others are
+	// still being filled, causing the transfer thread to make a
+	// concurrent call to the TX callback.
+
+	// We also need to handle the case where the callback returns
+	// nonzero to indicate completion, so keep count of how many
+	// transfers were made ready to submit at this stage.
+
+	if (endpoint_address == TX_ENDPOINT_ADDRESS) {
+		for (transfer_index = 0; transfer_index < device->transfer_count;
+		     transfer_index++) {
+			timssdr_transfer transfer = {
+				.device = device->owner,
+				.buffer = device->transfers[transfer_index]->buffer,
+				.buffer_length = device->transfer_buffer_size,
+				.valid_length = device->transfer_buffer_size,
+				.rx_ctx = device->rx_ctx,
+				.tx_ctx = device->tx_ctx,
+			};
+			if ((device->callback(&transfer) == 0) &&
+			    (transfer.valid_length > 0)) {
+				device->transfers[transfer_index]->length =
+					transfer.valid_length;
+				ready_transfers++;
+			} else {
+				break;
+			}
+		}
+
+	} else {
+		// For RX, all transfers are ready for use once their length is
+		// restored (a previous TX run may have shortened it).
+		for (transfer_index = 0; transfer_index < device->transfer_count;
+		     transfer_index++) {
+			device->transfers[transfer_index]->length =
+				device->transfer_buffer_size;
+		}
+		ready_transfers = device->transfer_count;
+	}
+
+	return ready_transfers;
+}
+
+/* First submission of one transfer. Must be called with transfer_lock held. */
+static int submit_initial_transfer_locked(
+	timssdr_device* device,
+	const uint_fast8_t endpoint_address,
+	libusb_transfer_cb_fn callback,
+	uint32_t transfer_index)
+{
+	struct libusb_transfer* transfer = device->transfers[transfer_index];
+	int error;
+
+	transfer->endpoint = endpoint_address;
+	transfer->callback = callback;
+
+	// Pad the size of a short transfer to the next 512-byte boundary.
+	if (endpoint_address == TX_ENDPOINT_ADDRESS) {
+		pad_tx_transfer(transfer);
+	}
+
+	note_submit_locked(device, transfer);
+	error = submit_transfer(device, transfer);
+	if (error != 0) {
+		last_libusb_error = error;
+		device->streaming = false;
+		return error;
+	}
+	add_active_transfer_locked(device);
+	return 0;
+}
+
+/* Wrap up the first submissions. Must be called with transfer_lock held. */
+static int finish_initial_submit_locked(timssdr_device* device, int error)
+{
+	if (error == 0) {
+		device->transfers_setup = true;
+
+		// If we're not continuing streaming, follow up with a flush if needed.
+		if (!device->streaming && device->flush) {
+			error = submit_transfer(device, device->flush_transfer);
+			if (error != 0) {
+				last_libusb_error = error;
+			}
+		}
+	}
+
+	return error;
+}
+
+static int prepare_transfers(timssdr_device* device, const uint_fast8_t endpoint_address, libusb_transfer_cb_fn callback)
+{
+	int error = 0;
+	uint32_t transfer_index;
+	uint32_t ready_transfers;
+
+	if (device->transfers == NULL) {
+		// This shouldn't happen.
+		return TIMSSDR_ERROR_OTHER;
+	}
+
+	reset_stream_state(device);
+	ready_transfers = ready_initial_transfers(device, endpoint_address);
+
+	// Now everything is ready, go ahead and submit the ready transfers. We must hold
+	// the transfer lock whilst doing this, so that completion callbacks cannot resubmit
+	// any transfers until all transfers have been initially submitted.
+	pthread_mutex_lock(&device->transfer_lock);
+
+	// We should only continue streaming if all transfers were made ready.
+	// Otherwise the completion callback must not ask for further blocks.
+	// Set this before submitting, as the callback checks it before taking
+	// the lock and a transfer may complete right away.
+	device->streaming = (ready_transfers == device->transfer_count);
+
+	for (transfer_index = 0; transfer_index < ready_transfers; transfer_index++) {
+		error = submit_initial_transfer_locked(device, endpoint_address, callback, transfer_index);
+		if (error != 0) {
+			break;
+		}
+	}
+	error = finish_initial_submit_locked(device, error);
+
+	// Now we can release the transfer lock.
+	pthread_mutex_unlock(&device->transfer_lock);
+
+	if (error == 0) {
+		return TIMSSDR_SUCCESS;
+	} else {
+		return TIMSSDR_ERROR_LIBUSB;
+	}
+}
+
+static int prepare_setup_transfers(timssdr_device* device, const uint8_t endpoint_address,timssdr_sample_block_cb_fn callback)
+{
+	if (device->transfers_setup == true) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	device->callback = callback;
+	return prepare_transfers(
+		device,
+		endpoint_address,
+		timssdr_libusb_transfer_callback);
+}
+
+int timssdr_init()
+{
+	int libusb_error;
+	if (g_libusb_context != NULL) {
+		return TIMSSDR_SUCCESS;
+	}
+
+	libusb_error = libusb_init(&g_libusb_context);
+	if (libusb_error != 0) {
+		last_libusb_error = libusb_error;
+		return TIMSSDR_ERROR_LIBUSB;
+	}
+
+	device_cache_start();
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_exit(void)
+{
+	if (open_devices == 0) {
+		if (g_libusb_context != NULL) {
+			stop_hotplug_thread();
+			device_cache_stop();
+			libusb_exit(g_libusb_context);
+			g_libusb_context = NULL;
+		}
+
+		return TIMSSDR_SUCCESS;
+	} else {
+		return TIMSSDR_ERROR_NOT_LAST_DEVICE;
+	}
+}
+
+#ifndef LIBRARY_VERSION
+	#define LIBRARY_VERSION "unknown"
+#endif
+const char* timssdr_library_version()
+{
+	return LIBRARY_VERSION;
+}
+
+/* Grow the cache to hold one more entry. Called with device_cache_lock held. */
+static bool device_cache_reserve_locked(void)
+{
+	struct device_cache_entry* entries;
+	size_t capacity;
+
+	if (device_cache_count < device_cache_capacity) {
+		return true;
+	}
+
+	capacity = device_cache_capacity ? device_cache_capacity * 2 : 8;
+	entries = (struct device_cache_entry*) realloc(device_cache, capacity * sizeof(*entries));
+	if (entries == NULL) {
+		return false;
+	}
+	device_cache = entries;
+	device_cache_capacity = capacity;
+	return true;
+}
+
+static void device_cache_add_locked(libusb_device* usb_device)
+{
+	struct device_cache_entry* entry;
+	size_t i;
+
+	for (i = 0; i < device_cache_count; i++) {
+		if (device_cache[i].device == usb_device && device_cache[i].present) {
+			return;
+		}
+	}
+
+	if (!device_cache_reserve_locked()) {
+		return;
+	}
+
+	entry = &device_cache[device_cache_count++];
+	entry->device = libusb_ref_device(usb_device);
+	entry->serial_number[0] = 0;
+	entry->serial_known = false;
+	entry->serial_failed = false;
+	entry->present = true;
+	entry->announced = false;
+}
+
+static void device_cache_remove_locked(libusb_device* usb_device)
+{
+	size_t i;
+
+	for (i = 0; i < device_cache_count; i++) {
+		if (device_cache[i].device == usb_device) {
+			device_cache[i].present = false;
+		}
+	}
+}
+
+/*
+ * Drop entries of devices that are gone, except those whose removal is
+ * still to be reported to the hotplug callback. Returns the devices to
+ * unref once device_cache_lock is released, NULL terminated.
+ */
+static void device_cache_prune_locked(libusb_device** unref, size_t unref_size)
+{
+	size_t i, kept = 0, dropped = 0;
+
+	for (i = 0; i < device_cache_count; i++) {
+		if (!device_cache[i].present &&
+		    (!device_cache[i].announced || hotplug_callback == NULL) &&
+		    dropped + 1 < unref_size) {
+			unref[dropped++] = device_cache[i].device;
+			continue;
+		}
+		device_cache[kept++] = device_cache[i];
+	}
+	device_cache_count = kept;
+	unref[dropped] = NULL;
+}
+
+static void unref_devices(libusb_device** devices)
+{
+	for (; *devices != NULL; devices++) {
+		libusb_unref_device(*devices);
+	}
+}
+
+/*
+ * Called by libusb while handling events, on whichever thread does that.
+ * No I/O here: libusb doesn't allow synchronous requests from hotplug
+ * callbacks, and this may hold up a streaming device's completions.
+ */
+static int LIBUSB_CALL device_cache_hotplug_callback(
+	libusb_context* context,
+	libusb_device* usb_device,
+	libusb_hotplug_event event,
+	void* user_data)
+{
+	(void) context;
+	(void) user_data;
+
+	pthread_mutex_lock(&device_cache_lock);
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		device_cache_add_locked(usb_device);
+	} else {
+		device_cache_remove_locked(usb_device);
+	}
+	pthread_mutex_unlock(&device_cache_lock);
+	hotplug_wake();
+
+	return 0;
+}
+
+/* Without hotplug support, find out what changed by scanning the bus. */
+static void device_cache_scan(void)
+{
+	struct libusb_device_descriptor device_descriptor;
+	libusb_device** devices = NULL;
+	ssize_t list_length, i;
+	size_t e;
+	bool seen;
+
+	list_length = libusb_get_device_list(g_libusb_context, &devices);
+	if (list_length < 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&device_cache_lock);
+	for (e = 0; e < device_cache_count; e++) {
+		seen = false;
+		for (i = 0; i < list_length; i++) {
+			seen = seen || devices[i] == device_cache[e].device;
+		}
+		if (!seen) {
+			device_cache[e].present = false;
+		}
+	}
+	for (i = 0; i < list_length; i++) {
+		libusb_get_device_descriptor(devices[i], &device_descriptor);
+		if (device_descriptor.idVendor == timssdr_usb_vid &&
+		    device_descriptor.idProduct == timssdr_usb_pid) {
+			device_cache_add_locked(devices[i]);
+		}
+	}
+	pthread_mutex_unlock(&device_cache_lock);
+
+	libusb_free_device_list(devices, 1);
+}
+
+/* Returns false if the device has a serial number that couldn't be read. */
+static bool read_serial_number(libusb_device* usb_device, char* serial_number)
+{
+	struct libusb_device_descriptor device_descriptor;
+	libusb_device_handle* usb_device_handle;
+	unsigned char buffer[64];
+	int length;
+
+	serial_number[0] = 0;
+	libusb_get_device_descriptor(usb_device, &device_descriptor);
+	if (device_descriptor.iSerialNumber == 0) {
+		return true;
+	}
+	if (libusb_open(usb_device, &usb_device_handle) != 0) {
+		return false;
+	}
+
+	length = libusb_get_string_descriptor_ascii(
+		usb_device_handle,
+		device_descriptor.iSerialNumber,
+		buffer,
+		sizeof(buffer));
+	if (length > 0) {
+		if (length > USB_MAX_SERIAL_LENGTH) {
+			length = USB_MAX_SERIAL_LENGTH;
+		}
+		memcpy(serial_number, buffer, length);
+		serial_number[length] = 0;
+	}
+
+	libusb_close(usb_device_handle);
+	return length > 0;
+}
+
+/* Read the serial number of every new device, once, without holding the lock. */
+static void device_cache_read_serials(void)
+{
+	char serial_number[USB_MAX_SERIAL_LENGTH + 1];
+	libusb_device* usb_device;
+	size_t i;
+	bool read;
+
+	for (;;) {
+		usb_device = NULL;
+		pthread_mutex_lock(&device_cache_lock);
+		for (i = 0; i < device_cache_count; i++) {
+			if (device_cache[i].present && !device_cache[i].serial_known) {
+				usb_device = libusb_ref_device(device_cache[i].device);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&device_cache_lock);
+
+		if (usb_device == NULL) {
+			return;
+		}
+
+		// A device that can't be opened (in use elsewhere, no
+		// permission) is listed without serial number for now.
+		read = read_serial_number(usb_device, serial_number);
+
+		pthread_mutex_lock(&device_cache_lock);
+		for (i = 0; i < device_cache_count; i++) {
+			if (device_cache[i].device == usb_device && !device_cache[i].serial_known) {
+				strcpy(device_cache[i].serial_number, serial_number);
+				device_cache[i].serial_known = true;
+				device_cache[i].serial_failed = !read;
+			}
+		}
+		pthread_mutex_unlock(&device_cache_lock);
+		libusb_unref_device(usb_device);
+	}
+}
+
+/*
+ * Have the serial numbers that couldn't be read read again by the next
+ * device_cache_read_serials(). Returns false if there are none.
+ */
+static bool device_cache_retry_serials(void)
+{
+	bool retry = false;
+	size_t i;
+
+	pthread_mutex_lock(&device_cache_lock);
+	for (i = 0; i < device_cache_count; i++) {
+		if (device_cache[i].present && device_cache[i].serial_failed) {
+			device_cache[i].serial_known = false;
+			retry = true;
+		}
+	}
+	pthread_mutex_unlock(&device_cache_lock);
+
+	return retry;
+}
+
+/* Bring the cache up to date: pending hotplug events or a scan, then serial numbers. */
+static void device_cache_refresh(void)
+{
+	struct timeval no_wait = {0, 0};
+	libusb_device* unref[64];
+
+	if (device_cache_hotplug) {
+		// With external event handling, the application delivers hotplug
+		// events, and running event threads do it for us.
+		if (event_mode != TIMSSDR_EVENTS_EXTERNAL && atomic_load(&event_threads) == 0) {
+			libusb_handle_events_timeout_completed(g_libusb_context, &no_wait, NULL);
+		}
+	} else {
+		device_cache_scan();
+	}
+	device_cache_read_serials();
+
+	pthread_mutex_lock(&device_cache_lock);
+	device_cache_prune_locked(unref, sizeof(unref) / sizeof(unref[0]));
+	pthread_mutex_unlock(&device_cache_lock);
+	unref_devices(unref);
+}
+
+static void device_cache_start(void)
+{
+	int result;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		return;
+	}
+
+	// Enumeration fills the cache with the devices already connected.
+	result = libusb_hotplug_register_callback(
+		g_libusb_context,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE,
+		timssdr_usb_vid,
+		timssdr_usb_pid,
+		LIBUSB_HOTPLUG_MATCH_ANY,
+		device_cache_hotplug_callback,
+		NULL,
+		&device_cache_handle);
+	device_cache_hotplug = result == LIBUSB_SUCCESS;
+}
+
+static void device_cache_stop(void)
+{
+	size_t i;
+
+	if (device_cache_hotplug) {
+		libusb_hotplug_deregister_callback(g_libusb_context, device_cache_handle);
+		device_cache_hotplug = false;
+	}
+
+	pthread_mutex_lock(&device_cache_lock);
+	for (i = 0; i < device_cache_count; i++) {
+		libusb_unref_device(device_cache[i].device);
+	}
+	free(device_cache);
+	device_cache = NULL;
+	device_cache_count = 0;
+	device_cache_capacity = 0;
+	pthread_mutex_unlock(&device_cache_lock);
+}
+
+/* Report arrivals and removals to the hotplug callback, one at a time. */
+static void hotplug_dispatch(void)
+{
+	char serial_number[USB_MAX_SERIAL_LENGTH + 1];
+	enum timssdr_hotplug_event event;
+	libusb_device* gone;
+	size_t i;
+
+	for (;;) {
+		gone = NULL;
+		event = 0;
+		pthread_mutex_lock(&device_cache_lock);
+		for (i = 0; i < device_cache_count; i++) {
+			if (device_cache[i].present && device_cache[i].serial_known &&
+			    !device_cache[i].announced) {
+				device_cache[i].announced = true;
+				event = TIMSSDR_HOTPLUG_ARRIVED;
+				break;
+			}
+			if (!device_cache[i].present && device_cache[i].announced) {
+				event = TIMSSDR_HOTPLUG_LEFT;
+				gone = device_cache[i].device;
+				break;
+			}
+		}
+		if (event != 0) {
+			strcpy(serial_number, device_cache[i].serial_number);
+		}
+		if (gone != NULL) {
+			device_cache_count--;
+			memmove(&device_cache[i], &device_cache[i + 1], (device_cache_count - i) * sizeof(*device_cache));
+		}
+		pthread_mutex_unlock(&device_cache_lock);
+
+		if (event == 0) {
+			return;
+		}
+		if (gone != NULL) {
+			libusb_unref_device(gone);
+		}
+		hotplug_callback(event, serial_number[0] ? serial_number : NULL, hotplug_ctx);
+	}
+}
+
+static void* hotplug_threadproc(void* arg)
+{
+	struct timeval timeout = {EVENT_THREAD_TIMEOUT_S, 0};
+
+	(void) arg;
+	while (!hotplug_exit) {
+		if (device_cache_hotplug) {
+			// Sleep until device_cache_hotplug_callback() ran on some
+			// event thread, or until there is none left.
+			pthread_mutex_lock(&hotplug_lock);
+			while (!hotplug_exit && !hotplug_pending &&
+			       (atomic_load(&event_threads) > 0 || event_mode == TIMSSDR_EVENTS_EXTERNAL)) {
+				pthread_cond_wait(&hotplug_cv, &hotplug_lock);
+			}
+			hotplug_pending = false;
+			pthread_mutex_unlock(&hotplug_lock);
+
+			// Hotplug events are delivered while handling libusb
+			// events, here only while no event thread of ours runs.
+			if (!hotplug_exit && event_mode != TIMSSDR_EVENTS_EXTERNAL &&
+			    atomic_load(&event_threads) == 0) {
+				libusb_handle_events_timeout_completed(g_libusb_context, &timeout, NULL);
+			}
+		} else {
+			// Nothing tells about changes, only scanning the bus does.
+			usleep(HOTPLUG_POLL_INTERVAL_US);
+		}
+		device_cache_refresh();
+		hotplug_dispatch();
+	}
+
+	return NULL;
+}
+
+static void stop_hotplug_thread(void)
+{
+	if (!hotplug_thread_started) {
+		return;
+	}
+
+	hotplug_exit = true;
+	hotplug_wake();
+	libusb_interrupt_event_handler(g_libusb_context);
+	pthread_join(hotplug_thread, NULL);
+	hotplug_thread_started = false;
+}
+
+int timssdr_set_hotplug_callback(timssdr_hotplug_cb_fn callback, void* ctx)
+{
+	size_t i;
+
+	stop_hotplug_thread();
+
+	pthread_mutex_lock(&device_cache_lock);
+	hotplug_callback = callback;
+	hotplug_ctx = ctx;
+	// A new callback hears about every device that is connected now.
+	for (i = 0; i < device_cache_count; i++) {
+		device_cache[i].announced = false;
+	}
+	pthread_mutex_unlock(&device_cache_lock);
+
+	if (callback == NULL) {
+		return TIMSSDR_SUCCESS;
+	}
+
+	hotplug_exit = false;
+	if (pthread_create(&hotplug_thread, NULL, hotplug_threadproc, NULL) != 0) {
+		pthread_mutex_lock(&device_cache_lock);
+		hotplug_callback = NULL;
+		pthread_mutex_unlock(&device_cache_lock);
+		return TIMSSDR_ERROR_THREAD;
+	}
+	hotplug_thread_started = true;
+
+	return TIMSSDR_SUCCESS;
+}
+
+timssdr_device_list_t* timssdr_device_list()
+{
+	timssdr_device_list_t* list;
+	size_t i;
+	int idx;
+
+	device_cache_retry_serials();
+	device_cache_refresh();
+
+	list = calloc(1, sizeof(*list));
+	if (list == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&device_cache_lock);
+	for (i = 0; i < device_cache_count; i++) {
+		if (device_cache[i].present) {
+			list->usb_devicecount++;
+		}
+	}
+
+	// NULL terminated like libusb's own lists, for libusb_free_device_list().
+	list->usb_devices = calloc(list->usb_devicecount + 1, sizeof(void*));
+	list->serial_numbers = calloc(list->usb_devicecount, sizeof(void*));
+	list->usb_board_ids =
+		calloc(list->usb_devicecount, sizeof(enum timssdr_usb_board_id));
+	list->usb_device_index = calloc(list->usb_devicecount, sizeof(int));
+
+	if (list->usb_devices == NULL || list->serial_numbers == NULL ||
+	    list->usb_board_ids == NULL || list->usb_device_index == NULL) {
+		pthread_mutex_unlock(&device_cache_lock);
+		timssdr_device_list_free(list);
+		return NULL;
+	}
+
+	for (i = 0; i < device_cache_count; i++) {
+		if (!device_cache[i].present) {
+			continue;
+		}
+		idx = list->devicecount++;
+		list->usb_devices[idx] = libusb_ref_device(device_cache[i].device);
+		list->usb_board_ids[idx] = timssdr_usb_pid;
+		list->usb_device_index[idx] = idx;
+		if (device_cache[i].serial_number[0] != 0) {
+			list->serial_numbers[idx] = strdup(device_cache[i].serial_number);
+		}
+	}
+	pthread_mutex_unlock(&device_cache_lock);
+
+	return list;
+}
+
+void timssdr_device_list_free(timssdr_device_list_t* list)
+{
+	int i;
+
+	libusb_free_device_list((libusb_device**) list->usb_devices, 1);
+
+	for (i = 0; i < list->devicecount; i++) {
+		if (list->serial_numbers[i])
+			free(list->serial_numbers[i]);
+	}
+
+	free(list->serial_numbers);
+	free(list->usb_board_ids);
+	free(list->usb_device_index);
+	free(list);
+}
+
+libusb_device_handle* timssdr_open_usb(const char* const desired_serial_number)
+{
+	libusb_device_handle* usb_device = NULL;
+	libusb_device* match = NULL;
+	size_t match_len = 0, serial_len, i;
+	const char* serial_number;
+	bool retried = false;
+
+	if (desired_serial_number) {
+		/* If a shorter serial number is specified, only match against the suffix.
+		 * Should probably complain if the match is not unique, currently doesn't.
+		 */
+		match_len = strlen(desired_serial_number);
+		if (match_len > USB_MAX_SERIAL_LENGTH)
+			return NULL;
+	}
+
+	device_cache_refresh();
+
+	for (;;) {
+		pthread_mutex_lock(&device_cache_lock);
+		for (i = 0; i < device_cache_count && match == NULL; i++) {
+			if (!device_cache[i].present) {
+				continue;
+			}
+			serial_number = device_cache[i].serial_number;
+			serial_len = strlen(serial_number);
+			if (desired_serial_number == NULL ||
+			    (serial_len >= match_len &&
+			     strcmp(serial_number + serial_len - match_len, desired_serial_number) == 0)) {
+				match = libusb_ref_device(device_cache[i].device);
+			}
+		}
+		pthread_mutex_unlock(&device_cache_lock);
+
+		// The device may be one whose serial number couldn't be read yet.
+		if (match != NULL || desired_serial_number == NULL || retried ||
+		    !device_cache_retry_serials()) {
+			break;
+		}
+		device_cache_read_serials();
+		retried = true;
+	}
+
+	if (match != NULL) {
+		if (libusb_open(match, &usb_device) != 0) {
+			usb_device = NULL;
+		}
+		libusb_unref_device(match);
+	}
+
+	return usb_device;
+}
+
+/* Allocate a device handle with its transfers, but no event handling yet. */
+static int alloc_device(libusb_device_handle* usb_device, timssdr_device** device)
+{
+	int result;
+	timssdr_device* lib_device;
+
+	lib_device = (timssdr_device*) calloc(1, sizeof(*lib_device));
+	if (lib_device == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	lib_device->usb_device = usb_device;
+	lib_device->transport = NULL;
+	lib_device->transfers = NULL;
+	lib_device->callback = NULL;
+	lib_device->transfer_thread_started = false;
+	lib_device->shared_events = false;
+	lib_device->external_events = false;
+	lib_device->thread_attrs_set = false;
+	lib_device->thread_pinned = false;
+#ifdef __linux__
+	CPU_ZERO(&lib_device->thread_cpus);
+#endif
+	lib_device->thread_sched_policy = SCHED_OTHER;
+	lib_device->thread_priority = 0;
+	lib_device->streaming = false;
+	lib_device->do_exit = false;
+	lib_device->active_transfers = 0;
+	lib_device->flush = false;
+	lib_device->flush_transfer = NULL;
+	lib_device->flush_buffer_source = BUFFER_HEAP;
+	lib_device->flush_callback = NULL;
+	lib_device->flush_ctx = NULL;
+	lib_device->tx_completion_callback = NULL;
+	lib_device->buffer = NULL;
+	lib_device->rx_buffered = false;
+	lib_device->rx_pool = NULL;
+	lib_device->rx_blocks = NULL;
+	lib_device->rx_filled = NULL;
+	lib_device->rx_free = NULL;
+	lib_device->rx_held = NULL;
+	lib_device->rx_delivery_thread_started = false;
+	lib_device->tx_buffered = false;
+	lib_device->tx_pool = NULL;
+	lib_device->tx_blocks = NULL;
+	lib_device->tx_filled = NULL;
+	lib_device->tx_free = NULL;
+	lib_device->tx_current = NULL;
+	lib_device->tx_idle = NULL;
+	lib_device->tx_idle_count = 0;
+	atomic_init(&lib_device->tx_waiting, 0);
+	lib_device->tx_underruns = 0;
+	lib_device->replay = NULL;
+	lib_device->sweep_frequencies = NULL;
+	lib_device->sweep_frequency_count = 0;
+	lib_device->sweep_bytes_per_tuning = 0;
+	lib_device->sweeping = false;
+	lib_device->record_fd = -1;
+	lib_device->record_direct = false;
+	lib_device->record_header = NULL;
+	atomic_init(&lib_device->record_bytes, 0);
+	atomic_init(&lib_device->record_errno, 0);
+	lib_device->sync_pending_length = 0;
+	lib_device->next_sample_index = 0;
+	lib_device->discontinuity = false;
+	lib_device->stream_rate = 0;
+	lib_device->device_busy_until_ns = 0;
+	lib_device->transfer_gaps = NULL;
+	lib_device->transfer_epochs = NULL;
+	lib_device->rx_paused = false;
+	lib_device->rx_epoch = 0;
+	lib_device->rx_resume_pending = false;
+	lib_device->recovery = false;
+	lib_device->recovery_exit = false;
+	lib_device->recovery_max_attempts = DEFAULT_RECOVERY_ATTEMPTS;
+	lib_device->gap_callback = NULL;
+	lib_device->gap_ctx = NULL;
+	lib_device->transfer_recovery = NULL;
+	lib_device->recovery_pending = 0;
+	lib_device->recovery_order = 0;
+	stats_reset(lib_device);
+	lib_device->rx_device_format = TIMSSDR_FORMAT_S8;
+	lib_device->rx_output_format = TIMSSDR_FORMAT_S8;
+	lib_device->rx_converted = NULL;
+	lib_device->rx_converted_size = 0;
+	lib_device->rx_converted_owned = false;
+	lib_device->psd = NULL;
+	lib_device->ddc = NULL;
+	lib_device->rx_shm = false;
+	lib_device->shm = NULL;
+	lib_device->rx_fanout = false;
+	lib_device->subscriber_count = 0;
+	lib_device->tx_peer = NULL;
+	lib_device->owner = lib_device;
+	lib_device->zero_copy = false;
+	lib_device->hugepages = false;
+	lib_device->buffer_source = BUFFER_HEAP;
+	lib_device->transfer_count = DEFAULT_TRANSFER_COUNT;
+	lib_device->transfer_buffer_size = DEFAULT_TRANSFER_BUFFER_SIZE;
+
+	result = pthread_mutex_init(&lib_device->transfer_lock, NULL);
+	if (result != 0) {
+		free(lib_device);
+		return TIMSSDR_ERROR_THREAD;
+	}
+
+	result = pthread_cond_init(&lib_device->all_finished_cv, NULL);
+	if (result != 0) {
+		pthread_mutex_destroy(&lib_device->transfer_lock);
+		free(lib_device);
+		return TIMSSDR_ERROR_THREAD;
+	}
+
+	result = pthread_mutex_init(&lib_device->rx_release_lock, NULL);
+	if (result != 0) {
+		pthread_cond_destroy(&lib_device->all_finished_cv);
+		pthread_mutex_destroy(&lib_device->transfer_lock);
+		free(lib_device);
+		return TIMSSDR_ERROR_THREAD;
+	}
+
+	*device = lib_device;
+	return TIMSSDR_SUCCESS;
+}
+
+/*
+ * Allocate the transfers and start event handling, unless done already.
+ * Devices opened in TIMSSDR_OPEN_LAZY mode get them on their first stream.
+ */
+static int activate_device(timssdr_device* device)
+{
+	int result;
+
+	if (device->transfers == NULL) {
+		result = allocate_transfers(device);
+		if (result != TIMSSDR_SUCCESS) {
+			return result;
+		}
+	}
+
+	if (!device->transfer_thread_started) {
+		return create_transfer_thread(device);
+	}
+	return TIMSSDR_SUCCESS;
+}
+
+/* Counterpart of alloc_device(), the USB handle is left to the caller. */
+static void free_device(timssdr_device* device)
+{
+	free_transfers(device);
+	pthread_mutex_destroy(&device->rx_release_lock);
+	pthread_mutex_destroy(&device->transfer_lock);
+	pthread_cond_destroy(&device->all_finished_cv);
+	free(device);
+}
+
+/* Device running TX streaming: the full duplex peer if there is one. */
+static timssdr_device* tx_side(timssdr_device* device)
+{
+	return device->tx_peer != NULL ? device->tx_peer : device;
+}
+
+/*
+ * Give the device a second handle on the same USB device for TX, with its
+ * own transfers and event handling, see timssdr_set_full_duplex().
+ */
+static int create_tx_peer(timssdr_device* device)
+{
+	timssdr_device* peer;
+	int result;
+
+	result = alloc_device(device->usb_device, &peer);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+
+	peer->owner = device;
+	peer->stream_rate = device->stream_rate;
+	peer->hugepages = device->hugepages;
+	result = reallocate_transfers(
+		peer,
+		device->transfer_count,
+		device->transfer_buffer_size,
+		device->zero_copy);
+	if (result != TIMSSDR_SUCCESS) {
+		free_device(peer);
+		return result;
+	}
+
+	if (device->usb_device == NULL) {
+		peer->mock_config = device->mock_config;
+		peer->transport = timssdr_mock_transport_create(&peer->mock_config);
+		if (peer->transport == NULL) {
+			free_device(peer);
+			return TIMSSDR_ERROR_THREAD;
+		}
+		peer->transfer_thread_started = true;
+	} else {
+		result = create_transfer_thread(peer);
+		if (result != TIMSSDR_SUCCESS) {
+			free_device(peer);
+			return result;
+		}
+	}
+
+	// TX settings made so far carry over.
+	peer->tx_completion_callback = device->tx_completion_callback;
+	if (device->flush_transfer != NULL) {
+		result = timssdr_enable_tx_flush(peer, device->flush_callback, device->flush_ctx);
+		if (result != TIMSSDR_SUCCESS) {
+			kill_transfer_thread(peer);
+			free_device(peer);
+			return result;
+		}
+	}
+
+	device->tx_peer = peer;
+	return TIMSSDR_SUCCESS;
+}
+
+/* Counterpart of create_tx_peer(), the USB handle stays with the owner. */
+static void free_tx_peer(timssdr_device* device)
+{
+	timssdr_device* peer = device->tx_peer;
+
+	if (peer == NULL) {
+		return;
+	}
+
+	kill_transfer_thread(peer);
+	finish_buffered_tx(peer);
+	finish_replay(peer);
+	free_tx_pool(peer);
+	free_flush_transfer(peer);
+	free_device(peer);
+	device->tx_peer = NULL;
+}
+
+static int timssdr_open_setup(libusb_device_handle* usb_device, timssdr_device** device)
+{
+	int result;
+	timssdr_device* lib_device;
+
+	//int speed = libusb_get_device_speed(usb_device);
+	// TODO: Error or warning if not high speed USB?
+
+	if (open_mode == TIMSSDR_OPEN_LAZY) {
+		result = set_timssdr_configuration_lazy(usb_device, USB_CONFIG_STANDARD);
+	} else {
+		result = set_timssdr_configuration(usb_device, USB_CONFIG_STANDARD);
+	}
+	if (result != LIBUSB_SUCCESS) {
+		libusb_close(usb_device);
+		return result;
+	}
+
+	result = libusb_claim_interface(usb_device, 0);
+	if (result != LIBUSB_SUCCESS) {
+		last_libusb_error = result;
+		libusb_close(usb_device);
+		return TIMSSDR_ERROR_LIBUSB;
+	}
+
+	result = alloc_device(usb_device, &lib_device);
+	if (result != TIMSSDR_SUCCESS) {
 		libusb_release_interface(usb_device, 0);
 		libusb_close(usb_device);
+		return result;
+	}
+
+	if (open_mode == TIMSSDR_OPEN_EAGER) {
+		result = activate_device(lib_device);
+		if (result != 0) {
+			free_device(lib_device);
+			libusb_release_interface(usb_device, 0);
+			libusb_close(usb_device);
+			return result;
+		}
+	}
+
+	*device = lib_device;
+	open_devices++;
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_open(timssdr_device** device)
+{
+	libusb_device_handle* usb_device;
+
+	if (device == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	usb_device = timssdr_open_usb(NULL);
+
+	if (usb_device == NULL) {
+		return TIMSSDR_ERROR_NOT_FOUND;
+	}
+
+	return timssdr_open_setup(usb_device, device);
+}
+
+int timssdr_open_by_serial(const char* const desired_serial_number, timssdr_device** device)
+{
+	libusb_device_handle* usb_device;
+
+	if (desired_serial_number == NULL) {
+		return timssdr_open(device);
+	}
+
+	if (device == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	usb_device = timssdr_open_usb(desired_serial_number);
+
+	if (usb_device == NULL) {
+		return TIMSSDR_ERROR_NOT_FOUND;
+	}
+
+	return timssdr_open_setup(usb_device, device);
+}
+
+int timssdr_device_list_open(timssdr_device_list_t* list, int idx, timssdr_device** device)
+{
+	libusb_device_handle* usb_device;
+	int i, result;
+
+	if (device == NULL || list == NULL || idx < 0 || idx >= list->devicecount) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	i = list->usb_device_index[idx];
+
+	result = libusb_open(list->usb_devices[i], &usb_device);
+	if (result != 0) {
+		usb_device = NULL;
+		last_libusb_error = result;
+		return TIMSSDR_ERROR_LIBUSB;
+	}
+
+	return timssdr_open_setup(usb_device, device);
+}
+
+struct open_all_job {
+	timssdr_device_list_t* list;
+	int idx;
+	timssdr_device** device;
+	int result;
+	pthread_t thread;
+	bool thread_started;
+};
+
+static void* open_all_threadproc(void* arg)
+{
+	struct open_all_job* job = (struct open_all_job*) arg;
+
+	job->result = timssdr_device_list_open(job->list, job->idx, job->device);
+	return NULL;
+}
+
+int timssdr_open_all(timssdr_device_list_t* list, timssdr_device** devices, int n)
+{
+	struct open_all_job* jobs;
+	int i, result = TIMSSDR_SUCCESS;
+
+	if (list == NULL || devices == NULL || n < 1 || n > list->devicecount) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	jobs = (struct open_all_job*) calloc(n, sizeof(*jobs));
+	if (jobs == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	// Most of an open is waiting for control requests, so one thread
+	// per device brings a rack up in about the time of a single open.
+	for (i = 0; i < n; i++) {
+		devices[i] = NULL;
+		jobs[i].list = list;
+		jobs[i].idx = i;
+		jobs[i].device = &devices[i];
+		jobs[i].thread_started =
+			pthread_create(&jobs[i].thread, NULL, open_all_threadproc, &jobs[i]) == 0;
+		if (!jobs[i].thread_started) {
+			open_all_threadproc(&jobs[i]);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (jobs[i].thread_started) {
+			pthread_join(jobs[i].thread, NULL);
+		}
+		if (jobs[i].result != TIMSSDR_SUCCESS && result == TIMSSDR_SUCCESS) {
+			result = jobs[i].result;
+		}
+	}
+	free(jobs);
+
+	// All or nothing, so the caller doesn't have to sort out which ones opened.
+	if (result != TIMSSDR_SUCCESS) {
+		for (i = 0; i < n; i++) {
+			if (devices[i] != NULL) {
+				timssdr_close(devices[i]);
+				devices[i] = NULL;
+			}
+		}
+	}
+
+	return result;
+}
+
+int timssdr_open_mock(const timssdr_mock_config* config, timssdr_device** device)
+{
+	int result;
+	timssdr_device* lib_device;
+
+	if (device == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	result = alloc_device(NULL, &lib_device);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+
+	result = allocate_transfers(lib_device);
+	if (result != TIMSSDR_SUCCESS) {
+		free_device(lib_device);
+		return result;
+	}
+
+	if (config != NULL) {
+		lib_device->mock_config = *config;
+	}
+	lib_device->transport = timssdr_mock_transport_create(config);
+	if (lib_device->transport == NULL) {
+		free_device(lib_device);
+		return TIMSSDR_ERROR_THREAD;
+	}
+	lib_device->transfer_thread_started = true;
+
+	*device = lib_device;
+	open_devices++;
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_close(timssdr_device* device)
+{
+	int result1, result2;
+
+	result1 = TIMSSDR_SUCCESS;
+	result2 = TIMSSDR_SUCCESS;
+
+	if (device != NULL) {
+		// The TX side shares the USB handle, it goes first.
+		free_tx_peer(device);
+
+		/*
+		 * Finally kill the transfer thread, which will
+		 * also cancel any pending transmit/receive transfers.
+		 */
+		result2 = kill_transfer_thread(device);
+		stop_recovery_thread(device);
+		finish_buffered_rx(device);
+		finish_shm_rx(device);
+		timssdr_shm_ring_destroy(device->shm);
+		finish_recording(device);
+		finish_buffered_tx(device);
+		finish_replay(device);
+
+		// Device memory buffers belong to the handle, free them first.
+		free_rx_pool(device);
+		free_tx_pool(device);
+		free_transfers(device);
+		if (device->rx_converted_owned) {
+			free(device->rx_converted);
+		}
+		timssdr_psd_destroy(device->psd);
+		timssdr_ddc_destroy(device->ddc);
+		while (device->subscriber_count > 0) {
+			free_subscription(device->subscribers[--device->subscriber_count]);
+		}
+		// The transport is gone already, so is the plan it was given.
+		free(device->sweep_frequencies);
+		free_flush_transfer(device);
+
+		if (device->usb_device != NULL) {
+			libusb_release_interface(device->usb_device, 0);
+			libusb_close(device->usb_device);
+			device->usb_device = NULL;
+		}
+
+		pthread_mutex_destroy(&device->rx_release_lock);
+		pthread_mutex_destroy(&device->transfer_lock);
+		pthread_cond_destroy(&device->all_finished_cv);
+
+		free(device);
+	}
+	open_devices--;
+
+	if (result2 != TIMSSDR_SUCCESS) {
+		return result2;
+	}
+	return result1;
+}
+
+int timssdr_is_streaming(timssdr_device* device)
+{
+	/* return timssdr is streaming only when streaming, transfer_thread_started are true and do_exit equal false */
+
+	// In full duplex either direction counts.
+	if (device->tx_peer != NULL && !device->streaming) {
+		return timssdr_is_streaming(device->tx_peer);
+	}
+
+	if ((device->transfer_thread_started == true) && (device->streaming == true) &&
+	    (device->do_exit == false)) {
+		return TIMSSDR_TRUE;
+	} else {
+		if (device->transfer_thread_started == false) {
+			return TIMSSDR_ERROR_STREAMING_THREAD_ERR;
+		}
+
+		if (device->streaming == false) {
+			return TIMSSDR_ERROR_STREAMING_STOPPED;
+		}
+
+		return TIMSSDR_ERROR_STREAMING_EXIT_CALLED;
+	}
+}
+
+int timssdr_start_rx(timssdr_device* device, timssdr_sample_block_cb_fn callback, void* rx_ctx)
+{
+	int result;
+	const uint8_t endpoint_address = RX_ENDPOINT_ADDRESS;
+	result = activate_device(device);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+	device->rx_ctx = rx_ctx;
+    result = prepare_setup_transfers(device, endpoint_address, callback);
+	return result;
+}
+
+/* Back to plain streaming once the sweep transfers are done. */
+static void finish_sweep(timssdr_device* device)
+{
+	if (!device->sweeping) {
+		return;
+	}
+
+	device->transport->set_sweep(device->transport, NULL);
+	device->sweeping = false;
+}
+
+int timssdr_start_rx_group(
+	timssdr_device* const* devices,
+	int n,
+	timssdr_sample_block_cb_fn callback,
+	void* const* rx_ctx)
+{
+	uint32_t transfer_index, max_transfers = 0;
+	int* errors;
+	int i, j, result = TIMSSDR_SUCCESS;
+
+	if (devices == NULL || n < 1) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+	// A device listed twice would wait on its own transfer lock below.
+	for (i = 0; i < n; i++) {
+		if (devices[i] == NULL) {
+			return TIMSSDR_ERROR_INVALID_PARAM;
+		}
+		for (j = 0; j < i; j++) {
+			if (devices[j] == devices[i]) {
+				return TIMSSDR_ERROR_INVALID_PARAM;
+			}
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (devices[i]->transfers_setup == true) {
+			return TIMSSDR_ERROR_BUSY;
+		}
+		result = activate_device(devices[i]);
+		if (result != TIMSSDR_SUCCESS) {
+			return result;
+		}
+	}
+
+	errors = (int*) calloc(n, sizeof(int));
+	if (errors == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	// Do everything but submitting up front, so that the submissions
+	// are all that is left between the first device starting and the last.
+	for (i = 0; i < n; i++) {
+		devices[i]->rx_ctx = rx_ctx != NULL ? rx_ctx[i] : NULL;
+		devices[i]->callback = callback;
+		reset_stream_state(devices[i]);
+		ready_initial_transfers(devices[i], RX_ENDPOINT_ADDRESS);
+		if (devices[i]->transfer_count > max_transfers) {
+			max_transfers = devices[i]->transfer_count;
+		}
+	}
+
+	// Each device's lock keeps its completions from resubmitting until
+	// every device is started. Locks are always taken in array order.
+	for (i = 0; i < n; i++) {
+		pthread_mutex_lock(&devices[i]->transfer_lock);
+		devices[i]->streaming = true;
+	}
+
+	// Round robin, so every device has a transfer queued as early as possible.
+	for (transfer_index = 0; transfer_index < max_transfers; transfer_index++) {
+		for (i = 0; i < n; i++) {
+			if (errors[i] == 0 && transfer_index < devices[i]->transfer_count) {
+				errors[i] = submit_initial_transfer_locked(
+					devices[i],
+					RX_ENDPOINT_ADDRESS,
+					timssdr_libusb_transfer_callback,
+					transfer_index);
+			}
+		}
+	}
+
+	for (i = n - 1; i >= 0; i--) {
+		errors[i] = finish_initial_submit_locked(devices[i], errors[i]);
+		if (errors[i] != 0) {
+			result = TIMSSDR_ERROR_LIBUSB;
+		}
+		pthread_mutex_unlock(&devices[i]->transfer_lock);
+	}
+
+	// A group is only useful complete: stop everything if one failed.
+	if (result != TIMSSDR_SUCCESS) {
+		for (i = 0; i < n; i++) {
+			if (errors[i] == 0) {
+				cancel_transfers(devices[i]);
+			} else {
+				devices[i]->streaming = false;
+				wait_transfers_finished(devices[i]);
+			}
+		}
+	}
+
+	free(errors);
+	return result;
+}
+
+int timssdr_stop_rx(timssdr_device* device)
+{
+	int result;
+
+	result = cancel_transfers(device);
+	finish_sweep(device);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+
+	result = finish_buffered_rx(device);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+	finish_shm_rx(device);
+
+	result = finish_recording(device);
+
+	// return timssdr_stop_cmd(device);
+	return result;
+}
+
+int timssdr_pause_rx(timssdr_device* device)
+{
+	if (device == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	// RX always runs on the device itself, TX may share its transfers.
+	if (!device->transfers_setup ||
+	    device->transfers[0]->endpoint != RX_ENDPOINT_ADDRESS) {
+		return TIMSSDR_ERROR_STREAMING_STOPPED;
+	}
+
+	atomic_store(&device->rx_paused, true);
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_resume_rx(timssdr_device* device)
+{
+	if (device == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (!device->transfers_setup ||
+	    device->transfers[0]->endpoint != RX_ENDPOINT_ADDRESS) {
+		return TIMSSDR_ERROR_STREAMING_STOPPED;
+	}
+
+	// Transfers in flight now were submitted before the retune was done,
+	// the new epoch tells their blocks apart from the ones that follow.
+	atomic_fetch_add(&device->rx_epoch, 1);
+	atomic_store(&device->rx_resume_pending, true);
+	atomic_store(&device->rx_paused, false);
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_init_sweep(
+	timssdr_device* device,
+	const uint16_t* frequency_list,
+	int num_ranges,
+	uint32_t num_bytes,
+	uint32_t step_width,
+	uint32_t offset,
+	enum timssdr_sweep_style style)
+{
+	uint64_t start, stop, frequency;
+	uint64_t* frequencies;
+	uint32_t tunings_per_step, count, i;
+	int range;
+
+	if (device == NULL || frequency_list == NULL || num_ranges < 1 ||
+	    num_ranges > TIMSSDR_SWEEP_MAX_RANGES || num_bytes == 0 ||
+	    (num_bytes % TIMSSDR_SWEEP_BLOCK_SIZE) != 0 || step_width == 0) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	switch (style) {
+	case TIMSSDR_SWEEP_STYLE_LINEAR:
+		tunings_per_step = 1;
+		break;
+	case TIMSSDR_SWEEP_STYLE_INTERLEAVED:
+		tunings_per_step = 2;
+		break;
+	default:
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	count = 0;
+	for (range = 0; range < num_ranges; range++) {
+		start = frequency_list[2 * range] * 1000000ull;
+		stop = frequency_list[2 * range + 1] * 1000000ull;
+		if (start >= stop) {
+			return TIMSSDR_ERROR_INVALID_PARAM;
+		}
+		if ((stop - start + step_width - 1) / step_width * tunings_per_step >
+		    MAX_SWEEP_TUNINGS - count) {
+			return TIMSSDR_ERROR_INVALID_PARAM;
+		}
+		count += (uint32_t) ((stop - start + step_width - 1) / step_width) * tunings_per_step;
+	}
+
+	// Retuning needs firmware support; the board's USB bridge alone
+	// can't do it, so only transports that know how to sweep can.
+	if (device->transport == NULL || device->transport->set_sweep == NULL) {
+		return TIMSSDR_ERROR_NOT_SUPPORTED;
+	}
+
+	if (device->transfers_setup == true) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	frequencies = (uint64_t*) malloc(count * sizeof(*frequencies));
+	if (frequencies == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	i = 0;
+	for (range = 0; range < num_ranges; range++) {
+		start = frequency_list[2 * range] * 1000000ull;
+		stop = frequency_list[2 * range + 1] * 1000000ull;
+		for (frequency = start; frequency < stop; frequency += step_width) {
+			frequencies[i++] = frequency + offset;
+			if (tunings_per_step == 2) {
+				frequencies[i++] = frequency + offset + step_width / 2;
+			}
+		}
+	}
+
+	free(device->sweep_frequencies);
+	device->sweep_frequencies = frequencies;
+	device->sweep_frequency_count = count;
+	device->sweep_bytes_per_tuning = num_bytes;
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_start_rx_sweep(
+	timssdr_device* device,
+	timssdr_sample_block_cb_fn callback,
+	void* rx_ctx)
+{
+	struct timssdr_sweep_plan plan;
+	int result;
+
+	if (device == NULL || device->sweep_frequency_count == 0 ||
+	    (device->transfer_buffer_size % TIMSSDR_SWEEP_BLOCK_SIZE) != 0) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (device->transfers_setup == true) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	result = activate_device(device);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+
+	plan.frequencies = device->sweep_frequencies;
+	plan.frequency_count = device->sweep_frequency_count;
+	plan.bytes_per_tuning = device->sweep_bytes_per_tuning;
+	result = device->transport->set_sweep(device->transport, &plan);
+	if (result != LIBUSB_SUCCESS) {
+		last_libusb_error = result;
+		return TIMSSDR_ERROR_LIBUSB;
+	}
+	device->sweeping = true;
+
+	result = timssdr_start_rx(device, callback, rx_ctx);
+	if (result != TIMSSDR_SUCCESS) {
+		// Whatever did get submitted has to drain before the plan goes.
+		device->streaming = false;
+		wait_transfers_finished(device);
+		finish_sweep(device);
+	}
+
+	return result;
+}
+
+int timssdr_sweep_parse(
+	const uint8_t* buffer,
+	int length,
+	timssdr_sweep_block* blocks,
+	int max_blocks,
+	int* block_count)
+{
+	const uint8_t* header;
+	uint64_t frequency;
+	int offset, block_length, count, i;
+
+	if ((buffer == NULL && length > 0) || length < 0 || (blocks == NULL && max_blocks > 0) ||
+	    max_blocks < 0 || block_count == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	count = 0;
+	for (offset = 0; offset + TIMSSDR_SWEEP_HEADER_SIZE < length && count < max_blocks;
+	     offset += TIMSSDR_SWEEP_BLOCK_SIZE) {
+		header = buffer + offset;
+		if (header[0] != TIMSSDR_SWEEP_MARKER || header[1] != TIMSSDR_SWEEP_MARKER) {
+			continue;
+		}
+
+		frequency = 0;
+		for (i = 7; i >= 0; i--) {
+			frequency = (frequency << 8) | header[2 + i];
+		}
+
+		block_length = length - offset;
+		if (block_length > TIMSSDR_SWEEP_BLOCK_SIZE) {
+			block_length = TIMSSDR_SWEEP_BLOCK_SIZE;
+		}
+
+		blocks[count].frequency = frequency;
+		blocks[count].samples = header + TIMSSDR_SWEEP_HEADER_SIZE;
+		blocks[count].length = block_length - TIMSSDR_SWEEP_HEADER_SIZE;
+		count++;
+	}
+
+	*block_count = count;
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_start_rx_buffered(
+	timssdr_device* device,
+	uint32_t queue_depth,
+	timssdr_sample_block_cb_fn callback,
+	void* rx_ctx)
+{
+	int result;
+
+	if (device == NULL || queue_depth < 2) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (device->transfers_setup == true || device->rx_buffered) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	result = activate_device(device);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+
+	result = setup_rx_pool(device, queue_depth);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+
+	device->rx_ctx = rx_ctx;
+	device->callback = callback;
+
+	if (callback != NULL) {
+		// Delivery runs until the end marker, so it must see streaming
+		// set before the first block arrives.
+		device->streaming = true;
+		result = pthread_create(
+			&device->rx_delivery_thread,
+			0,
+			rx_delivery_threadproc,
+			device);
+		if (result != 0) {
+			device->streaming = false;
+			finish_buffered_rx(device);
+			return TIMSSDR_ERROR_THREAD;
+		}
+		device->rx_delivery_thread_started = true;
+	}
+
+	result = prepare_transfers(
+		device,
+		RX_ENDPOINT_ADDRESS,
+		timssdr_libusb_buffered_rx_callback);
+	if (result != TIMSSDR_SUCCESS) {
+		// Let whatever did get submitted drain. If nothing was in
+		// flight there's no libusb callback to post the end marker.
+		device->streaming = false;
+		wait_transfers_finished(device);
+		pthread_mutex_lock(&device->transfer_lock);
+		if (!device->rx_end_queued) {
+			post_rx_end_locked(device);
+		}
+		pthread_mutex_unlock(&device->transfer_lock);
+		finish_buffered_rx(device);
+		return result;
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_start_rx_shm(timssdr_device* device, const char* name, uint32_t slot_count)
+{
+	uint32_t transfer_index;
+	int result;
+
+	if (device == NULL || name == NULL || slot_count <= device->transfer_count) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (device->transfers_setup == true || device->rx_buffered || device->rx_shm) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	result = activate_device(device);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+
+	// Consumers of the last run keep their mapping, new ones get this ring.
+	timssdr_shm_ring_destroy(device->shm);
+	device->shm = NULL;
+	result = timssdr_shm_ring_create(
+		name,
+		slot_count,
+		device->transfer_buffer_size,
+		device->transfer_count,
+		&device->shm);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+
+	for (transfer_index = 0; transfer_index < device->transfer_count;
+	     transfer_index++) {
+		timssdr_shm_ring_claim(device->shm, transfer_index);
+		device->transfers[transfer_index]->buffer =
+			timssdr_shm_ring_slot(device->shm, transfer_index);
+	}
+	device->shm_slot_count = slot_count;
+	device->shm_next_slot = device->transfer_count;
+	device->rx_shm = true;
+
+	result = prepare_transfers(device, RX_ENDPOINT_ADDRESS, timssdr_libusb_shm_rx_callback);
+	if (result != TIMSSDR_SUCCESS) {
+		device->streaming = false;
+		wait_transfers_finished(device);
+		finish_shm_rx(device);
+	}
+	return result;
+}
+
+static void free_subscription(struct timssdr_subscription* subscription)
+{
+	timssdr_queue_destroy(subscription->queue);
+	free(subscription);
+}
+
+int timssdr_rx_subscribe(
+	timssdr_device* device,
+	timssdr_sample_block_cb_fn callback,
+	void* ctx,
+	uint32_t queue_depth,
+	timssdr_subscription** subscription)
+{
+	struct timssdr_subscription* created;
+
+	if (device == NULL || callback == NULL || queue_depth < 1 || subscription == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (device->transfers_setup == true || device->rx_buffered) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	if (device->subscriber_count == TIMSSDR_MAX_SUBSCRIBERS) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	created = (struct timssdr_subscription*) calloc(1, sizeof(*created));
+	if (created == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+	// One more entry for the end marker.
+	created->queue = timssdr_queue_create(queue_depth + 1);
+	if (created->queue == NULL) {
+		free(created);
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+	created->device = device;
+	created->callback = callback;
+	created->ctx = ctx;
+	created->queue_depth = queue_depth;
+	atomic_init(&created->active, true);
+	atomic_init(&created->overruns, 0);
+
+	device->subscribers[device->subscriber_count++] = created;
+	*subscription = created;
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_rx_unsubscribe(timssdr_subscription* subscription)
+{
+	timssdr_device* device;
+	uint32_t i;
+
+	if (subscription == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	device = subscription->device;
+	if (device->transfers_setup == true || device->rx_buffered) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	for (i = 0; i < device->subscriber_count; i++) {
+		if (device->subscribers[i] == subscription) {
+			memmove(&device->subscribers[i],
+				&device->subscribers[i + 1],
+				(device->subscriber_count - i - 1) * sizeof(device->subscribers[0]));
+			device->subscriber_count--;
+			free_subscription(subscription);
+			return TIMSSDR_SUCCESS;
+		}
+	}
+
+	return TIMSSDR_ERROR_INVALID_PARAM;
+}
+
+int timssdr_get_subscription_overruns(const timssdr_subscription* subscription, uint64_t* overruns)
+{
+	if (subscription == NULL || overruns == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	*overruns = atomic_load_explicit(&subscription->overruns, memory_order_relaxed);
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_start_rx_subscribers(timssdr_device* device)
+{
+	struct timssdr_subscription* subscription;
+	uint32_t spares = 0, i;
+	void* leftover;
+	int result;
+
+	if (device == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (device->subscriber_count == 0) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (device->transfers_setup == true || device->rx_buffered) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	result = activate_device(device);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+
+	// Every subscriber may hold a full queue plus the block it's working
+	// on, and they don't necessarily hold the same blocks.
+	for (i = 0; i < device->subscriber_count; i++) {
+		spares += device->subscribers[i]->queue_depth + 1;
+	}
+	result = setup_rx_pool(device, spares);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+
+	device->callback = NULL;
+	device->rx_fanout = true;
+	device->streaming = true;
+	for (i = 0; i < device->subscriber_count; i++) {
+		subscription = device->subscribers[i];
+		subscription->active = true;
+		subscription->dropped = false;
+		subscription->overruns = 0;
+		// Leftovers from a stream that was never started.
+		while (timssdr_queue_try_pop(subscription->queue, &leftover)) {
+		}
+		if (pthread_create(&subscription->thread, 0, subscription_threadproc, subscription) != 0) {
+			device->streaming = false;
+			pthread_mutex_lock(&device->transfer_lock);
+			post_rx_end_locked(device);
+			pthread_mutex_unlock(&device->transfer_lock);
+			finish_buffered_rx(device);
+			return TIMSSDR_ERROR_THREAD;
+		}
+		subscription->thread_started = true;
+	}
+
+	result = prepare_transfers(
+		device,
+		RX_ENDPOINT_ADDRESS,
+		timssdr_libusb_buffered_rx_callback);
+	if (result != TIMSSDR_SUCCESS) {
+		device->streaming = false;
+		wait_transfers_finished(device);
+		pthread_mutex_lock(&device->transfer_lock);
+		if (!device->rx_end_queued) {
+			post_rx_end_locked(device);
+		}
+		pthread_mutex_unlock(&device->transfer_lock);
+		finish_buffered_rx(device);
+		return result;
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_start_rx_to_file(
+	timssdr_device* device,
+	const char* path,
+	const timssdr_recorder_opts* opts)
+{
+	timssdr_recorder_opts defaults = {0};
+	timssdr_file_header* header;
+	struct timespec now;
+	uint32_t queue_depth;
+	void* memory;
+	int fd, error, result;
+	bool direct;
+
+	if (device == NULL || path == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+	if (opts == NULL) {
+		opts = &defaults;
+	}
+	if (opts->sample_rate < 0) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+	queue_depth = opts->queue_depth ? opts->queue_depth : DEFAULT_RECORDER_QUEUE_DEPTH;
+
+	if (device->transfers_setup == true || device->rx_buffered || device->record_fd >= 0) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	direct = opts->direct_io != 0;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+	if (fd < 0 && direct && errno == EINVAL) {
+		// File systems such as tmpfs don't do O_DIRECT.
+		direct = false;
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (fd < 0) {
+		atomic_store(&device->record_errno, errno);
+		return TIMSSDR_ERROR_FILE;
+	}
+
+	if (posix_memalign(&memory, BUFFER_MEMORY_ALIGNMENT, TIMSSDR_FILE_HEADER_SIZE) != 0) {
+		close(fd);
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+	header = (timssdr_file_header*) memory;
+	memset(header, 0, TIMSSDR_FILE_HEADER_SIZE);
+	memcpy(header->magic, TIMSSDR_FILE_MAGIC, sizeof(header->magic));
+	header->version = TIMSSDR_FILE_VERSION;
+	header->header_size = TIMSSDR_FILE_HEADER_SIZE;
+	header->format = TIMSSDR_FORMAT_S8;
+	header->sample_rate = opts->sample_rate;
+	clock_gettime(CLOCK_REALTIME, &now);
+	header->start_time_ns = (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+	header->start_timestamp_ns = completion_timestamp_ns();
+
+	error = write_fully(fd, (const uint8_t*) header, TIMSSDR_FILE_HEADER_SIZE);
+	if (error == EINVAL && direct) {
+		int flags = fcntl(fd, F_GETFL);
+		fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+		direct = false;
+		error = write_fully(fd, (const uint8_t*) header, TIMSSDR_FILE_HEADER_SIZE);
+	}
+	if (error != 0) {
+		atomic_store(&device->record_errno, error);
+		free(header);
+		close(fd);
+		return TIMSSDR_ERROR_FILE;
+	}
+
+	device->record_fd = fd;
+	device->record_direct = direct;
+	device->record_header = header;
+	atomic_store(&device->record_bytes, 0);
+	atomic_store(&device->record_errno, 0);
+
+	if (opts->sample_rate > 0) {
+		timssdr_set_stream_rate(device, opts->sample_rate);
+	}
+
+	result = timssdr_start_rx_buffered(device, queue_depth, recorder_block_callback, NULL);
+	if (result != TIMSSDR_SUCCESS) {
+		finish_recording(device);
+		return result;
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_get_recording_status(
+	timssdr_device* device,
+	uint64_t* bytes_written,
+	int* os_error)
+{
+	int error;
+
+	if (device == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	error = atomic_load(&device->record_errno);
+	if (bytes_written != NULL) {
+		*bytes_written = atomic_load_explicit(&device->record_bytes, memory_order_relaxed);
+	}
+	if (os_error != NULL) {
+		*os_error = error;
+	}
+	return error == 0 ? TIMSSDR_SUCCESS : TIMSSDR_ERROR_FILE;
+}
+
+/* Return the held block and wait for the next one in buffered pull mode. */
+static int rx_next_block(timssdr_device* device, int timeout_ms)
+{
+	struct timssdr_block* block;
+
+	// The previous block is ours until now, give it back for reuse.
+	if (device->rx_held != NULL) {
+		timssdr_queue_push(device->rx_free, device->rx_held);
+		device->rx_held = NULL;
+	}
+
+	if (device->rx_end_of_stream) {
+		return TIMSSDR_ERROR_STREAMING_STOPPED;
+	}
+
+	if (!timssdr_queue_pop_wait(device->rx_filled, (void**) &block, timeout_ms)) {
+		return TIMSSDR_ERROR_TIMEOUT;
+	}
+
+	if (block == NULL) {
+		device->rx_end_of_stream = true;
+		return TIMSSDR_ERROR_STREAMING_STOPPED;
+	}
+
+	device->rx_held = block;
+	device->rx_held_offset = 0;
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_rx_read(timssdr_device* device, timssdr_transfer* transfer, int timeout_ms)
+{
+	int result;
+
+	if (device == NULL || transfer == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (device->rx_filled == NULL) {
+		return TIMSSDR_ERROR_STREAMING_STOPPED;
+	}
+
+	if (device->rx_delivery_thread_started || device->rx_fanout) {
+		// Blocks are being handed to the callback instead.
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	result = rx_next_block(device, timeout_ms);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+
+	transfer->device = device;
+	transfer->buffer = device->rx_held->data;
+	transfer->buffer_length = device->rx_block_size;
+	transfer->valid_length = device->rx_held->valid_length;
+	transfer->rx_ctx = device->rx_ctx;
+	transfer->tx_ctx = device->tx_ctx;
+	transfer->converted = NULL;
+	transfer->converted_count = 0;
+	transfer->sample_index = device->rx_held->sample_index;
+	transfer->timestamp_ns = device->rx_held->timestamp_ns;
+	transfer->flags = device->rx_held->flags;
+	convert_rx_block(device, transfer);
+	feed_stages(device, transfer);
+
+	return TIMSSDR_SUCCESS;
+}
+
+/* Absolute CLOCK_MONOTONIC deadline in ms, or -1 for no timeout. */
+static int64_t sync_deadline(int timeout_ms)
+{
+	struct timespec now;
+
+	if (timeout_ms < 0) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000 + timeout_ms;
+}
+
+/* Milliseconds left until deadline, -1 if there is none. */
+static int sync_time_left(int64_t deadline)
+{
+	struct timespec now;
+	int64_t left;
+
+	if (deadline < 0) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = deadline - ((int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000);
+	return left > 0 ? (int) left : 0;
+}
+
+static int read_sync_buffered(
+	timssdr_device* device,
+	uint8_t* buf,
+	int len,
+	int* n_read,
+	int64_t deadline)
+{
+	struct timssdr_block* block;
+	int chunk, result;
+
+	while (*n_read < len) {
+		block = device->rx_held;
+		if (block == NULL || device->rx_held_offset >= block->valid_length) {
+			result = rx_next_block(device, sync_time_left(deadline));
+			if (result != TIMSSDR_SUCCESS) {
+				// Report what we have, the end shows up on the next call.
+				if (result == TIMSSDR_ERROR_STREAMING_STOPPED && *n_read > 0) {
+					return TIMSSDR_SUCCESS;
+				}
+				return result;
+			}
+			continue;
+		}
+
+		chunk = block->valid_length - device->rx_held_offset;
+		if (chunk > len - *n_read) {
+			chunk = len - *n_read;
+		}
+		memcpy(buf + *n_read, block->data + device->rx_held_offset, chunk);
+		device->rx_held_offset += chunk;
+		*n_read += chunk;
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+static int read_sync_direct(
+	timssdr_device* device,
+	uint8_t* buf,
+	int len,
+	int* n_read,
+	int64_t deadline)
+{
+	int remaining, chunk, actual, copied, timeout, result;
+	uint8_t* dest;
+
+	// Whatever a previous short read left behind comes first.
+	if (device->sync_pending_length > 0) {
+		copied = device->sync_pending_length < len ? device->sync_pending_length : len;
+		memcpy(buf, device->buffer + device->sync_pending_offset, copied);
+		device->sync_pending_offset += copied;
+		device->sync_pending_length -= copied;
+		*n_read += copied;
+	}
+
+	while (*n_read < len) {
+		remaining = len - *n_read;
+
+		// Whole packets go straight into the caller's buffer. Only a
+		// tail shorter than a packet is bounced through our own buffer,
+		// since a bulk IN transfer must not be shorter than a packet.
+		if (remaining >= USB_PACKET_SIZE) {
+			chunk = remaining - (remaining % USB_PACKET_SIZE);
+			if ((uint32_t) chunk > device->transfer_buffer_size) {
+				chunk = device->transfer_buffer_size;
+			}
+			dest = buf + *n_read;
+		} else {
+			chunk = USB_PACKET_SIZE;
+			dest = device->buffer;
+		}
+
+		// libusb treats 0 as no timeout.
+		timeout = sync_time_left(deadline);
+		if (timeout == 0) {
+			return TIMSSDR_ERROR_TIMEOUT;
+		}
+
+		actual = 0;
+		result = libusb_bulk_transfer(
+			device->usb_device,
+			RX_ENDPOINT_ADDRESS,
+			dest,
+			chunk,
+			&actual,
+			timeout < 0 ? 0 : timeout);
+
+		if (dest == device->buffer) {
+			copied = actual < remaining ? actual : remaining;
+			memcpy(buf + *n_read, device->buffer, copied);
+			device->sync_pending_offset = copied;
+			device->sync_pending_length = actual - copied;
+			*n_read += copied;
+		} else {
+			*n_read += actual;
+		}
+
+		if (result == LIBUSB_ERROR_TIMEOUT) {
+			return TIMSSDR_ERROR_TIMEOUT;
+		} else if (result != LIBUSB_SUCCESS) {
+			last_libusb_error = result;
+			return TIMSSDR_ERROR_LIBUSB;
+		}
+
+		// A short transfer means the device has nothing more right now.
+		if (actual < chunk) {
+			break;
+		}
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_read_sync(
+	timssdr_device* device,
+	void* buf,
+	int len,
+	int* n_read,
+	int timeout_ms)
+{
+	int bytes_read = 0, result;
+	const int64_t deadline = sync_deadline(timeout_ms);
+
+	if (device == NULL || buf == NULL || len < 0) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (device->rx_filled != NULL && !device->rx_end_of_stream) {
+		if (device->rx_delivery_thread_started) {
+			return TIMSSDR_ERROR_BUSY;
+		}
+		result = read_sync_buffered(device, (uint8_t*) buf, len, &bytes_read, deadline);
+	} else if (device->transfers_setup) {
+		return TIMSSDR_ERROR_BUSY;
+	} else if (device->usb_device == NULL) {
+		return TIMSSDR_ERROR_NOT_SUPPORTED;
+	} else if ((result = activate_device(device)) == TIMSSDR_SUCCESS) {
+		result = read_sync_direct(device, (uint8_t*) buf, len, &bytes_read, deadline);
+	}
+
+	if (n_read != NULL) {
+		*n_read = bytes_read;
+	}
+	return result;
+}
+
+int timssdr_write_sync(
+	timssdr_device* device,
+	const void* buf,
+	int len,
+	int* n_written,
+	int timeout_ms)
+{
+	const uint8_t* src = (const uint8_t*) buf;
+	const int64_t deadline = sync_deadline(timeout_ms);
+	int written = 0, remaining, chunk, actual, timeout, result = LIBUSB_SUCCESS;
+	uint8_t* data;
+
+	if (device == NULL || buf == NULL || len < 0) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+	device = tx_side(device);
+
+	if (device->transfers_setup) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	if (device->usb_device == NULL) {
+		return TIMSSDR_ERROR_NOT_SUPPORTED;
+	}
+
+	result = activate_device(device);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+
+	while (written < len) {
+		remaining = len - written;
+
+		// As with TX streaming, the device expects whole packets. Send
+		// them straight from the caller's buffer and only copy a short
+		// tail, padded with zeroes.
+		if (remaining >= USB_PACKET_SIZE) {
+			chunk = remaining - (remaining % USB_PACKET_SIZE);
+			if ((uint32_t) chunk > device->transfer_buffer_size) {
+				chunk = device->transfer_buffer_size;
+			}
+			data = (uint8_t*) (src + written);
+		} else {
+			memcpy(device->buffer, src + written, remaining);
+			memset(device->buffer + remaining, 0, USB_PACKET_SIZE - remaining);
+			chunk = USB_PACKET_SIZE;
+			data = device->buffer;
+		}
+
+		timeout = sync_time_left(deadline);
+		if (timeout == 0) {
+			result = LIBUSB_ERROR_TIMEOUT;
+			break;
+		}
+
+		actual = 0;
+		result = libusb_bulk_transfer(
+			device->usb_device,
+			TX_ENDPOINT_ADDRESS,
+			data,
+			chunk,
+			&actual,
+			timeout < 0 ? 0 : timeout);
+		written += actual < remaining ? actual : remaining;
+
+		if (result != LIBUSB_SUCCESS) {
+			break;
+		}
+	}
+
+	// The bounce buffer is no longer holding received data.
+	device->sync_pending_length = 0;
+
+	if (n_written != NULL) {
+		*n_written = written;
+	}
+
+	if (result == LIBUSB_ERROR_TIMEOUT) {
+		return TIMSSDR_ERROR_TIMEOUT;
+	} else if (result != LIBUSB_SUCCESS) {
+		last_libusb_error = result;
+		return TIMSSDR_ERROR_LIBUSB;
+	}
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_get_rx_overruns(timssdr_device* device, uint64_t* overruns)
+{
+	if (device == NULL || overruns == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	pthread_mutex_lock(&device->transfer_lock);
+	*overruns = device->rx_overruns;
+	pthread_mutex_unlock(&device->transfer_lock);
+
+	return TIMSSDR_SUCCESS;
+}
+
+/* Add the transfer and callback counters of one device to stats. */
+static void add_stats(const struct timssdr_device_stats* s, timssdr_stats* stats)
+{
+	uint64_t max;
+	uint32_t peak;
+	int i;
+
+	stats->transfers_completed += atomic_load_explicit(&s->transfers_completed, memory_order_relaxed);
+	stats->bytes_transferred += atomic_load_explicit(&s->bytes_transferred, memory_order_relaxed);
+	stats->short_transfers += atomic_load_explicit(&s->short_transfers, memory_order_relaxed);
+	stats->zero_length_transfers += atomic_load_explicit(&s->zero_length_transfers, memory_order_relaxed);
+	stats->failed_transfers += atomic_load_explicit(&s->failed_transfers, memory_order_relaxed);
+	stats->resubmit_failures += atomic_load_explicit(&s->resubmit_failures, memory_order_relaxed);
+	stats->discontinuities += atomic_load_explicit(&s->discontinuities, memory_order_relaxed);
+	stats->psd_dropped += atomic_load_explicit(&s->psd_dropped, memory_order_relaxed);
+	stats->ddc_dropped += atomic_load_explicit(&s->ddc_dropped, memory_order_relaxed);
+	stats->paused_blocks += atomic_load_explicit(&s->paused_blocks, memory_order_relaxed);
+	stats->recovered_transfers += atomic_load_explicit(&s->recovered_transfers, memory_order_relaxed);
+	peak = (uint32_t) atomic_load_explicit(&s->peak_active_transfers, memory_order_relaxed);
+	if (peak > stats->peak_active_transfers) {
+		stats->peak_active_transfers = peak;
+	}
+	stats->callbacks += atomic_load_explicit(&s->callbacks, memory_order_relaxed);
+	stats->callback_time_total_ns += atomic_load_explicit(&s->callback_time_total_ns, memory_order_relaxed);
+	max = atomic_load_explicit(&s->callback_time_max_ns, memory_order_relaxed);
+	if (max > stats->callback_time_max_ns) {
+		stats->callback_time_max_ns = max;
+	}
+	for (i = 0; i < TIMSSDR_STATS_HISTOGRAM_BINS; i++) {
+		stats->callback_histogram[i] +=
+			atomic_load_explicit(&s->callback_histogram[i], memory_order_relaxed);
+	}
+}
+
+int timssdr_get_stats(timssdr_device* device, timssdr_stats* stats)
+{
+	struct timssdr_device_stats* s;
+	timssdr_device* peer;
+	uint64_t intervals, min;
+	double mean, variance;
+
+	if (device == NULL || stats == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	s = &device->stats;
+	peer = device->tx_peer;
+	memset(stats, 0, sizeof(*stats));
+	add_stats(s, stats);
+	if (peer != NULL) {
+		add_stats(&peer->stats, stats);
+	}
+
+	// Completion timing is kept per device, in full duplex this is RX.
+	intervals = atomic_load_explicit(&s->intervals, memory_order_relaxed);
+	if (intervals > 0) {
+		mean = (double) atomic_load_explicit(&s->interval_total_ns, memory_order_relaxed) / (double) intervals;
+		variance = atomic_load_explicit(&s->interval_total_sq_ns, memory_order_relaxed) / (double) intervals -
+			mean * mean;
+		min = atomic_load_explicit(&s->interval_min_ns, memory_order_relaxed);
+		stats->interval_mean_ns = (uint64_t) (mean + 0.5);
+		stats->interval_min_ns = min == UINT64_MAX ? 0 : min;
+		stats->interval_max_ns = atomic_load_explicit(&s->interval_max_ns, memory_order_relaxed);
+		stats->interval_jitter_ns = variance > 0.0 ? (uint64_t) (sqrt(variance) + 0.5) : 0;
+	}
+
+	pthread_mutex_lock(&device->transfer_lock);
+	stats->active_transfers = (uint32_t) device->active_transfers;
+	stats->rx_overruns = device->rx_overruns;
+	stats->tx_underruns = device->tx_underruns;
+	pthread_mutex_unlock(&device->transfer_lock);
+
+	if (peer != NULL) {
+		pthread_mutex_lock(&peer->transfer_lock);
+		stats->active_transfers += (uint32_t) peer->active_transfers;
+		stats->tx_underruns += peer->tx_underruns;
+		pthread_mutex_unlock(&peer->transfer_lock);
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_reset_stats(timssdr_device* device)
+{
+	if (device == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	stats_reset(device);
+	if (device->tx_peer != NULL) {
+		stats_reset(device->tx_peer);
+	}
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_start_tx(timssdr_device* device, timssdr_sample_block_cb_fn callback, void* tx_ctx)
+{
+	int result;
+	const uint8_t endpoint_address = TX_ENDPOINT_ADDRESS;
+	device = tx_side(device);
+	result = activate_device(device);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+	if (device->flush_transfer != NULL) {
+		device->flush = true;
+	}
+    device->tx_ctx = tx_ctx;
+    result = prepare_setup_transfers(device, endpoint_address, callback);
+	return result;
+}
+
+int timssdr_start_tx_buffered(timssdr_device* device, uint32_t queue_depth, void* tx_ctx)
+{
+	uint32_t transfer_index;
+	int result;
+
+	if (device == NULL || queue_depth < 2) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+	device = tx_side(device);
+
+	if (device->transfers_setup == true || device->tx_buffered || device->rx_buffered) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	result = activate_device(device);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+
+	if (setup_tx_pool(device, queue_depth) != TIMSSDR_SUCCESS) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	reset_stream_state(device);
+	device->tx_ctx = tx_ctx;
+	device->callback = NULL;
+
+	for (transfer_index = 0; transfer_index < device->transfer_count;
+	     transfer_index++) {
+		device->transfers[transfer_index]->endpoint = TX_ENDPOINT_ADDRESS;
+		device->transfers[transfer_index]->callback =
+			timssdr_libusb_buffered_tx_callback;
+	}
+
+	// Nothing goes out until the producer has filled a block, every
+	// transfer waits in the idle list until then.
+	pthread_mutex_lock(&device->transfer_lock);
+	device->flush = false;
+	device->streaming = true;
+	device->transfers_setup = true;
+	pthread_mutex_unlock(&device->transfer_lock);
+
+	return TIMSSDR_SUCCESS;
+}
+
+/* Queue the producer's current block and wake an idle transfer for it. */
+static void push_tx_block(timssdr_device* device)
+{
+	timssdr_queue_push(device->tx_filled, device->tx_current);
+	device->tx_current = NULL;
+
+	// Pairs with the fence in timssdr_libusb_buffered_tx_callback(): either
+	// we see the parked transfer here or it sees the block we just queued.
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&device->tx_waiting, memory_order_relaxed) > 0) {
+		pthread_mutex_lock(&device->transfer_lock);
+		kick_idle_tx_locked(device);
+		pthread_mutex_unlock(&device->transfer_lock);
+	}
+}
+
+int timssdr_tx_submit(
+	timssdr_device* device,
+	const void* samples,
+	int length,
+	int* n_submitted,
+	int timeout_ms)
+{
+	const uint8_t* src = (const uint8_t*) samples;
+	const int64_t deadline = sync_deadline(timeout_ms);
+	struct timssdr_block* block;
+	int submitted = 0, chunk, padded, result = TIMSSDR_SUCCESS;
+
+	if (device == NULL || length < 0 || (samples == NULL && length > 0)) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+	device = tx_side(device);
+
+	if (!device->tx_buffered) {
+		return TIMSSDR_ERROR_STREAMING_STOPPED;
+	}
+
+	while (submitted < length) {
+		if (!device->streaming) {
+			result = TIMSSDR_ERROR_STREAMING_STOPPED;
+			break;
+		}
+
+		if (device->tx_current == NULL) {
+			if (!timssdr_queue_pop_wait(
+				    device->tx_free,
+				    (void**) &block,
+				    sync_time_left(deadline))) {
+				result = TIMSSDR_ERROR_TIMEOUT;
+				break;
+			}
+			block->valid_length = 0;
+			device->tx_current = block;
+		}
+
+		block = device->tx_current;
+		chunk = (int) device->tx_block_size - block->valid_length;
+		if (chunk > length - submitted) {
+			chunk = length - submitted;
+		}
+		memcpy(block->data + block->valid_length, src + submitted, chunk);
+		block->valid_length += chunk;
+		submitted += chunk;
+
+		if ((uint32_t) block->valid_length == device->tx_block_size) {
+			push_tx_block(device);
+		}
+	}
+
+	// An empty submit sends what's left, padded to whole USB packets.
+	if (length == 0 && device->tx_current != NULL &&
+	    device->tx_current->valid_length > 0) {
+		block = device->tx_current;
+		padded = (block->valid_length + USB_PACKET_SIZE - 1) /
+			USB_PACKET_SIZE * USB_PACKET_SIZE;
+		memset(block->data + block->valid_length, 0, padded - block->valid_length);
+		block->valid_length = padded;
+		push_tx_block(device);
+	}
+
+	if (n_submitted != NULL) {
+		*n_submitted = submitted;
+	}
+	return result;
+}
+
+int timssdr_start_tx_from_file(
+	timssdr_device* device,
+	const char* const* paths,
+	int path_count,
+	const timssdr_replay_opts* opts)
+{
+	struct timssdr_replay* replay;
+	int i, result;
+	bool empty = true;
+
+	if (device == NULL || paths == NULL || path_count <= 0) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+	device = tx_side(device);
+
+	if (device->transfers_setup == true || device->replay != NULL) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	replay = (struct timssdr_replay*) calloc(1, sizeof(*replay));
+	if (replay == NULL) {
 		return TIMSSDR_ERROR_NO_MEM;
 	}
+	replay->files = (struct timssdr_replay_file*) calloc(
+		path_count,
+		sizeof(struct timssdr_replay_file));
+	if (replay->files == NULL) {
+		free(replay);
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+	device->replay = replay;
 
-	lib_device->usb_device = usb_device;
-	lib_device->transfers = NULL;
-	lib_device->callback = NULL;
-	lib_device->transfer_thread_started = false;
-	lib_device->streaming = false;
-	lib_device->do_exit = false;
-	lib_device->active_transfers = 0;
-	lib_device->flush = false;
-	lib_device->flush_transfer = NULL;
-	lib_device->flush_callback = NULL;
-	lib_device->flush_ctx = NULL;
-	lib_device->tx_completion_callback = NULL;
+	for (i = 0; i < path_count; i++) {
+		if (paths[i] == NULL) {
+			result = TIMSSDR_ERROR_INVALID_PARAM;
+		} else {
+			result = map_replay_file(paths[i], &replay->files[i]);
+		}
+		if (result != TIMSSDR_SUCCESS) {
+			finish_replay(device);
+			return result;
+		}
+		replay->file_count++;
+		if (replay->files[i].end > replay->files[i].start) {
+			empty = false;
+		}
+	}
+
+	if (empty) {
+		finish_replay(device);
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	replay->loop = opts != NULL && opts->loop;
+	// Start "before" the first file to find the first one with samples.
+	replay->file = -1;
+	replay_next_file(replay);
+
+	result = timssdr_start_tx(device, replay_tx_callback, NULL);
+	if (result != TIMSSDR_SUCCESS) {
+		finish_replay(device);
+	}
+	return result;
+}
+
+int timssdr_set_tx_block_complete_callback(timssdr_device* device, timssdr_tx_block_complete_cb_fn callback)
+{
+	device = tx_side(device);
+	device->tx_completion_callback = callback;
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_enable_tx_flush(timssdr_device* device, timssdr_flush_cb_fn callback, void* flush_ctx)
+{
+	device = tx_side(device);
+	device->flush_callback = callback;
+	device->flush_ctx = flush_ctx;
+
+	if (device->flush_transfer) {
+		return TIMSSDR_SUCCESS;
+	}
+
+	unsigned char* buffer = allocate_buffer_memory(
+		device,
+		DEVICE_BUFFER_SIZE,
+		&device->flush_buffer_source);
+	if (buffer == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	if ((device->flush_transfer = libusb_alloc_transfer(0)) == NULL) {
+		free_buffer_memory(device, buffer, DEVICE_BUFFER_SIZE, device->flush_buffer_source);
+		return TIMSSDR_ERROR_LIBUSB;
+	}
+
+	// Zeroed by allocate_buffer_memory(), and freed by free_flush_transfer().
+	libusb_fill_bulk_transfer(
+		device->flush_transfer,
+		device->usb_device,
+		TX_ENDPOINT_ADDRESS,
+		buffer,
+		DEVICE_BUFFER_SIZE,
+		timssdr_libusb_flush_callback,
+		device,
+		0);
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_disable_tx_flush(timssdr_device* device)
+{
+	device = tx_side(device);
+	free_flush_transfer(device);
+	device->flush_callback = NULL;
+	device->flush_ctx = NULL;
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_stop_tx(timssdr_device* device)
+{
+	int result;
+	device = tx_side(device);
+	result = cancel_transfers(device);
+	if (result != TIMSSDR_SUCCESS) {
+		return result;
+	}
+
+	finish_buffered_tx(device);
+	finish_replay(device);
+
+	// return timssdr_stop_cmd(device);
+	return result;
+}
+
+int timssdr_set_thread_attrs(
+	timssdr_device* device,
+	const int* cpus,
+	int cpu_count,
+	int sched_policy,
+	int priority)
+{
+#ifdef __linux__
+	cpu_set_t new_cpus, old_cpus;
+	int old_sched_policy, old_priority, result, i;
+	bool old_attrs_set, old_pinned;
+#endif
+
+	if (device == NULL || cpu_count < 0 || (cpu_count > 0 && cpus == NULL)) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+#ifdef __linux__
+	CPU_ZERO(&new_cpus);
+	for (i = 0; i < cpu_count; i++) {
+		if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+			return TIMSSDR_ERROR_INVALID_PARAM;
+		}
+		CPU_SET(cpus[i], &new_cpus);
+	}
+	switch (sched_policy) {
+	case SCHED_OTHER:
+	case SCHED_BATCH:
+	case SCHED_IDLE:
+	case SCHED_FIFO:
+	case SCHED_RR:
+		break;
+	default:
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+	if (priority < sched_get_priority_min(sched_policy) ||
+	    priority > sched_get_priority_max(sched_policy)) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	// Only a device with its own event thread has a thread to configure.
+	// The per-device flags are only set on activation, the mode can't change while open.
+	if (event_mode != TIMSSDR_EVENTS_PER_DEVICE || device->usb_device == NULL) {
+		return TIMSSDR_ERROR_NOT_SUPPORTED;
+	}
+
+	if (device->transfers_setup == true) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	old_cpus = device->thread_cpus;
+	old_pinned = device->thread_pinned;
+	old_sched_policy = device->thread_sched_policy;
+	old_priority = device->thread_priority;
+	old_attrs_set = device->thread_attrs_set;
+	device->thread_cpus = new_cpus;
+	device->thread_pinned = cpu_count > 0;
+	device->thread_sched_policy = sched_policy;
+	device->thread_priority = priority;
+	device->thread_attrs_set = true;
+
+	// Without a thread yet (TIMSSDR_OPEN_LAZY) transfer_threadproc() applies them.
+	if (device->transfer_thread_started) {
+		result = apply_thread_attrs(device, device->transfer_thread);
+		if (result != TIMSSDR_SUCCESS) {
+			// Keep what the thread actually runs with.
+			device->thread_cpus = old_cpus;
+			device->thread_pinned = old_pinned;
+			device->thread_sched_policy = old_sched_policy;
+			device->thread_priority = old_priority;
+			device->thread_attrs_set = old_attrs_set;
+			return result;
+		}
+	}
+
+	// Reallocate the transfer buffers on the memory node of the new CPUs.
+	// Transfers not allocated yet get there on activation.
+	result = TIMSSDR_SUCCESS;
+	if (device->thread_pinned && device->transfers != NULL) {
+		result = reallocate_transfers(
+			device,
+			device->transfer_count,
+			device->transfer_buffer_size,
+			device->zero_copy);
+	}
+
+	return result;
+#else
+	(void) cpus;
+	(void) sched_policy;
+	(void) priority;
+	return TIMSSDR_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+int timssdr_set_event_mode(enum timssdr_event_mode mode, int cpu)
+{
+	if (mode != TIMSSDR_EVENTS_PER_DEVICE && mode != TIMSSDR_EVENTS_SHARED &&
+	    mode != TIMSSDR_EVENTS_EXTERNAL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+#ifdef __linux__
+	// pin_event_thread() sets the CPU in a cpu_set_t.
+	if (cpu >= CPU_SETSIZE) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+#endif
+
+	if (open_devices != 0) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	event_mode = mode;
+	event_thread_cpu = cpu < 0 ? -1 : cpu;
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_set_open_mode(enum timssdr_open_mode mode)
+{
+	if (mode != TIMSSDR_OPEN_EAGER && mode != TIMSSDR_OPEN_LAZY) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	open_mode = mode;
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_get_pollfds(timssdr_pollfd* fds, int max_fds, int* fd_count)
+{
+	const struct libusb_pollfd** pollfds;
+	int count;
+
+	if (fd_count == NULL || max_fds < 0 || (fds == NULL && max_fds > 0)) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	pollfds = libusb_get_pollfds(g_libusb_context);
+	if (pollfds == NULL) {
+		return TIMSSDR_ERROR_NOT_SUPPORTED;
+	}
+
+	for (count = 0; pollfds[count] != NULL; count++) {
+		if (count < max_fds) {
+			fds[count].fd = pollfds[count]->fd;
+			fds[count].events = pollfds[count]->events;
+		}
+	}
+	libusb_free_pollfds(pollfds);
+
+	*fd_count = count;
+	return TIMSSDR_SUCCESS;
+}
+
+static void pollfd_added_trampoline(int fd, short events, void* user_data)
+{
+	(void) user_data;
+	if (pollfd_added_callback != NULL) {
+		pollfd_added_callback(fd, events, pollfd_notifier_ctx);
+	}
+}
+
+static void pollfd_removed_trampoline(int fd, void* user_data)
+{
+	(void) user_data;
+	if (pollfd_removed_callback != NULL) {
+		pollfd_removed_callback(fd, pollfd_notifier_ctx);
+	}
+}
+
+int timssdr_set_pollfd_notifiers(
+	timssdr_pollfd_added_cb_fn added_cb,
+	timssdr_pollfd_removed_cb_fn removed_cb,
+	void* ctx)
+{
+	pollfd_added_callback = added_cb;
+	pollfd_removed_callback = removed_cb;
+	pollfd_notifier_ctx = ctx;
+
+	if (added_cb == NULL && removed_cb == NULL) {
+		libusb_set_pollfd_notifiers(g_libusb_context, NULL, NULL, NULL);
+	} else {
+		libusb_set_pollfd_notifiers(
+			g_libusb_context,
+			pollfd_added_trampoline,
+			pollfd_removed_trampoline,
+			NULL);
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_get_next_timeout(int* timeout_ms)
+{
+	struct timeval timeout;
+	int result;
+
+	if (timeout_ms == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	result = libusb_get_next_timeout(g_libusb_context, &timeout);
+	if (result < 0) {
+		last_libusb_error = result;
+		return TIMSSDR_ERROR_LIBUSB;
+	}
+
+	if (result == 0) {
+		// No libusb timeout pending, the fds alone decide.
+		*timeout_ms = -1;
+	} else {
+		// Round up, waking early would just spin.
+		*timeout_ms = (int) (timeout.tv_sec * 1000 + (timeout.tv_usec + 999) / 1000);
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_handle_events(int timeout_ms)
+{
+	struct timeval timeout;
+	int result;
+
+	if (timeout_ms < 0) {
+		result = libusb_handle_events_completed(g_libusb_context, NULL);
+	} else {
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_usec = (timeout_ms % 1000) * 1000;
+		result = libusb_handle_events_timeout_completed(g_libusb_context, &timeout, NULL);
+	}
+
+	if (result != LIBUSB_SUCCESS && result != LIBUSB_ERROR_INTERRUPTED) {
+		last_libusb_error = result;
+		return TIMSSDR_ERROR_LIBUSB;
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_set_transfer_config(
+	timssdr_device* device,
+	uint32_t transfer_count,
+	uint32_t transfer_buffer_size)
+{
+	if (device == NULL || transfer_count == 0 || transfer_buffer_size == 0 ||
+	    transfer_buffer_size > MAX_TRANSFER_BUFFER_SIZE ||
+	    (transfer_buffer_size % TRANSFER_BUFFER_ALIGNMENT) != 0 ||
+	    ((uint64_t) transfer_count * transfer_buffer_size) > SIZE_MAX) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (device->transfers_setup == true ||
+	    (device->tx_peer != NULL && device->tx_peer->transfers_setup == true)) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	if (device->tx_peer != NULL) {
+		int result = timssdr_set_transfer_config(
+			device->tx_peer,
+			transfer_count,
+			transfer_buffer_size);
+		if (result != TIMSSDR_SUCCESS) {
+			return result;
+		}
+	}
+
+	if (transfer_count == device->transfer_count &&
+	    transfer_buffer_size == device->transfer_buffer_size &&
+	    device->transfers != NULL) {
+		return TIMSSDR_SUCCESS;
+	}
+
+	return reallocate_transfers(
+		device,
+		transfer_count,
+		transfer_buffer_size,
+		device->zero_copy);
+}
+
+int timssdr_get_transfer_config(
+	timssdr_device* device,
+	uint32_t* transfer_count,
+	uint32_t* transfer_buffer_size)
+{
+	if (device == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (transfer_count != NULL) {
+		*transfer_count = device->transfer_count;
+	}
+	if (transfer_buffer_size != NULL) {
+		*transfer_buffer_size = device->transfer_buffer_size;
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_set_rx_conversion(
+	timssdr_device* device,
+	enum timssdr_sample_format device_format,
+	enum timssdr_sample_format output_format,
+	void* buffer,
+	size_t buffer_size)
+{
+	if (device == NULL ||
+	    (device_format != TIMSSDR_FORMAT_S8 && device_format != TIMSSDR_FORMAT_U8) ||
+	    (output_format != device_format && output_format != TIMSSDR_FORMAT_CS16 &&
+	     output_format != TIMSSDR_FORMAT_CF32)) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
 
-	result = pthread_mutex_init(&lib_device->transfer_lock, NULL);
-	if (result != 0) {
-		free(lib_device);
-		libusb_release_interface(usb_device, 0);
-		libusb_close(usb_device);
-		return TIMSSDR_ERROR_THREAD;
+	if (device->transfers_setup == true) {
+		return TIMSSDR_ERROR_BUSY;
 	}
 
-	result = pthread_cond_init(&lib_device->all_finished_cv, NULL);
-	if (result != 0) {
-		free(lib_device);
-		libusb_release_interface(usb_device, 0);
-		libusb_close(usb_device);
-		return TIMSSDR_ERROR_THREAD;
+	if (device->rx_converted_owned) {
+		free(device->rx_converted);
 	}
+	device->rx_converted = NULL;
+	device->rx_converted_size = 0;
+	device->rx_converted_owned = false;
+	device->rx_device_format = device_format;
+	device->rx_output_format = device_format;
 
-	result = allocate_transfers(lib_device);
-	if (result != 0) {
-		free(lib_device);
-		libusb_release_interface(usb_device, 0);
-		libusb_close(usb_device);
-		return TIMSSDR_ERROR_NO_MEM;
+	if (output_format == device_format) {
+		return TIMSSDR_SUCCESS;
 	}
 
-	result = create_transfer_thread(lib_device);
-	if (result != 0) {
-		free(lib_device);
-		libusb_release_interface(usb_device, 0);
-		libusb_close(usb_device);
-		return result;
+	if (buffer == NULL) {
+		buffer_size = (size_t) device->transfer_buffer_size / 2 *
+			timssdr_sample_size(output_format);
+		buffer = malloc(buffer_size);
+		if (buffer == NULL) {
+			return TIMSSDR_ERROR_NO_MEM;
+		}
+		device->rx_converted_owned = true;
 	}
 
-	*device = lib_device;
-	open_devices++;
+	device->rx_converted = buffer;
+	device->rx_converted_size = buffer_size;
+	device->rx_output_format = output_format;
 
 	return TIMSSDR_SUCCESS;
 }
 
-int timssdr_open(timssdr_device** device)
+int timssdr_set_psd(
+	timssdr_device* device,
+	const timssdr_psd_config* config,
+	timssdr_psd_cb_fn callback,
+	void* psd_ctx)
 {
-	libusb_device_handle* usb_device;
+	struct timssdr_psd* psd = NULL;
+	int result;
 
 	if (device == NULL) {
 		return TIMSSDR_ERROR_INVALID_PARAM;
 	}
 
-	usb_device = libusb_open_device_with_vid_pid(
-		g_libusb_context,
-		timssdr_usb_vid,
-		timssdr_usb_pid);
+	if (device->transfers_setup == true) {
+		return TIMSSDR_ERROR_BUSY;
+	}
 
-	if (usb_device == NULL) {
-		return TIMSSDR_ERROR_NOT_FOUND;
+	if (config != NULL) {
+		result = timssdr_psd_create(
+			config,
+			device->rx_device_format,
+			device,
+			callback,
+			psd_ctx,
+			&psd);
+		if (result != TIMSSDR_SUCCESS) {
+			return result;
+		}
 	}
 
-	return timssdr_open_setup(usb_device, device);
+	timssdr_psd_destroy(device->psd);
+	device->psd = psd;
+
+	return TIMSSDR_SUCCESS;
 }
 
-int timssdr_open_by_serial(const char* const desired_serial_number, timssdr_device** device)
+int timssdr_set_ddc(timssdr_device* device, const timssdr_ddc_config* config)
 {
-	libusb_device_handle* usb_device;
-
-	if (desired_serial_number == NULL) {
-		return timssdr_open(device);
-	}
+	struct timssdr_ddc* ddc = NULL;
+	int result;
 
 	if (device == NULL) {
 		return TIMSSDR_ERROR_INVALID_PARAM;
 	}
 
-	usb_device = timssdr_open_usb(desired_serial_number);
+	if (device->transfers_setup == true) {
+		return TIMSSDR_ERROR_BUSY;
+	}
 
-	if (usb_device == NULL) {
-		return TIMSSDR_ERROR_NOT_FOUND;
+	if (config != NULL) {
+		result = timssdr_ddc_create(config, device->rx_device_format, device, &ddc);
+		if (result != TIMSSDR_SUCCESS) {
+			return result;
+		}
 	}
 
-	return timssdr_open_setup(usb_device, device);
+	timssdr_ddc_destroy(device->ddc);
+	device->ddc = ddc;
+
+	return TIMSSDR_SUCCESS;
 }
 
-int timssdr_device_list_open(timssdr_device_list_t* list, int idx, timssdr_device** device)
+int timssdr_set_stream_rate(timssdr_device* device, double sample_rate)
 {
-	libusb_device_handle* usb_device;
-	int i, result;
-
-	if (device == NULL || list == NULL || idx < 0 || idx >= list->devicecount) {
+	// Also rejects NaN, which would poison the gap estimation.
+	if (device == NULL || !(sample_rate >= 0) || isinf(sample_rate)) {
 		return TIMSSDR_ERROR_INVALID_PARAM;
 	}
 
-	i = list->usb_device_index[idx];
+	pthread_mutex_lock(&device->transfer_lock);
+	device->stream_rate = sample_rate;
+	device->device_busy_until_ns = 0;
+	pthread_mutex_unlock(&device->transfer_lock);
 
-	result = libusb_open(list->usb_devices[i], &usb_device);
-	if (result != 0) {
-		usb_device = NULL;
-		last_libusb_error = result;
-		return TIMSSDR_ERROR_LIBUSB;
+	if (device->tx_peer != NULL) {
+		return timssdr_set_stream_rate(device->tx_peer, sample_rate);
 	}
 
-	return timssdr_open_setup(usb_device, device);
+	return TIMSSDR_SUCCESS;
 }
 
-int timssdr_close(timssdr_device* device)
+/* The held transfer that failed first, transfer_count if there is none. */
+static uint32_t next_recovery_locked(timssdr_device* device)
 {
-	int result1, result2;
-
-	result1 = TIMSSDR_SUCCESS;
-	result2 = TIMSSDR_SUCCESS;
+	uint32_t i, next = device->transfer_count;
 
-	if (device != NULL) {
-		/*
-		 * Finally kill the transfer thread, which will
-		 * also cancel any pending transmit/receive transfers.
-		 */
-		result2 = kill_transfer_thread(device);
-		if (device->usb_device != NULL) {
-			libusb_release_interface(device->usb_device, 0);
-			libusb_close(device->usb_device);
-			device->usb_device = NULL;
+	for (i = 0; i < device->transfer_count; i++) {
+		if (device->transfer_recovery[i].pending &&
+		    (next == device->transfer_count ||
+		     device->transfer_recovery[i].order < device->transfer_recovery[next].order)) {
+			next = i;
 		}
-
-		free_transfers(device);
-
-		pthread_mutex_destroy(&device->transfer_lock);
-		pthread_cond_destroy(&device->all_finished_cv);
-
-		free(device);
 	}
-	open_devices--;
+	return next;
+}
 
-	if (result2 != TIMSSDR_SUCCESS) {
-		return result2;
+/* A held transfer won't be resubmitted, end it like its callback would have. */
+static void end_held_transfer_locked(timssdr_device* device, struct transfer_recovery* recovery)
+{
+	recovery->pending = false;
+	device->recovery_pending--;
+	device->streaming = false;
+	if (release_transfer_locked(device) && device->rx_buffered) {
+		post_rx_end_locked(device);
 	}
-	return result1;
 }
 
-int timssdr_is_streaming(timssdr_device* device)
+/*
+ * Gets held transfers going again, see recover_transfer_locked(). Clearing
+ * a halt is a synchronous control transfer, which can't be done from the
+ * event thread, and retries back off without holding up completions of
+ * the transfers that are still in flight.
+ */
+static void* recovery_threadproc(void* arg)
 {
-	/* return timssdr is streaming only when streaming, transfer_thread_started are true and do_exit equal false */
+	timssdr_device* device = (timssdr_device*) arg;
+	struct libusb_transfer* usb_transfer;
+	struct transfer_recovery* recovery;
+	timssdr_gap_event event;
+	uint32_t index, attempts;
+	bool stalled;
+	int result;
 
-	if ((device->transfer_thread_started == true) && (device->streaming == true) &&
-	    (device->do_exit == false)) {
-		return TIMSSDR_TRUE;
-	} else {
-		if (device->transfer_thread_started == false) {
-			return TIMSSDR_ERROR_STREAMING_THREAD_ERR;
+	pthread_mutex_lock(&device->transfer_lock);
+	while (!device->recovery_exit) {
+		if (device->recovery_pending == 0) {
+			pthread_cond_wait(&device->recovery_cv, &device->transfer_lock);
+			continue;
 		}
 
-		if (device->streaming == false) {
-			return TIMSSDR_ERROR_STREAMING_STOPPED;
+		index = next_recovery_locked(device);
+		recovery = &device->transfer_recovery[index];
+		usb_transfer = device->transfers[index];
+		attempts = ++recovery->attempts;
+		stalled = recovery->status == LIBUSB_TRANSFER_STALL;
+		pthread_mutex_unlock(&device->transfer_lock);
+
+		if (attempts > 1) {
+			uint32_t backoff = RECOVERY_BACKOFF_US << (attempts < 8 ? attempts - 2 : 6);
+			usleep(backoff < RECOVERY_BACKOFF_MAX_US ? backoff : RECOVERY_BACKOFF_MAX_US);
+		}
+		if (stalled && device->usb_device != NULL) {
+			libusb_clear_halt(device->usb_device, usb_transfer->endpoint);
 		}
 
-		return TIMSSDR_ERROR_STREAMING_EXIT_CALLED;
+		pthread_mutex_lock(&device->transfer_lock);
+		if (!device->streaming || !device->transfers_setup) {
+			// Stopped meanwhile.
+			end_held_transfer_locked(device, recovery);
+			continue;
+		}
+
+		if (device->rx_buffered) {
+			usb_transfer->length = device->rx_block_size;
+		}
+		if (device->rx_shm) {
+			claim_shm_slot_locked(device, usb_transfer);
+		}
+		note_submit_locked(device, usb_transfer);
+		result = submit_transfer(device, usb_transfer);
+		if (result != LIBUSB_SUCCESS && device->rx_shm) {
+			unclaim_shm_slot_locked(device);
+		}
+		if (result != LIBUSB_SUCCESS && result != LIBUSB_ERROR_NO_DEVICE &&
+		    attempts < device->recovery_max_attempts) {
+			recovery->status = submit_error_status(result);
+			continue;
+		}
+
+		event.device = device->owner;
+		event.status = recovery->status;
+		event.sample_index = recovery->sample_index;
+		event.lost_samples = recovery->lost_samples;
+		event.attempts = attempts;
+		event.recovered = result == LIBUSB_SUCCESS;
+		event.gap_ctx = device->gap_ctx;
+		if (result == LIBUSB_SUCCESS) {
+			recovery->pending = false;
+			device->recovery_pending--;
+			STATS_ADD(device, recovered_transfers, 1);
+		} else {
+			last_libusb_error = result;
+			end_held_transfer_locked(device, recovery);
+		}
+
+		if (device->gap_callback != NULL) {
+			pthread_mutex_unlock(&device->transfer_lock);
+			device->gap_callback(&event);
+			pthread_mutex_lock(&device->transfer_lock);
+		}
 	}
+	pthread_mutex_unlock(&device->transfer_lock);
+
+	return NULL;
 }
 
-int timssdr_start_rx(timssdr_device* device, timssdr_sample_block_cb_fn callback, void* rx_ctx)
+static void stop_recovery_thread(timssdr_device* device)
 {
-	int result;
-	const uint8_t endpoint_address = RX_ENDPOINT_ADDRESS;
-	device->rx_ctx = rx_ctx;
-    result = prepare_setup_transfers(device, endpoint_address, callback);
-	return result;
+	if (!device->recovery) {
+		return;
+	}
+
+	pthread_mutex_lock(&device->transfer_lock);
+	device->recovery_exit = true;
+	pthread_cond_signal(&device->recovery_cv);
+	pthread_mutex_unlock(&device->transfer_lock);
+	pthread_join(device->recovery_thread, NULL);
+	pthread_cond_destroy(&device->recovery_cv);
+	device->recovery = false;
 }
 
-int timssdr_stop_rx(timssdr_device* device)
+int timssdr_set_error_recovery(timssdr_device* device, const timssdr_recovery_opts* opts)
 {
-	int result;
+	if (device == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
 
-	result = cancel_transfers(device);
-	if (result != TIMSSDR_SUCCESS) {
-		return result;
+	if (device->transfers_setup == true) {
+		return TIMSSDR_ERROR_BUSY;
 	}
 
-	// return timssdr_stop_cmd(device);
-	return result;
-}
+	if (opts == NULL) {
+		stop_recovery_thread(device);
+		return TIMSSDR_SUCCESS;
+	}
 
-int timssdr_start_tx(timssdr_device* device, timssdr_sample_block_cb_fn callback, void* tx_ctx)
-{
-	int result;
-	const uint8_t endpoint_address = TX_ENDPOINT_ADDRESS;
-	if (device->flush_transfer != NULL) {
-		device->flush = true;
+	device->recovery_max_attempts = opts->max_attempts ? opts->max_attempts : DEFAULT_RECOVERY_ATTEMPTS;
+	device->gap_callback = opts->gap_callback;
+	device->gap_ctx = opts->gap_ctx;
+	if (device->recovery) {
+		return TIMSSDR_SUCCESS;
 	}
-    device->tx_ctx = tx_ctx;
-    result = prepare_setup_transfers(device, endpoint_address, callback);
-	return result;
-}
 
-int timssdr_set_tx_block_complete_callback(timssdr_device* device, timssdr_tx_block_complete_cb_fn callback)
-{
-	device->tx_completion_callback = callback;
+	if (pthread_cond_init(&device->recovery_cv, NULL) != 0) {
+		return TIMSSDR_ERROR_THREAD;
+	}
+	device->recovery_exit = false;
+	if (pthread_create(&device->recovery_thread, NULL, recovery_threadproc, device) != 0) {
+		pthread_cond_destroy(&device->recovery_cv);
+		return TIMSSDR_ERROR_THREAD;
+	}
+	device->recovery = true;
+
 	return TIMSSDR_SUCCESS;
 }
 
-int timssdr_enable_tx_flush(timssdr_device* device, timssdr_flush_cb_fn callback, void* flush_ctx)
+int timssdr_set_zero_copy(timssdr_device* device, int enable)
 {
-	device->flush_callback = callback;
-	device->flush_ctx = flush_ctx;
+	int result;
 
-	if (device->flush_transfer) {
-		return TIMSSDR_SUCCESS;
+	if (device == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
 	}
 
-	if ((device->flush_transfer = libusb_alloc_transfer(0)) == NULL) {
-		return TIMSSDR_ERROR_LIBUSB;
+	if (device->transfers_setup == true ||
+	    (device->tx_peer != NULL && device->tx_peer->transfers_setup == true)) {
+		return TIMSSDR_ERROR_BUSY;
 	}
 
-	libusb_fill_bulk_transfer(
-		device->flush_transfer,
-		device->usb_device,
-		TX_ENDPOINT_ADDRESS,
-		calloc(1, DEVICE_BUFFER_SIZE),
-		DEVICE_BUFFER_SIZE,
-		timssdr_libusb_flush_callback,
-		device,
-		0);
+	if (device->tx_peer != NULL) {
+		// Device memory is reported on by the owner's own buffers below.
+		result = timssdr_set_zero_copy(device->tx_peer, enable);
+		if (result != TIMSSDR_SUCCESS && result != TIMSSDR_ERROR_NOT_SUPPORTED) {
+			return result;
+		}
+	}
+
+	if ((bool) (enable != 0) != device->zero_copy || device->transfers == NULL) {
+		result = reallocate_transfers(
+			device,
+			device->transfer_count,
+			device->transfer_buffer_size,
+			enable != 0);
+		if (result != TIMSSDR_SUCCESS) {
+			return result;
+		}
+	}
 
-	device->flush_transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	if (enable && device->buffer_source != BUFFER_DEV_MEM) {
+		return TIMSSDR_ERROR_NOT_SUPPORTED;
+	}
 
 	return TIMSSDR_SUCCESS;
 }
 
-int timssdr_disable_tx_flush(timssdr_device* device)
+int timssdr_set_hugepages(timssdr_device* device, int enable)
 {
-	libusb_free_transfer(device->flush_transfer);
-	device->flush_transfer = NULL;
-	device->flush_callback = NULL;
-	device->flush_ctx = NULL;
+	int result;
+
+	if (device == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (device->transfers_setup == true || device->rx_buffered || device->tx_buffered ||
+	    device->replay != NULL ||
+	    (device->tx_peer != NULL && device->tx_peer->transfers_setup == true)) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	if (device->tx_peer != NULL) {
+		result = timssdr_set_hugepages(device->tx_peer, enable);
+		if (result != TIMSSDR_SUCCESS && result != TIMSSDR_ERROR_NOT_SUPPORTED) {
+			return result;
+		}
+	}
+
+	if ((bool) (enable != 0) != device->hugepages) {
+		device->hugepages = enable != 0;
+		// The block pools are allocated again by the next start, from the new memory.
+		free_rx_pool(device);
+		free_tx_pool(device);
+		result = reallocate_transfers(
+			device,
+			device->transfer_count,
+			device->transfer_buffer_size,
+			device->zero_copy);
+		if (result != TIMSSDR_SUCCESS) {
+			return result;
+		}
+	}
+
+	if (enable && device->buffer_source == BUFFER_HEAP) {
+		return TIMSSDR_ERROR_NOT_SUPPORTED;
+	}
 
 	return TIMSSDR_SUCCESS;
 }
 
-int timssdr_stop_tx(timssdr_device* device)
+int timssdr_set_full_duplex(timssdr_device* device, int enable)
 {
-	int result;
-	result = cancel_transfers(device);
-	if (result != TIMSSDR_SUCCESS) {
-		return result;
+	timssdr_device* peer;
+
+	if (device == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
 	}
 
-	// return timssdr_stop_cmd(device);
-	return result;
+	peer = device->tx_peer;
+	if (device->transfers_setup == true || device->rx_buffered || device->tx_buffered ||
+	    device->replay != NULL || (peer != NULL && peer->transfers_setup == true)) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	if (enable && peer == NULL) {
+		return create_tx_peer(device);
+	}
+	if (!enable) {
+		free_tx_peer(device);
+	}
+
+	return TIMSSDR_SUCCESS;
 }
 
 const char* timssdr_error_name(enum timssdr_error errcode)
@@ -1035,6 +6155,18 @@ const char* timssdr_error_name(enum timssdr_error errcode)
 	case TIMSSDR_ERROR_OTHER:
 		return "unspecified error";
 
+	case TIMSSDR_ERROR_NOT_SUPPORTED:
+		return "feature not supported";
+
+	case TIMSSDR_ERROR_TIMEOUT:
+		return "operation timed out";
+
+	case TIMSSDR_ERROR_FILE:
+		return "file I/O error";
+
+	case TIMSSDR_ERROR_NETWORK:
+		return "network error";
+
 	default:
 		return "unknown error code";
 	}
@@ -0,0 +1,506 @@
+#include "timssdr.h"
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define CONVERT_X86 1
+	#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	#define CONVERT_NEON 1
+	#include <arm_neon.h>
+#endif
+
+/*
+ * Sample format conversion kernels.
+ *
+ * All kernels work element-wise on the interleaved I/Q scalars, so a count
+ * of n complex samples is 2 * n scalars. Unsigned 8 bit samples are offset
+ * binary (0x80 is zero), which is a signed sample with the top bit flipped,
+ * so the u8 variants only XOR with 0x80 around the signed kernels.
+ *
+ * Scaling follows the usual conventions: 8 bit samples map to [-1, 1) as
+ * float by dividing by 128 and to full scale int16 by shifting left by 8.
+ * The narrowing direction rounds to nearest and saturates.
+ */
+
+#define S8_TO_F32_SCALE (1.0f / 128.0f)
+#define F32_TO_S8_SCALE 128.0f
+
+typedef void (*widen_fn)(const uint8_t* src, void* dst, size_t n, uint8_t flip);
+typedef void (*narrow_fn)(const void* src, uint8_t* dst, size_t n, uint8_t flip);
+
+struct convert_kernels {
+	const char* name;
+	widen_fn s8_to_f32;
+	widen_fn s8_to_s16;
+	narrow_fn f32_to_s8;
+	narrow_fn s16_to_s8;
+};
+
+/* Scalar versions, also used for the tails of the vector kernels */
+
+static void s8_to_f32_scalar(const uint8_t* src, void* dst, size_t n, uint8_t flip)
+{
+	float* out = (float*) dst;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		out[i] = (float) (int8_t) (src[i] ^ flip) * S8_TO_F32_SCALE;
+	}
+}
+
+static void s8_to_s16_scalar(const uint8_t* src, void* dst, size_t n, uint8_t flip)
+{
+	int16_t* out = (int16_t*) dst;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		out[i] = (int16_t) ((int16_t) (int8_t) (src[i] ^ flip) * 256);
+	}
+}
+
+static void f32_to_s8_scalar(const void* src, uint8_t* dst, size_t n, uint8_t flip)
+{
+	const float* in = (const float*) src;
+	float v;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		v = in[i] * F32_TO_S8_SCALE;
+		if (v > 127.0f) {
+			v = 127.0f;
+		} else if (!(v >= -128.0f)) { /* also catches NaN */
+			v = -128.0f;
+		}
+		dst[i] = (uint8_t) (int8_t) lrintf(v) ^ flip;
+	}
+}
+
+static void s16_to_s8_scalar(const void* src, uint8_t* dst, size_t n, uint8_t flip)
+{
+	const int16_t* in = (const int16_t*) src;
+
+	int v;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		v = (in[i] + 0x80) >> 8;
+		if (v > 127) {
+			v = 127;
+		}
+		dst[i] = (uint8_t) (int8_t) v ^ flip;
+	}
+}
+
+static const struct convert_kernels scalar_kernels = {
+	"scalar",
+	s8_to_f32_scalar,
+	s8_to_s16_scalar,
+	f32_to_s8_scalar,
+	s16_to_s8_scalar,
+};
+
+#ifdef CONVERT_X86
+
+/* SSE2, 16 scalars per iteration */
+
+__attribute__((target("sse2"))) static void
+s8_to_f32_sse2(const uint8_t* src, void* dst, size_t n, uint8_t flip)
+{
+	float* out = (float*) dst;
+	const __m128i flip_v = _mm_set1_epi8((char) flip);
+	const __m128 scale = _mm_set1_ps(S8_TO_F32_SCALE);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (src + i)), flip_v);
+		// Sign extend by placing each byte in the top of a wider lane.
+		__m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+		__m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+		__m128i w0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16);
+		__m128i w1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16);
+		__m128i w2 = _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16);
+		__m128i w3 = _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16);
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(w0), scale));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(w1), scale));
+		_mm_storeu_ps(out + i + 8, _mm_mul_ps(_mm_cvtepi32_ps(w2), scale));
+		_mm_storeu_ps(out + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(w3), scale));
+	}
+	s8_to_f32_scalar(src + i, out + i, n - i, flip);
+}
+
+__attribute__((target("sse2"))) static void
+s8_to_s16_sse2(const uint8_t* src, void* dst, size_t n, uint8_t flip)
+{
+	int16_t* out = (int16_t*) dst;
+	const __m128i flip_v = _mm_set1_epi8((char) flip);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (src + i)), flip_v);
+		// Byte in the high half of each 16 bit lane is the sample << 8.
+		_mm_storeu_si128((__m128i*) (out + i), _mm_unpacklo_epi8(zero, v));
+		_mm_storeu_si128((__m128i*) (out + i + 8), _mm_unpackhi_epi8(zero, v));
+	}
+	s8_to_s16_scalar(src + i, out + i, n - i, flip);
+}
+
+__attribute__((target("sse2"))) static void
+f32_to_s8_sse2(const void* src, uint8_t* dst, size_t n, uint8_t flip)
+{
+	const float* in = (const float*) src;
+	const __m128i flip_v = _mm_set1_epi8((char) flip);
+	const __m128 scale = _mm_set1_ps(F32_TO_S8_SCALE);
+	const __m128 lo = _mm_set1_ps(-128.0f);
+	const __m128 hi = _mm_set1_ps(127.0f);
+	size_t i;
+
+	// Clamp before converting, out of range values would become INT_MIN.
+	// max() first so that NaN ends up at -128 like the scalar version.
+#define F32_TO_S32_SSE2(p) \
+	_mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(p), scale), lo), hi))
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i w0 = F32_TO_S32_SSE2(in + i);
+		__m128i w1 = F32_TO_S32_SSE2(in + i + 4);
+		__m128i w2 = F32_TO_S32_SSE2(in + i + 8);
+		__m128i w3 = F32_TO_S32_SSE2(in + i + 12);
+		__m128i v = _mm_packs_epi16(_mm_packs_epi32(w0, w1), _mm_packs_epi32(w2, w3));
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_xor_si128(v, flip_v));
+	}
+#undef F32_TO_S32_SSE2
+	f32_to_s8_scalar(in + i, dst + i, n - i, flip);
+}
+
+__attribute__((target("sse2"))) static void
+s16_to_s8_sse2(const void* src, uint8_t* dst, size_t n, uint8_t flip)
+{
+	const int16_t* in = (const int16_t*) src;
+	const __m128i flip_v = _mm_set1_epi8((char) flip);
+	const __m128i half = _mm_set1_epi16(0x80);
+	size_t i;
+
+	// The saturating add rounds, values that would round up to 128 stop at 127.
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i a = _mm_srai_epi16(_mm_adds_epi16(_mm_loadu_si128((const __m128i*) (in + i)), half), 8);
+		__m128i b = _mm_srai_epi16(_mm_adds_epi16(_mm_loadu_si128((const __m128i*) (in + i + 8)), half), 8);
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_xor_si128(_mm_packs_epi16(a, b), flip_v));
+	}
+	s16_to_s8_scalar(in + i, dst + i, n - i, flip);
+}
+
+static const struct convert_kernels sse2_kernels = {
+	"sse2",
+	s8_to_f32_sse2,
+	s8_to_s16_sse2,
+	f32_to_s8_sse2,
+	s16_to_s8_sse2,
+};
+
+/* AVX2, 32 scalars per iteration */
+
+__attribute__((target("avx2"))) static void
+s8_to_f32_avx2(const uint8_t* src, void* dst, size_t n, uint8_t flip)
+{
+	float* out = (float*) dst;
+	const __m128i flip_v = _mm_set1_epi8((char) flip);
+	const __m256 scale = _mm256_set1_ps(S8_TO_F32_SCALE);
+	size_t i, j;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		for (j = 0; j < 32; j += 8) {
+			__m128i v = _mm_xor_si128(
+				_mm_loadl_epi64((const __m128i*) (src + i + j)),
+				flip_v);
+			__m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(v));
+			_mm256_storeu_ps(out + i + j, _mm256_mul_ps(f, scale));
+		}
+	}
+	s8_to_f32_sse2(src + i, out + i, n - i, flip);
+}
+
+__attribute__((target("avx2"))) static void
+s8_to_s16_avx2(const uint8_t* src, void* dst, size_t n, uint8_t flip)
+{
+	int16_t* out = (int16_t*) dst;
+	const __m128i flip_v = _mm_set1_epi8((char) flip);
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (src + i)), flip_v);
+		__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (src + i + 16)), flip_v);
+		_mm256_storeu_si256(
+			(__m256i*) (out + i),
+			_mm256_slli_epi16(_mm256_cvtepi8_epi16(a), 8));
+		_mm256_storeu_si256(
+			(__m256i*) (out + i + 16),
+			_mm256_slli_epi16(_mm256_cvtepi8_epi16(b), 8));
+	}
+	s8_to_s16_sse2(src + i, out + i, n - i, flip);
+}
+
+__attribute__((target("avx2"))) static void
+f32_to_s8_avx2(const void* src, uint8_t* dst, size_t n, uint8_t flip)
+{
+	const float* in = (const float*) src;
+	const __m256i flip_v = _mm256_set1_epi8((char) flip);
+	const __m256 scale = _mm256_set1_ps(F32_TO_S8_SCALE);
+	const __m256 lo = _mm256_set1_ps(-128.0f);
+	const __m256 hi = _mm256_set1_ps(127.0f);
+	// The packs work within 128 bit lanes, this puts the dwords back in order.
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	size_t i;
+
+#define F32_TO_S32_AVX2(p) \
+	_mm256_cvtps_epi32( \
+		_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(p), scale), lo), hi))
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i w0 = F32_TO_S32_AVX2(in + i);
+		__m256i w1 = F32_TO_S32_AVX2(in + i + 8);
+		__m256i w2 = F32_TO_S32_AVX2(in + i + 16);
+		__m256i w3 = F32_TO_S32_AVX2(in + i + 24);
+		__m256i v = _mm256_packs_epi16(
+			_mm256_packs_epi32(w0, w1),
+			_mm256_packs_epi32(w2, w3));
+		v = _mm256_permutevar8x32_epi32(v, order);
+		_mm256_storeu_si256((__m256i*) (dst + i), _mm256_xor_si256(v, flip_v));
+	}
+#undef F32_TO_S32_AVX2
+	f32_to_s8_sse2(in + i, dst + i, n - i, flip);
+}
+
+__attribute__((target("avx2"))) static void
+s16_to_s8_avx2(const void* src, uint8_t* dst, size_t n, uint8_t flip)
+{
+	const int16_t* in = (const int16_t*) src;
+	const __m256i flip_v = _mm256_set1_epi8((char) flip);
+	const __m256i half = _mm256_set1_epi16(0x80);
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_srai_epi16(
+			_mm256_adds_epi16(_mm256_loadu_si256((const __m256i*) (in + i)), half),
+			8);
+		__m256i b = _mm256_srai_epi16(
+			_mm256_adds_epi16(_mm256_loadu_si256((const __m256i*) (in + i + 16)), half),
+			8);
+		__m256i v = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xd8);
+		_mm256_storeu_si256((__m256i*) (dst + i), _mm256_xor_si256(v, flip_v));
+	}
+	s16_to_s8_sse2(in + i, dst + i, n - i, flip);
+}
+
+static const struct convert_kernels avx2_kernels = {
+	"avx2",
+	s8_to_f32_avx2,
+	s8_to_s16_avx2,
+	f32_to_s8_avx2,
+	s16_to_s8_avx2,
+};
+
+#endif /* CONVERT_X86 */
+
+#ifdef CONVERT_NEON
+
+/* NEON, 16 scalars per iteration */
+
+static void s8_to_f32_neon(const uint8_t* src, void* dst, size_t n, uint8_t flip)
+{
+	float* out = (float*) dst;
+	const uint8x16_t flip_v = vdupq_n_u8(flip);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		int8x16_t v = vreinterpretq_s8_u8(veorq_u8(vld1q_u8(src + i), flip_v));
+		int16x8_t lo = vmovl_s8(vget_low_s8(v));
+		int16x8_t hi = vmovl_s8(vget_high_s8(v));
+		vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(lo))), S8_TO_F32_SCALE));
+		vst1q_f32(out + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(lo))), S8_TO_F32_SCALE));
+		vst1q_f32(out + i + 8, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(hi))), S8_TO_F32_SCALE));
+		vst1q_f32(out + i + 12, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(hi))), S8_TO_F32_SCALE));
+	}
+	s8_to_f32_scalar(src + i, out + i, n - i, flip);
+}
+
+static void s8_to_s16_neon(const uint8_t* src, void* dst, size_t n, uint8_t flip)
+{
+	int16_t* out = (int16_t*) dst;
+	const uint8x16_t flip_v = vdupq_n_u8(flip);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		int8x16_t v = vreinterpretq_s8_u8(veorq_u8(vld1q_u8(src + i), flip_v));
+		vst1q_s16(out + i, vshll_n_s8(vget_low_s8(v), 8));
+		vst1q_s16(out + i + 8, vshll_n_s8(vget_high_s8(v), 8));
+	}
+	s8_to_s16_scalar(src + i, out + i, n - i, flip);
+}
+
+static void f32_to_s8_neon(const void* src, uint8_t* dst, size_t n, uint8_t flip)
+{
+	const float* in = (const float*) src;
+	const uint8x16_t flip_v = vdupq_n_u8(flip);
+	const float32x4_t lo_f = vdupq_n_f32(-128.0f);
+	const float32x4_t hi_f = vdupq_n_f32(127.0f);
+	size_t i;
+
+	// vcvtnq would turn NaN into 0. maxnm() returns the number for a NaN
+	// operand, so NaN ends up at -128 like the scalar version.
+#define F32_TO_S32_NEON(p) \
+	vcvtnq_s32_f32(vminnmq_f32(vmaxnmq_f32(vmulq_n_f32(vld1q_f32(p), F32_TO_S8_SCALE), lo_f), hi_f))
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		int32x4_t w0 = F32_TO_S32_NEON(in + i);
+		int32x4_t w1 = F32_TO_S32_NEON(in + i + 4);
+		int32x4_t w2 = F32_TO_S32_NEON(in + i + 8);
+		int32x4_t w3 = F32_TO_S32_NEON(in + i + 12);
+		int16x8_t lo = vcombine_s16(vqmovn_s32(w0), vqmovn_s32(w1));
+		int16x8_t hi = vcombine_s16(vqmovn_s32(w2), vqmovn_s32(w3));
+		int8x16_t v = vcombine_s8(vqmovn_s16(lo), vqmovn_s16(hi));
+		vst1q_u8(dst + i, veorq_u8(vreinterpretq_u8_s8(v), flip_v));
+	}
+#undef F32_TO_S32_NEON
+	f32_to_s8_scalar(in + i, dst + i, n - i, flip);
+}
+
+static void s16_to_s8_neon(const void* src, uint8_t* dst, size_t n, uint8_t flip)
+{
+	const int16_t* in = (const int16_t*) src;
+	const uint8x16_t flip_v = vdupq_n_u8(flip);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		// Rounding, saturating narrow, same as the scalar version.
+		int8x16_t v = vcombine_s8(
+			vqrshrn_n_s16(vld1q_s16(in + i), 8),
+			vqrshrn_n_s16(vld1q_s16(in + i + 8), 8));
+		vst1q_u8(dst + i, veorq_u8(vreinterpretq_u8_s8(v), flip_v));
+	}
+	s16_to_s8_scalar(in + i, dst + i, n - i, flip);
+}
+
+static const struct convert_kernels neon_kernels = {
+	"neon",
+	s8_to_f32_neon,
+	s8_to_s16_neon,
+	f32_to_s8_neon,
+	s16_to_s8_neon,
+};
+
+#endif /* CONVERT_NEON */
+
+static const struct convert_kernels* kernels = &scalar_kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void)
+{
+	const char* disable = getenv("TIMSSDR_CONVERT_SCALAR");
+
+	// Lets a scalar reference run be compared against the vector code.
+	if (disable != NULL && disable[0] != '\0' && disable[0] != '0') {
+		kernels = &scalar_kernels;
+		return;
+	}
+
+#if defined(CONVERT_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernels = &avx2_kernels;
+	} else if (__builtin_cpu_supports("sse2")) {
+		kernels = &sse2_kernels;
+	}
+#elif defined(CONVERT_NEON)
+	kernels = &neon_kernels;
+#endif
+}
+
+static const struct convert_kernels* get_kernels(void)
+{
+	pthread_once(&kernels_once, select_kernels);
+	return kernels;
+}
+
+const char* timssdr_convert_backend(void)
+{
+	return get_kernels()->name;
+}
+
+size_t timssdr_sample_size(enum timssdr_sample_format format)
+{
+	switch (format) {
+	case TIMSSDR_FORMAT_S8:
+	case TIMSSDR_FORMAT_U8:
+		return 2 * sizeof(int8_t);
+	case TIMSSDR_FORMAT_CS16:
+		return 2 * sizeof(int16_t);
+	case TIMSSDR_FORMAT_CF32:
+		return 2 * sizeof(float);
+	default:
+		return 0;
+	}
+}
+
+static int is_8bit(enum timssdr_sample_format format)
+{
+	return format == TIMSSDR_FORMAT_S8 || format == TIMSSDR_FORMAT_U8;
+}
+
+int timssdr_convert(
+	enum timssdr_sample_format src_format,
+	const void* src,
+	enum timssdr_sample_format dst_format,
+	void* dst,
+	size_t count)
+{
+	const struct convert_kernels* k = get_kernels();
+	const size_t n = 2 * count;
+
+	if ((src == NULL || dst == NULL) && count > 0) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (is_8bit(src_format)) {
+		const uint8_t flip = src_format == TIMSSDR_FORMAT_U8 ? 0x80 : 0x00;
+
+		switch (dst_format) {
+		case TIMSSDR_FORMAT_CF32:
+			k->s8_to_f32((const uint8_t*) src, dst, n, flip);
+			return TIMSSDR_SUCCESS;
+		case TIMSSDR_FORMAT_CS16:
+			k->s8_to_s16((const uint8_t*) src, dst, n, flip);
+			return TIMSSDR_SUCCESS;
+		case TIMSSDR_FORMAT_S8:
+		case TIMSSDR_FORMAT_U8:
+			if (src_format == dst_format) {
+				memmove(dst, src, n);
+			} else {
+				size_t i;
+				for (i = 0; i < n; i++) {
+					((uint8_t*) dst)[i] = ((const uint8_t*) src)[i] ^ 0x80;
+				}
+			}
+			return TIMSSDR_SUCCESS;
+		default:
+			return TIMSSDR_ERROR_INVALID_PARAM;
+		}
+	} else if (is_8bit(dst_format)) {
+		const uint8_t flip = dst_format == TIMSSDR_FORMAT_U8 ? 0x80 : 0x00;
+
+		switch (src_format) {
+		case TIMSSDR_FORMAT_CF32:
+			k->f32_to_s8(src, (uint8_t*) dst, n, flip);
+			return TIMSSDR_SUCCESS;
+		case TIMSSDR_FORMAT_CS16:
+			k->s16_to_s8(src, (uint8_t*) dst, n, flip);
+			return TIMSSDR_SUCCESS;
+		default:
+			return TIMSSDR_ERROR_INVALID_PARAM;
+		}
+	}
+
+	// Conversions between the wide formats aren't provided.
+	return TIMSSDR_ERROR_INVALID_PARAM;
+}
@@ -0,0 +1,978 @@
+#include "timssdr_ddc.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define DDC_X86 1
+	#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	#define DDC_NEON 1
+	#include <arm_neon.h>
+#endif
+
+/*
+ * Digital down-conversion into channels.
+ *
+ * Every channel keeps a work buffer holding the last filter length - 1
+ * input samples followed by the current block, so filter windows never
+ * wrap and the output continues seamlessly across blocks. Filters are
+ * only evaluated where an output sample is kept, which is what makes a
+ * decimating FIR polyphase: each output only touches taps_per_phase taps
+ * per decimation step of input.
+ *
+ * Independent channels are mixed to baseband first. The NCO phase is kept
+ * in double precision and re-evaluated every DDC_NCO_CHUNK samples; within
+ * a chunk, a precomputed table of phasors is rotated by it, so there is no
+ * accumulated drift and the inner loop is two complex products.
+ *
+ * The filter bank folds the window of L = taps_per_phase * M input samples
+ * times the reversed prototype filter into M branch sums (one MAC kernel
+ * over P rows of M samples), and every selected channel is then one DFT
+ * bin of those sums. Channel k comes out at baseband without any mixing.
+ *
+ * Workers each own a subset of the channels and process every block for
+ * them, so there is no ordering to restore. Blocks go through a ring of
+ * jobs; a job is only reused once every worker is done with it, and a
+ * block that finds its job still in use is dropped.
+ */
+
+#define DDC_DEFAULT_TAPS_PER_PHASE 16
+#define DDC_MAX_TAPS_PER_PHASE     256
+#define DDC_MAX_DECIMATION         4096
+#define DDC_MIN_PFB_CHANNELS       2
+#define DDC_MAX_PFB_CHANNELS       1024
+#define DDC_MAX_THREADS            64
+#define DDC_JOB_COUNT              8
+#define DDC_NCO_CHUNK              256 /* samples mixed per NCO phase evaluation */
+#define DDC_FIR_WIDTH              8   /* floats the FIR accumulates side by side */
+
+#ifndef M_PI
+	#define M_PI 3.14159265358979323846
+#endif
+
+/*
+ * acc[w] = sum over rows q of x[q * width + w] * taps[q * width + w],
+ * for w < width. Both arrays are interleaved complex or doubled real taps.
+ */
+typedef void (*mac_fn)(const float* x, const float* taps, size_t rows, size_t width, float* acc);
+/* out[i] = x[i] * table[i] * c for n complex samples */
+typedef void (*mix_fn)(const float* x, const float* table, float c_re, float c_im, float* out, size_t n);
+
+struct ddc_kernels {
+	const char* name;
+	mac_fn mac;
+	mix_fn mix;
+};
+
+struct ddc_block_info {
+	uint64_t sample_index;
+	uint64_t timestamp_ns;
+	uint32_t flags;
+};
+
+struct ddc_channel {
+	timssdr_ddc_channel config;
+	uint32_t index;
+	uint32_t decimation;
+	bool stopped;          /* the callback asked for no more samples */
+
+	/* TIMSSDR_DDC_INDEPENDENT */
+	float* taps;           /* reversed, each doubled for I and Q, zero padded at the start */
+	uint32_t tap_count;    /* complex taps, a multiple of DDC_FIR_WIDTH / 2 */
+	float* nco_table;      /* e^(j * nco_step * n) for n < DDC_NCO_CHUNK */
+	double nco_step;       /* radians per input sample */
+	double nco_phase;
+	float* work;           /* tap_count - 1 samples of history, then the mixed block */
+	size_t work_capacity;  /* complex samples */
+	uint32_t next_output;  /* offset of the next output sample into the next block */
+
+	/* TIMSSDR_DDC_PFB */
+	float* twiddles;       /* DFT bin of the branch sums, which are in window order */
+
+	float* output;
+	size_t output_capacity; /* complex samples */
+};
+
+struct ddc_lane {
+	struct timssdr_ddc* ddc;
+	pthread_t thread;
+	struct ddc_channel** channels;
+	uint32_t channel_count;
+	uint64_t next_sequence; /* next job to process */
+
+	float* input;           /* independent: the block as complex float */
+	size_t input_capacity;
+
+	/* TIMSSDR_DDC_PFB, shared by the lane's channels */
+	float* work;            /* pfb_tap_count - 1 samples of history, then the block */
+	size_t work_capacity;
+	uint32_t next_output;
+	float* branches;        /* 2 * pfb_size floats */
+};
+
+struct ddc_job {
+	uint8_t* data;
+	size_t capacity;
+	int length;
+	struct ddc_block_info info;
+	uint32_t refs;          /* lanes still to process the job */
+};
+
+struct timssdr_ddc {
+	enum timssdr_ddc_mode mode;
+	enum timssdr_sample_format input_format;
+	timssdr_device* device;
+	const struct ddc_kernels* kernels;
+
+	struct ddc_channel* channels;
+	uint32_t channel_count;
+
+	float* pfb_taps;        /* reversed prototype, each doubled for I and Q */
+	uint32_t pfb_tap_count; /* taps_per_phase * pfb_size */
+	uint32_t pfb_size;
+
+	struct ddc_lane* lanes;
+	uint32_t lane_count;
+	uint32_t lanes_started;
+	bool threaded;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;    /* a job was queued or exit was set */
+	struct ddc_job jobs[DDC_JOB_COUNT];
+	uint64_t next_sequence;
+	bool exit;
+	bool dropped;           /* feeding thread only: a block was dropped since the last job */
+};
+
+/* Scalar versions, also used for the tails of the vector kernels */
+
+static void mac_columns_scalar(
+	const float* x,
+	const float* taps,
+	size_t rows,
+	size_t width,
+	size_t first,
+	float* acc)
+{
+	size_t q, w;
+
+	for (w = first; w < width; w++) {
+		acc[w] = 0.0f;
+	}
+	for (q = 0; q < rows; q++) {
+		for (w = first; w < width; w++) {
+			acc[w] += x[q * width + w] * taps[q * width + w];
+		}
+	}
+}
+
+static void mac_scalar(const float* x, const float* taps, size_t rows, size_t width, float* acc)
+{
+	mac_columns_scalar(x, taps, rows, width, 0, acc);
+}
+
+static void mix_scalar(const float* x, const float* table, float c_re, float c_im, float* out, size_t n)
+{
+	float p_re, p_im, x_re, x_im;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		p_re = table[2 * i] * c_re - table[2 * i + 1] * c_im;
+		p_im = table[2 * i] * c_im + table[2 * i + 1] * c_re;
+		x_re = x[2 * i];
+		x_im = x[2 * i + 1];
+		out[2 * i] = x_re * p_re - x_im * p_im;
+		out[2 * i + 1] = x_re * p_im + x_im * p_re;
+	}
+}
+
+static const struct ddc_kernels scalar_kernels = {
+	"scalar",
+	mac_scalar,
+	mix_scalar,
+};
+
+#ifdef DDC_X86
+
+/* SSE2, 4 floats (2 complex) per vector */
+
+__attribute__((target("sse2"))) static inline __m128 cmul_sse2(__m128 a, __m128 b)
+{
+	const __m128 negate_re = _mm_set_ps(0.0f, -0.0f, 0.0f, -0.0f);
+	__m128 b_re = _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 2, 0, 0));
+	__m128 b_im = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 3, 1, 1));
+	__m128 a_swapped = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+
+	return _mm_add_ps(_mm_mul_ps(a, b_re), _mm_xor_ps(_mm_mul_ps(a_swapped, b_im), negate_re));
+}
+
+__attribute__((target("sse2"))) static void
+mac_sse2(const float* x, const float* taps, size_t rows, size_t width, float* acc)
+{
+	size_t q, w;
+
+	for (w = 0; w + 4 <= width; w += 4) {
+		// Two chains, so the additions don't wait on each other.
+		__m128 a0 = _mm_setzero_ps();
+		__m128 a1 = _mm_setzero_ps();
+		for (q = 0; q + 2 <= rows; q += 2) {
+			a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(x + q * width + w), _mm_loadu_ps(taps + q * width + w)));
+			a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(x + (q + 1) * width + w), _mm_loadu_ps(taps + (q + 1) * width + w)));
+		}
+		if (q < rows) {
+			a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(x + q * width + w), _mm_loadu_ps(taps + q * width + w)));
+		}
+		_mm_storeu_ps(acc + w, _mm_add_ps(a0, a1));
+	}
+	mac_columns_scalar(x, taps, rows, width, w, acc);
+}
+
+__attribute__((target("sse2"))) static void
+mix_sse2(const float* x, const float* table, float c_re, float c_im, float* out, size_t n)
+{
+	const __m128 c = _mm_set_ps(c_im, c_re, c_im, c_re);
+	size_t i;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		__m128 p = cmul_sse2(_mm_loadu_ps(table + 2 * i), c);
+		_mm_storeu_ps(out + 2 * i, cmul_sse2(_mm_loadu_ps(x + 2 * i), p));
+	}
+	mix_scalar(x + 2 * i, table + 2 * i, c_re, c_im, out + 2 * i, n - i);
+}
+
+static const struct ddc_kernels sse2_kernels = {
+	"sse2",
+	mac_sse2,
+	mix_sse2,
+};
+
+/* AVX2, 8 floats (4 complex) per vector */
+
+__attribute__((target("avx2"))) static inline __m256 cmul_avx2(__m256 a, __m256 b)
+{
+	const __m256 negate_re = _mm256_set_ps(0.0f, -0.0f, 0.0f, -0.0f, 0.0f, -0.0f, 0.0f, -0.0f);
+	__m256 b_re = _mm256_permute_ps(b, _MM_SHUFFLE(2, 2, 0, 0));
+	__m256 b_im = _mm256_permute_ps(b, _MM_SHUFFLE(3, 3, 1, 1));
+	__m256 a_swapped = _mm256_permute_ps(a, _MM_SHUFFLE(2, 3, 0, 1));
+
+	return _mm256_add_ps(_mm256_mul_ps(a, b_re), _mm256_xor_ps(_mm256_mul_ps(a_swapped, b_im), negate_re));
+}
+
+__attribute__((target("avx2"))) static void
+mac_avx2(const float* x, const float* taps, size_t rows, size_t width, float* acc)
+{
+	size_t q, w;
+
+	for (w = 0; w + 8 <= width; w += 8) {
+		__m256 a0 = _mm256_setzero_ps();
+		__m256 a1 = _mm256_setzero_ps();
+		for (q = 0; q + 2 <= rows; q += 2) {
+			a0 = _mm256_add_ps(a0, _mm256_mul_ps(_mm256_loadu_ps(x + q * width + w), _mm256_loadu_ps(taps + q * width + w)));
+			a1 = _mm256_add_ps(a1, _mm256_mul_ps(_mm256_loadu_ps(x + (q + 1) * width + w), _mm256_loadu_ps(taps + (q + 1) * width + w)));
+		}
+		if (q < rows) {
+			a0 = _mm256_add_ps(a0, _mm256_mul_ps(_mm256_loadu_ps(x + q * width + w), _mm256_loadu_ps(taps + q * width + w)));
+		}
+		_mm256_storeu_ps(acc + w, _mm256_add_ps(a0, a1));
+	}
+	mac_columns_scalar(x, taps, rows, width, w, acc);
+}
+
+__attribute__((target("avx2"))) static void
+mix_avx2(const float* x, const float* table, float c_re, float c_im, float* out, size_t n)
+{
+	const __m256 c = _mm256_set_ps(c_im, c_re, c_im, c_re, c_im, c_re, c_im, c_re);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256 p = cmul_avx2(_mm256_loadu_ps(table + 2 * i), c);
+		_mm256_storeu_ps(out + 2 * i, cmul_avx2(_mm256_loadu_ps(x + 2 * i), p));
+	}
+	mix_sse2(x + 2 * i, table + 2 * i, c_re, c_im, out + 2 * i, n - i);
+}
+
+static const struct ddc_kernels avx2_kernels = {
+	"avx2",
+	mac_avx2,
+	mix_avx2,
+};
+
+#endif /* DDC_X86 */
+
+#ifdef DDC_NEON
+
+/* NEON, 4 floats per vector; mixing deinterleaves 4 complex samples */
+
+static void mac_neon(const float* x, const float* taps, size_t rows, size_t width, float* acc)
+{
+	size_t q, w;
+
+	for (w = 0; w + 4 <= width; w += 4) {
+		float32x4_t a0 = vdupq_n_f32(0.0f);
+		float32x4_t a1 = vdupq_n_f32(0.0f);
+		for (q = 0; q + 2 <= rows; q += 2) {
+			a0 = vmlaq_f32(a0, vld1q_f32(x + q * width + w), vld1q_f32(taps + q * width + w));
+			a1 = vmlaq_f32(a1, vld1q_f32(x + (q + 1) * width + w), vld1q_f32(taps + (q + 1) * width + w));
+		}
+		if (q < rows) {
+			a0 = vmlaq_f32(a0, vld1q_f32(x + q * width + w), vld1q_f32(taps + q * width + w));
+		}
+		vst1q_f32(acc + w, vaddq_f32(a0, a1));
+	}
+	mac_columns_scalar(x, taps, rows, width, w, acc);
+}
+
+static void mix_neon(const float* x, const float* table, float c_re, float c_im, float* out, size_t n)
+{
+	float32x4x2_t t, v, r;
+	float32x4_t p_re, p_im;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		t = vld2q_f32(table + 2 * i);
+		v = vld2q_f32(x + 2 * i);
+		p_re = vmlsq_n_f32(vmulq_n_f32(t.val[0], c_re), t.val[1], c_im);
+		p_im = vmlaq_n_f32(vmulq_n_f32(t.val[0], c_im), t.val[1], c_re);
+		r.val[0] = vmlsq_f32(vmulq_f32(v.val[0], p_re), v.val[1], p_im);
+		r.val[1] = vmlaq_f32(vmulq_f32(v.val[0], p_im), v.val[1], p_re);
+		vst2q_f32(out + 2 * i, r);
+	}
+	mix_scalar(x + 2 * i, table + 2 * i, c_re, c_im, out + 2 * i, n - i);
+}
+
+static const struct ddc_kernels neon_kernels = {
+	"neon",
+	mac_neon,
+	mix_neon,
+};
+
+#endif /* DDC_NEON */
+
+static const struct ddc_kernels* kernels = &scalar_kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void)
+{
+	const char* disable = getenv("TIMSSDR_DDC_SCALAR");
+
+	// Lets a scalar reference run be compared against the vector code.
+	if (disable != NULL && disable[0] != '\0' && disable[0] != '0') {
+		kernels = &scalar_kernels;
+		return;
+	}
+
+#if defined(DDC_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernels = &avx2_kernels;
+	} else if (__builtin_cpu_supports("sse2")) {
+		kernels = &sse2_kernels;
+	}
+#elif defined(DDC_NEON)
+	kernels = &neon_kernels;
+#endif
+}
+
+static const struct ddc_kernels* get_kernels(void)
+{
+	pthread_once(&kernels_once, select_kernels);
+	return kernels;
+}
+
+const char* timssdr_ddc_backend(void)
+{
+	return get_kernels()->name;
+}
+
+/* Windowed sinc low-pass with unity DC gain, cutoff in cycles per sample. */
+static void design_lowpass(float* h, uint32_t length, double cutoff)
+{
+	const double center = (length - 1) / 2.0;
+	double sum = 0, x, w, sinc;
+	uint32_t n;
+
+	if (length == 1) {
+		h[0] = 1.0f;
+		return;
+	}
+
+	for (n = 0; n < length; n++) {
+		x = n - center;
+		sinc = x == 0 ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+		// Blackman-Harris, for about 90 dB of stopband rejection.
+		w = 0.35875 - 0.48829 * cos(2.0 * M_PI * n / (length - 1)) +
+			0.14128 * cos(4.0 * M_PI * n / (length - 1)) -
+			0.01168 * cos(6.0 * M_PI * n / (length - 1));
+		h[n] = (float) (sinc * w);
+		sum += h[n];
+	}
+	for (n = 0; n < length; n++) {
+		h[n] = (float) (h[n] / sum);
+	}
+}
+
+/*
+ * Reversed and doubled copy of h (length taps) for the MAC kernel,
+ * zero padded at the start to padded_length taps.
+ */
+static float* reverse_taps(const float* h, uint32_t length, uint32_t padded_length)
+{
+	float* taps = (float*) calloc(2 * (size_t) padded_length, sizeof(float));
+	uint32_t i;
+
+	if (taps == NULL) {
+		return NULL;
+	}
+	for (i = padded_length - length; i < padded_length; i++) {
+		taps[2 * i] = h[padded_length - 1 - i];
+		taps[2 * i + 1] = h[padded_length - 1 - i];
+	}
+	return taps;
+}
+
+static bool reserve_floats(float** buffer, size_t* capacity, size_t complex_count)
+{
+	float* grown;
+
+	if (complex_count <= *capacity) {
+		return true;
+	}
+	grown = (float*) realloc(*buffer, 2 * complex_count * sizeof(float));
+	if (grown == NULL) {
+		return false;
+	}
+	*buffer = grown;
+	*capacity = complex_count;
+	return true;
+}
+
+/*
+ * Make room for a block of count samples after history samples, keeping
+ * the history. A new buffer starts with a zero history.
+ */
+static bool reserve_work(float** work, size_t* capacity, size_t history, size_t count)
+{
+	const bool fresh = *work == NULL;
+
+	if (!reserve_floats(work, capacity, history + count)) {
+		return false;
+	}
+	if (fresh) {
+		memset(*work, 0, 2 * history * sizeof(float));
+	}
+	return true;
+}
+
+/* Number of outputs in a block of count samples, advancing *next_output. */
+static uint32_t outputs_in(uint32_t* next_output, uint32_t decimation, size_t count, uint32_t* first)
+{
+	uint32_t outputs;
+
+	*first = *next_output;
+	if (*first >= count) {
+		*next_output = (uint32_t) (*first - count);
+		return 0;
+	}
+	outputs = (uint32_t) ((count - *first + decimation - 1) / decimation);
+	*next_output = (uint32_t) (*first + (size_t) outputs * decimation - count);
+	return outputs;
+}
+
+static void emit(
+	const struct timssdr_ddc* ddc,
+	struct ddc_channel* channel,
+	uint32_t count,
+	uint32_t first,
+	const struct ddc_block_info* info)
+{
+	timssdr_ddc_block block;
+
+	if (count == 0) {
+		return;
+	}
+
+	block.device = ddc->device;
+	block.channel = channel->index;
+	block.samples = channel->output;
+	block.sample_count = count;
+	block.sample_index = info->sample_index + first;
+	block.timestamp_ns = info->timestamp_ns;
+	block.flags = info->flags;
+	block.ctx = channel->config.ctx;
+	if (channel->config.callback(&block) != 0) {
+		channel->stopped = true;
+	}
+}
+
+/* Mix, filter and decimate one independent channel; input is the lane's converted block. */
+static void process_independent(
+	const struct timssdr_ddc* ddc,
+	struct ddc_channel* channel,
+	const float* input,
+	size_t count,
+	const struct ddc_block_info* info)
+{
+	const struct ddc_kernels* k = ddc->kernels;
+	const size_t history = channel->tap_count - 1;
+	const uint32_t decimation = channel->decimation;
+	float acc[DDC_FIR_WIDTH];
+	uint32_t outputs, first, m;
+	size_t done, chunk;
+
+	if (!reserve_work(&channel->work, &channel->work_capacity, history, count)) {
+		return;
+	}
+
+	for (done = 0; done < count; done += chunk) {
+		chunk = count - done < DDC_NCO_CHUNK ? count - done : DDC_NCO_CHUNK;
+		k->mix(input + 2 * done,
+		       channel->nco_table,
+		       (float) cos(channel->nco_phase),
+		       (float) sin(channel->nco_phase),
+		       channel->work + 2 * (history + done),
+		       chunk);
+		channel->nco_phase = fmod(channel->nco_phase + channel->nco_step * (double) chunk, 2.0 * M_PI);
+	}
+
+	outputs = outputs_in(&channel->next_output, decimation, count, &first);
+	if (reserve_floats(&channel->output, &channel->output_capacity, outputs)) {
+		// The window of the output at block offset q starts at work offset q.
+		for (m = 0; m < outputs; m++) {
+			k->mac(channel->work + 2 * ((size_t) first + (size_t) m * decimation),
+			       channel->taps,
+			       channel->tap_count / (DDC_FIR_WIDTH / 2),
+			       DDC_FIR_WIDTH,
+			       acc);
+			channel->output[2 * m] = acc[0] + acc[2] + acc[4] + acc[6];
+			channel->output[2 * m + 1] = acc[1] + acc[3] + acc[5] + acc[7];
+		}
+		emit(ddc, channel, outputs, first, info);
+	}
+
+	memmove(channel->work, channel->work + 2 * count, 2 * history * sizeof(float));
+}
+
+/* Run the filter bank over a block already converted into the lane's work buffer. */
+static void process_pfb(struct ddc_lane* lane, size_t count, const struct ddc_block_info* info)
+{
+	const struct timssdr_ddc* ddc = lane->ddc;
+	const uint32_t size = ddc->pfb_size;
+	struct ddc_channel* channel;
+	uint32_t outputs, first, m, c, j;
+	const float* b;
+	const float* w;
+	float y_re, y_im;
+
+	outputs = outputs_in(&lane->next_output, size, count, &first);
+	for (c = 0; c < lane->channel_count; c++) {
+		if (!reserve_floats(&lane->channels[c]->output, &lane->channels[c]->output_capacity, outputs)) {
+			return;
+		}
+	}
+
+	for (m = 0; m < outputs; m++) {
+		ddc->kernels->mac(
+			lane->work + 2 * ((size_t) first + (size_t) m * size),
+			ddc->pfb_taps,
+			ddc->pfb_tap_count / size,
+			2 * (size_t) size,
+			lane->branches);
+
+		b = lane->branches;
+		for (c = 0; c < lane->channel_count; c++) {
+			channel = lane->channels[c];
+			if (channel->stopped) {
+				continue;
+			}
+			w = channel->twiddles;
+			y_re = 0.0f;
+			y_im = 0.0f;
+			for (j = 0; j < size; j++) {
+				y_re += b[2 * j] * w[2 * j] - b[2 * j + 1] * w[2 * j + 1];
+				y_im += b[2 * j] * w[2 * j + 1] + b[2 * j + 1] * w[2 * j];
+			}
+			channel->output[2 * m] = y_re;
+			channel->output[2 * m + 1] = y_im;
+		}
+	}
+
+	for (c = 0; c < lane->channel_count; c++) {
+		if (!lane->channels[c]->stopped) {
+			emit(ddc, lane->channels[c], outputs, first, info);
+		}
+	}
+}
+
+static void process_block(
+	struct ddc_lane* lane,
+	const uint8_t* buffer,
+	int length,
+	const struct ddc_block_info* info)
+{
+	const struct timssdr_ddc* ddc = lane->ddc;
+	const size_t count = (size_t) length / 2;
+	size_t history;
+	uint32_t c;
+
+	if (count == 0) {
+		return;
+	}
+
+	if (ddc->mode == TIMSSDR_DDC_PFB) {
+		// Converted straight behind the history, no extra copy.
+		history = ddc->pfb_tap_count - 1;
+		if (!reserve_work(&lane->work, &lane->work_capacity, history, count)) {
+			return;
+		}
+		timssdr_convert(ddc->input_format, buffer, TIMSSDR_FORMAT_CF32, lane->work + 2 * history, count);
+		process_pfb(lane, count, info);
+		memmove(lane->work, lane->work + 2 * count, 2 * history * sizeof(float));
+		return;
+	}
+
+	if (!reserve_floats(&lane->input, &lane->input_capacity, count)) {
+		return;
+	}
+	timssdr_convert(ddc->input_format, buffer, TIMSSDR_FORMAT_CF32, lane->input, count);
+	for (c = 0; c < lane->channel_count; c++) {
+		if (!lane->channels[c]->stopped) {
+			process_independent(ddc, lane->channels[c], lane->input, count, info);
+		}
+	}
+}
+
+static void* ddc_threadproc(void* arg)
+{
+	struct ddc_lane* lane = (struct ddc_lane*) arg;
+	struct timssdr_ddc* ddc = lane->ddc;
+	struct ddc_job* job;
+
+	pthread_mutex_lock(&ddc->lock);
+	for (;;) {
+		while (lane->next_sequence == ddc->next_sequence && !ddc->exit) {
+			pthread_cond_wait(&ddc->work, &ddc->lock);
+		}
+		// Queued jobs are finished before exiting.
+		if (lane->next_sequence == ddc->next_sequence) {
+			break;
+		}
+
+		job = &ddc->jobs[lane->next_sequence % DDC_JOB_COUNT];
+		pthread_mutex_unlock(&ddc->lock);
+
+		process_block(lane, job->data, job->length, &job->info);
+
+		pthread_mutex_lock(&ddc->lock);
+		job->refs--;
+		lane->next_sequence++;
+	}
+	pthread_mutex_unlock(&ddc->lock);
+
+	return NULL;
+}
+
+static int setup_channel(
+	struct timssdr_ddc* ddc,
+	const timssdr_ddc_config* config,
+	uint32_t index,
+	uint32_t taps_per_phase)
+{
+	struct ddc_channel* channel = &ddc->channels[index];
+	const timssdr_ddc_channel* source = &config->channels[index];
+	double bandwidth, angle;
+	uint32_t length, n, rows;
+	float* h;
+
+	channel->config = *source;
+	channel->index = index;
+
+	if (ddc->mode == TIMSSDR_DDC_PFB) {
+		// Branch sum j holds the taps n = L - 1 - j (mod M) of the window.
+		channel->decimation = ddc->pfb_size;
+		channel->twiddles = (float*) malloc(2 * (size_t) ddc->pfb_size * sizeof(float));
+		if (channel->twiddles == NULL) {
+			return TIMSSDR_ERROR_NO_MEM;
+		}
+		for (n = 0; n < ddc->pfb_size; n++) {
+			angle = 2.0 * M_PI * (double) source->pfb_channel * (double) (ddc->pfb_size - 1 - n) /
+				(double) ddc->pfb_size;
+			channel->twiddles[2 * n] = (float) cos(angle);
+			channel->twiddles[2 * n + 1] = (float) sin(angle);
+		}
+		return TIMSSDR_SUCCESS;
+	}
+
+	channel->decimation = source->decimation;
+	bandwidth = source->bandwidth_hz > 0 ? source->bandwidth_hz :
+					       0.8 * config->sample_rate / source->decimation;
+	length = taps_per_phase * source->decimation;
+	rows = (length + DDC_FIR_WIDTH / 2 - 1) / (DDC_FIR_WIDTH / 2);
+	channel->tap_count = rows * (DDC_FIR_WIDTH / 2);
+
+	h = (float*) malloc(length * sizeof(float));
+	if (h == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+	design_lowpass(h, length, bandwidth / 2.0 / config->sample_rate);
+	channel->taps = reverse_taps(h, length, channel->tap_count);
+	free(h);
+	if (channel->taps == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	// Mixing down by the offset brings the channel to DC.
+	channel->nco_step = -2.0 * M_PI * source->offset_hz / config->sample_rate;
+	channel->nco_table = (float*) malloc(2 * DDC_NCO_CHUNK * sizeof(float));
+	if (channel->nco_table == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+	for (n = 0; n < DDC_NCO_CHUNK; n++) {
+		channel->nco_table[2 * n] = (float) cos(channel->nco_step * n);
+		channel->nco_table[2 * n + 1] = (float) sin(channel->nco_step * n);
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+static int validate(const timssdr_ddc_config* config, enum timssdr_sample_format input_format)
+{
+	const timssdr_ddc_channel* channel;
+	uint32_t i;
+
+	if (config == NULL || config->channels == NULL || config->channel_count == 0 ||
+	    config->channel_count > TIMSSDR_DDC_MAX_CHANNELS || !(config->sample_rate > 0) ||
+	    config->taps_per_phase > DDC_MAX_TAPS_PER_PHASE || config->threads > DDC_MAX_THREADS ||
+	    (config->mode != TIMSSDR_DDC_INDEPENDENT && config->mode != TIMSSDR_DDC_PFB) ||
+	    (input_format != TIMSSDR_FORMAT_S8 && input_format != TIMSSDR_FORMAT_U8)) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (config->mode == TIMSSDR_DDC_PFB &&
+	    (config->pfb_channels < DDC_MIN_PFB_CHANNELS || config->pfb_channels > DDC_MAX_PFB_CHANNELS)) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	for (i = 0; i < config->channel_count; i++) {
+		channel = &config->channels[i];
+		if (channel->callback == NULL) {
+			return TIMSSDR_ERROR_INVALID_PARAM;
+		}
+		if (config->mode == TIMSSDR_DDC_PFB) {
+			if (channel->pfb_channel >= config->pfb_channels) {
+				return TIMSSDR_ERROR_INVALID_PARAM;
+			}
+		} else if (channel->decimation == 0 || channel->decimation > DDC_MAX_DECIMATION ||
+			   !(fabs(channel->offset_hz) <= config->sample_rate / 2) ||
+			   !(channel->bandwidth_hz >= 0 && channel->bandwidth_hz <= config->sample_rate)) {
+			return TIMSSDR_ERROR_INVALID_PARAM;
+		}
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+void timssdr_ddc_destroy(struct timssdr_ddc* ddc)
+{
+	uint32_t i;
+
+	if (ddc == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&ddc->lock);
+	ddc->exit = true;
+	pthread_cond_broadcast(&ddc->work);
+	pthread_mutex_unlock(&ddc->lock);
+	for (i = 0; i < ddc->lanes_started; i++) {
+		pthread_join(ddc->lanes[i].thread, NULL);
+	}
+
+	if (ddc->lanes != NULL) {
+		for (i = 0; i < ddc->lane_count; i++) {
+			free(ddc->lanes[i].channels);
+			free(ddc->lanes[i].input);
+			free(ddc->lanes[i].work);
+			free(ddc->lanes[i].branches);
+		}
+	}
+	if (ddc->channels != NULL) {
+		for (i = 0; i < ddc->channel_count; i++) {
+			free(ddc->channels[i].taps);
+			free(ddc->channels[i].nco_table);
+			free(ddc->channels[i].work);
+			free(ddc->channels[i].twiddles);
+			free(ddc->channels[i].output);
+		}
+	}
+	for (i = 0; i < DDC_JOB_COUNT; i++) {
+		free(ddc->jobs[i].data);
+	}
+
+	pthread_cond_destroy(&ddc->work);
+	pthread_mutex_destroy(&ddc->lock);
+	free(ddc->lanes);
+	free(ddc->channels);
+	free(ddc->pfb_taps);
+	free(ddc);
+}
+
+int timssdr_ddc_create(
+	const timssdr_ddc_config* config,
+	enum timssdr_sample_format input_format,
+	timssdr_device* device,
+	struct timssdr_ddc** out)
+{
+	struct timssdr_ddc* ddc;
+	struct ddc_lane* lane;
+	uint32_t taps_per_phase, i;
+	float* h;
+	int result;
+
+	result = validate(config, input_format);
+	if (result != TIMSSDR_SUCCESS || out == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	ddc = (struct timssdr_ddc*) calloc(1, sizeof(*ddc));
+	if (ddc == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	ddc->mode = config->mode;
+	ddc->input_format = input_format;
+	ddc->device = device;
+	ddc->kernels = get_kernels();
+	ddc->channel_count = config->channel_count;
+	ddc->threaded = config->threads > 0;
+	ddc->lane_count = ddc->threaded ?
+		(config->threads < config->channel_count ? config->threads : config->channel_count) :
+		1;
+	pthread_mutex_init(&ddc->lock, NULL);
+	pthread_cond_init(&ddc->work, NULL);
+
+	ddc->channels = (struct ddc_channel*) calloc(ddc->channel_count, sizeof(*ddc->channels));
+	ddc->lanes = (struct ddc_lane*) calloc(ddc->lane_count, sizeof(*ddc->lanes));
+	if (ddc->channels == NULL || ddc->lanes == NULL) {
+		timssdr_ddc_destroy(ddc);
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	taps_per_phase = config->taps_per_phase ? config->taps_per_phase : DDC_DEFAULT_TAPS_PER_PHASE;
+	if (ddc->mode == TIMSSDR_DDC_PFB) {
+		// Each channel is sample rate / M wide, crossing over at its edges.
+		ddc->pfb_size = config->pfb_channels;
+		ddc->pfb_tap_count = taps_per_phase * ddc->pfb_size;
+		h = (float*) malloc(ddc->pfb_tap_count * sizeof(float));
+		if (h == NULL) {
+			timssdr_ddc_destroy(ddc);
+			return TIMSSDR_ERROR_NO_MEM;
+		}
+		design_lowpass(h, ddc->pfb_tap_count, 0.5 / ddc->pfb_size);
+		ddc->pfb_taps = reverse_taps(h, ddc->pfb_tap_count, ddc->pfb_tap_count);
+		free(h);
+		if (ddc->pfb_taps == NULL) {
+			timssdr_ddc_destroy(ddc);
+			return TIMSSDR_ERROR_NO_MEM;
+		}
+	}
+
+	for (i = 0; i < ddc->channel_count; i++) {
+		result = setup_channel(ddc, config, i, taps_per_phase);
+		if (result != TIMSSDR_SUCCESS) {
+			timssdr_ddc_destroy(ddc);
+			return result;
+		}
+	}
+
+	// Channels are dealt out round robin.
+	for (i = 0; i < ddc->lane_count; i++) {
+		lane = &ddc->lanes[i];
+		lane->ddc = ddc;
+		lane->channels = (struct ddc_channel**) malloc(
+			((ddc->channel_count + ddc->lane_count - 1) / ddc->lane_count) * sizeof(*lane->channels));
+		if (ddc->mode == TIMSSDR_DDC_PFB) {
+			lane->branches = (float*) malloc(2 * (size_t) ddc->pfb_size * sizeof(float));
+		}
+		if (lane->channels == NULL || (ddc->mode == TIMSSDR_DDC_PFB && lane->branches == NULL)) {
+			timssdr_ddc_destroy(ddc);
+			return TIMSSDR_ERROR_NO_MEM;
+		}
+	}
+	for (i = 0; i < ddc->channel_count; i++) {
+		lane = &ddc->lanes[i % ddc->lane_count];
+		lane->channels[lane->channel_count++] = &ddc->channels[i];
+	}
+
+	if (ddc->threaded) {
+		for (i = 0; i < ddc->lane_count; i++) {
+			if (pthread_create(&ddc->lanes[i].thread, NULL, ddc_threadproc, &ddc->lanes[i]) != 0) {
+				timssdr_ddc_destroy(ddc);
+				return TIMSSDR_ERROR_THREAD;
+			}
+			ddc->lanes_started++;
+		}
+	}
+
+	*out = ddc;
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_ddc_feed(
+	struct timssdr_ddc* ddc,
+	const uint8_t* buffer,
+	int length,
+	uint64_t sample_index,
+	uint64_t timestamp_ns,
+	uint32_t flags)
+{
+	struct ddc_block_info info = {sample_index, timestamp_ns, flags};
+	struct ddc_job* job;
+	uint8_t* data;
+
+	if (length <= 0) {
+		return 1;
+	}
+
+	if (!ddc->threaded) {
+		process_block(&ddc->lanes[0], buffer, length, &info);
+		return 1;
+	}
+
+	job = &ddc->jobs[ddc->next_sequence % DDC_JOB_COUNT];
+	pthread_mutex_lock(&ddc->lock);
+	if (job->refs > 0) {
+		pthread_mutex_unlock(&ddc->lock);
+		ddc->dropped = true;
+		return 0;
+	}
+	pthread_mutex_unlock(&ddc->lock);
+
+	// No lane looks at the job until it is queued.
+	if ((size_t) length > job->capacity) {
+		data = (uint8_t*) realloc(job->data, (size_t) length);
+		if (data == NULL) {
+			ddc->dropped = true;
+			return 0;
+		}
+		job->data = data;
+		job->capacity = (size_t) length;
+	}
+	memcpy(job->data, buffer, (size_t) length);
+	job->length = length;
+	job->info = info;
+	if (ddc->dropped) {
+		job->info.flags |= TIMSSDR_TRANSFER_DISCONTINUITY;
+		ddc->dropped = false;
+	}
+
+	pthread_mutex_lock(&ddc->lock);
+	job->refs = ddc->lane_count;
+	ddc->next_sequence++;
+	pthread_cond_broadcast(&ddc->work);
+	pthread_mutex_unlock(&ddc->lock);
+
+	return 1;
+}
@@ -0,0 +1,37 @@
+#ifndef TIMSSDR_DDC_H
+#define TIMSSDR_DDC_H
+
+#include "timssdr.h"
+
+/*
+ * DDC pipeline stage, see timssdr_set_ddc(). Blocks are fed from one
+ * thread at a time (the thread delivering RX blocks). Without workers
+ * they are processed during the call, otherwise they are copied, so the
+ * caller's buffer can be reused as soon as feeding returns.
+ */
+
+struct timssdr_ddc;
+
+/* input_format is the format of the fed samples, S8 or U8. */
+int timssdr_ddc_create(
+	const timssdr_ddc_config* config,
+	enum timssdr_sample_format input_format,
+	timssdr_device* device,
+	struct timssdr_ddc** ddc);
+
+/*
+ * Process a block, or queue it for the workers. Returns 0 if a worker
+ * was still busy with an older block and this one was dropped.
+ */
+int timssdr_ddc_feed(
+	struct timssdr_ddc* ddc,
+	const uint8_t* buffer,
+	int length,
+	uint64_t sample_index,
+	uint64_t timestamp_ns,
+	uint32_t flags);
+
+/* Finish queued blocks, then stop the workers. */
+void timssdr_ddc_destroy(struct timssdr_ddc* ddc);
+
+#endif /* TIMSSDR_DDC_H */
@@ -0,0 +1,349 @@
+#include "timssdr_transport.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Mock transport for benchmarks and tests without hardware.
+ *
+ * Submitted transfers are completed in order by a worker thread, which
+ * plays the part of the libusb event thread. With a sample rate set, the
+ * bus moves bytes at that rate independently of the worker: a transfer is
+ * due once its bytes have arrived after the previous one was done, or
+ * after it was submitted if the bus had run dry by then, like a device
+ * overflowing its FIFO. A worker held up by a slow callback catches up
+ * with a burst of completions, as libusb does.
+ *
+ * While sweeping, RX data is framed like sweep firmware would: every
+ * TIMSSDR_SWEEP_BLOCK_SIZE block starts with a header carrying the
+ * frequency it was tuned to, moving to the next step of the plan after
+ * bytes_per_tuning bytes.
+ */
+
+struct mock_entry {
+	struct libusb_transfer* transfer;
+	uint64_t due_ns;
+};
+
+struct mock_transport {
+	struct timssdr_transport ops;
+	timssdr_mock_config config;
+	double ns_per_byte; /* 0 for unthrottled */
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	bool exit;
+
+	/* FIFO of submitted transfers */
+	struct mock_entry* queue;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	uint64_t bus_ns; /* time the last queued transfer is due */
+	uint64_t completions; /* for error_interval */
+
+	/* Cancelled and waiting for their callback */
+	struct libusb_transfer** cancelled;
+	size_t cancelled_count;
+
+	/* Sweep plan, frequency_count is 0 when not sweeping */
+	uint64_t* sweep_frequencies;
+	uint32_t sweep_frequency_count;
+	uint32_t sweep_bytes_per_tuning;
+	uint32_t sweep_step;           /* index into sweep_frequencies */
+	uint32_t sweep_bytes;          /* bytes sent at the current step */
+};
+
+static uint64_t mock_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+/* Grow both arrays so every queued transfer can also be cancelled. */
+static int mock_reserve(struct mock_transport* mock, size_t needed)
+{
+	struct mock_entry* queue;
+	struct libusb_transfer** cancelled;
+	size_t capacity, i;
+
+	if (needed <= mock->capacity) {
+		return 1;
+	}
+
+	capacity = mock->capacity ? mock->capacity * 2 : 16;
+	while (capacity < needed) {
+		capacity *= 2;
+	}
+
+	queue = (struct mock_entry*) malloc(capacity * sizeof(*queue));
+	cancelled = (struct libusb_transfer**) malloc(capacity * sizeof(*cancelled));
+	if (queue == NULL || cancelled == NULL) {
+		free(queue);
+		free(cancelled);
+		return 0;
+	}
+
+	for (i = 0; i < mock->count; i++) {
+		queue[i] = mock->queue[(mock->head + i) % mock->capacity];
+	}
+	if (mock->cancelled_count > 0) {
+		memcpy(cancelled, mock->cancelled, mock->cancelled_count * sizeof(*cancelled));
+	}
+
+	free(mock->queue);
+	free(mock->cancelled);
+	mock->queue = queue;
+	mock->cancelled = cancelled;
+	mock->capacity = capacity;
+	mock->head = 0;
+
+	return 1;
+}
+
+/* Returns the number of header bytes at the start of the transfer. */
+static int mock_frame_sweep(struct mock_transport* mock, struct libusb_transfer* transfer)
+{
+	uint64_t frequency;
+	uint8_t* header;
+	int offset, i;
+
+	if (mock->sweep_frequency_count == 0 || (transfer->endpoint & LIBUSB_ENDPOINT_IN) == 0) {
+		return 0;
+	}
+
+	for (offset = 0; offset + TIMSSDR_SWEEP_HEADER_SIZE <= transfer->length; offset += TIMSSDR_SWEEP_BLOCK_SIZE) {
+		frequency = mock->sweep_frequencies[mock->sweep_step];
+		header = transfer->buffer + offset;
+		header[0] = TIMSSDR_SWEEP_MARKER;
+		header[1] = TIMSSDR_SWEEP_MARKER;
+		for (i = 0; i < 8; i++) {
+			header[2 + i] = (uint8_t) (frequency >> (8 * i));
+		}
+
+		mock->sweep_bytes += TIMSSDR_SWEEP_BLOCK_SIZE;
+		if (mock->sweep_bytes >= mock->sweep_bytes_per_tuning) {
+			mock->sweep_bytes = 0;
+			mock->sweep_step = (mock->sweep_step + 1) % mock->sweep_frequency_count;
+		}
+	}
+
+	return TIMSSDR_SWEEP_HEADER_SIZE;
+}
+
+static void mock_complete(struct mock_transport* mock, struct libusb_transfer* transfer, uint64_t now)
+{
+	int offset;
+
+	mock->completions++;
+	if (mock->config.error_interval != 0 &&
+	    mock->completions % mock->config.error_interval == 0) {
+		transfer->status = LIBUSB_TRANSFER_STALL;
+		transfer->actual_length = 0;
+		return;
+	}
+
+	transfer->status = LIBUSB_TRANSFER_COMPLETED;
+	transfer->actual_length = transfer->length;
+
+	// With sweep headers, the stamp goes into the first block's samples.
+	offset = mock_frame_sweep(mock, transfer);
+	if (mock->config.stamp_completions && transfer->length >= offset + (int) sizeof(now)) {
+		memcpy(transfer->buffer + offset, &now, sizeof(now));
+	}
+}
+
+static void* mock_threadproc(void* arg)
+{
+	struct mock_transport* mock = (struct mock_transport*) arg;
+	struct libusb_transfer* transfer;
+	struct timespec until;
+	uint64_t now, due;
+
+	pthread_mutex_lock(&mock->lock);
+	while (!mock->exit) {
+		// Cancellations are reported first, like libusb does on its
+		// next round of event handling.
+		if (mock->cancelled_count > 0) {
+			transfer = mock->cancelled[--mock->cancelled_count];
+			transfer->status = LIBUSB_TRANSFER_CANCELLED;
+			transfer->actual_length = 0;
+			pthread_mutex_unlock(&mock->lock);
+			transfer->callback(transfer);
+			pthread_mutex_lock(&mock->lock);
+			continue;
+		}
+
+		if (mock->count == 0) {
+			pthread_cond_wait(&mock->wakeup, &mock->lock);
+			continue;
+		}
+
+		transfer = mock->queue[mock->head].transfer;
+		due = mock->queue[mock->head].due_ns;
+		now = mock_now_ns();
+		if (now < due) {
+			until.tv_sec = (time_t) (due / 1000000000u);
+			until.tv_nsec = (long) (due % 1000000000u);
+			pthread_cond_timedwait(&mock->wakeup, &mock->lock, &until);
+			continue;
+		}
+
+		mock->head = (mock->head + 1) % mock->capacity;
+		mock->count--;
+
+		mock_complete(mock, transfer, now);
+		pthread_mutex_unlock(&mock->lock);
+		transfer->callback(transfer);
+		pthread_mutex_lock(&mock->lock);
+	}
+	pthread_mutex_unlock(&mock->lock);
+
+	return NULL;
+}
+
+static int mock_submit(struct timssdr_transport* transport, struct libusb_transfer* transfer)
+{
+	struct mock_transport* mock = (struct mock_transport*) transport;
+	struct mock_entry* entry;
+	int result = LIBUSB_SUCCESS;
+	uint64_t now;
+
+	pthread_mutex_lock(&mock->lock);
+	if (!mock_reserve(mock, mock->count + mock->cancelled_count + 1)) {
+		result = LIBUSB_ERROR_NO_MEM;
+	} else {
+		entry = &mock->queue[(mock->head + mock->count) % mock->capacity];
+		entry->transfer = transfer;
+		entry->due_ns = 0;
+		if (mock->ns_per_byte > 0) {
+			now = mock_now_ns();
+			if (mock->bus_ns < now) {
+				mock->bus_ns = now;
+			}
+			mock->bus_ns += (uint64_t) (transfer->length * mock->ns_per_byte);
+			entry->due_ns = mock->bus_ns;
+		}
+		mock->count++;
+		pthread_cond_signal(&mock->wakeup);
+	}
+	pthread_mutex_unlock(&mock->lock);
+
+	return result;
+}
+
+static int mock_cancel(struct timssdr_transport* transport, struct libusb_transfer* transfer)
+{
+	struct mock_transport* mock = (struct mock_transport*) transport;
+	int result = LIBUSB_ERROR_NOT_FOUND;
+	size_t i, from, to;
+
+	pthread_mutex_lock(&mock->lock);
+	for (i = 0; i < mock->count; i++) {
+		if (mock->queue[(mock->head + i) % mock->capacity].transfer != transfer) {
+			continue;
+		}
+
+		// Close the gap, keeping the order of the remaining transfers.
+		// Those behind it keep their due times, the stream is being
+		// stopped anyway.
+		for (; i + 1 < mock->count; i++) {
+			from = (mock->head + i + 1) % mock->capacity;
+			to = (mock->head + i) % mock->capacity;
+			mock->queue[to] = mock->queue[from];
+		}
+		mock->count--;
+		mock->cancelled[mock->cancelled_count++] = transfer;
+		pthread_cond_signal(&mock->wakeup);
+		result = LIBUSB_SUCCESS;
+		break;
+	}
+	pthread_mutex_unlock(&mock->lock);
+
+	return result;
+}
+
+static int mock_set_sweep(struct timssdr_transport* transport, const struct timssdr_sweep_plan* plan)
+{
+	struct mock_transport* mock = (struct mock_transport*) transport;
+	uint64_t* frequencies = NULL;
+
+	if (plan != NULL) {
+		frequencies = (uint64_t*) malloc(plan->frequency_count * sizeof(*frequencies));
+		if (frequencies == NULL) {
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		memcpy(frequencies, plan->frequencies, plan->frequency_count * sizeof(*frequencies));
+	}
+
+	pthread_mutex_lock(&mock->lock);
+	free(mock->sweep_frequencies);
+	mock->sweep_frequencies = frequencies;
+	mock->sweep_frequency_count = plan != NULL ? plan->frequency_count : 0;
+	mock->sweep_bytes_per_tuning = plan != NULL ? plan->bytes_per_tuning : 0;
+	mock->sweep_step = 0;
+	mock->sweep_bytes = 0;
+	pthread_mutex_unlock(&mock->lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+static void mock_destroy(struct timssdr_transport* transport)
+{
+	struct mock_transport* mock = (struct mock_transport*) transport;
+
+	pthread_mutex_lock(&mock->lock);
+	mock->exit = true;
+	pthread_cond_signal(&mock->wakeup);
+	pthread_mutex_unlock(&mock->lock);
+	pthread_join(mock->thread, NULL);
+
+	pthread_cond_destroy(&mock->wakeup);
+	pthread_mutex_destroy(&mock->lock);
+	free(mock->queue);
+	free(mock->cancelled);
+	free(mock->sweep_frequencies);
+	free(mock);
+}
+
+struct timssdr_transport* timssdr_mock_transport_create(const timssdr_mock_config* config)
+{
+	struct mock_transport* mock;
+	pthread_condattr_t attr;
+
+	mock = (struct mock_transport*) calloc(1, sizeof(*mock));
+	if (mock == NULL) {
+		return NULL;
+	}
+
+	mock->ops.submit = mock_submit;
+	mock->ops.cancel = mock_cancel;
+	mock->ops.set_sweep = mock_set_sweep;
+	mock->ops.destroy = mock_destroy;
+	if (config != NULL) {
+		mock->config = *config;
+	}
+	if (mock->config.sample_rate > 0) {
+		// Two bytes (one I/Q pair) per sample.
+		mock->ns_per_byte = 1e9 / (mock->config.sample_rate * 2.0);
+	}
+
+	pthread_mutex_init(&mock->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&mock->wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&mock->thread, NULL, mock_threadproc, mock) != 0) {
+		pthread_cond_destroy(&mock->wakeup);
+		pthread_mutex_destroy(&mock->lock);
+		free(mock);
+		return NULL;
+	}
+
+	return &mock->ops;
+}
@@ -0,0 +1,508 @@
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE /* recvmmsg() */
+#endif
+
+#include "timssdr.h"
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/*
+ * Receiving end of a timssdr-server stream.
+ *
+ * The client thread reassembles blocks from the packets and hands them to
+ * the callback. Over TCP a block is one packet and its samples are read
+ * straight into the block buffer. Over UDP datagrams are taken in batches
+ * with recvmmsg() and their samples copied into place; a gap in the
+ * sequence throws away the block being assembled, and delivery resumes
+ * with the next block that starts after it.
+ *
+ * Waits are bounded by NET_POLL_MS so that stopping never takes longer,
+ * and UDP subscriptions are renewed from the same loop.
+ */
+
+#define NET_POLL_MS          100
+#define NET_SUBSCRIBE_NS     1000000000ull /* UDP subscription renewal */
+#define NET_UDP_BATCH        32            /* datagrams per recvmmsg() */
+#define NET_UDP_RCVBUF       (8 << 20)     /* room for bursts while the callback runs */
+#define NET_MAX_BLOCK_LENGTH (64u << 20)   /* sanity limit on block_length */
+
+_Static_assert(sizeof(timssdr_net_header) == 48, "timssdr_net_header must have no padding");
+
+struct timssdr_net_client {
+	int fd;
+	enum timssdr_net_protocol protocol;
+	pthread_t thread;
+	bool thread_started;
+	atomic_bool do_exit;
+	bool tcp_done;                  /* the TCP stream ended or broke, it can't be restarted */
+	timssdr_sample_block_cb_fn callback;
+	void* rx_ctx;
+	bool delivering;                /* the callback hasn't asked to stop */
+	/* Block being assembled */
+	uint8_t* block;
+	uint32_t block_capacity;
+	uint32_t block_filled;          /* bytes received in order so far */
+	bool in_block;
+	timssdr_net_header block_header;
+	bool discontinuity;             /* packets were lost since the last delivered block */
+	uint64_t next_sequence;
+	bool have_sequence;
+	/* UDP receive batch */
+	uint8_t* datagrams;             /* NET_UDP_BATCH * TIMSSDR_NET_MAX_DATAGRAM bytes */
+	uint64_t last_subscribe_ns;
+	/* Counters, written by the client thread */
+	atomic_uint_fast64_t packets;
+	atomic_uint_fast64_t bytes;
+	atomic_uint_fast64_t lost_packets;
+	atomic_uint_fast64_t blocks;
+	atomic_uint_fast64_t dropped_blocks;
+};
+
+static uint64_t net_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static void header_from_wire(timssdr_net_header* header)
+{
+	header->magic = le32toh(header->magic);
+	header->version = le16toh(header->version);
+	header->type = le16toh(header->type);
+	header->sequence = le64toh(header->sequence);
+	header->sample_index = le64toh(header->sample_index);
+	header->timestamp_ns = le64toh(header->timestamp_ns);
+	header->block_flags = le32toh(header->block_flags);
+	header->block_length = le32toh(header->block_length);
+	header->offset = le32toh(header->offset);
+	header->length = le32toh(header->length);
+}
+
+/* Send a control packet to the server, UDP only. */
+static void send_control(timssdr_net_client* client, enum timssdr_net_packet_type type)
+{
+	timssdr_net_header header;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = htole32(TIMSSDR_NET_MAGIC);
+	header.version = htole16(TIMSSDR_NET_VERSION);
+	header.type = htole16((uint16_t) type);
+	// Best effort: a lost subscription is renewed, a lost
+	// unsubscription expires on the server.
+	send(client->fd, &header, sizeof(header), MSG_NOSIGNAL);
+	client->last_subscribe_ns = net_now_ns();
+}
+
+static void drop_block(timssdr_net_client* client)
+{
+	if (client->in_block) {
+		client->in_block = false;
+		client->dropped_blocks++;
+	}
+}
+
+/*
+ * Account for a received header and find where its samples go. Returns
+ * NULL if they are to be discarded.
+ */
+static uint8_t* begin_packet(timssdr_net_client* client, const timssdr_net_header* header)
+{
+	uint8_t* block;
+
+	if (header->magic != TIMSSDR_NET_MAGIC || header->version != TIMSSDR_NET_VERSION ||
+	    header->type != TIMSSDR_NET_PACKET_DATA) {
+		return NULL;
+	}
+
+	client->packets++;
+	client->bytes += header->length;
+
+	if (client->have_sequence && header->sequence != client->next_sequence) {
+		if (header->sequence > client->next_sequence) {
+			client->lost_packets += header->sequence - client->next_sequence;
+		}
+		drop_block(client);
+		client->discontinuity = true;
+	}
+	client->next_sequence = header->sequence + 1;
+	client->have_sequence = true;
+
+	if (header->offset == 0) {
+		// A new block: whatever was left of the previous one is lost.
+		drop_block(client);
+		if (header->block_length > NET_MAX_BLOCK_LENGTH) {
+			client->discontinuity = true;
+			return NULL;
+		}
+		if (header->block_length > client->block_capacity) {
+			block = (uint8_t*) realloc(client->block, header->block_length);
+			if (block == NULL) {
+				client->discontinuity = true;
+				return NULL;
+			}
+			client->block = block;
+			client->block_capacity = header->block_length;
+		}
+		client->block_header = *header;
+		client->block_filled = 0;
+		client->in_block = true;
+	}
+
+	if (!client->in_block || header->offset != client->block_filled ||
+	    header->block_length != client->block_header.block_length ||
+	    (uint64_t) header->offset + header->length > header->block_length) {
+		drop_block(client);
+		return NULL;
+	}
+
+	return client->block + header->offset;
+}
+
+/* The samples of a packet accepted by begin_packet() are in place. */
+static void end_packet(timssdr_net_client* client, const timssdr_net_header* header)
+{
+	timssdr_transfer transfer;
+
+	client->block_filled += header->length;
+	if (client->block_filled < client->block_header.block_length) {
+		return;
+	}
+
+	client->in_block = false;
+	client->blocks++;
+	if (!client->delivering) {
+		return;
+	}
+
+	memset(&transfer, 0, sizeof(transfer));
+	transfer.device = NULL;
+	transfer.buffer = client->block;
+	transfer.buffer_length = (int) client->block_capacity;
+	transfer.valid_length = (int) client->block_header.block_length;
+	transfer.rx_ctx = client->rx_ctx;
+	transfer.sample_index = client->block_header.sample_index;
+	transfer.timestamp_ns = client->block_header.timestamp_ns;
+	transfer.flags = client->block_header.block_flags;
+	if (client->discontinuity) {
+		transfer.flags |= TIMSSDR_TRANSFER_DISCONTINUITY;
+		client->discontinuity = false;
+	}
+
+	if (client->callback(&transfer) != 0) {
+		client->delivering = false;
+	}
+}
+
+/* Wait for the socket to become readable. Returns false on exit or error. */
+static bool wait_readable(timssdr_net_client* client)
+{
+	struct pollfd pfd = {.fd = client->fd, .events = POLLIN};
+	int result;
+
+	while (!client->do_exit) {
+		result = poll(&pfd, 1, NET_POLL_MS);
+		if (result > 0) {
+			return true;
+		}
+		if (result < 0 && errno != EINTR) {
+			return false;
+		}
+	}
+	return false;
+}
+
+/* Read exactly length bytes from the TCP stream, into a scratch area if buffer is NULL. */
+static bool read_full(timssdr_net_client* client, uint8_t* buffer, uint32_t length)
+{
+	uint8_t scratch[4096];
+	uint32_t done = 0, chunk;
+	ssize_t result;
+
+	while (done < length) {
+		if (!wait_readable(client)) {
+			return false;
+		}
+		chunk = length - done;
+		if (buffer == NULL && chunk > sizeof(scratch)) {
+			chunk = sizeof(scratch);
+		}
+		result = recv(client->fd, buffer != NULL ? buffer + done : scratch, chunk, 0);
+		if (result == 0) {
+			return false;
+		}
+		if (result < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			return false;
+		}
+		done += (uint32_t) result;
+	}
+	return true;
+}
+
+static void receive_tcp(timssdr_net_client* client)
+{
+	timssdr_net_header header;
+	uint8_t* destination;
+
+	while (!client->do_exit) {
+		if (!read_full(client, (uint8_t*) &header, sizeof(header))) {
+			break;
+		}
+		header_from_wire(&header);
+		if (header.magic != TIMSSDR_NET_MAGIC) {
+			// Out of step with the stream, nothing sensible follows.
+			break;
+		}
+		destination = begin_packet(client, &header);
+		if (!read_full(client, destination, header.length)) {
+			break;
+		}
+		if (destination != NULL) {
+			end_packet(client, &header);
+		}
+	}
+
+	if (!client->do_exit) {
+		client->tcp_done = true;
+	}
+}
+
+static void receive_udp(timssdr_net_client* client)
+{
+	struct mmsghdr messages[NET_UDP_BATCH];
+	struct iovec iovs[NET_UDP_BATCH];
+	timssdr_net_header header;
+	uint8_t* datagram;
+	uint8_t* destination;
+	int i, count;
+
+	for (i = 0; i < NET_UDP_BATCH; i++) {
+		iovs[i].iov_base = client->datagrams + (size_t) i * TIMSSDR_NET_MAX_DATAGRAM;
+		iovs[i].iov_len = TIMSSDR_NET_MAX_DATAGRAM;
+	}
+
+	send_control(client, TIMSSDR_NET_PACKET_SUBSCRIBE);
+	while (!client->do_exit) {
+		if (net_now_ns() - client->last_subscribe_ns >= NET_SUBSCRIBE_NS) {
+			send_control(client, TIMSSDR_NET_PACKET_SUBSCRIBE);
+		}
+
+		memset(messages, 0, sizeof(messages));
+		for (i = 0; i < NET_UDP_BATCH; i++) {
+			messages[i].msg_hdr.msg_iov = &iovs[i];
+			messages[i].msg_hdr.msg_iovlen = 1;
+		}
+		count = recvmmsg(client->fd, messages, NET_UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (count <= 0) {
+			// Nothing yet, or ICMP from a server that's (still) down.
+			struct pollfd pfd = {.fd = client->fd, .events = POLLIN};
+			poll(&pfd, 1, NET_POLL_MS);
+			continue;
+		}
+
+		for (i = 0; i < count; i++) {
+			datagram = (uint8_t*) iovs[i].iov_base;
+			if (messages[i].msg_len < sizeof(header)) {
+				continue;
+			}
+			memcpy(&header, datagram, sizeof(header));
+			header_from_wire(&header);
+			if (header.length != messages[i].msg_len - sizeof(header)) {
+				continue;
+			}
+			destination = begin_packet(client, &header);
+			if (destination != NULL) {
+				memcpy(destination, datagram + sizeof(header), header.length);
+				end_packet(client, &header);
+			}
+		}
+	}
+
+	send_control(client, TIMSSDR_NET_PACKET_UNSUBSCRIBE);
+}
+
+static void* net_client_threadproc(void* arg)
+{
+	timssdr_net_client* client = (timssdr_net_client*) arg;
+
+	if (client->protocol == TIMSSDR_NET_TCP) {
+		receive_tcp(client);
+	} else {
+		receive_udp(client);
+	}
+	return NULL;
+}
+
+int timssdr_net_connect(
+	const char* host,
+	uint16_t port,
+	enum timssdr_net_protocol protocol,
+	timssdr_net_client** client)
+{
+	struct addrinfo hints, *addresses, *address;
+	timssdr_net_client* lib_client;
+	char service[8];
+	int fd = -1, value;
+
+	if (host == NULL || client == NULL ||
+	    (protocol != TIMSSDR_NET_TCP && protocol != TIMSSDR_NET_UDP)) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = protocol == TIMSSDR_NET_TCP ? SOCK_STREAM : SOCK_DGRAM;
+	snprintf(service, sizeof(service), "%u", port);
+	if (getaddrinfo(host, service, &hints, &addresses) != 0) {
+		return TIMSSDR_ERROR_NOT_FOUND;
+	}
+
+	// UDP "connects" too, so only the server's datagrams are received.
+	for (address = addresses; address != NULL; address = address->ai_next) {
+		fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+	if (fd < 0) {
+		return TIMSSDR_ERROR_NETWORK;
+	}
+
+	lib_client = (timssdr_net_client*) calloc(1, sizeof(*lib_client));
+	if (lib_client == NULL) {
+		close(fd);
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	if (protocol == TIMSSDR_NET_TCP) {
+		value = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+	} else {
+		value = NET_UDP_RCVBUF;
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value));
+		lib_client->datagrams = (uint8_t*) malloc((size_t) NET_UDP_BATCH * TIMSSDR_NET_MAX_DATAGRAM);
+		if (lib_client->datagrams == NULL) {
+			free(lib_client);
+			close(fd);
+			return TIMSSDR_ERROR_NO_MEM;
+		}
+	}
+
+	lib_client->fd = fd;
+	lib_client->protocol = protocol;
+	lib_client->thread_started = false;
+	lib_client->do_exit = false;
+	lib_client->tcp_done = false;
+	lib_client->block = NULL;
+	lib_client->block_capacity = 0;
+	lib_client->in_block = false;
+	lib_client->discontinuity = false;
+	lib_client->have_sequence = false;
+
+	*client = lib_client;
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_net_start_rx(
+	timssdr_net_client* client,
+	timssdr_sample_block_cb_fn callback,
+	void* rx_ctx)
+{
+	if (client == NULL || callback == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (client->thread_started) {
+		return TIMSSDR_ERROR_BUSY;
+	}
+
+	if (client->tcp_done) {
+		return TIMSSDR_ERROR_NETWORK;
+	}
+
+	client->callback = callback;
+	client->rx_ctx = rx_ctx;
+	client->delivering = true;
+	client->do_exit = false;
+	// Whatever arrived before a restart is not contiguous with what follows.
+	client->in_block = false;
+	client->have_sequence = false;
+	client->discontinuity = false;
+
+	if (pthread_create(&client->thread, NULL, net_client_threadproc, client) != 0) {
+		return TIMSSDR_ERROR_THREAD;
+	}
+	client->thread_started = true;
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_net_stop_rx(timssdr_net_client* client)
+{
+	if (client == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	if (client->thread_started) {
+		client->do_exit = true;
+		pthread_join(client->thread, NULL);
+		client->thread_started = false;
+		if (client->protocol == TIMSSDR_NET_TCP) {
+			client->tcp_done = true;
+		}
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_net_get_stats(timssdr_net_client* client, timssdr_net_stats* stats)
+{
+	if (client == NULL || stats == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	stats->packets = atomic_load_explicit(&client->packets, memory_order_relaxed);
+	stats->bytes = atomic_load_explicit(&client->bytes, memory_order_relaxed);
+	stats->lost_packets = atomic_load_explicit(&client->lost_packets, memory_order_relaxed);
+	stats->blocks = atomic_load_explicit(&client->blocks, memory_order_relaxed);
+	stats->dropped_blocks = atomic_load_explicit(&client->dropped_blocks, memory_order_relaxed);
+
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_net_close(timssdr_net_client* client)
+{
+	if (client == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	timssdr_net_stop_rx(client);
+	close(client->fd);
+	free(client->datagrams);
+	free(client->block);
+	free(client);
+
+	return TIMSSDR_SUCCESS;
+}
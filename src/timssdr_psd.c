@@ -0,0 +1,851 @@
+#include "timssdr_psd.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef TIMSSDR_HAVE_FFTW
+	#include <fftw3.h>
+#endif
+
+/*
+ * Averaged power spectra on a pool of worker threads.
+ *
+ * The feeding thread copies every block into a free job and queues it;
+ * when no job is free the block is dropped, so the RX path never waits
+ * for the workers. Jobs are numbered as they are queued. A worker
+ * transforms a whole job into frames on its own, then waits for its turn
+ * to hand them to the callback, so frames come out in stream order and
+ * one callback at a time, while the FFTs themselves run in parallel.
+ *
+ * Frames span blocks. The feeding thread puts the samples a block left
+ * over (fewer than fft_size) in front of the next one, and tells each
+ * job how many segments the frame still open holds, so the worker knows
+ * how many of its segments go on with that frame. Emitting, which runs
+ * in job order, keeps the sum of the open frame between jobs.
+ *
+ * The FFT is planned once per stage: FFTW plans per worker (the planner
+ * isn't thread safe, so planning is serialized over all stages), or the
+ * built-in radix-2 FFT with per-stage twiddle tables shared by all
+ * workers. The inner loops run over contiguous arrays, so the compiler
+ * vectorizes windowing, butterflies and power accumulation.
+ */
+
+#define PSD_MIN_FFT_SIZE 16
+#define PSD_MAX_FFT_SIZE 65536
+#define PSD_MAX_THREADS  64
+
+#ifndef M_PI
+	#define M_PI 3.14159265358979323846
+#endif
+
+struct psd_job {
+	uint8_t* data;
+	size_t capacity;
+	int length;
+	uint64_t sample_index;
+	uint64_t timestamp_ns;
+	uint32_t flags;
+	bool sweep;
+	bool restart;      /* the open frame and carried samples were dropped */
+	uint32_t phase;    /* segments the open frame holds before this job */
+	uint64_t sequence; /* order in which the job was queued */
+};
+
+enum psd_slot_kind {
+	PSD_FRAME,    /* a whole frame, scaled */
+	PSD_CONTINUE, /* sum of segments going on with the open frame */
+	PSD_OPEN,     /* sum of segments starting a new open frame */
+};
+
+/* A frame (or part of one) waiting to be emitted; its bins are in psd_worker.power */
+struct psd_frame_info {
+	uint64_t sample_index;
+	uint64_t frequency;
+	enum psd_slot_kind kind;
+	uint32_t averaged;
+};
+
+struct psd_worker {
+	struct timssdr_psd* psd;
+	pthread_t thread;
+	float* input;          /* job converted to interleaved complex float */
+	size_t input_capacity; /* complex samples */
+	float* segment;        /* 2 * fft_size floats, built-in FFT only */
+	float* power;          /* fft_size floats per frame */
+	struct psd_frame_info* frames;
+	size_t frame_capacity;
+	timssdr_sweep_block* sweep_blocks;
+	int sweep_block_capacity;
+#ifdef TIMSSDR_HAVE_FFTW
+	fftwf_complex* fft_in;
+	fftwf_complex* fft_out;
+	fftwf_plan plan;
+#endif
+};
+
+struct timssdr_psd {
+	timssdr_psd_config config;
+	uint32_t step; /* fft_size - overlap */
+	enum timssdr_sample_format input_format;
+	timssdr_device* device;
+	timssdr_psd_cb_fn callback;
+	void* psd_ctx;
+
+	float* window;
+	float scale;       /* 1 / (sum of the window)^2 */
+	float* twiddles;   /* per stage, stage of length 2h at offset 2 * (h - 1) */
+	uint32_t* bitrev;  /* bit reversed index of each input sample */
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;   /* a job was queued or exit was set */
+	pthread_cond_t turn;   /* emit_sequence moved on */
+	struct psd_job* jobs;
+	uint32_t job_count;
+	uint32_t* free_jobs;   /* stack of job indices */
+	uint32_t free_count;
+	uint32_t* pending;     /* FIFO of job indices */
+	uint32_t pending_head;
+	uint32_t pending_count;
+	uint64_t next_sequence;
+	uint64_t emit_sequence;
+	bool exit;
+	atomic_bool stopped;   /* the callback asked for no more frames */
+
+	/* Feeding thread only */
+	uint8_t* carry;        /* samples left over by the last block, fewer than fft_size */
+	size_t carry_length;   /* bytes */
+	uint64_t carry_index;  /* sample index of the first carried sample */
+	uint32_t phase;        /* segments fed into the open frame so far */
+	bool dropped;          /* a block was skipped since the last job */
+
+	/* Emitting worker only */
+	float* open;           /* unscaled sum of the open frame */
+	uint32_t open_count;   /* segments in it, 0 when there is none */
+	uint64_t open_index;
+	uint32_t pending_flags; /* flags of the jobs since the last frame */
+
+	struct psd_worker* workers;
+	uint32_t worker_count;
+	uint32_t workers_started;
+};
+
+#ifdef TIMSSDR_HAVE_FFTW
+static pthread_mutex_t fftw_planner_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+const char* timssdr_psd_backend(void)
+{
+#ifdef TIMSSDR_HAVE_FFTW
+	return "fftw3f";
+#else
+	return "builtin";
+#endif
+}
+
+static float window_value(enum timssdr_window window, uint32_t n, uint32_t size)
+{
+	// Periodic windows, the usual choice for spectral analysis.
+	const double x = 2.0 * M_PI * n / size;
+
+	switch (window) {
+	case TIMSSDR_WINDOW_HANN:
+		return (float) (0.5 - 0.5 * cos(x));
+	case TIMSSDR_WINDOW_HAMMING:
+		return (float) (0.54 - 0.46 * cos(x));
+	case TIMSSDR_WINDOW_BLACKMAN_HARRIS:
+		return (float) (0.35875 - 0.48829 * cos(x) + 0.14128 * cos(2 * x) - 0.01168 * cos(3 * x));
+	case TIMSSDR_WINDOW_RECTANGULAR:
+	default:
+		return 1.0f;
+	}
+}
+
+static int plan_builtin(struct timssdr_psd* psd)
+{
+	const uint32_t size = psd->config.fft_size;
+	uint32_t bits = 0, half, j, i, reversed;
+
+	psd->twiddles = (float*) malloc(2 * (size - 1) * sizeof(float));
+	psd->bitrev = (uint32_t*) malloc(size * sizeof(uint32_t));
+	if (psd->twiddles == NULL || psd->bitrev == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	for (half = 1; half < size; half <<= 1) {
+		for (j = 0; j < half; j++) {
+			psd->twiddles[2 * (half - 1 + j)] = (float) cos(-M_PI * j / half);
+			psd->twiddles[2 * (half - 1 + j) + 1] = (float) sin(-M_PI * j / half);
+		}
+	}
+
+	while ((1u << bits) < size) {
+		bits++;
+	}
+	for (i = 0; i < size; i++) {
+		reversed = 0;
+		for (j = 0; j < bits; j++) {
+			reversed |= ((i >> j) & 1) << (bits - 1 - j);
+		}
+		psd->bitrev[i] = reversed;
+	}
+
+	return TIMSSDR_SUCCESS;
+}
+
+/* In-place decimation in time on bit reversed input, interleaved complex. */
+static void fft_builtin(const struct timssdr_psd* psd, float* x)
+{
+	const uint32_t size = psd->config.fft_size;
+	const float* w;
+	uint32_t half, i, j, a, b;
+	float xr, xi;
+
+	for (half = 1; half < size; half <<= 1) {
+		w = psd->twiddles + 2 * (half - 1);
+		for (i = 0; i < size; i += 2 * half) {
+			for (j = 0; j < half; j++) {
+				a = 2 * (i + j);
+				b = a + 2 * half;
+				xr = x[b] * w[2 * j] - x[b + 1] * w[2 * j + 1];
+				xi = x[b] * w[2 * j + 1] + x[b + 1] * w[2 * j];
+				x[b] = x[a] - xr;
+				x[b + 1] = x[a + 1] - xi;
+				x[a] += xr;
+				x[a + 1] += xi;
+			}
+		}
+	}
+}
+
+/* Add the power of one windowed segment to acc, DC moved to the middle. */
+static void accumulate_segment(struct psd_worker* worker, const float* samples, float* acc)
+{
+	const struct timssdr_psd* psd = worker->psd;
+	const uint32_t size = psd->config.fft_size;
+	const uint32_t half = size / 2;
+	const float* out;
+	uint32_t n, k;
+
+#ifdef TIMSSDR_HAVE_FFTW
+	float* in = (float*) worker->fft_in;
+
+	for (n = 0; n < size; n++) {
+		in[2 * n] = samples[2 * n] * psd->window[n];
+		in[2 * n + 1] = samples[2 * n + 1] * psd->window[n];
+	}
+	fftwf_execute(worker->plan);
+	out = (const float*) worker->fft_out;
+#else
+	float* x = worker->segment;
+	uint32_t r;
+
+	for (n = 0; n < size; n++) {
+		r = psd->bitrev[n];
+		x[2 * r] = samples[2 * n] * psd->window[n];
+		x[2 * r + 1] = samples[2 * n + 1] * psd->window[n];
+	}
+	fft_builtin(psd, x);
+	out = x;
+#endif
+
+	for (k = 0; k < half; k++) {
+		acc[half + k] += out[2 * k] * out[2 * k] + out[2 * k + 1] * out[2 * k + 1];
+		acc[k] += out[2 * (half + k)] * out[2 * (half + k)] +
+			out[2 * (half + k) + 1] * out[2 * (half + k) + 1];
+	}
+}
+
+static bool reserve_frames(struct psd_worker* worker, size_t frames)
+{
+	const uint32_t size = worker->psd->config.fft_size;
+	struct psd_frame_info* info;
+	float* power;
+
+	if (frames <= worker->frame_capacity) {
+		return true;
+	}
+
+	power = (float*) realloc(worker->power, frames * size * sizeof(float));
+	if (power == NULL) {
+		return false;
+	}
+	worker->power = power;
+
+	info = (struct psd_frame_info*) realloc(worker->frames, frames * sizeof(*info));
+	if (info == NULL) {
+		return false;
+	}
+	worker->frames = info;
+	worker->frame_capacity = frames;
+
+	return true;
+}
+
+/* Number of segments starting in count samples. */
+static size_t segments_in(const struct timssdr_psd* psd, size_t count)
+{
+	if (count < psd->config.fft_size) {
+		return 0;
+	}
+	return (count - psd->config.fft_size) / psd->step + 1;
+}
+
+/* Number of slots transform_span() fills for the same arguments. */
+static size_t slots_in(size_t segments, size_t head, size_t per_frame, bool open_tail)
+{
+	size_t slots = head > 0 ? 1 : 0;
+
+	segments -= head;
+	if (per_frame > 0) {
+		slots += segments / per_frame;
+		if (open_tail && segments % per_frame != 0) {
+			slots++;
+		}
+	}
+	return slots;
+}
+
+/* Sum segments consecutive segments from offset into the next slot. */
+static void sum_slot(
+	struct psd_worker* worker,
+	const struct psd_job* job,
+	size_t offset,
+	size_t segments,
+	enum psd_slot_kind kind,
+	uint64_t frequency,
+	size_t* frame_count)
+{
+	const struct timssdr_psd* psd = worker->psd;
+	const uint32_t size = psd->config.fft_size;
+	struct psd_frame_info* info;
+	float* acc;
+	float scale;
+	size_t s;
+	uint32_t k;
+
+	acc = worker->power + (*frame_count) * size;
+	memset(acc, 0, size * sizeof(float));
+	for (s = 0; s < segments; s++) {
+		accumulate_segment(worker, worker->input + 2 * (offset + s * psd->step), acc);
+	}
+	// Partial sums are scaled once the frame is complete.
+	if (kind == PSD_FRAME) {
+		scale = psd->scale / (float) segments;
+		for (k = 0; k < size; k++) {
+			acc[k] *= scale;
+		}
+	}
+
+	info = &worker->frames[*frame_count];
+	info->sample_index = job->sample_index + offset;
+	info->frequency = frequency;
+	info->kind = kind;
+	info->averaged = (uint32_t) segments;
+	(*frame_count)++;
+}
+
+/*
+ * Transform the segments starting at offset: the first head of them go on
+ * with the open frame, the rest make frames of per_frame segments, and
+ * with open_tail set, the segments left over open a new frame.
+ */
+static void transform_span(
+	struct psd_worker* worker,
+	const struct psd_job* job,
+	size_t offset,
+	size_t segments,
+	size_t head,
+	size_t per_frame,
+	bool open_tail,
+	uint64_t frequency,
+	size_t* frame_count)
+{
+	const uint32_t step = worker->psd->step;
+	size_t s = 0;
+
+	if (head > 0) {
+		sum_slot(worker, job, offset, head, PSD_CONTINUE, frequency, frame_count);
+		s = head;
+	}
+	while (per_frame > 0 && segments - s >= per_frame) {
+		sum_slot(worker, job, offset + s * step, per_frame, PSD_FRAME, frequency, frame_count);
+		s += per_frame;
+	}
+	if (open_tail && s < segments) {
+		sum_slot(worker, job, offset + s * step, segments - s, PSD_OPEN, frequency, frame_count);
+	}
+}
+
+/* Turn a job into frames. Returns false if out of memory. */
+static bool process_job(struct psd_worker* worker, const struct psd_job* job, size_t* frame_count)
+{
+	const struct timssdr_psd* psd = worker->psd;
+	const size_t count = (size_t) job->length / 2;
+	const size_t averages = psd->config.averages;
+	size_t slots = 0, offset, segments, head, per_frame;
+	int blocks, i, max_blocks;
+
+	*frame_count = 0;
+	if (count > worker->input_capacity) {
+		float* input = (float*) realloc(worker->input, count * 2 * sizeof(float));
+		if (input == NULL) {
+			return false;
+		}
+		worker->input = input;
+		worker->input_capacity = count;
+	}
+	timssdr_convert(psd->input_format, job->data, TIMSSDR_FORMAT_CF32, worker->input, count);
+
+	if (!job->sweep) {
+		segments = segments_in(psd, count);
+		head = 0;
+		if (averages > 0 && job->phase > 0) {
+			head = averages - job->phase < segments ? averages - job->phase : segments;
+		}
+		per_frame = averages ? averages : segments;
+		if (!reserve_frames(worker, slots_in(segments, head, per_frame, averages > 0))) {
+			return false;
+		}
+		transform_span(worker, job, 0, segments, head, per_frame, averages > 0, 0, frame_count);
+		return true;
+	}
+
+	max_blocks = job->length / TIMSSDR_SWEEP_BLOCK_SIZE + 1;
+	if (max_blocks > worker->sweep_block_capacity) {
+		timssdr_sweep_block* sweep_blocks = (timssdr_sweep_block*) realloc(
+			worker->sweep_blocks,
+			max_blocks * sizeof(*sweep_blocks));
+		if (sweep_blocks == NULL) {
+			return false;
+		}
+		worker->sweep_blocks = sweep_blocks;
+		worker->sweep_block_capacity = max_blocks;
+	}
+	timssdr_sweep_parse(job->data, job->length, worker->sweep_blocks, max_blocks, &blocks);
+
+	// Sweep blocks are at different frequencies, so frames don't span them
+	// and average at most the segments of one sweep block.
+	for (i = 0; i < blocks; i++) {
+		segments = segments_in(psd, (size_t) worker->sweep_blocks[i].length / 2);
+		per_frame = averages > 0 && averages <= segments ? averages : segments;
+		slots += slots_in(segments, 0, per_frame, false);
+	}
+	if (!reserve_frames(worker, slots)) {
+		return false;
+	}
+
+	// The header is an even number of bytes, so samples stay paired.
+	for (i = 0; i < blocks; i++) {
+		offset = (size_t) (worker->sweep_blocks[i].samples - job->data) / 2;
+		segments = segments_in(psd, (size_t) worker->sweep_blocks[i].length / 2);
+		per_frame = averages > 0 && averages <= segments ? averages : segments;
+		transform_span(
+			worker,
+			job,
+			offset,
+			segments,
+			0,
+			per_frame,
+			false,
+			worker->sweep_blocks[i].frequency,
+			frame_count);
+	}
+
+	return true;
+}
+
+static void emit_frame(
+	struct timssdr_psd* psd,
+	const struct psd_job* job,
+	const float* power,
+	uint32_t averaged,
+	uint64_t sample_index,
+	uint64_t frequency)
+{
+	timssdr_psd_frame frame;
+
+	frame.device = psd->device;
+	frame.power = power;
+	frame.bin_count = psd->config.fft_size;
+	frame.averaged = averaged;
+	frame.sample_index = sample_index;
+	frame.timestamp_ns = job->timestamp_ns;
+	frame.frequency = frequency;
+	frame.flags = psd->pending_flags;
+	frame.psd_ctx = psd->psd_ctx;
+	psd->pending_flags = 0;
+	if (psd->callback(&frame) != 0) {
+		psd->stopped = true;
+	}
+}
+
+/* Emit the frames of a job, failed when it couldn't be transformed. */
+static void emit_frames(struct psd_worker* worker, const struct psd_job* job, size_t frame_count, bool failed)
+{
+	struct timssdr_psd* psd = worker->psd;
+	const uint32_t size = psd->config.fft_size;
+	const struct psd_frame_info* info;
+	const float* power;
+	float scale;
+	size_t f;
+	uint32_t k;
+
+	psd->pending_flags |= job->flags;
+	// The open frame only goes on if the jobs before built it the way the
+	// feeding thread expected.
+	if (failed || job->restart || psd->open_count != job->phase) {
+		psd->open_count = 0;
+	}
+
+	for (f = 0; f < frame_count && !psd->stopped; f++) {
+		info = &worker->frames[f];
+		power = worker->power + f * size;
+		switch (info->kind) {
+		case PSD_FRAME:
+			emit_frame(psd, job, power, info->averaged, info->sample_index, info->frequency);
+			break;
+		case PSD_CONTINUE:
+			if (psd->open_count == 0) {
+				break;
+			}
+			for (k = 0; k < size; k++) {
+				psd->open[k] += power[k];
+			}
+			psd->open_count += info->averaged;
+			if (psd->open_count == psd->config.averages) {
+				scale = psd->scale / (float) psd->open_count;
+				for (k = 0; k < size; k++) {
+					psd->open[k] *= scale;
+				}
+				emit_frame(psd, job, psd->open, psd->open_count, psd->open_index, 0);
+				psd->open_count = 0;
+			}
+			break;
+		case PSD_OPEN:
+			memcpy(psd->open, power, size * sizeof(float));
+			psd->open_count = info->averaged;
+			psd->open_index = info->sample_index;
+			break;
+		}
+	}
+}
+
+static void* psd_threadproc(void* arg)
+{
+	struct psd_worker* worker = (struct psd_worker*) arg;
+	struct timssdr_psd* psd = worker->psd;
+	struct psd_job* job;
+	size_t frame_count = 0;
+	uint32_t index;
+	bool failed;
+
+	pthread_mutex_lock(&psd->lock);
+	for (;;) {
+		while (psd->pending_count == 0 && !psd->exit) {
+			pthread_cond_wait(&psd->work, &psd->lock);
+		}
+		// Queued jobs are finished before exiting.
+		if (psd->pending_count == 0) {
+			break;
+		}
+
+		index = psd->pending[psd->pending_head];
+		psd->pending_head = (psd->pending_head + 1) % psd->job_count;
+		psd->pending_count--;
+		job = &psd->jobs[index];
+		pthread_mutex_unlock(&psd->lock);
+
+		failed = !psd->stopped && !process_job(worker, job, &frame_count);
+
+		pthread_mutex_lock(&psd->lock);
+		while (psd->emit_sequence != job->sequence) {
+			pthread_cond_wait(&psd->turn, &psd->lock);
+		}
+		pthread_mutex_unlock(&psd->lock);
+
+		emit_frames(worker, job, psd->stopped ? 0 : frame_count, failed);
+
+		pthread_mutex_lock(&psd->lock);
+		psd->emit_sequence++;
+		psd->free_jobs[psd->free_count++] = index;
+		pthread_cond_broadcast(&psd->turn);
+	}
+	pthread_mutex_unlock(&psd->lock);
+
+	return NULL;
+}
+
+static int setup_worker(struct timssdr_psd* psd, struct psd_worker* worker)
+{
+	const uint32_t size = psd->config.fft_size;
+
+	worker->psd = psd;
+#ifdef TIMSSDR_HAVE_FFTW
+	worker->fft_in = (fftwf_complex*) fftwf_malloc(size * sizeof(fftwf_complex));
+	worker->fft_out = (fftwf_complex*) fftwf_malloc(size * sizeof(fftwf_complex));
+	if (worker->fft_in == NULL || worker->fft_out == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+	pthread_mutex_lock(&fftw_planner_lock);
+	worker->plan = fftwf_plan_dft_1d(
+		(int) size,
+		worker->fft_in,
+		worker->fft_out,
+		FFTW_FORWARD,
+		FFTW_MEASURE);
+	pthread_mutex_unlock(&fftw_planner_lock);
+	if (worker->plan == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+#else
+	worker->segment = (float*) malloc(2 * size * sizeof(float));
+	if (worker->segment == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+#endif
+	return TIMSSDR_SUCCESS;
+}
+
+static void free_worker(struct psd_worker* worker)
+{
+#ifdef TIMSSDR_HAVE_FFTW
+	if (worker->plan != NULL) {
+		pthread_mutex_lock(&fftw_planner_lock);
+		fftwf_destroy_plan(worker->plan);
+		pthread_mutex_unlock(&fftw_planner_lock);
+	}
+	fftwf_free(worker->fft_in);
+	fftwf_free(worker->fft_out);
+#endif
+	free(worker->segment);
+	free(worker->input);
+	free(worker->power);
+	free(worker->frames);
+	free(worker->sweep_blocks);
+}
+
+void timssdr_psd_destroy(struct timssdr_psd* psd)
+{
+	uint32_t i;
+
+	if (psd == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&psd->lock);
+	psd->exit = true;
+	pthread_cond_broadcast(&psd->work);
+	pthread_mutex_unlock(&psd->lock);
+	for (i = 0; i < psd->workers_started; i++) {
+		pthread_join(psd->workers[i].thread, NULL);
+	}
+
+	if (psd->workers != NULL) {
+		for (i = 0; i < psd->worker_count; i++) {
+			free_worker(&psd->workers[i]);
+		}
+	}
+	if (psd->jobs != NULL) {
+		for (i = 0; i < psd->job_count; i++) {
+			free(psd->jobs[i].data);
+		}
+	}
+
+	pthread_cond_destroy(&psd->turn);
+	pthread_cond_destroy(&psd->work);
+	pthread_mutex_destroy(&psd->lock);
+	free(psd->workers);
+	free(psd->jobs);
+	free(psd->free_jobs);
+	free(psd->pending);
+	free(psd->carry);
+	free(psd->open);
+	free(psd->bitrev);
+	free(psd->twiddles);
+	free(psd->window);
+	free(psd);
+}
+
+int timssdr_psd_create(
+	const timssdr_psd_config* config,
+	enum timssdr_sample_format input_format,
+	timssdr_device* device,
+	timssdr_psd_cb_fn callback,
+	void* psd_ctx,
+	struct timssdr_psd** out)
+{
+	struct timssdr_psd* psd;
+	double sum = 0;
+	uint32_t i;
+	int result;
+
+	if (config == NULL || callback == NULL || out == NULL ||
+	    config->fft_size < PSD_MIN_FFT_SIZE || config->fft_size > PSD_MAX_FFT_SIZE ||
+	    (config->fft_size & (config->fft_size - 1)) != 0 ||
+	    config->overlap >= config->fft_size || config->threads > PSD_MAX_THREADS ||
+	    (uint32_t) config->window > TIMSSDR_WINDOW_BLACKMAN_HARRIS ||
+	    (input_format != TIMSSDR_FORMAT_S8 && input_format != TIMSSDR_FORMAT_U8)) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	psd = (struct timssdr_psd*) calloc(1, sizeof(*psd));
+	if (psd == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	psd->config = *config;
+	psd->step = config->fft_size - config->overlap;
+	psd->input_format = input_format;
+	psd->device = device;
+	psd->callback = callback;
+	psd->psd_ctx = psd_ctx;
+	psd->worker_count = config->threads ? config->threads : 1;
+	// Enough to keep every worker busy with a block queued behind each.
+	psd->job_count = 2 * psd->worker_count + 2;
+	psd->free_count = psd->job_count;
+	atomic_init(&psd->stopped, false);
+	pthread_mutex_init(&psd->lock, NULL);
+	pthread_cond_init(&psd->work, NULL);
+	pthread_cond_init(&psd->turn, NULL);
+
+	psd->window = (float*) malloc(config->fft_size * sizeof(float));
+	psd->jobs = (struct psd_job*) calloc(psd->job_count, sizeof(*psd->jobs));
+	psd->free_jobs = (uint32_t*) malloc(psd->job_count * sizeof(uint32_t));
+	psd->pending = (uint32_t*) malloc(psd->job_count * sizeof(uint32_t));
+	psd->workers = (struct psd_worker*) calloc(psd->worker_count, sizeof(*psd->workers));
+	psd->carry = (uint8_t*) malloc(2 * config->fft_size);
+	psd->open = (float*) malloc(config->fft_size * sizeof(float));
+	if (psd->window == NULL || psd->jobs == NULL || psd->free_jobs == NULL ||
+	    psd->pending == NULL || psd->workers == NULL || psd->carry == NULL ||
+	    psd->open == NULL) {
+		timssdr_psd_destroy(psd);
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < config->fft_size; i++) {
+		psd->window[i] = window_value(config->window, i, config->fft_size);
+		sum += psd->window[i];
+	}
+	psd->scale = (float) (1.0 / (sum * sum));
+
+	for (i = 0; i < psd->job_count; i++) {
+		psd->free_jobs[i] = i;
+	}
+
+#ifndef TIMSSDR_HAVE_FFTW
+	result = plan_builtin(psd);
+	if (result != TIMSSDR_SUCCESS) {
+		timssdr_psd_destroy(psd);
+		return result;
+	}
+#endif
+
+	for (i = 0; i < psd->worker_count; i++) {
+		result = setup_worker(psd, &psd->workers[i]);
+		if (result != TIMSSDR_SUCCESS) {
+			timssdr_psd_destroy(psd);
+			return result;
+		}
+	}
+
+	for (i = 0; i < psd->worker_count; i++) {
+		if (pthread_create(&psd->workers[i].thread, NULL, psd_threadproc, &psd->workers[i]) != 0) {
+			timssdr_psd_destroy(psd);
+			return TIMSSDR_ERROR_THREAD;
+		}
+		psd->workers_started++;
+	}
+
+	*out = psd;
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_psd_feed(
+	struct timssdr_psd* psd,
+	const uint8_t* buffer,
+	int length,
+	uint64_t sample_index,
+	uint64_t timestamp_ns,
+	uint32_t flags,
+	int sweep)
+{
+	struct psd_job* job;
+	uint32_t index;
+	uint8_t* data;
+	size_t carry, size, count, segments, consumed;
+	bool restart;
+
+	if (psd->stopped || length <= 0) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&psd->lock);
+	if (psd->free_count == 0) {
+		pthread_mutex_unlock(&psd->lock);
+		psd->dropped = true;
+		return 0;
+	}
+	index = psd->free_jobs[--psd->free_count];
+	pthread_mutex_unlock(&psd->lock);
+
+	// Carried samples and the open frame only go on with the samples right after them.
+	restart = sweep || psd->dropped || (flags & TIMSSDR_TRANSFER_DISCONTINUITY) ||
+		sample_index != psd->carry_index + psd->carry_length / 2;
+	if (restart) {
+		psd->carry_length = 0;
+		psd->phase = 0;
+	}
+	carry = psd->carry_length;
+	size = carry + (size_t) length;
+
+	// Only this thread touches a job between taking it and queueing it.
+	job = &psd->jobs[index];
+	if (size > job->capacity) {
+		data = (uint8_t*) realloc(job->data, size);
+		if (data == NULL) {
+			pthread_mutex_lock(&psd->lock);
+			psd->free_jobs[psd->free_count++] = index;
+			pthread_mutex_unlock(&psd->lock);
+			psd->dropped = true;
+			return 0;
+		}
+		job->data = data;
+		job->capacity = size;
+	}
+	memcpy(job->data, psd->carry, carry);
+	memcpy(job->data + carry, buffer, (size_t) length);
+	job->length = (int) size;
+	job->sample_index = sample_index - carry / 2;
+	job->timestamp_ns = timestamp_ns;
+	job->flags = flags;
+	if (psd->dropped) {
+		job->flags |= TIMSSDR_TRANSFER_DISCONTINUITY;
+		psd->dropped = false;
+	}
+	job->sweep = sweep != 0;
+	job->restart = restart;
+	job->phase = psd->phase;
+
+	if (!job->sweep) {
+		count = size / 2;
+		segments = segments_in(psd, count);
+		consumed = segments * psd->step;
+		psd->carry_length = 2 * (count - consumed);
+		memcpy(psd->carry, job->data + 2 * consumed, psd->carry_length);
+		psd->carry_index = job->sample_index + consumed;
+		if (psd->config.averages > 0) {
+			psd->phase = (uint32_t) ((psd->phase + segments) % psd->config.averages);
+		}
+	}
+
+	pthread_mutex_lock(&psd->lock);
+	job->sequence = psd->next_sequence++;
+	psd->pending[(psd->pending_head + psd->pending_count) % psd->job_count] = index;
+	psd->pending_count++;
+	pthread_cond_signal(&psd->work);
+	pthread_mutex_unlock(&psd->lock);
+
+	return 1;
+}
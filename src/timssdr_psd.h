@@ -0,0 +1,40 @@
+#ifndef TIMSSDR_PSD_H
+#define TIMSSDR_PSD_H
+
+#include "timssdr.h"
+
+/*
+ * PSD pipeline stage, see timssdr_set_psd(). Blocks are fed from one
+ * thread at a time (the thread delivering RX blocks) and copied into a
+ * job, so the caller's buffer can be reused as soon as feeding returns.
+ */
+
+struct timssdr_psd;
+
+/* input_format is the format of the fed samples, S8 or U8. */
+int timssdr_psd_create(
+	const timssdr_psd_config* config,
+	enum timssdr_sample_format input_format,
+	timssdr_device* device,
+	timssdr_psd_cb_fn callback,
+	void* psd_ctx,
+	struct timssdr_psd** psd);
+
+/*
+ * Queue a block for transformation. With sweep set, the buffer is made of
+ * sweep blocks, see timssdr_sweep_parse(). Returns 0 if every job was busy
+ * and the block was dropped.
+ */
+int timssdr_psd_feed(
+	struct timssdr_psd* psd,
+	const uint8_t* buffer,
+	int length,
+	uint64_t sample_index,
+	uint64_t timestamp_ns,
+	uint32_t flags,
+	int sweep);
+
+/* Finish queued blocks, then stop the workers. */
+void timssdr_psd_destroy(struct timssdr_psd* psd);
+
+#endif /* TIMSSDR_PSD_H */
@@ -0,0 +1,100 @@
+#include "timssdr_queue.h"
+
+// atomicops.h uses errno without including it on POSIX.
+#include <cerrno>
+#include "readerwriterqueue/readerwriterqueue.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+
+struct timssdr_queue {
+	explicit timssdr_queue(size_t capacity) : items(capacity), waiting(false) {}
+
+	moodycamel::ReaderWriterQueue<void*> items;
+
+	/*
+	 * The consumer only sleeps when the queue is empty. The producer
+	 * touches the mutex only if it sees the consumer waiting, so the
+	 * push path stays lock-free while the consumer keeps up.
+	 */
+	std::atomic<bool> waiting;
+	std::mutex lock;
+	std::condition_variable available;
+};
+
+extern "C" {
+
+timssdr_queue* timssdr_queue_create(size_t capacity)
+{
+	try {
+		return new timssdr_queue(capacity);
+	} catch (...) {
+		return nullptr;
+	}
+}
+
+void timssdr_queue_destroy(timssdr_queue* queue)
+{
+	delete queue;
+}
+
+int timssdr_queue_push(timssdr_queue* queue, void* item)
+{
+	if (!queue->items.try_enqueue(item)) {
+		return 0;
+	}
+
+	/*
+	 * Pairs with the fence in timssdr_queue_pop_wait(): either this load
+	 * sees the consumer waiting, or the consumer's check of the queue sees
+	 * the item just enqueued. Without it the load may be ordered before the
+	 * enqueue and both sides miss each other.
+	 */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (queue->waiting.load(std::memory_order_relaxed)) {
+		std::lock_guard<std::mutex> guard(queue->lock);
+		queue->available.notify_one();
+	}
+	return 1;
+}
+
+int timssdr_queue_try_pop(timssdr_queue* queue, void** item)
+{
+	return queue->items.try_dequeue(*item) ? 1 : 0;
+}
+
+int timssdr_queue_pop_wait(timssdr_queue* queue, void** item, int timeout_ms)
+{
+	if (queue->items.try_dequeue(*item)) {
+		return 1;
+	}
+
+	std::unique_lock<std::mutex> guard(queue->lock);
+	queue->waiting.store(true, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	auto ready = [queue, item] { return queue->items.try_dequeue(*item); };
+	bool popped;
+	if (timeout_ms < 0) {
+		queue->available.wait(guard, ready);
+		popped = true;
+	} else {
+		popped = queue->available.wait_for(
+			guard,
+			std::chrono::milliseconds(timeout_ms),
+			ready);
+	}
+
+	queue->waiting.store(false, std::memory_order_relaxed);
+	return popped ? 1 : 0;
+}
+
+size_t timssdr_queue_size(timssdr_queue* queue)
+{
+	return queue->items.size_approx();
+}
+
+} // extern "C"
@@ -0,0 +1,44 @@
+#ifndef TIMSSDR_QUEUE_H
+#define TIMSSDR_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * C interface to the vendored moodycamel::ReaderWriterQueue, used to pass
+ * pointers between exactly one producer and one consumer thread without
+ * taking a lock on the fast path. Only the thread currently acting as
+ * consumer may pop, only the one acting as producer may push.
+ */
+
+typedef struct timssdr_queue timssdr_queue;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Create a queue that holds up to capacity items without allocating. */
+timssdr_queue* timssdr_queue_create(size_t capacity);
+
+void timssdr_queue_destroy(timssdr_queue* queue);
+
+/* Push item, never allocates. Returns 0 if the queue is full. */
+int timssdr_queue_push(timssdr_queue* queue, void* item);
+
+/* Pop an item without waiting. Returns 0 if the queue is empty. */
+int timssdr_queue_try_pop(timssdr_queue* queue, void** item);
+
+/*
+ * Pop an item, waiting up to timeout_ms milliseconds for one to arrive.
+ * A negative timeout waits forever. Returns 0 on timeout.
+ */
+int timssdr_queue_pop_wait(timssdr_queue* queue, void** item, int timeout_ms);
+
+/* Approximate number of queued items, safe from either side. */
+size_t timssdr_queue_size(timssdr_queue* queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TIMSSDR_QUEUE_H */
@@ -0,0 +1,553 @@
+#include "timssdr_shm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+
+/*
+ * Shared-memory ring of received blocks.
+ *
+ * The ring is a file on hugetlbfs when hugepages are available, a POSIX
+ * shared memory object otherwise, so consumers can find it by name. Its
+ * slots are the transfer buffers themselves: the broker submits transfers
+ * straight into the slots and publishes each completed one in place, so
+ * the samples are never copied on either side.
+ *
+ * Every slot carries the sequence number of the block it holds. Before a
+ * transfer is submitted into a slot, the slot is marked as being written;
+ * consumers check the number before and after reading a block (like a
+ * seqlock), so a consumer that fell a lap behind notices instead of
+ * reading torn data. The broker never waits for consumers. Blocking reads
+ * sleep on a futex word that the broker bumps with every block; consumers
+ * map the ring read-only, so the broker wakes unconditionally.
+ */
+
+#define SHM_MAGIC        0x4d485354u /* "TSHM" */
+#define SHM_VERSION      1
+#define SHM_SLOT_WRITING UINT64_MAX
+#define SHM_PAGE_SIZE    4096
+#define SHM_MAP_ALIGN    (2u << 20)  /* hugepage size, ring size is a multiple of it */
+#define SHM_NAME_MAX     200
+#define SHM_HUGETLBFS    "/dev/hugepages"
+#define HUGETLBFS_MAGIC  0x958458f6
+
+struct shm_slot {
+	_Atomic uint64_t sequence;  /* block held, SHM_SLOT_WRITING while a transfer fills it */
+	uint64_t sample_index;
+	uint64_t timestamp_ns;
+	uint32_t flags;
+	int32_t length;
+};
+
+struct shm_header {
+	uint32_t magic;             /* written last, once the ring is set up */
+	uint32_t version;
+	uint32_t slot_count;
+	uint32_t slot_size;
+	uint32_t in_flight;         /* slots the broker may be writing at once */
+	uint32_t reserved;
+	uint64_t data_offset;       /* of slot 0, from the start of the ring */
+	uint64_t map_length;
+	_Atomic uint64_t head;      /* number of blocks published */
+	_Atomic uint32_t wake;      /* futex word */
+	_Atomic uint32_t ended;
+	struct shm_slot slots[];
+};
+
+struct timssdr_shm_ring {
+	char path[SHM_NAME_MAX + 32];
+	bool huge;                  /* path is on hugetlbfs, else a shm_open() name */
+	int fd;
+	uint8_t* map;
+	size_t map_length;
+	struct shm_header* header;
+	uint8_t* data;
+	uint64_t published;
+};
+
+struct timssdr_shm_consumer {
+	int fd;
+	const uint8_t* map;
+	size_t map_length;
+	const struct shm_header* header;
+	const uint8_t* data;
+	uint64_t next;              /* sequence of the next block to read */
+	uint64_t last;              /* sequence of the block last handed out */
+	bool have_last;
+	bool discontinuity;
+	uint64_t overruns;
+};
+
+static bool valid_name(const char* name)
+{
+	size_t length;
+
+	if (name == NULL) {
+		return false;
+	}
+	length = strlen(name);
+	return length > 0 && length <= SHM_NAME_MAX && strchr(name, '/') == NULL;
+}
+
+static bool have_hugetlbfs(void)
+{
+	struct statfs fs;
+
+	return statfs(SHM_HUGETLBFS, &fs) == 0 && (unsigned long) fs.f_type == HUGETLBFS_MAGIC;
+}
+
+static void ring_path(const char* name, bool huge, char* path, size_t size)
+{
+	if (huge) {
+		snprintf(path, size, SHM_HUGETLBFS "/timssdr-%s", name);
+	} else {
+		snprintf(path, size, "/timssdr-%s", name);
+	}
+}
+
+static int open_ring(const char* path, bool huge, int flags, mode_t mode)
+{
+	if (huge) {
+		return open(path, flags | O_CLOEXEC, mode);
+	}
+	return shm_open(path, flags, mode);
+}
+
+static void unlink_ring(const char* path, bool huge)
+{
+	if (huge) {
+		unlink(path);
+	} else {
+		shm_unlink(path);
+	}
+}
+
+static long futex(_Atomic uint32_t* word, int op, uint32_t value, const struct timespec* timeout)
+{
+	return syscall(SYS_futex, (uint32_t*) word, op, value, timeout, NULL, 0);
+}
+
+/* Fault in a fresh mapping, writing zeroes where the kernel can't do it. */
+static void prefault(uint8_t* map, size_t length)
+{
+	size_t offset;
+
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(map, length, MADV_POPULATE_WRITE) == 0) {
+		return;
+	}
+#endif
+	for (offset = 0; offset < length; offset += SHM_PAGE_SIZE) {
+		((volatile uint8_t*) map)[offset] = 0;
+	}
+}
+
+/* Create and map the backing file, hugetlbfs first. */
+static int create_backing(struct timssdr_shm_ring* ring, const char* name, size_t length)
+{
+	const bool options[2] = {true, false};
+	void* map;
+	int i, fd;
+
+	for (i = 0; i < 2; i++) {
+		if (options[i] && !have_hugetlbfs()) {
+			continue;
+		}
+		ring_path(name, options[i], ring->path, sizeof(ring->path));
+		// A ring left behind by a broker that died is taken over.
+		unlink_ring(ring->path, options[i]);
+		fd = open_ring(ring->path, options[i], O_CREAT | O_EXCL | O_RDWR, 0644);
+		if (fd < 0) {
+			continue;
+		}
+		// On hugetlbfs the pages are reserved here, so a lack of
+		// hugepages fails now rather than faulting later. The ring is
+		// populated up front so the first laps don't take page faults
+		// in the libusb thread. Shared memory is populated only after
+		// the hugepage advice, or it would be faulted in 4 KiB pages.
+		if (ftruncate(fd, (off_t) length) == 0) {
+			map = mmap(
+				NULL,
+				length,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | (options[i] ? MAP_POPULATE : 0),
+				fd,
+				0);
+			if (map != MAP_FAILED) {
+				if (!options[i]) {
+					madvise(map, length, MADV_HUGEPAGE);
+					prefault(map, length);
+				}
+				ring->huge = options[i];
+				ring->fd = fd;
+				ring->map = (uint8_t*) map;
+				ring->map_length = length;
+				return TIMSSDR_SUCCESS;
+			}
+		}
+		close(fd);
+		unlink_ring(ring->path, options[i]);
+	}
+
+	return TIMSSDR_ERROR_FILE;
+}
+
+int timssdr_shm_ring_create(
+	const char* name,
+	uint32_t slot_count,
+	uint32_t slot_size,
+	uint32_t in_flight,
+	struct timssdr_shm_ring** ring)
+{
+	struct timssdr_shm_ring* lib_ring;
+	struct shm_header* header;
+	size_t header_size, data_size, length;
+	uint32_t i;
+	int result;
+
+	if (!valid_name(name) || slot_count == 0 || slot_size == 0 || in_flight >= slot_count) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	header_size = offsetof(struct shm_header, slots) + (size_t) slot_count * sizeof(struct shm_slot);
+	header_size = (header_size + SHM_PAGE_SIZE - 1) / SHM_PAGE_SIZE * SHM_PAGE_SIZE;
+	data_size = (size_t) slot_count * slot_size;
+	length = (header_size + data_size + SHM_MAP_ALIGN - 1) / SHM_MAP_ALIGN * SHM_MAP_ALIGN;
+
+	lib_ring = (struct timssdr_shm_ring*) calloc(1, sizeof(*lib_ring));
+	if (lib_ring == NULL) {
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	result = create_backing(lib_ring, name, length);
+	if (result != TIMSSDR_SUCCESS) {
+		free(lib_ring);
+		return result;
+	}
+
+	// The file starts out zeroed, so consumers attaching now see no magic.
+	header = (struct shm_header*) lib_ring->map;
+	header->version = SHM_VERSION;
+	header->slot_count = slot_count;
+	header->slot_size = slot_size;
+	header->in_flight = in_flight;
+	header->data_offset = header_size;
+	header->map_length = length;
+	atomic_init(&header->head, 0);
+	atomic_init(&header->wake, 0);
+	atomic_init(&header->ended, 0);
+	for (i = 0; i < slot_count; i++) {
+		atomic_init(&header->slots[i].sequence, SHM_SLOT_WRITING);
+	}
+	atomic_thread_fence(memory_order_release);
+	header->magic = SHM_MAGIC;
+
+	lib_ring->header = header;
+	lib_ring->data = lib_ring->map + header_size;
+	lib_ring->published = 0;
+
+	*ring = lib_ring;
+	return TIMSSDR_SUCCESS;
+}
+
+uint8_t* timssdr_shm_ring_slot(struct timssdr_shm_ring* ring, uint32_t slot)
+{
+	return ring->data + (size_t) slot * ring->header->slot_size;
+}
+
+uint32_t timssdr_shm_ring_slot_of(struct timssdr_shm_ring* ring, const uint8_t* buffer)
+{
+	return (uint32_t) ((size_t) (buffer - ring->data) / ring->header->slot_size);
+}
+
+void timssdr_shm_ring_claim(struct timssdr_shm_ring* ring, uint32_t slot)
+{
+	// Consumers that still read the old block see this before the new
+	// samples land, the submit that follows is a full barrier.
+	atomic_store(&ring->header->slots[slot].sequence, SHM_SLOT_WRITING);
+}
+
+void timssdr_shm_ring_publish(
+	struct timssdr_shm_ring* ring,
+	uint32_t slot,
+	int length,
+	uint64_t sample_index,
+	uint64_t timestamp_ns,
+	uint32_t flags)
+{
+	struct shm_header* header = ring->header;
+	struct shm_slot* entry = &header->slots[slot];
+
+	entry->sample_index = sample_index;
+	entry->timestamp_ns = timestamp_ns;
+	entry->flags = flags;
+	entry->length = length;
+	atomic_store_explicit(&entry->sequence, ring->published, memory_order_release);
+	ring->published++;
+	atomic_store_explicit(&header->head, ring->published, memory_order_release);
+
+	atomic_fetch_add_explicit(&header->wake, 1, memory_order_release);
+	futex(&header->wake, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+void timssdr_shm_ring_end(struct timssdr_shm_ring* ring)
+{
+	struct shm_header* header = ring->header;
+
+	atomic_store_explicit(&header->ended, 1, memory_order_release);
+	atomic_fetch_add_explicit(&header->wake, 1, memory_order_release);
+	futex(&header->wake, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+void timssdr_shm_ring_destroy(struct timssdr_shm_ring* ring)
+{
+	if (ring == NULL) {
+		return;
+	}
+
+	timssdr_shm_ring_end(ring);
+	munmap(ring->map, ring->map_length);
+	close(ring->fd);
+	unlink_ring(ring->path, ring->huge);
+	free(ring);
+}
+
+/* Consumer side */
+
+int timssdr_shm_attach(const char* name, timssdr_shm_consumer** consumer)
+{
+	const bool options[2] = {true, false};
+	timssdr_shm_consumer* lib_consumer;
+	const struct shm_header* header;
+	char path[SHM_NAME_MAX + 32];
+	struct stat st;
+	void* map = MAP_FAILED;
+	int i, fd = -1;
+
+	if (!valid_name(name) || consumer == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	for (i = 0; i < 2 && fd < 0; i++) {
+		ring_path(name, options[i], path, sizeof(path));
+		fd = open_ring(path, options[i], O_RDONLY, 0);
+	}
+	if (fd < 0) {
+		return TIMSSDR_ERROR_NOT_FOUND;
+	}
+
+	// Map the whole file, hugetlbfs only maps whole hugepages.
+	if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(struct shm_header)) {
+		map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	if (map == MAP_FAILED) {
+		close(fd);
+		return TIMSSDR_ERROR_FILE;
+	}
+
+	header = (const struct shm_header*) map;
+	if (header->magic != SHM_MAGIC || header->version != SHM_VERSION ||
+	    header->map_length != (uint64_t) st.st_size) {
+		munmap(map, (size_t) st.st_size);
+		close(fd);
+		return TIMSSDR_ERROR_FILE;
+	}
+	atomic_thread_fence(memory_order_acquire);
+
+	lib_consumer = (timssdr_shm_consumer*) calloc(1, sizeof(*lib_consumer));
+	if (lib_consumer == NULL) {
+		munmap(map, (size_t) st.st_size);
+		close(fd);
+		return TIMSSDR_ERROR_NO_MEM;
+	}
+
+	lib_consumer->fd = fd;
+	lib_consumer->map = (const uint8_t*) map;
+	lib_consumer->map_length = (size_t) st.st_size;
+	lib_consumer->header = header;
+	lib_consumer->data = lib_consumer->map + header->data_offset;
+	// Only blocks published from now on.
+	lib_consumer->next = atomic_load_explicit(
+		&((struct shm_header*) header)->head,
+		memory_order_acquire);
+	lib_consumer->have_last = false;
+	lib_consumer->discontinuity = false;
+	lib_consumer->overruns = 0;
+
+	*consumer = lib_consumer;
+	return TIMSSDR_SUCCESS;
+}
+
+static int64_t shm_deadline_ns(int timeout_ms)
+{
+	struct timespec now;
+
+	if (timeout_ms < 0) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec + (int64_t) timeout_ms * 1000000;
+}
+
+/* Sleep until the broker bumps wake from its value seen, or the deadline. Returns false past the deadline. */
+static bool shm_sleep(struct shm_header* header, uint32_t seen, int64_t deadline)
+{
+	struct timespec now, timeout;
+	int64_t left;
+
+	if (deadline < 0) {
+		futex(&header->wake, FUTEX_WAIT, seen, NULL);
+		return true;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = deadline - ((int64_t) now.tv_sec * 1000000000 + now.tv_nsec);
+	if (left <= 0) {
+		return false;
+	}
+	timeout.tv_sec = (time_t) (left / 1000000000);
+	timeout.tv_nsec = (long) (left % 1000000000);
+	futex(&header->wake, FUTEX_WAIT, seen, &timeout);
+	return true;
+}
+
+static void shm_missed(timssdr_shm_consumer* consumer, uint64_t count)
+{
+	consumer->overruns += count;
+	consumer->discontinuity = true;
+}
+
+int timssdr_shm_read(timssdr_shm_consumer* consumer, timssdr_transfer* transfer, int timeout_ms)
+{
+	struct shm_header* header;
+	const struct shm_slot* slot;
+	const int64_t deadline = shm_deadline_ns(timeout_ms);
+	uint64_t head, oldest, window, n, sample_index, timestamp_ns;
+	uint32_t flags, seen;
+	int32_t length;
+
+	if (consumer == NULL || transfer == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	// The header is only written through the broker's mapping.
+	header = (struct shm_header*) consumer->header;
+	window = header->slot_count - header->in_flight;
+
+	for (;;) {
+		head = atomic_load_explicit(&header->head, memory_order_acquire);
+		if (consumer->next < head) {
+			// Slots older than the window are being overwritten.
+			oldest = head > window ? head - window : 0;
+			if (consumer->next < oldest) {
+				shm_missed(consumer, oldest - consumer->next);
+				consumer->next = oldest;
+			}
+
+			n = consumer->next++;
+			slot = &header->slots[n % header->slot_count];
+			if (atomic_load_explicit(&((struct shm_slot*) slot)->sequence, memory_order_acquire) != n) {
+				shm_missed(consumer, 1);
+				continue;
+			}
+			sample_index = slot->sample_index;
+			timestamp_ns = slot->timestamp_ns;
+			flags = slot->flags;
+			length = slot->length;
+			atomic_thread_fence(memory_order_acquire);
+			if (atomic_load_explicit(&((struct shm_slot*) slot)->sequence, memory_order_relaxed) != n) {
+				shm_missed(consumer, 1);
+				continue;
+			}
+			if (length <= 0) {
+				continue;
+			}
+
+			memset(transfer, 0, sizeof(*transfer));
+			transfer->device = NULL;
+			transfer->buffer = (uint8_t*) consumer->data + (size_t) (n % header->slot_count) * header->slot_size;
+			transfer->buffer_length = (int) header->slot_size;
+			transfer->valid_length = length;
+			transfer->sample_index = sample_index;
+			transfer->timestamp_ns = timestamp_ns;
+			transfer->flags = flags;
+			if (consumer->discontinuity) {
+				transfer->flags |= TIMSSDR_TRANSFER_DISCONTINUITY;
+				consumer->discontinuity = false;
+			}
+			consumer->last = n;
+			consumer->have_last = true;
+			return TIMSSDR_SUCCESS;
+		}
+
+		// The end is set after the last block was published.
+		if (atomic_load_explicit(&header->ended, memory_order_acquire) &&
+		    consumer->next >= atomic_load_explicit(&header->head, memory_order_acquire)) {
+			return TIMSSDR_ERROR_STREAMING_STOPPED;
+		}
+		if (timeout_ms == 0) {
+			return TIMSSDR_ERROR_TIMEOUT;
+		}
+
+		seen = atomic_load_explicit(&header->wake, memory_order_acquire);
+		if (atomic_load_explicit(&header->head, memory_order_acquire) != head ||
+		    atomic_load_explicit(&header->ended, memory_order_acquire)) {
+			continue;
+		}
+		if (!shm_sleep(header, seen, deadline)) {
+			return TIMSSDR_ERROR_TIMEOUT;
+		}
+	}
+}
+
+int timssdr_shm_block_intact(timssdr_shm_consumer* consumer)
+{
+	struct shm_slot* slot;
+
+	if (consumer == NULL || !consumer->have_last) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	atomic_thread_fence(memory_order_acquire);
+	slot = (struct shm_slot*) &consumer->header->slots[consumer->last % consumer->header->slot_count];
+	if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) != consumer->last) {
+		// Reported once, the next block read is flagged.
+		consumer->have_last = false;
+		shm_missed(consumer, 1);
+		return TIMSSDR_ERROR_BUSY;
+	}
+	return TIMSSDR_TRUE;
+}
+
+int timssdr_shm_get_overruns(const timssdr_shm_consumer* consumer, uint64_t* overruns)
+{
+	if (consumer == NULL || overruns == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	*overruns = consumer->overruns;
+	return TIMSSDR_SUCCESS;
+}
+
+int timssdr_shm_detach(timssdr_shm_consumer* consumer)
+{
+	if (consumer == NULL) {
+		return TIMSSDR_ERROR_INVALID_PARAM;
+	}
+
+	munmap((void*) consumer->map, consumer->map_length);
+	close(consumer->fd);
+	free(consumer);
+	return TIMSSDR_SUCCESS;
+}
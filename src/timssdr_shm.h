@@ -0,0 +1,45 @@
+#ifndef TIMSSDR_SHM_H
+#define TIMSSDR_SHM_H
+
+#include "timssdr.h"
+
+/*
+ * Producer side of a shared-memory ring, see timssdr_start_rx_shm(). Only
+ * touched by the thread completing transfers, and by the thread starting
+ * and stopping the stream while no transfer is in flight.
+ */
+
+struct timssdr_shm_ring;
+
+/* in_flight is the number of slots the producer may be writing at once. */
+int timssdr_shm_ring_create(
+	const char* name,
+	uint32_t slot_count,
+	uint32_t slot_size,
+	uint32_t in_flight,
+	struct timssdr_shm_ring** ring);
+
+uint8_t* timssdr_shm_ring_slot(struct timssdr_shm_ring* ring, uint32_t slot);
+
+/* Index of the slot holding buffer, which must point into the ring. */
+uint32_t timssdr_shm_ring_slot_of(struct timssdr_shm_ring* ring, const uint8_t* buffer);
+
+/* Mark a slot as being overwritten, before a transfer is submitted into it. */
+void timssdr_shm_ring_claim(struct timssdr_shm_ring* ring, uint32_t slot);
+
+/* Publish the next block, held in slot, and wake the consumers. */
+void timssdr_shm_ring_publish(
+	struct timssdr_shm_ring* ring,
+	uint32_t slot,
+	int length,
+	uint64_t sample_index,
+	uint64_t timestamp_ns,
+	uint32_t flags);
+
+/* No more blocks will follow; consumers see the end once they caught up. */
+void timssdr_shm_ring_end(struct timssdr_shm_ring* ring);
+
+/* Unmap and unlink the ring. Attached consumers keep their mapping. */
+void timssdr_shm_ring_destroy(struct timssdr_shm_ring* ring);
+
+#endif /* TIMSSDR_SHM_H */
@@ -0,0 +1,37 @@
+#ifndef TIMSSDR_TRACE_H
+#define TIMSSDR_TRACE_H
+
+/*
+ * Static tracepoints of provider "timssdr", built in with
+ * -DTIMSSDR_WITH_TRACEPOINTS=ON (needs <sys/sdt.h> from systemtap-sdt-dev).
+ * A probe is a single nop until a tracer attaches to it, and its arguments
+ * are only evaluated in builds with tracepoints. Without the option the
+ * probes compile to nothing.
+ *
+ * Every probe takes (device, index, bytes):
+ *   transfer_submit    index of the transfer, bytes requested
+ *   transfer_complete  index of the transfer, bytes transferred (not for cancelled ones)
+ *   callback_entry     index of the buffer in the transfer buffers (the
+ *   callback_exit      transfer's index) or in the block pool of buffered
+ *                      modes, valid bytes (on exit as set by the callback)
+ *   flush_submit       0, bytes of the flush transfer
+ *   flush_complete     0, bytes transferred
+ *   cancel_lock_wait   transfers in flight, 0; cancel_transfers() is about to take transfer_lock
+ *   cancel_lock_acquire  transfers in flight, 0; it has the lock
+ *   cancel_lock_release  transfers in flight, 0; every transfer has finished
+ *
+ * For example, to see how long blocks wait between completion and the
+ * callback of timssdr_start_rx():
+ *   bpftrace -e 'usdt:libtimssdr.so:timssdr:transfer_complete { @t[arg1] = nsecs; }
+ *     usdt:libtimssdr.so:timssdr:callback_entry /@t[arg1]/ { @us = hist((nsecs - @t[arg1]) / 1000); }'
+ */
+
+#ifdef TIMSSDR_HAVE_SDT
+	#include <sys/sdt.h>
+	#define TIMSSDR_TRACE(probe, device, index, bytes) \
+		DTRACE_PROBE3(timssdr, probe, device, index, bytes)
+#else
+	#define TIMSSDR_TRACE(probe, device, index, bytes) ((void) 0)
+#endif
+
+#endif /* TIMSSDR_TRACE_H */
@@ -0,0 +1,36 @@
+#ifndef TIMSSDR_TRANSPORT_H
+#define TIMSSDR_TRANSPORT_H
+
+#include "timssdr.h"
+
+/* Hop plan handed to the device by timssdr_start_rx_sweep() */
+struct timssdr_sweep_plan {
+	const uint64_t* frequencies; /* tuned frequency of each step in Hz, in sweep order */
+	uint32_t frequency_count;
+	uint32_t bytes_per_tuning;   /* multiple of TIMSSDR_SWEEP_BLOCK_SIZE */
+};
+
+/*
+ * Transport used to move bulk transfers instead of libusb. A device with
+ * no transport submits to libusb; one with a transport hands every
+ * submit/cancel to it. A transport must follow libusb's rules: completion
+ * callbacks (also for cancelled transfers) run on a thread of its own,
+ * never from within submit or cancel, and one at a time per device.
+ */
+struct timssdr_transport {
+	int (*submit)(struct timssdr_transport* transport, struct libusb_transfer* transfer);
+	int (*cancel)(struct timssdr_transport* transport, struct libusb_transfer* transfer);
+	/*
+	 * Start framing RX data as sweep blocks following the plan, or go back
+	 * to plain streaming with NULL. Called while no transfer is in
+	 * flight. NULL if the device can't sweep.
+	 */
+	int (*set_sweep)(struct timssdr_transport* transport, const struct timssdr_sweep_plan* plan);
+	/* Only called once no transfer is in flight any more. */
+	void (*destroy)(struct timssdr_transport* transport);
+};
+
+/* Synthetic bulk completions at a configured rate, see timssdr_open_mock(). */
+struct timssdr_transport* timssdr_mock_transport_create(const timssdr_mock_config* config);
+
+#endif /* TIMSSDR_TRANSPORT_H */
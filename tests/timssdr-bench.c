@@ -0,0 +1,314 @@
+#include "include/timssdr.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+/*
+ * Benchmarks the streaming path against a mock device, so results only
+ * depend on the host: transfer callbacks, locking, queueing and buffer
+ * handling, without USB or firmware in the way.
+ *
+ * For every transfer count/size pair, RX, buffered RX, TX and push TX are
+ * run for a fixed time. Latency is measured from the mock's completion stamp to the
+ * moment the block reaches the application. CPU time covers the whole
+ * process, including the mock's completion thread.
+ */
+
+#define MAX_LATENCIES (1 << 20)
+
+enum bench_mode {
+	BENCH_RX,
+	BENCH_RX_BUFFERED,
+	BENCH_TX,
+	BENCH_TX_PUSH,
+};
+
+static const char* const mode_names[] = {"rx", "rx-buffered", "tx", "tx-push"};
+
+typedef struct {
+	uint64_t* latencies;
+	size_t latency_count;
+	uint64_t bytes;
+} bench_state;
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return ((uint64_t) usage.ru_utime.tv_sec + (uint64_t) usage.ru_stime.tv_sec) * 1000000000u +
+		((uint64_t) usage.ru_utime.tv_usec + (uint64_t) usage.ru_stime.tv_usec) * 1000u;
+}
+
+static void record_block(bench_state* state, const uint8_t* buffer, int length)
+{
+	uint64_t stamp;
+
+	if (length < (int) sizeof(stamp)) {
+		return;
+	}
+
+	// No stamp yet: a TX buffer being filled before its first submission.
+	memcpy(&stamp, buffer, sizeof(stamp));
+	if (stamp == 0) {
+		return;
+	}
+
+	if (state->latency_count < MAX_LATENCIES) {
+		state->latencies[state->latency_count++] = now_ns() - stamp;
+	}
+	state->bytes += length;
+}
+
+static int rx_callback(timssdr_transfer* transfer)
+{
+	record_block((bench_state*) transfer->rx_ctx, transfer->buffer, transfer->valid_length);
+	return 0;
+}
+
+static int tx_callback(timssdr_transfer* transfer)
+{
+	// The buffer still holds the stamp of the transfer that just completed.
+	record_block((bench_state*) transfer->tx_ctx, transfer->buffer, transfer->buffer_length);
+	memset(transfer->buffer, 0, sizeof(uint64_t));
+	transfer->valid_length = transfer->buffer_length;
+	return 0;
+}
+
+static void tx_complete_callback(timssdr_transfer* transfer, int success)
+{
+	if (success) {
+		record_block((bench_state*) transfer->tx_ctx, transfer->buffer, transfer->valid_length);
+	}
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const bench_state* state, double p)
+{
+	size_t index;
+
+	if (state->latency_count == 0) {
+		return 0.0;
+	}
+	index = (size_t) (p / 100.0 * (double) (state->latency_count - 1));
+	return state->latencies[index] / 1000.0;
+}
+
+static int run(
+	enum bench_mode mode,
+	uint32_t count,
+	uint32_t size,
+	double sample_rate,
+	double seconds,
+	bench_state* state)
+{
+	timssdr_mock_config config = {.sample_rate = sample_rate, .stamp_completions = 1};
+	timssdr_device* device = NULL;
+	timssdr_transfer transfer;
+	static uint8_t chunk[65536];
+	uint64_t start, end, cpu_start, elapsed, cpu;
+	double msps;
+	int result;
+
+	state->latency_count = 0;
+	state->bytes = 0;
+
+	result = timssdr_open_mock(&config, &device);
+	if (result != TIMSSDR_SUCCESS) {
+		fprintf(stderr, "timssdr_open_mock() failed: %s (%d)\n", timssdr_error_name(result), result);
+		return result;
+	}
+
+	result = timssdr_set_transfer_config(device, count, size);
+	if (result != TIMSSDR_SUCCESS) {
+		fprintf(stderr, "timssdr_set_transfer_config() failed: %s (%d)\n", timssdr_error_name(result), result);
+		timssdr_close(device);
+		return result;
+	}
+
+	cpu_start = cpu_ns();
+	start = now_ns();
+	end = start + (uint64_t) (seconds * 1e9);
+
+	switch (mode) {
+	case BENCH_RX:
+		result = timssdr_start_rx(device, rx_callback, state);
+		break;
+	case BENCH_RX_BUFFERED:
+		result = timssdr_start_rx_buffered(device, count * 2, NULL, state);
+		break;
+	case BENCH_TX:
+		result = timssdr_start_tx(device, tx_callback, state);
+		break;
+	case BENCH_TX_PUSH:
+		timssdr_set_tx_block_complete_callback(device, tx_complete_callback);
+		result = timssdr_start_tx_buffered(device, count * 2, state);
+		break;
+	}
+	if (result != TIMSSDR_SUCCESS) {
+		fprintf(stderr, "starting %s failed: %s (%d)\n", mode_names[mode], timssdr_error_name(result), result);
+		timssdr_close(device);
+		return result;
+	}
+
+	if (mode == BENCH_RX_BUFFERED) {
+		while (now_ns() < end) {
+			result = timssdr_rx_read(device, &transfer, 100);
+			if (result == TIMSSDR_SUCCESS) {
+				record_block(state, transfer.buffer, transfer.valid_length);
+			} else if (result != TIMSSDR_ERROR_TIMEOUT) {
+				break;
+			}
+		}
+	} else if (mode == BENCH_TX_PUSH) {
+		while (now_ns() < end) {
+			result = timssdr_tx_submit(device, chunk, sizeof(chunk), NULL, 100);
+			if (result != TIMSSDR_SUCCESS && result != TIMSSDR_ERROR_TIMEOUT) {
+				break;
+			}
+		}
+	} else {
+		while (now_ns() < end && timssdr_is_streaming(device) == TIMSSDR_TRUE) {
+			usleep(10000);
+		}
+	}
+
+	if (mode == BENCH_TX || mode == BENCH_TX_PUSH) {
+		timssdr_stop_tx(device);
+	} else {
+		timssdr_stop_rx(device);
+	}
+	elapsed = now_ns() - start;
+	cpu = cpu_ns() - cpu_start;
+
+	if (mode == BENCH_RX_BUFFERED) {
+		// Blocks queued before the stop don't count, they weren't read in time.
+		while (timssdr_rx_read(device, &transfer, 0) == TIMSSDR_SUCCESS) {
+		}
+	}
+
+	qsort(state->latencies, state->latency_count, sizeof(uint64_t), compare_u64);
+
+	msps = state->bytes / 2.0 / (elapsed / 1e9) / 1e6;
+	printf("%-12s %5u %8u %9.2f %8.1f %8.1f %8.1f %8.1f %9.1f %8.3f\n",
+	       mode_names[mode],
+	       count,
+	       size,
+	       msps,
+	       percentile_us(state, 50.0),
+	       percentile_us(state, 90.0),
+	       percentile_us(state, 99.0),
+	       percentile_us(state, 99.9),
+	       state->latency_count ? state->latencies[state->latency_count - 1] / 1000.0 : 0.0,
+	       msps > 0 ? (100.0 * cpu / elapsed) / msps : 0.0);
+
+	timssdr_close(device);
+	return TIMSSDR_SUCCESS;
+}
+
+static void usage(void)
+{
+	printf("Usage: timssdr-bench [options]\n");
+	printf("\t-r <MS/s>: mock sample rate, 0 for unthrottled (default 20)\n");
+	printf("\t-t <seconds>: duration of each run (default 2)\n");
+	printf("\t-c <count>: only test this number of transfers\n");
+	printf("\t-s <bytes>: only test this transfer size\n");
+	printf("\t-m <rx|rx-buffered|tx|tx-push>: only test this mode\n");
+}
+
+int main(int argc, char** argv)
+{
+	static const uint32_t default_counts[] = {2, 4, 8, 16};
+	static const uint32_t default_sizes[] = {16384, 65536, 262144, 1048576};
+	const uint32_t* counts = default_counts;
+	const uint32_t* sizes = default_sizes;
+	size_t count_count = sizeof(default_counts) / sizeof(default_counts[0]);
+	size_t size_count = sizeof(default_sizes) / sizeof(default_sizes[0]);
+	uint32_t single_count, single_size;
+	int first_mode = BENCH_RX, last_mode = BENCH_TX_PUSH;
+	double rate = 20.0, seconds = 2.0;
+	bench_state state;
+	size_t c, s;
+	int opt, mode, m;
+
+	while ((opt = getopt(argc, argv, "r:t:c:s:m:h")) != EOF) {
+		switch (opt) {
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'c':
+			single_count = (uint32_t) strtoul(optarg, NULL, 0);
+			counts = &single_count;
+			count_count = 1;
+			break;
+		case 's':
+			single_size = (uint32_t) strtoul(optarg, NULL, 0);
+			sizes = &single_size;
+			size_count = 1;
+			break;
+		case 'm':
+			for (m = BENCH_RX; m <= BENCH_TX_PUSH; m++) {
+				if (strcmp(optarg, mode_names[m]) == 0) {
+					first_mode = last_mode = m;
+					break;
+				}
+			}
+			if (m > BENCH_TX_PUSH) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage();
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	state.latencies = (uint64_t*) malloc(MAX_LATENCIES * sizeof(uint64_t));
+	if (state.latencies == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("mock rate %.2f MS/s, %.1f s per run, SIMD backend %s\n",
+	       rate,
+	       seconds,
+	       timssdr_convert_backend());
+	printf("%-12s %5s %8s %9s %8s %8s %8s %8s %9s %8s\n",
+	       "mode", "count", "size", "MS/s", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us", "CPU%/MS/s");
+
+	for (mode = first_mode; mode <= last_mode; mode++) {
+		for (c = 0; c < count_count; c++) {
+			for (s = 0; s < size_count; s++) {
+				if (run((enum bench_mode) mode, counts[c], sizes[s], rate * 1e6, seconds, &state) != TIMSSDR_SUCCESS) {
+					free(state.latencies);
+					return EXIT_FAILURE;
+				}
+			}
+		}
+	}
+
+	free(state.latencies);
+	return EXIT_SUCCESS;
+}
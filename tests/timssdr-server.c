@@ -0,0 +1,680 @@
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE /* sendmmsg(), accept4() */
+#endif
+
+#include "include/timssdr.h"
+#include <endian.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/*
+ * Streams received blocks to network clients, see timssdr_net_connect().
+ *
+ * The device runs in buffered pull mode, so a slow network costs spare
+ * buffers (and overruns once they run out) rather than USB transfers. A
+ * block read with timssdr_rx_read() stays valid until the next read,
+ * which is long enough to hand it to the kernel without copying it here:
+ * TCP clients get one sendmsg() per block with the header and the
+ * transfer buffer as separate iovecs, UDP clients get all of a block's
+ * datagrams in one sendmmsg() batch, each pointing into the block.
+ *
+ * With -z the sockets use MSG_ZEROCOPY, so the kernel doesn't copy the
+ * samples either. The block and the headers must then stay untouched
+ * until the kernel reports completion. Each client has its own headers,
+ * so the block goes out to every client first, then the completions are
+ * collected once, before the next block is read.
+ */
+
+#define MAX_CLIENTS      16
+#define UDP_EXPIRY_NS    5000000000ull /* clients renew every second */
+#define SEND_TIMEOUT_S   2             /* a TCP client stuck this long is dropped */
+#define UDP_SNDBUF       (8 << 20)
+#define ZEROCOPY_WAIT_MS 1000
+#define SEND_BATCH       UIO_MAXIOV    /* datagrams per sendmmsg() */
+
+#ifndef SO_ZEROCOPY
+	#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+	#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+	#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+typedef struct {
+	bool used;
+	enum timssdr_net_protocol protocol;
+	int fd;                         /* connection for TCP, the shared socket for UDP */
+	struct sockaddr_storage address;
+	socklen_t address_length;
+	uint64_t sequence;
+	uint64_t last_seen_ns;          /* UDP: last subscription */
+} server_client;
+
+typedef struct {
+	int fd;
+	bool zerocopy;
+	uint32_t sent;                  /* MSG_ZEROCOPY sends so far */
+	uint32_t completed;             /* of those, completed by the kernel */
+} zerocopy_socket;
+
+/* Per client send state, sized for the largest block seen */
+typedef struct {
+	timssdr_net_header* headers;
+	struct iovec* iovs;
+	struct mmsghdr* messages;
+	uint32_t capacity;
+} packet_buffers;
+
+static volatile sig_atomic_t do_exit = 0;
+
+static server_client clients[MAX_CLIENTS];
+static int tcp_listen_fd = -1;
+static int udp_fd = -1;
+static zerocopy_socket udp_socket;
+static zerocopy_socket tcp_sockets[MAX_CLIENTS];
+static bool use_zerocopy = false;
+static uint32_t udp_payload = 1400;
+static packet_buffers packets[MAX_CLIENTS];
+
+static uint64_t blocks_sent = 0;
+static uint64_t bytes_sent = 0;
+
+static void sigint_callback_handler(int signum)
+{
+	(void) signum;
+	do_exit = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static void describe(const server_client* client, char* text, size_t size)
+{
+	char host[INET6_ADDRSTRLEN] = "?";
+	uint16_t port = 0;
+
+	if (client->address.ss_family == AF_INET) {
+		const struct sockaddr_in* address = (const struct sockaddr_in*) &client->address;
+		inet_ntop(AF_INET, &address->sin_addr, host, sizeof(host));
+		port = ntohs(address->sin_port);
+	} else if (client->address.ss_family == AF_INET6) {
+		const struct sockaddr_in6* address = (const struct sockaddr_in6*) &client->address;
+		inet_ntop(AF_INET6, &address->sin6_addr, host, sizeof(host));
+		port = ntohs(address->sin6_port);
+	}
+	snprintf(text, size, "%s %s:%u", client->protocol == TIMSSDR_NET_TCP ? "tcp" : "udp", host, port);
+}
+
+static void enable_zerocopy(zerocopy_socket* zc, int fd)
+{
+	int one = 1;
+
+	zc->fd = fd;
+	zc->sent = 0;
+	zc->completed = 0;
+	zc->zerocopy = use_zerocopy &&
+		setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+	if (use_zerocopy && !zc->zerocopy) {
+		fprintf(stderr, "MSG_ZEROCOPY not available (%s), copying instead\n", strerror(errno));
+	}
+}
+
+/* Collect zero-copy completions, waiting until every send is done. */
+static bool wait_zerocopy(zerocopy_socket* zc)
+{
+	struct pollfd pfd = {.fd = zc->fd, .events = 0};
+	char control[128];
+	struct msghdr message;
+	struct cmsghdr* cmsg;
+	struct sock_extended_err* error;
+
+	while (zc->zerocopy && zc->completed != zc->sent) {
+		memset(&message, 0, sizeof(message));
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		if (recvmsg(zc->fd, &message, MSG_ERRQUEUE) < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				return false;
+			}
+			// The error queue shows up as POLLERR.
+			if (poll(&pfd, 1, ZEROCOPY_WAIT_MS) <= 0) {
+				return false;
+			}
+			continue;
+		}
+		for (cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+			error = (struct sock_extended_err*) CMSG_DATA(cmsg);
+			if (error->ee_origin == SO_EE_ORIGIN_ZEROCOPY && error->ee_errno == 0) {
+				// Completions cover the range [ee_info, ee_data] of send numbers.
+				zc->completed = error->ee_data + 1;
+			}
+		}
+	}
+	return true;
+}
+
+static void drop_client(server_client* client, const char* reason)
+{
+	char text[80];
+
+	describe(client, text, sizeof(text));
+	fprintf(stderr, "%s: %s\n", text, reason);
+	if (client->protocol == TIMSSDR_NET_TCP) {
+		close(client->fd);
+	}
+	client->used = false;
+}
+
+static server_client* add_client(enum timssdr_net_protocol protocol, int fd, const struct sockaddr_storage* address, socklen_t address_length)
+{
+	char text[80];
+	int i;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (!clients[i].used) {
+			clients[i].used = true;
+			clients[i].protocol = protocol;
+			clients[i].fd = fd;
+			clients[i].address = *address;
+			clients[i].address_length = address_length;
+			clients[i].sequence = 0;
+			clients[i].last_seen_ns = now_ns();
+			describe(&clients[i], text, sizeof(text));
+			fprintf(stderr, "%s: connected\n", text);
+			return &clients[i];
+		}
+	}
+	return NULL;
+}
+
+static void accept_tcp_client(void)
+{
+	struct sockaddr_storage address;
+	socklen_t address_length = sizeof(address);
+	struct timeval timeout = {.tv_sec = SEND_TIMEOUT_S, .tv_usec = 0};
+	server_client* client;
+	int fd, one = 1;
+
+	fd = accept4(tcp_listen_fd, (struct sockaddr*) &address, &address_length, SOCK_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	client = add_client(TIMSSDR_NET_TCP, fd, &address, address_length);
+	if (client == NULL) {
+		fprintf(stderr, "too many clients, refusing connection\n");
+		close(fd);
+		return;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	enable_zerocopy(&tcp_sockets[client - clients], fd);
+}
+
+static server_client* find_udp_client(const struct sockaddr_storage* address, socklen_t address_length)
+{
+	int i;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].used && clients[i].protocol == TIMSSDR_NET_UDP &&
+		    clients[i].address_length == address_length &&
+		    memcmp(&clients[i].address, address, address_length) == 0) {
+			return &clients[i];
+		}
+	}
+	return NULL;
+}
+
+static void receive_udp_control(void)
+{
+	struct sockaddr_storage address;
+	socklen_t address_length = sizeof(address);
+	timssdr_net_header header;
+	server_client* client;
+	ssize_t length;
+
+	while ((length = recvfrom(udp_fd, &header, sizeof(header), MSG_DONTWAIT, (struct sockaddr*) &address, &address_length)) >= 0) {
+		if ((size_t) length == sizeof(header) && le32toh(header.magic) == TIMSSDR_NET_MAGIC &&
+		    le16toh(header.version) == TIMSSDR_NET_VERSION) {
+			// Zero out what the kernel didn't fill, so addresses compare.
+			memset((char*) &address + address_length, 0, sizeof(address) - address_length);
+			client = find_udp_client(&address, address_length);
+			if (le16toh(header.type) == TIMSSDR_NET_PACKET_SUBSCRIBE) {
+				if (client == NULL) {
+					client = add_client(TIMSSDR_NET_UDP, udp_fd, &address, address_length);
+				}
+				if (client != NULL) {
+					client->last_seen_ns = now_ns();
+				}
+			} else if (le16toh(header.type) == TIMSSDR_NET_PACKET_UNSUBSCRIBE && client != NULL) {
+				drop_client(client, "unsubscribed");
+			}
+		}
+		address_length = sizeof(address);
+	}
+}
+
+/* Accept connections, handle subscriptions and expire silent UDP clients. */
+static void service_sockets(int timeout_ms)
+{
+	struct pollfd pfds[2] = {{.fd = tcp_listen_fd, .events = POLLIN}, {.fd = udp_fd, .events = POLLIN}};
+	uint64_t now;
+	int i;
+
+	if (poll(pfds, 2, timeout_ms) > 0) {
+		if (pfds[0].revents & POLLIN) {
+			accept_tcp_client();
+		}
+		if (pfds[1].revents & POLLIN) {
+			receive_udp_control();
+		}
+	}
+
+	now = now_ns();
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].used && clients[i].protocol == TIMSSDR_NET_UDP &&
+		    now - clients[i].last_seen_ns > UDP_EXPIRY_NS) {
+			drop_client(&clients[i], "subscription expired");
+		}
+	}
+}
+
+static void free_packets(packet_buffers* buffers)
+{
+	free(buffers->headers);
+	free(buffers->iovs);
+	free(buffers->messages);
+	memset(buffers, 0, sizeof(*buffers));
+}
+
+static bool reserve_packets(packet_buffers* buffers, uint32_t count)
+{
+	if (count <= buffers->capacity) {
+		return true;
+	}
+
+	free_packets(buffers);
+	buffers->headers = (timssdr_net_header*) calloc(count, sizeof(*buffers->headers));
+	buffers->iovs = (struct iovec*) calloc((size_t) count * 2, sizeof(*buffers->iovs));
+	buffers->messages = (struct mmsghdr*) calloc(count, sizeof(*buffers->messages));
+	if (buffers->headers == NULL || buffers->iovs == NULL || buffers->messages == NULL) {
+		free_packets(buffers);
+		return false;
+	}
+	buffers->capacity = count;
+	return true;
+}
+
+static void fill_header(timssdr_net_header* header, server_client* client, const timssdr_transfer* transfer, uint32_t offset, uint32_t length)
+{
+	header->magic = htole32(TIMSSDR_NET_MAGIC);
+	header->version = htole16(TIMSSDR_NET_VERSION);
+	header->type = htole16(TIMSSDR_NET_PACKET_DATA);
+	header->sequence = htole64(client->sequence++);
+	header->sample_index = htole64(transfer->sample_index);
+	header->timestamp_ns = htole64(transfer->timestamp_ns);
+	header->block_flags = htole32(transfer->flags);
+	header->block_length = htole32((uint32_t) transfer->valid_length);
+	header->offset = htole32(offset);
+	header->length = htole32(length);
+}
+
+/* One packet per block, written in one go where the socket allows. */
+static bool send_tcp(server_client* client, const timssdr_transfer* transfer)
+{
+	zerocopy_socket* zc = &tcp_sockets[client - clients];
+	packet_buffers* buffers = &packets[client - clients];
+	struct iovec* iov;
+	struct msghdr message;
+	size_t remaining = sizeof(timssdr_net_header) + (size_t) transfer->valid_length;
+	ssize_t result;
+
+	if (!reserve_packets(buffers, 1)) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	iov = buffers->iovs;
+	fill_header(&buffers->headers[0], client, transfer, 0, (uint32_t) transfer->valid_length);
+	iov[0].iov_base = &buffers->headers[0];
+	iov[0].iov_len = sizeof(timssdr_net_header);
+	iov[1].iov_base = transfer->buffer;
+	iov[1].iov_len = (size_t) transfer->valid_length;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = iov;
+	message.msg_iovlen = 2;
+	while (remaining > 0) {
+		result = sendmsg(client->fd, &message, MSG_NOSIGNAL | (zc->zerocopy ? MSG_ZEROCOPY : 0));
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		if (zc->zerocopy) {
+			zc->sent++;
+		}
+		remaining -= (size_t) result;
+		// Skip what went out, the rest of the stream follows on.
+		while (message.msg_iovlen > 0 && (size_t) result >= message.msg_iov->iov_len) {
+			result -= (ssize_t) message.msg_iov->iov_len;
+			message.msg_iov++;
+			message.msg_iovlen--;
+		}
+		if (message.msg_iovlen > 0) {
+			message.msg_iov->iov_base = (uint8_t*) message.msg_iov->iov_base + result;
+			message.msg_iov->iov_len -= (size_t) result;
+		}
+	}
+	return true;
+}
+
+/* The block in datagrams of up to udp_payload samples, in sendmmsg() batches. */
+static bool send_udp(server_client* client, const timssdr_transfer* transfer)
+{
+	uint32_t length = (uint32_t) transfer->valid_length;
+	uint32_t count = (length + udp_payload - 1) / udp_payload;
+	packet_buffers* buffers = &packets[client - clients];
+	timssdr_net_header* headers;
+	struct iovec* iovs;
+	struct mmsghdr* messages;
+	uint32_t i, offset, chunk, done;
+	int result;
+
+	if (count == 0) {
+		return true;
+	}
+	if (!reserve_packets(buffers, count)) {
+		errno = ENOMEM;
+		return false;
+	}
+	headers = buffers->headers;
+	iovs = buffers->iovs;
+	messages = buffers->messages;
+
+	for (i = 0; i < count; i++) {
+		offset = i * udp_payload;
+		chunk = length - offset < udp_payload ? length - offset : udp_payload;
+		fill_header(&headers[i], client, transfer, offset, chunk);
+		iovs[2 * i].iov_base = &headers[i];
+		iovs[2 * i].iov_len = sizeof(timssdr_net_header);
+		iovs[2 * i + 1].iov_base = transfer->buffer + offset;
+		iovs[2 * i + 1].iov_len = chunk;
+		memset(&messages[i], 0, sizeof(messages[i]));
+		messages[i].msg_hdr.msg_name = &client->address;
+		messages[i].msg_hdr.msg_namelen = client->address_length;
+		messages[i].msg_hdr.msg_iov = &iovs[2 * i];
+		messages[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	for (done = 0; done < count;) {
+		chunk = count - done < SEND_BATCH ? count - done : SEND_BATCH;
+		result = sendmmsg(udp_fd, &messages[done], chunk, udp_socket.zerocopy ? MSG_ZEROCOPY : 0);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// Unreachable clients show up as errors on the shared socket,
+			// skip the rest of the block; the subscription expires.
+			return errno == ECONNREFUSED || errno == EHOSTUNREACH || errno == ENETUNREACH;
+		}
+		if (udp_socket.zerocopy) {
+			udp_socket.sent += (uint32_t) result;
+		}
+		done += (uint32_t) result;
+	}
+	return true;
+}
+
+static void send_block(const timssdr_transfer* transfer)
+{
+	bool sent = false, udp = false;
+	int i;
+
+	// Every client has its own headers, so all sends can be in flight
+	// at once; the completions are collected below.
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (!clients[i].used) {
+			continue;
+		}
+		if (clients[i].protocol == TIMSSDR_NET_TCP) {
+			if (!send_tcp(&clients[i], transfer)) {
+				drop_client(&clients[i], errno == EAGAIN ? "too slow" : strerror(errno));
+				continue;
+			}
+		} else {
+			if (!send_udp(&clients[i], transfer)) {
+				fprintf(stderr, "sendmmsg() failed: %s\n", strerror(errno));
+			}
+			udp = true;
+		}
+		sent = true;
+	}
+
+	// The block is only read over once the kernel is done with it.
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].used && clients[i].protocol == TIMSSDR_NET_TCP &&
+		    !wait_zerocopy(&tcp_sockets[i])) {
+			drop_client(&clients[i], "zero-copy completion timed out");
+		}
+	}
+	if (udp && !wait_zerocopy(&udp_socket)) {
+		fprintf(stderr, "zero-copy completion timed out, copying from now on\n");
+		udp_socket.zerocopy = false;
+	}
+
+	if (sent) {
+		blocks_sent++;
+		bytes_sent += (uint64_t) transfer->valid_length;
+	}
+}
+
+static int open_sockets(uint16_t port)
+{
+	struct sockaddr_in6 address;
+	int one = 1, zero = 0, size = UDP_SNDBUF;
+
+	memset(&address, 0, sizeof(address));
+	address.sin6_family = AF_INET6;
+	address.sin6_addr = in6addr_any;
+	address.sin6_port = htons(port);
+
+	tcp_listen_fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	udp_fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (tcp_listen_fd < 0 || udp_fd < 0) {
+		return -1;
+	}
+
+	// Dual stack, so IPv4 clients are served as well.
+	setsockopt(tcp_listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+	setsockopt(udp_fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+	setsockopt(tcp_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(udp_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	if (bind(tcp_listen_fd, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+	    listen(tcp_listen_fd, MAX_CLIENTS) != 0 ||
+	    bind(udp_fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+		return -1;
+	}
+
+	enable_zerocopy(&udp_socket, udp_fd);
+	return 0;
+}
+
+static void usage(void)
+{
+	printf("Usage: timssdr-server [options]\n");
+	printf("\t-p <port>: TCP and UDP port (default %d)\n", TIMSSDR_NET_DEFAULT_PORT);
+	printf("\t-d <serial>: serial number of the device to stream (default first found)\n");
+	printf("\t-M <MS/s>: stream from a mock device at this rate instead\n");
+	printf("\t-c <count>: number of transfers in flight\n");
+	printf("\t-s <bytes>: transfer size, this is the block size on the network\n");
+	printf("\t-q <blocks>: spare buffers for slow clients (default 32)\n");
+	printf("\t-m <bytes>: sample bytes per UDP datagram (default %u, up to %u)\n",
+	       udp_payload,
+	       (unsigned) (TIMSSDR_NET_MAX_DATAGRAM - sizeof(timssdr_net_header)));
+	printf("\t-z: send with MSG_ZEROCOPY\n");
+}
+
+int main(int argc, char** argv)
+{
+	timssdr_mock_config mock = {.sample_rate = 0, .stamp_completions = 0};
+	timssdr_device* device = NULL;
+	timssdr_transfer transfer;
+	const char* serial = NULL;
+	uint32_t transfer_count = 0, transfer_size = 0, queue_depth = 32;
+	uint64_t overruns = 0;
+	bool use_mock = false;
+	uint16_t port = TIMSSDR_NET_DEFAULT_PORT;
+	int opt, result, i;
+
+	while ((opt = getopt(argc, argv, "p:d:M:c:s:q:m:zh")) != EOF) {
+		switch (opt) {
+		case 'p':
+			port = (uint16_t) strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			serial = optarg;
+			break;
+		case 'M':
+			use_mock = true;
+			mock.sample_rate = atof(optarg) * 1e6;
+			break;
+		case 'c':
+			transfer_count = (uint32_t) strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			transfer_size = (uint32_t) strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			queue_depth = (uint32_t) strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			udp_payload = (uint32_t) strtoul(optarg, NULL, 0);
+			if (udp_payload == 0 || udp_payload > TIMSSDR_NET_MAX_DATAGRAM - sizeof(timssdr_net_header)) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'z':
+			use_zerocopy = true;
+			break;
+		default:
+			usage();
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	signal(SIGINT, &sigint_callback_handler);
+	signal(SIGTERM, &sigint_callback_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (open_sockets(port) != 0) {
+		fprintf(stderr, "can't listen on port %u: %s\n", port, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	result = timssdr_init();
+	if (result != TIMSSDR_SUCCESS) {
+		fprintf(stderr, "timssdr_init() failed: %s (%d)\n", timssdr_error_name(result), result);
+		return EXIT_FAILURE;
+	}
+
+	if (use_mock) {
+		result = timssdr_open_mock(&mock, &device);
+	} else if (serial != NULL) {
+		result = timssdr_open_by_serial(serial, &device);
+	} else {
+		result = timssdr_open(&device);
+	}
+	if (result != TIMSSDR_SUCCESS) {
+		fprintf(stderr, "opening the device failed: %s (%d)\n", timssdr_error_name(result), result);
+		timssdr_exit();
+		return EXIT_FAILURE;
+	}
+
+	if (transfer_count != 0 || transfer_size != 0) {
+		timssdr_get_transfer_config(
+			device,
+			transfer_count != 0 ? NULL : &transfer_count,
+			transfer_size != 0 ? NULL : &transfer_size);
+		result = timssdr_set_transfer_config(device, transfer_count, transfer_size);
+		if (result != TIMSSDR_SUCCESS) {
+			fprintf(stderr, "timssdr_set_transfer_config() failed: %s (%d)\n", timssdr_error_name(result), result);
+			timssdr_close(device);
+			timssdr_exit();
+			return EXIT_FAILURE;
+		}
+	}
+
+	result = timssdr_start_rx_buffered(device, queue_depth, NULL, NULL);
+	if (result != TIMSSDR_SUCCESS) {
+		fprintf(stderr, "timssdr_start_rx_buffered() failed: %s (%d)\n", timssdr_error_name(result), result);
+		timssdr_close(device);
+		timssdr_exit();
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "streaming on port %u (tcp, udp)%s\n", port, use_zerocopy ? ", zero-copy" : "");
+
+	while (!do_exit) {
+		service_sockets(0);
+		result = timssdr_rx_read(device, &transfer, 100);
+		if (result == TIMSSDR_ERROR_TIMEOUT) {
+			continue;
+		}
+		if (result != TIMSSDR_SUCCESS) {
+			fprintf(stderr, "timssdr_rx_read() failed: %s (%d)\n", timssdr_error_name(result), result);
+			break;
+		}
+		send_block(&transfer);
+	}
+
+	timssdr_get_rx_overruns(device, &overruns);
+	timssdr_stop_rx(device);
+	while (timssdr_rx_read(device, &transfer, 0) == TIMSSDR_SUCCESS) {
+	}
+	timssdr_close(device);
+	timssdr_exit();
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].used && clients[i].protocol == TIMSSDR_NET_TCP) {
+			close(clients[i].fd);
+		}
+	}
+	close(tcp_listen_fd);
+	close(udp_fd);
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		free_packets(&packets[i]);
+	}
+
+	fprintf(stderr,
+		"sent %llu blocks (%llu bytes), %llu overruns\n",
+		(unsigned long long) blocks_sent,
+		(unsigned long long) bytes_sent,
+		(unsigned long long) overruns);
+	return EXIT_SUCCESS;
+}